@@ -0,0 +1,376 @@
+// bench.c
+//
+// See bench.h
+
+#include "bench.h"
+#include "usb_mouse_debug.h"
+#include "log.h"
+#include "controller/teensy-2-0.h"
+#include "controller/n35p112.h"
+#include "controller/mcp23018.h"
+#include "twi/twi_sched.h"
+#include "twi/twi_tune.h"
+#include "mouse/upsample.h"
+#include "mouse/pipeline.h"
+#include "fixed.h"
+
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <avr/pgmspace.h>
+
+// ----------------------------------------------------------------------------
+
+// Cycles for one step, over every time it ran
+typedef struct {
+	uint16_t count;
+	uint16_t min;
+	uint16_t max;
+	uint32_t total;
+} bench_step_t;
+
+// ----------------------------------------------------------------------------
+
+// The sample set: rest, inside the deadzone, then out through every part
+//  of the curve in all four directions and on the diagonals, up to the ends
+//  of the range
+static const int8_t kSamples[][2] PROGMEM = {
+	{   0,    0 }, {   5,   -4 }, {  20,    0 }, {   0,  -35 },
+	{ -50,   10 }, {  40,   40 }, {  70,  -20 }, { -90,  -30 },
+	{  10,  110 }, {-120,    5 }, { 127,  127 }, {-128, -128 },
+	{  90,  -90 }, { -60,   60 }, {  30,  -10 }, {   0,    0 },
+};
+
+#define BENCH_SAMPLES (sizeof(kSamples) / sizeof(kSamples[0]))
+
+// The per axis square deadzone and curve that pipeline_curve() replaced,
+//  as the two getters had it, for comparison
+#define LEGACY_MID_THRESH 100
+#define LEGACY_MID_DIVIDE 8
+#define LEGACY_LOW_THRESH 60
+#define LEGACY_LOW_DIVIDE 12
+
+// ----------------------------------------------------------------------------
+
+// static data
+static uint16_t sOverhead = 0;
+
+// The fixed point steps' operands and results, volatile so that the
+//  compiler can neither fold the operands in nor drop the result
+static volatile uint16_t sFixedA, sFixedB;
+static volatile uint32_t sFixedOut;
+
+// ----------------------------------------------------------------------------
+
+// Timer1 counts CPU cycles, from 0 at _start() to _stop().  Up to two
+//  wraps can be told apart, about 8 ms.
+static inline void _start(void)
+{
+	TIFR1 = (1 << TOV1);
+	TCNT1 = 0;
+}
+
+static inline uint32_t _stop(void)
+{
+	uint16_t count = TCNT1;
+
+	// a wrap just after reading the count leaves it near the top
+	if ((TIFR1 & (1 << TOV1)) && count < 0x8000)
+		return 0x10000UL + count;
+	return count;
+}
+
+static void _add(bench_step_t *step, uint32_t cycles)
+{
+	cycles = cycles > sOverhead ? cycles - sOverhead : 0;
+	if (cycles > 0xFFFF)
+		cycles = 0xFFFF;
+	if (!step->count || cycles < step->min)
+		step->min = cycles;
+	if (cycles > step->max)
+		step->max = cycles;
+	step->total += cycles;
+	step->count++;
+}
+
+static uint16_t _mean(const bench_step_t *step)
+{
+	return step->count ? step->total / step->count : 0;
+}
+
+#define _FIELDS(step) (step).count, (step).min, _mean(&(step)), (step).max
+
+// Time one call, with interrupts off.  The barrier keeps the compiler from
+//  moving an inlined step's work out from between _start() and _stop().
+#define _TIME(step, data, call)					\
+	do {							\
+		cli();						\
+		_start();					\
+		__asm__ __volatile__ ("" : : "r" (data) : "memory");	\
+		call;						\
+		__asm__ __volatile__ ("" : : "r" (data) : "memory");	\
+		cycles = _stop();				\
+		SREG = intr_state;				\
+		_add(&(step), cycles);				\
+	} while (0)
+
+// The least a _start() _stop() pair measures with nothing in between
+static void _measure_overhead(void)
+{
+	uint32_t cycles;
+	uint8_t i;
+
+	sOverhead = 0xFFFF;
+	for (i=0; i<16; i++)
+	{
+		_start();
+		cycles = _stop();
+		if (cycles < sOverhead)
+			sOverhead = cycles;
+	}
+}
+
+// One axis the old way: offset, square deadzone and curve, whole counts.
+//  A call of its own, as each getter was.
+static int8_t __attribute__((noinline)) _legacy_axis(int8_t v, int8_t offset, int8_t radius)
+{
+	int8_t out;
+
+	if (v > 0)
+	{
+		if (v < radius)
+			return 0;
+		if ((127 - (v - radius)) < offset)
+			return 127;
+		out = v - radius + offset;
+		if (out < 0)
+			out = 0;
+		else if (out < LEGACY_LOW_THRESH)
+			out /= LEGACY_LOW_DIVIDE;
+		else if (out < LEGACY_MID_THRESH)
+			out /= LEGACY_MID_DIVIDE;
+		return out;
+	}
+	if (v > -radius)
+		return 0;
+	if ((-127 - (v + radius)) > offset)
+		return -127;
+	out = v + radius + offset;
+	if (out > 0)
+		out = 0;
+	else if (out > -LEGACY_LOW_THRESH)
+		out /= LEGACY_LOW_DIVIDE;
+	else if (out > -LEGACY_MID_THRESH)
+		out /= LEGACY_MID_DIVIDE;
+	return out;
+}
+
+// Wait for the next 1 ms tick
+static void _next_tick(void)
+{
+	uint8_t ms = teensy_get_elapsed_ms();
+
+	while (teensy_get_elapsed_ms() == ms)
+		;
+}
+
+/* Run the benchmark and send the results.  Call it from the main loop,
+ *  between twi_sched_run() calls: it has the bus to itself while the
+ *  scheduler has nothing pending.  Takes about a quarter of a second.
+ *
+ * returns
+ * - 0, or 1 if the stick is being calibrated and it didn't run
+ */
+uint8_t bench_run(void)
+{
+	bench_step_t shape = { 0 }, push = { 0 }, frame = { 0 }, report = { 0 };
+	bench_step_t stick = { 0 }, expander = { 0 };
+	bench_step_t offset = { 0 }, filter = { 0 }, curve = { 0 };
+	bench_step_t accel = { 0 }, accumulate = { 0 }, quantise = { 0 };
+	bench_step_t whole = { 0 }, legacy = { 0 };
+	bench_step_t mulQ8 = { 0 }, mulHi = { 0 }, div = { 0 }, divLib = { 0 };
+	bench_step_t isqrt = { 0 }, hypot = { 0 }, lerp = { 0 };
+	pipeline_state_t state;
+	pipeline_t p;
+	uint8_t pass, i, f, intr_state, eimsk;
+	int8_t x, y, dx, dy, radius;
+	uint32_t cycles;
+
+	if (n35p112_calibrating())
+	{
+		LOG("bench: calibrating, try again\n");
+		return 1;
+	}
+	while (twi_sched_pending())
+		twi_sched_run();
+
+	// Only the synthetic samples for now
+	eimsk = EIMSK;
+	EIMSK &=~ (1 << INT2);
+
+	TCCR1A = 0;
+	TCCR1B = (1 << CS10);	// no prescaler, a count per cycle
+	intr_state = SREG;
+	cli();
+	_measure_overhead();
+	SREG = intr_state;
+
+	// The sensor path and the upsampler, with interrupts off for each step
+	//  so that only the step is counted
+	upsample_reset();
+	for (pass=0; pass<BENCH_PASSES; pass++)
+	{
+		for (i=0; i<BENCH_SAMPLES; i++)
+		{
+			x = pgm_read_byte(&kSamples[i][0]);
+			y = pgm_read_byte(&kSamples[i][1]);
+
+			cli();
+			_start();
+			n35p112_feed(x, y);
+			n35p112_update();
+			cycles = _stop();
+			SREG = intr_state;
+			_add(&shape, cycles);
+
+			x = n35p112_get_x();
+			y = n35p112_get_y();
+			cli();
+			_start();
+			upsample_push(x, y, n35p112_get_sample_us());
+			cycles = _stop();
+			SREG = intr_state;
+			_add(&push, cycles);
+
+			for (f=0; f<BENCH_FRAMES; f++)
+			{
+				cli();
+				_start();
+				upsample_frame(&dx, &dy);
+				cycles = _stop();
+				SREG = intr_state;
+				_add(&frame, cycles);
+			}
+		}
+	}
+
+	// Each stage of the pointer pipeline on its own, on a copy of the
+	//  stick's, in the order pipeline_run() has them
+	state = *n35p112_get_pipeline();
+	pipeline_reset(&state);
+	for (pass=0; pass<BENCH_PASSES; pass++)
+	{
+		for (i=0; i<BENCH_SAMPLES; i++)
+		{
+			p.x = (int8_t)pgm_read_byte(&kSamples[i][0]);
+			p.y = (int8_t)pgm_read_byte(&kSamples[i][1]);
+#if PIPELINE_OFFSET
+			_TIME(offset, &p, pipeline_offset(&p, &state));
+#endif
+#if PIPELINE_FILTER
+			_TIME(filter, &p, pipeline_filter(&p, &state));
+#endif
+			_TIME(curve, &p, pipeline_curve(&p, &state));
+#if PIPELINE_ACCEL
+			_TIME(accel, &p, pipeline_accel(&p, &state));
+#endif
+#if PIPELINE_ACCUMULATE
+			_TIME(accumulate, &p, pipeline_accumulate(&p, &state));
+#endif
+			_TIME(quantise, &p, pipeline_quantise(&p, &state));
+		}
+	}
+
+	// The whole pipeline, against the two getters it took over from, with
+	//  the same offset and deadzone
+	radius = n35p112_get_noise()->radius;
+	for (pass=0; pass<BENCH_PASSES; pass++)
+	{
+		for (i=0; i<BENCH_SAMPLES; i++)
+		{
+			x = pgm_read_byte(&kSamples[i][0]);
+			y = pgm_read_byte(&kSamples[i][1]);
+			p.x = x;
+			p.y = y;
+			_TIME(whole, &p, pipeline_run(&p, &state));
+			_TIME(legacy, &p, p.x = _legacy_axis(x, state.offsetX, radius);
+			                 p.y = _legacy_axis(y, state.offsetY, radius));
+		}
+	}
+
+	// The fixed point library (fixed.h) on a spread of operands, with a
+	//  plain division by the same constant to compare
+	for (i=0; i<BENCH_FIXED; i++)
+	{
+		sFixedA = (uint16_t)i * 0x9E37;
+		sFixedB = (uint16_t)i * 0x7F4A + 0x3C6F;
+		_TIME(mulQ8, &sFixedOut, sFixedOut = fixed_mul_q8(sFixedA, sFixedB));
+		_TIME(mulHi, &sFixedOut, sFixedOut = fixed_umul16_hi(sFixedA, sFixedB));
+		_TIME(div, &sFixedOut, sFixedOut = FIXED_DIV_U16(sFixedA, 1000));
+		_TIME(divLib, &sFixedOut, sFixedOut = sFixedA / 1000);
+		_TIME(isqrt, &sFixedOut, sFixedOut = fixed_isqrt32((uint32_t)sFixedA << 16 | sFixedB));
+		_TIME(hypot, &sFixedOut, sFixedOut = fixed_hypot8(sFixedA, sFixedB));
+		_TIME(lerp, &sFixedOut, sFixedOut = fixed_lerp(sFixedA, sFixedB, i << 2));
+	}
+
+	// Mouse reports, or gamepad ones without the mouse, one per tick so
+	//  that the endpoint always has room and only the packing is counted
+	for (i=0; i<BENCH_REPORTS; i++)
+	{
+		_next_tick();
+		cli();
+		_start();
+#ifdef USB_GAMEPAD_ONLY
+		usb_gamepad_send(0, 0, 0);
+#else
+		usb_mouse_move(0, 0, 0);
+#endif
+		cycles = _stop();
+		SREG = intr_state;
+		_add(&report, cycles);
+	}
+
+	// Bus transfers, straight through the driver
+	for (i=0; i<BENCH_TRANSFERS; i++)
+	{
+		cli();
+		_start();
+		n35p112_probe();
+		cycles = _stop();
+		_start();
+		mcp23018_probe();
+		_add(&expander, _stop());
+		SREG = intr_state;
+		_add(&stick, cycles);
+	}
+
+	TCCR1B = 0;
+	n35p112_release();
+	upsample_reset();
+	EIFR |= (1 << INTF2);
+	EIMSK = eimsk;
+
+	LOG("bench %u MHz, bus %u kHz, overhead %u cycles\n",
+	    (uint16_t)(F_CPU / 1000000), twi_tune_get_khz(), sOverhead);
+	LOG("bench shape %u %u %u %u\n", _FIELDS(shape));
+	LOG("bench push %u %u %u %u\n", _FIELDS(push));
+	LOG("bench frame %u %u %u %u\n", _FIELDS(frame));
+	LOG("bench stage-offset %u %u %u %u\n", _FIELDS(offset));
+	LOG("bench stage-filter %u %u %u %u\n", _FIELDS(filter));
+	LOG("bench stage-curve %u %u %u %u\n", _FIELDS(curve));
+	LOG("bench stage-accel %u %u %u %u\n", _FIELDS(accel));
+	LOG("bench stage-accumulate %u %u %u %u\n", _FIELDS(accumulate));
+	LOG("bench stage-quantise %u %u %u %u\n", _FIELDS(quantise));
+	LOG("bench pipeline %u %u %u %u\n", _FIELDS(whole));
+	LOG("bench legacy-axes %u %u %u %u\n", _FIELDS(legacy));
+	LOG("bench fixed-mul-q8 %u %u %u %u\n", _FIELDS(mulQ8));
+	LOG("bench fixed-umul16-hi %u %u %u %u\n", _FIELDS(mulHi));
+	LOG("bench fixed-div-1000 %u %u %u %u\n", _FIELDS(div));
+	LOG("bench libgcc-div-1000 %u %u %u %u\n", _FIELDS(divLib));
+	LOG("bench fixed-isqrt32 %u %u %u %u\n", _FIELDS(isqrt));
+	LOG("bench fixed-hypot8 %u %u %u %u\n", _FIELDS(hypot));
+	LOG("bench fixed-lerp %u %u %u %u\n", _FIELDS(lerp));
+	LOG("bench report %u %u %u %u\n", _FIELDS(report));
+	LOG("bench twi-stick %u %u %u %u\n", _FIELDS(stick));
+	LOG("bench twi-expander %u %u %u %u\n", _FIELDS(expander));
+	return 0;
+}
@@ -0,0 +1,44 @@
+// bench.h
+//
+// On-device benchmark, for comparing builds on real silicon.  A fixed set
+//  of stick samples goes through the same path the main loop takes them
+//  (n35p112_update()'s offset, deadzone and curve, the upsampler, the mouse
+//  report), then a fixed number of bus transfers to each part, every step
+//  timed in CPU cycles with Timer1.
+//
+// The pointer pipeline's stages (mouse/pipeline.h) are timed one by one as
+//  well, a stage the build leaves out with a count of 0, then the whole of
+//  it next to the per axis deadzone and curve it replaced, and so are the
+//  fixed point library's (fixed.h) multiplies, division, square root, hypot
+//  and lerp, with the compiler's own division by the same constant.
+//
+// Runs with the stick's button held down through the start, or when the
+//  host writes HEALTH_COMMAND_BENCH to the debug feature report
+//  (healthmon -b).  Nothing else runs meanwhile, and the pointer doesn't
+//  move: the reports it times carry no movement.
+//
+// The results go over the debug channel, one line per step:
+//
+//   bench <step> <count> <min> <mean> <max>
+//
+//  in cycles at F_CPU, with the timer's own overhead taken off, after a
+//  line with the build's bus clock and the overhead.
+
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <stdint.h>
+
+// --------------------------------------------------------------------
+
+#define BENCH_PASSES         4	// over the sample set
+#define BENCH_FRAMES         20	// upsampled frames per sample, one period
+#define BENCH_REPORTS        64	// mouse reports, one per tick
+#define BENCH_TRANSFERS      64	// bus transfers, per part
+#define BENCH_FIXED          64	// operand pairs, per fixed point step
+
+// --------------------------------------------------------------------
+
+uint8_t bench_run(void);
+
+#endif //BENCH_H
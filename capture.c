@@ -0,0 +1,98 @@
+// capture.c
+//
+// Builds capture records and hands them to the bulk endpoint.  Nothing
+//  here waits: a record that finds both banks full is counted and dropped,
+//  so capturing can't slow down what it's looking at.
+
+#include "capture.h"
+#include "usb_mouse_debug.h"
+#include "log.h"
+#include "controller/teensy-2-0.h"
+
+#ifdef USB_CAPTURE
+
+// ----------------------------------------------------------------------------
+
+// static data
+static uint8_t sSeq = 0;
+static uint16_t sRecords = 0;
+static uint16_t sDrops = 0;
+static uint32_t sFillCount = 0;
+
+// ----------------------------------------------------------------------------
+
+static void _write(capture_record_t *record)
+{
+	record->seq = sSeq++;
+	sRecords++;
+	if (usb_capture_write((const uint8_t *)record, sizeof(*record)))
+		sDrops++;
+}
+
+// The flags the host asked for, 0 while it isn't capturing
+uint8_t capture_flags(void)
+{
+	return usb_capture_flags();
+}
+
+void capture_sample(uint16_t us, int8_t x, int8_t y, uint8_t polled)
+{
+	capture_record_t record;
+
+	if (!(usb_capture_flags() & CAPTURE_FLAG_SAMPLES))
+		return;
+	record.type = CAPTURE_RECORD_SAMPLE;
+	record.us = us;
+	record.data[0] = x;
+	record.data[1] = y;
+	record.data[2] = polled;
+	record.data[3] = 0;
+	_write(&record);
+}
+
+void capture_twi(uint16_t us, uint8_t device, uint8_t error, uint16_t busUs)
+{
+	capture_record_t record;
+
+	if (!(usb_capture_flags() & CAPTURE_FLAG_TWI))
+		return;
+	record.type = CAPTURE_RECORD_TWI;
+	record.us = us;
+	record.data[0] = device;
+	record.data[1] = error;
+	record.data[2] = busUs;
+	record.data[3] = busUs >> 8;
+	_write(&record);
+}
+
+// From the main loop: with CAPTURE_FLAG_FILL, top the endpoint up with
+//  counting records until both banks are full.  The host sees how fast
+//  they drain, which is as fast as the endpoint goes.
+void capture_fill(void)
+{
+	capture_record_t record;
+
+	if (!(usb_capture_flags() & CAPTURE_FLAG_FILL))
+		return;
+	record.type = CAPTURE_RECORD_FILL;
+	while (usb_capture_ready())
+	{
+		record.seq = sSeq++;
+		record.us = teensy_get_us();
+		record.data[0] = sFillCount;
+		record.data[1] = sFillCount >> 8;
+		record.data[2] = sFillCount >> 16;
+		record.data[3] = sFillCount >> 24;
+		sFillCount++;
+		if (usb_capture_write((const uint8_t *)&record, sizeof(record)))
+			break;
+	}
+}
+
+// Records made and dropped since reset
+void capture_print_stats(void)
+{
+	LOG("capture records %04X drop %04X\n", sRecords, sDrops);
+}
+
+#endif //USB_CAPTURE
@@ -0,0 +1,60 @@
+// capture.h
+//
+// Raw data capture over the vendor bulk endpoint (build with
+//  make USB_CAPTURE=1).  The host turns it on with a vendor request that
+//  carries the CAPTURE_FLAG_* bits it wants, and reads fixed size records
+//  from bulk IN endpoint 2.  See host/rawcap.c.
+
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include <stdint.h>
+
+// --------------------------------------------------------------------
+
+// The vendor interface and its requests: bmRequestType 0x41 (vendor,
+//  interface, host to device), wIndex = the interface, wValue = flags
+#define CAPTURE_INTERFACE     3
+#define CAPTURE_ENDPOINT      2
+#define CAPTURE_PACKET_SIZE   64
+#define CAPTURE_REQUEST_START 1
+
+// What to capture
+#define CAPTURE_FLAG_SAMPLES  0x01	// every stick read, INT2 or polled
+#define CAPTURE_FLAG_TWI      0x02	// every bus scheduler job
+#define CAPTURE_FLAG_POLL     0x04	// read the stick every tick as well
+#define CAPTURE_FLAG_FILL     0x08	// pad out the bandwidth, to measure it
+
+// Record types
+#define CAPTURE_RECORD_SAMPLE 1	// data: x, y, polled, 0
+#define CAPTURE_RECORD_TWI    2	// data: device, error, bus time (us, 16 bits)
+#define CAPTURE_RECORD_FILL   3	// data: a 32 bit count
+
+// One record, little endian like the AVR.  Records are 8 bytes so that a
+//  packet holds a whole number of them.  seq counts every record made,
+//  including the ones dropped because both endpoint banks were full, so
+//  the host sees drops as gaps.
+typedef struct {
+	uint8_t type;
+	uint8_t seq;
+	uint16_t us;		// teensy_get_us() time
+	uint8_t data[4];
+} capture_record_t;
+
+// --------------------------------------------------------------------
+
+#ifdef USB_CAPTURE
+uint8_t capture_flags(void);
+void capture_sample(uint16_t us, int8_t x, int8_t y, uint8_t polled);
+void capture_twi(uint16_t us, uint8_t device, uint8_t error, uint16_t busUs);
+void capture_fill(void);
+void capture_print_stats(void);
+#else
+static inline uint8_t capture_flags(void) { return 0; }
+static inline void capture_sample(uint16_t us, int8_t x, int8_t y, uint8_t polled) {}
+static inline void capture_twi(uint16_t us, uint8_t device, uint8_t error, uint16_t busUs) {}
+static inline void capture_fill(void) {}
+static inline void capture_print_stats(void) {}
+#endif
+
+#endif //CAPTURE_H
@@ -0,0 +1,127 @@
+// mcp23018.c
+
+#include "mcp23018.h"
+#include "../twi/twi_teensy-2-0.h"
+#include "../twi/twi_sched.h"
+#include "../twi/twi_tune.h"
+
+#include "../log.h"
+
+// ----------------------------------------------------------------------------
+
+#define MCP23018_TWI_ADDRESS (0x20 << 1)	// ADDR pin tied to GND
+#define MCP23018_TWI_TIMEOUT_MS 10
+
+// register addresses with IOCON.BANK = 0 (the power-on default)
+const uint8_t REG_IODIRA = 0x00;
+const uint8_t REG_GPPUB = 0x0D;
+const uint8_t REG_GPIOA = 0x12;
+
+// IODIRA, IODIRB.  GPA: columns, all outputs.  The pins are open drain, so
+//  writing a 1 to a column leaves it hi-Z and a 0 drives it low.  GPB: rows,
+//  all inputs.  mcp23018_probe() reads them back.
+const uint8_t kDir[2] = { 0x00, 0xFF };
+
+const uint8_t kColMask = (1 << MCP23018_MATRIX_COLS) - 1;
+const uint8_t kRowMask = 0x3F;
+
+// ----------------------------------------------------------------------------
+
+// static data
+static uint8_t sPresent = 0;
+static uint8_t sDevice = 0;
+static uint8_t sScanCol = 0;
+static uint8_t sScanRows[MCP23018_MATRIX_COLS];	// pass in progress
+static uint8_t sRows[MCP23018_MATRIX_COLS];	// last complete pass
+
+// static function declarations
+uint8_t _scan_service(void);
+
+/* Set up the expander and register it with the bus scheduler.  Uses the bus
+ *  directly, so call it before the scheduler is running.
+ *
+ * returns
+ * - a TWI_ErrorCodes_t value. If the expander doesn't answer, the matrix on
+ *   it just reads as all keys up; the same if the scheduler has no room for
+ *   it, with TWI_ERROR_SlaveNotReady.
+ */
+uint8_t mcp23018_init(void)
+{
+	uint8_t twiError;
+
+	// columns out, rows in (kDir), with pull-ups on the rows
+	const uint8_t pullup = 0xFF;
+	twiError = TWI_WritePacket(MCP23018_TWI_ADDRESS, MCP23018_TWI_TIMEOUT_MS, &REG_IODIRA, 1, kDir, 2);
+	if (twiError == TWI_ERROR_NoError)
+		twiError = TWI_WritePacket(MCP23018_TWI_ADDRESS, MCP23018_TWI_TIMEOUT_MS, &REG_GPPUB, 1, &pullup, 1);
+	if (twiError != TWI_ERROR_NoError)
+	{
+		LOG("mcp23018 twiError = %02X\n", twiError);
+		return twiError;
+	}
+
+	sDevice = twi_sched_add_device(TWI_SCHED_PRIORITY_NORMAL, _scan_service);
+	if (sDevice == TWI_SCHED_NO_DEVICE)
+		return TWI_ERROR_SlaveNotReady;
+	sPresent = 1;
+	return twiError;
+}
+
+// A read of both direction registers, for bus clock tuning
+//  (twi/twi_tune.c): one all zeros and one all ones, so a bit flipped either
+//  way without a NAK shows up as a mismatch.  Passes if the expander isn't
+//  there.
+uint8_t mcp23018_probe(void)
+{
+	uint8_t dir[2], twiError;
+
+	if (!sPresent)
+		return TWI_ERROR_NoError;
+	twiError = TWI_ReadPacket(MCP23018_TWI_ADDRESS, MCP23018_TWI_TIMEOUT_MS, &REG_IODIRA, 1, dir, 2);
+	if (twiError == TWI_ERROR_NoError && (dir[0] != kDir[0] || dir[1] != kDir[1]))
+		return TWI_TUNE_MISMATCH;
+	return twiError;
+}
+
+// Start a pass over the expander's columns.  Each column is its own
+//  scheduler job, so a joystick read never waits for more than one of them.
+void mcp23018_start_scan(void)
+{
+	if (sPresent && sScanCol == 0)
+		twi_sched_request(sDevice);
+}
+
+uint8_t mcp23018_get_column(uint8_t col)
+{
+	return sRows[col];
+}
+
+// Read one column in a single burst: the write selects the column through
+//  GPIOA, which leaves the register pointer on GPIOB (sequential mode), so
+//  the repeated-start read that follows returns the rows.
+uint8_t _scan_service(void)
+{
+	uint8_t twiError, rows;
+	const uint8_t select[2] = { REG_GPIOA, ~(1 << sScanCol) & kColMask };
+
+	twiError = TWI_ReadPacket(MCP23018_TWI_ADDRESS, MCP23018_TWI_TIMEOUT_MS, select, 2, &rows, 1);
+	if (twiError != TWI_ERROR_NoError)
+	{
+		// drop the whole pass, the last complete one stays current
+		sScanCol = 0;
+		return twiError;
+	}
+	sScanRows[sScanCol] = ~rows & kRowMask;
+
+	if (++sScanCol < MCP23018_MATRIX_COLS)
+	{
+		twi_sched_request(sDevice);
+	}
+	else
+	{
+		for (sScanCol=0; sScanCol<MCP23018_MATRIX_COLS; sScanCol++)
+			sRows[sScanCol] = sScanRows[sScanCol];
+		sScanCol = 0;
+	}
+	return twiError;
+}
@@ -0,0 +1,21 @@
+// mcp23018.h
+
+#ifndef MCP23018_H
+#define MCP23018_H
+
+#include <stdint.h>
+
+// --------------------------------------------------------------------
+
+// key matrix on the expander: columns on GPA0..GPA5 (open drain), rows on
+//  GPB0..GPB5, same row count as the local matrix
+#define MCP23018_MATRIX_COLS 6
+
+// --------------------------------------------------------------------
+
+uint8_t mcp23018_init(void);
+uint8_t mcp23018_probe(void);
+void mcp23018_start_scan(void);
+uint8_t mcp23018_get_column(uint8_t col);
+
+#endif //MCP23018_H
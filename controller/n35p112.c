@@ -1,16 +1,25 @@
 // n35p112.c
 
 #include "n35p112.h"
+#include "teensy-2-0.h"
+#include "stack.h"
 #include "../twi/twi_teensy-2-0.h"
+#include "../twi/twi_sched.h"
+#include "../twi/twi_tune.h"
+#include "../capture.h"
+#include "../mouse/pipeline.h"
+#include "../power.h"
+#include "../fixed.h"
+#include "split.h"
 
-#include "../print.h"
+#include "../log.h"
 
 #include <avr/interrupt.h>
 #include <util/delay.h>
+#include <string.h>
 
 // ----------------------------------------------------------------------------
 
-#define N35P112_TWI_ADDRESS (0x41 << 1)
 #define N35P112_TWI_TIMEOUT_MS 10
 
 #define MATRIX_DEBOUNCE_SCANS (5)
@@ -28,104 +37,359 @@ const uint8_t REG_JOY_X_NEGATIVE_THRESHHOLD = 0x13;
 const uint8_t REG_JOY_Y_POSITIVE_THRESHHOLD = 0x14;
 const uint8_t REG_JOY_Y_NEGATIVE_THRESHHOLD = 0x15;
 
-const uint8_t kJoyResetMs = 22;
-const uint8_t kMidSensitivityThresh = 100;
-const int8_t kMidSensitivity = 8;
-const uint8_t kLowSensitivityThresh = 60;
-const int8_t kLowEndSensitivity = 12;
+// CONTROL1 settings.  Active: 20ms between conversions, interrupt after
+//  each one.  Asleep: 320ms between conversions, interrupt only outside the
+//  deadzone thresholds (wake-up mode).  See N35P112 data sheet p.23
+const uint8_t kControlActive = 0x00;
+const uint8_t kControlSleep = (7 << 4) | (1 << 3);
+
+// The hall sensor's scaling, for 0.5mm knob travel.  n35p112_probe() reads
+//  it back.
+const uint8_t kScaleFactor = 0x06;
+
+// Release detection, see n35p112_update().  A conversion is expected a
+//  period after the last one, give or take the chip's timebase jitter.  Past
+//  that the registers are polled until the stick is found back in the
+//  threshold window, and after two periods it is taken to be there anyway.
+//  Two periods have to fit in the 16 bit us clock, hence the longest one.
+const uint16_t kJoyLateUs = 1500;
+const uint16_t kJoyPollUs = 1000;
+const uint16_t kJoyMinPeriodUs = 10000;
+const uint16_t kJoyMaxPeriodUs = 32000;
+// bounds on waiting for the chip, so a missing or wedged part can't hang us
+const uint8_t kInitRetries = 10;
+
+// Deadzone, see _noise_window().  The threshold window's half side on each
+//  axis is the furthest any rest sample went, or kNoiseSigmas4 / 4 standard
+//  deviations of the rest noise plus half a count for the rest position
+//  being a whole count, whichever is more.  At 4.75 sigma a Gaussian sample
+//  lands outside about once in 250000 per axis, under one false motion an
+//  hour at 50 conversions a second.  kDeadZoneRadius is for a calibration
+//  that failed.
+const uint8_t kNoiseSigmas4 = 19;
+const int8_t kDeadZoneRadius = 15;
+const int8_t kDeadZoneMinRadius = 3;
+const int8_t kDeadZoneMaxRadius = 30;
+
+// Calibration, see _calibrate_sample().  Samples further than
+//  kCalibrateOutlier from the median of the first few are dropped, and it's
+//  done as soon as the mean of the rest is known to within about a quarter
+//  of a count, but not on fewer than kCalibrateMinSamples, which are enough
+//  for the noise too.  It gives up after kCalibrateSamples, or
+//  kCalibrateMisses periods without one.
+const uint8_t kCalibrateMinSamples = 16;
+const uint8_t kCalibrateSamples = 32;
+const uint8_t kCalibrateMisses = 10;
+const int8_t kCalibrateOutlier = 6;
+
+// Samples read by _joy_service() wait here for n35p112_update().  One slot
+//  is always left empty, so a power of two size holds one less than that.
+#define N35P112_QUEUE_SIZE 8
+#define N35P112_QUEUE_MASK (N35P112_QUEUE_SIZE - 1)
+
+// Motion states.  The chip interrupts after every conversion outside the
+//  threshold window set by _set_deadzone() and stays quiet inside it, so a
+//  missing interrupt while moving means the stick was let go, or that the
+//  conversion is late.
+#define JOY_IDLE     0	// in the window, no samples expected
+#define JOY_MOVING   1	// out of it, a sample every period
+#define JOY_CONFIRM  2	// a sample is overdue, polling the registers
+
+// Calibration states.  Samples go to _calibrate_sample() instead of the
+//  pointer until it's off.
+#define CAL_OFF        0
+#define CAL_REFERENCE  1	// collecting the first few for the median
+#define CAL_GATHER     2	// averaging the rest against it
+#define N35P112_CAL_REFERENCE 5
 
 // ----------------------------------------------------------------------------
 
 // static data
-volatile static int8_t sJoyX = 0;
-volatile static int8_t sJoyY = 0;
-volatile static int8_t sJoyOffsetX = 0;
-volatile static int8_t sJoyOffsetY = 0;
-volatile static int8_t sDeadZoneRadius = 0;
-volatile static uint8_t sJoyChangeElapsedMs = 0;
+static int8_t sJoyX = 0;
+static int8_t sJoyY = 0;
+static pipeline_state_t sPipe;
+static int8_t sWindowXp = 0;
+static int8_t sWindowXn = 0;
+static int8_t sWindowYp = 0;
+static int8_t sWindowYn = 0;
+static uint8_t sJoyDevice = 0;
+volatile static uint8_t sJoyRetry = 0;
+volatile static uint16_t sJoyIntUs = 0;
+static uint16_t sSampleUs = 0;
+static uint8_t sJoyState = JOY_IDLE;
+static uint16_t sJoyPeriodUs = 20000;
+static uint16_t sJoyPollUs = 0;
+static uint8_t sRawX = 0;
+static uint8_t sRawY = 0;
+
+// sample queue: the producer (_joy_service()) only moves sQueueHead, the
+//  consumer (n35p112_update()) only moves sQueueTail
+static n35p112_sample_t sQueue[N35P112_QUEUE_SIZE];
+volatile static uint8_t sQueueHead = 0;
+volatile static uint8_t sQueueTail = 0;
+static n35p112_stats_t sStats;
+static int8_t sOutX = 0;
+static int8_t sOutY = 0;
+
+// calibration: deviations from the reference, summed and squared, for the
+//  samples kept
+static uint8_t sCalState = CAL_OFF;
+static uint8_t sCalSeen = 0;
+static uint8_t sCalKept = 0;
+static uint8_t sCalMisses = 0;
+static int8_t sCalRefX[N35P112_CAL_REFERENCE];
+static int8_t sCalRefY[N35P112_CAL_REFERENCE];
+static int8_t sCalX = 0;
+static int8_t sCalY = 0;
+static int16_t sCalSumX = 0;
+static int16_t sCalSumY = 0;
+static uint16_t sCalSquaresX = 0;
+static uint16_t sCalSquaresY = 0;
+static n35p112_noise_t sNoise;
 
 static uint8_t sBtn = 0;
 static uint8_t sBtnDebounceBuffer = 0;
 
 // static function declarations
-void _offset_calibrate(void);
-void _set_deadzone (int8_t deadZoneRadius);
+void _calibrate_sample(const n35p112_sample_t *sample);
+void _calibrate_wait(void);
+void _calibrate_finish(void);
+void _write_window(uint8_t xp, uint8_t xn, uint8_t yp, uint8_t yn);
+void _set_deadzone (int8_t halfX, int8_t halfY);
+void _shape(void);
+void _track(const n35p112_sample_t *sample);
+void _release(void);
+uint8_t _joy_service(void);
 
 uint8_t n35p112_init(void)
 {
-	uint8_t ret = 0;
 	uint8_t twiError;
 
 	//print("n35p112_init()\n");
 
 	// reset high
 	PORTD |= (1<<3);
-	_delay_ms(1);
+	POWER_DELAY_MS(1);
 	// reset low
 	PORTD &=~ (1<<3);
-	_delay_ms(1);
+	POWER_DELAY_MS(1);
 	// reset high
 	PORTD |= (1<<3);
-	_delay_ms(100);
+	POWER_DELAY_MS(100);
+	power_sensor = POWER_SENSOR_ACTIVE;
 
-	// Wait for the chip to finish Power On Reset
+	pipeline_init(&sPipe);
+
+	// Sensor reads are latency critical, they go ahead of anything else
+	//  waiting for the bus
+	sJoyDevice = twi_sched_add_device(TWI_SCHED_PRIORITY_CRITICAL, _joy_service);
+	if (sJoyDevice == TWI_SCHED_NO_DEVICE)
+		return TWI_ERROR_SlaveNotReady;	// no stick without the scheduler
+
+	// Wait for the chip to finish Power On Reset, for about a second at most
 	uint8_t resetStatus = 0;
-	while (resetStatus != 0xF0)// Check the reset has been done
+	uint8_t tries;
+	for (tries=0; tries<kInitRetries; tries++)
 	{
 		//print("Reading Reset\n");
 		twiError = TWI_ReadPacket(N35P112_TWI_ADDRESS, N35P112_TWI_TIMEOUT_MS, &REG_CONTROL1, 1, &resetStatus, 1);
+		if (twiError == TWI_ERROR_NoError && (resetStatus & 0xFE) == 0xF0)
+			break;
 		if (twiError != TWI_ERROR_NoError)
 		{
-			print("twiError = ");
-			phex(twiError);
-			print("\n");
+			LOG("twiError = %02X\n", twiError);
+			twi_sched_recover(sJoyDevice);
 		}
-		else
-		{
-			_delay_ms(100);
-		}
-		resetStatus &= 0xFE;
-		//print("resetStatus = ");
-		//phex(resetStatus);
-		//print("\n");
+		POWER_DELAY_MS(100);
+	}
+	if (tries == kInitRetries)
+	{
+		LOG("n35p112 not ready\n");
+		return twiError != TWI_ERROR_NoError ? twiError : TWI_ERROR_SlaveNotReady;
 	}
 
 	//print("Reset Complete\n");
 	//_delay_ms(100);
 
 	// Set the scaling factor for the hall effect sensor for 0.5mm knob travel distance
-	const uint8_t scaleFactor = 0x06;
-	twiError = TWI_WritePacket(N35P112_TWI_ADDRESS, N35P112_TWI_TIMEOUT_MS, &REG_SCALEFACTOR, 1, &scaleFactor, 1);
+	twiError = TWI_WritePacket(N35P112_TWI_ADDRESS, N35P112_TWI_TIMEOUT_MS, &REG_SCALEFACTOR, 1, &kScaleFactor, 1);
 	if (twiError != TWI_ERROR_NoError)
 	{
-		print("twiError = ");
-		phex(twiError);
-		print("\n");
+		LOG("twiError = %02X\n", twiError);
 	}
 
 	//print("n35p112_init() complete\n");
 
-	return ret;
+	return twiError;
 }
 
+// A read of the scale factor init wrote, for bus clock tuning
+//  (twi/twi_tune.c): a clock that flips bits without a NAK shows up as a
+//  mismatch
+uint8_t n35p112_probe(void)
+{
+	uint8_t scale, twiError;
+
+	twiError = TWI_ReadPacket(N35P112_TWI_ADDRESS, N35P112_TWI_TIMEOUT_MS, &REG_SCALEFACTOR, 1, &scale, 1);
+	if (twiError == TWI_ERROR_NoError && scale != kScaleFactor)
+		return TWI_TUNE_MISMATCH;
+	return twiError;
+}
+
+/* Find the stick's rest position, and set the deadzone around it.  This
+ *  only starts it: it goes on from n35p112_update(), which keeps the
+ *  pointer still meanwhile, and takes a few conversions.  Call it from the
+ *  main loop between twi_sched_run() calls, with INT2 listening.
+ */
 void n35p112_calibrate(void)
 {
-	_offset_calibrate();
-	_set_deadzone(15);
+	uint8_t twiError;
+
+	// A conversion every 20ms, and an empty threshold window so that every
+	//  one of them raises the interrupt
+	twiError = TWI_WritePacket(N35P112_TWI_ADDRESS, N35P112_TWI_TIMEOUT_MS, &REG_CONTROL1, 1, &kControlActive, 1);
+	if (twiError != TWI_ERROR_NoError)
+		twi_sched_recover(sJoyDevice);
+	_write_window(0x80, 0x7F, 0x80, 0x7F);
+
+	sCalState = CAL_REFERENCE;
+	sCalSeen = 0;
+	sCalKept = 0;
+	sCalMisses = 0;
+	memset(&sNoise, 0, sizeof(sNoise));
+	sJoyState = JOY_IDLE;
+	sSampleUs = teensy_get_us();
 }
 
-void n35p112_update(uint8_t elapsedMs)
+// Nonzero until the calibration n35p112_calibrate() started is done
+uint8_t n35p112_calibrating(void)
 {
-	// If no interrupts were received during the self-timer sample period,
-	//  assume the pointer is re-centered
-	sJoyChangeElapsedMs += elapsedMs;
-	if (sJoyChangeElapsedMs > kJoyResetMs)
+	return sCalState != CAL_OFF;
+}
+
+/* Slow the chip down to its wake-up mode while the host is suspended, and
+ *  back again.  They use the bus directly, so call them from the main loop
+ *  between twi_sched_run() calls.
+ */
+void n35p112_suspend(void)
+{
+	uint8_t twiError;
+
+	sJoyState = JOY_IDLE;
+	twiError = TWI_WritePacket(N35P112_TWI_ADDRESS, N35P112_TWI_TIMEOUT_MS, &REG_CONTROL1, 1, &kControlSleep, 1);
+	if (twiError != TWI_ERROR_NoError)
+		twi_sched_recover(sJoyDevice);
+	else
+		power_sensor = POWER_SENSOR_SLEEP;
+#ifdef USB_GAMEPAD
+	// only a push past the deadzone wakes the host
+	_write_window(sWindowXp, sWindowXn, sWindowYp, sWindowYn);
+#endif
+}
+
+void n35p112_resume(void)
+{
+	uint8_t twiError;
+
+	twiError = TWI_WritePacket(N35P112_TWI_ADDRESS, N35P112_TWI_TIMEOUT_MS, &REG_CONTROL1, 1, &kControlActive, 1);
+	if (twiError != TWI_ERROR_NoError)
+		twi_sched_recover(sJoyDevice);
+	power_sensor = POWER_SENSOR_ACTIVE;
+#ifdef USB_GAMEPAD
+	_write_window(0x80, 0x7F, 0x80, 0x7F);
+#endif
+	_release();
+}
+
+// Non-zero if there's a sample waiting for n35p112_update() or the button
+//  is down.  In wake-up mode a sample means the stick has been pushed past
+//  the deadzone.
+uint8_t n35p112_activity(void)
+{
+	return (sQueueHead != sQueueTail) || !(PINB & (1<<7));
+}
+
+/* Take new samples, handle the stick being let go, and shape the result.
+ *  Call it every tick: a release that the chip doesn't interrupt for is
+ *  found by polling from here, within a couple of ms of the conversion that
+ *  saw it.
+ *
+ * returns
+ * - N35P112_SAMPLE if there was a new sample that moves the pointer (or
+ *   leaves it still), N35P112_RELEASED if the pointer was moving and the
+ *   stick is now back in the deadzone, N35P112_NO_CHANGE otherwise
+ */
+uint8_t n35p112_update(void)
+{
+	uint8_t change = N35P112_NO_CHANGE;
+	uint8_t wasMoving = sOutX || sOutY;
+	uint16_t sinceUs;
+
+	// A failed read left the interrupt asserted.  Listening again right away
+	//  would retry in a tight loop on a dead bus, so wait for the next update.
+	if (sJoyRetry)
+	{
+		sJoyRetry = 0;
+		EIFR |= (1 << INTF2);
+		EIMSK |= (1 << INT2);
+	}
+
+	// Take everything that arrived since the last update.  The pointer only
+	//  needs the newest pair, but every sample is seen in order.
+	uint8_t tail = sQueueTail;
+	while (tail != sQueueHead)
+	{
+		if (sCalState != CAL_OFF)
+		{
+			_calibrate_sample(&sQueue[tail]);
+		}
+		else
+		{
+			_track(&sQueue[tail]);
+			change = N35P112_SAMPLE;
+		}
+		sStats.samples++;
+		tail = (tail + 1) & N35P112_QUEUE_MASK;
+		sQueueTail = tail;
+	}
+
+	// No sample when one was due.  Read the registers, which hold the latest
+	//  conversion whether it interrupted or not, once the conversion should
+	//  have landed and then every kJoyPollUs until a new one turns up.  If
+	//  the bus can't tell us for two whole periods, give up on the stick.
+	// Capturing with CAPTURE_FLAG_POLL reads the registers every tick, to
+	//  see when conversions land whether they interrupt or not
+	if (capture_flags() & CAPTURE_FLAG_POLL)
+		twi_sched_request(sJoyDevice);
+
+	if (sCalState != CAL_OFF)
 	{
-		// Is this needed? Do we get interupts every 20ms even if the cursor is
-		//  not moving?
-		sJoyX = 0;
-		sJoyY = 0;
-		sJoyChangeElapsedMs = 0;
+		_calibrate_wait();
+	}
+	else if (change == N35P112_NO_CHANGE && sJoyState != JOY_IDLE)
+	{
+		sinceUs = teensy_get_us() - sSampleUs;
+		if (sinceUs > 2 * (uint32_t)sJoyPeriodUs)
+		{
+			sStats.lateReleases++;
+			_release();
+			change = N35P112_SAMPLE;
+		}
+		else if (sinceUs > sJoyPeriodUs + kJoyLateUs &&
+		         (sJoyState == JOY_MOVING || (uint16_t)(teensy_get_us() - sJoyPollUs) >= kJoyPollUs))
+		{
+			sJoyState = JOY_CONFIRM;
+			sJoyPollUs = teensy_get_us();
+			sStats.polls++;
+			twi_sched_request(sJoyDevice);
+		}
+	}
+
+	if (change != N35P112_NO_CHANGE)
+	{
+		_shape();
+		if (wasMoving && !sOutX && !sOutY)
+			change = N35P112_RELEASED;
 	}
 
 	// Debounce the switch
@@ -153,197 +417,373 @@ void n35p112_update(uint8_t elapsedMs)
 	//		sBtn = 1;
 	//	}
 	//}
+
+	return change;
+}
+
+// When the latest sample's conversion finished, or for a polled one when it
+//  was read (teensy_get_us() time)
+uint16_t n35p112_get_sample_us(void)
+{
+	return sSampleUs;
 }
 
 int8_t n35p112_get_x(void)
 {
-	int8_t joyX;
-	if (sJoyX > 0)
+	return sOutX;
+}
+
+int8_t n35p112_get_y(void)
+{
+	return sOutY;
+}
+
+uint8_t n35p112_get_btn(void)
+{
+	return sBtn;
+}
+
+// Where the stick is, for an absolute report: the latest sample with the
+//  offset taken off but no deadzone or curve, a count as 258 so that the
+//  8 bit travel spans +-N35P112_POSITION_MAX
+static int16_t _position(int8_t joy, int8_t offset)
+{
+	int16_t c = joy + offset;
+
+	if (c > 127)
+		c = 127;
+	else if (c < -127)
+		c = -127;
+	return c * (N35P112_POSITION_MAX / 127);
+}
+
+int16_t n35p112_get_position_x(void)
+{
+	return _position(sJoyX, sPipe.offsetX);
+}
+
+int16_t n35p112_get_position_y(void)
+{
+	return _position(sJoyY, sPipe.offsetY);
+}
+
+// The latest sample through the pointer pipeline (mouse/pipeline.h)
+void _shape(void)
+{
+	pipeline_t p = { sJoyX, sJoyY };
+
+	pipeline_run(&p, &sPipe);
+	sOutX = p.x;
+	sOutY = p.y;
+}
+
+// Move the state machine on by one sample
+void _track(const n35p112_sample_t *sample)
+{
+	uint16_t periodUs;
+
+	sJoyX = sample->x;
+	sJoyY = sample->y;
+
+	if (sample->x <= sWindowXp && sample->x >= sWindowXn &&
+	    sample->y <= sWindowYp && sample->y >= sWindowYn)
 	{
-		if (sJoyX < sDeadZoneRadius)
-		{
-			joyX = 0;
-		}
-		else if ((127 - (sJoyX - sDeadZoneRadius)) < sJoyOffsetX)
-		{
-			joyX = 127;
-		}
-		else
-		{
-			joyX = sJoyX - sDeadZoneRadius + sJoyOffsetX;
-			if (joyX < 0)
-			{
-				joyX =0;
-			}
-			else if(joyX < kLowSensitivityThresh)
-			{
-				joyX /= kLowEndSensitivity;
-			}
-			else if(joyX < kMidSensitivityThresh)
-			{
-				joyX /= kMidSensitivity;
-			}
-		}
+		sJoyState = JOY_IDLE;
 	}
 	else
 	{
-		if (sJoyX > -sDeadZoneRadius)
-		{
-			joyX = 0;
-		}
-		else if ((-127 - (sJoyX + sDeadZoneRadius)) > sJoyOffsetX)
-		{
-			joyX = -127;
-		}
-		else
-		{
-			joyX = sJoyX + sDeadZoneRadius + sJoyOffsetX;
-			if (joyX > 0)
-			{
-				joyX = 0;
-			}
-			else if(joyX > -kLowSensitivityThresh)
-			{
-				joyX /= kLowEndSensitivity;
-			}
-			else if(joyX > -kMidSensitivityThresh)
-			{
-				joyX /= kMidSensitivity;
-			}
-		}
+		// Follow the conversion period from back to back interrupts
+		periodUs = sample->us - sSampleUs;
+		if (sJoyState == JOY_MOVING && !sample->polled &&
+		    periodUs >= kJoyMinPeriodUs && periodUs <= kJoyMaxPeriodUs)
+			sJoyPeriodUs = (3 * (uint32_t)sJoyPeriodUs + periodUs + 2) >> 2;
+		sJoyState = JOY_MOVING;
 	}
-	return joyX;
+	sSampleUs = sample->us;
 }
 
-int8_t n35p112_get_y(void)
+// Back to center, without a sample to say so
+void _release(void)
+{
+	sJoyX = -sPipe.offsetX;
+	sJoyY = -sPipe.offsetY;
+	sJoyState = JOY_IDLE;
+	pipeline_reset(&sPipe);
+	_shape();
+}
+
+// The middle one of N35P112_CAL_REFERENCE values, sorted in a copy
+static int8_t _median(const int8_t *values)
 {
-	int8_t joyY;
-	if (sJoyY > 0)
+	int8_t v[N35P112_CAL_REFERENCE];
+	uint8_t i, j;
+
+	for (i=0; i<N35P112_CAL_REFERENCE; i++)
 	{
-		if (sJoyY < sDeadZoneRadius)
-		{
-			joyY = 0;
-		}
-		else if ((127 - (sJoyY - sDeadZoneRadius)) < sJoyOffsetY)
-		{
-			joyY = 127;
-		}
-		else
-		{
-			joyY = sJoyY - sDeadZoneRadius + sJoyOffsetY;
-			if (joyY < 0)
-			{
-				joyY =0;
-			}
-			else if(joyY < kLowSensitivityThresh)
-			{
-				joyY /= kLowEndSensitivity;
-			}
-			else if(joyY < kMidSensitivityThresh)
-			{
-				joyY /= kMidSensitivity;
-			}
-		}
+		for (j=i; j && v[j - 1] > values[i]; j--)
+			v[j] = v[j - 1];
+		v[j] = values[i];
+	}
+	return v[N35P112_CAL_REFERENCE >> 1];
+}
+
+// One deviation into a noise histogram, the ends take everything past them
+static void _noise_count(uint8_t *bins, int8_t d)
+{
+	if (d < -N35P112_NOISE_SPAN)
+		d = -N35P112_NOISE_SPAN;
+	else if (d > N35P112_NOISE_SPAN)
+		d = N35P112_NOISE_SPAN;
+	bins[d + N35P112_NOISE_SPAN]++;
+}
+
+// Keep a sample that's close enough to the reference.  Every one counts for
+//  the noise histograms, outliers too.
+static void _calibrate_add(int8_t x, int8_t y)
+{
+	int8_t dx = x - sCalX;
+	int8_t dy = y - sCalY;
+
+	_noise_count(sNoise.x, dx);
+	_noise_count(sNoise.y, dy);
+	sNoise.samples++;
+	if (dx > kCalibrateOutlier || dx < -kCalibrateOutlier ||
+	    dy > kCalibrateOutlier || dy < -kCalibrateOutlier)
+		return;
+	sCalSumX += dx;
+	sCalSumY += dy;
+	sCalSquaresX += dx * dx;
+	sCalSquaresY += dy * dy;
+	sCalKept++;
+}
+
+// Whether the mean along one axis is known well enough: the variance of the
+//  mean, var / n, under 1/16 of a count squared
+static uint8_t _calibrate_converged(int16_t sum, uint16_t squares)
+{
+	int32_t n = sCalKept;
+
+	return 16 * (n * squares - (int32_t)sum * sum) < n * n * (n - 1);
+}
+
+/* One sample at rest.  The first few only make the reference, their median,
+ *  so a bump or a stale conversion among them can't drag it off; then they
+ *  and everything after are measured against it, outliers dropped, until
+ *  the offsets have converged.
+ */
+void _calibrate_sample(const n35p112_sample_t *sample)
+{
+	uint8_t i;
+
+	sSampleUs = sample->us;
+	sCalMisses = 0;
+	if (sCalState == CAL_REFERENCE)
+	{
+		sCalRefX[sCalSeen] = sample->x;
+		sCalRefY[sCalSeen] = sample->y;
+		if (++sCalSeen < N35P112_CAL_REFERENCE)
+			return;
+
+		sCalX = _median(sCalRefX);
+		sCalY = _median(sCalRefY);
+		sCalKept = 0;
+		sCalSumX = 0;
+		sCalSumY = 0;
+		sCalSquaresX = 0;
+		sCalSquaresY = 0;
+		for (i=0; i<N35P112_CAL_REFERENCE; i++)
+			_calibrate_add(sCalRefX[i], sCalRefY[i]);
+		sCalState = CAL_GATHER;
 	}
 	else
 	{
-		if (sJoyY > -sDeadZoneRadius)
-		{
-			joyY = 0;
-		}
-		else if ((-127 - (sJoyY + sDeadZoneRadius)) > sJoyOffsetY)
-		{
-			joyY = -127;
-		}
-		else
-		{
-			joyY = sJoyY + sDeadZoneRadius + sJoyOffsetY;
-			if (joyY > 0)
-			{
-				joyY = 0;
-			}
-			else if(joyY > -kLowSensitivityThresh)
-			{
-				joyY /= kLowEndSensitivity;
-			}
-			else if(joyY > -kMidSensitivityThresh)
-			{
-				joyY /= kMidSensitivity;
-			}
-		}
+		sCalSeen++;
+		_calibrate_add(sample->x, sample->y);
 	}
-	return joyY;
+
+	if (sCalSeen >= kCalibrateSamples ||
+	    (sCalKept >= kCalibrateMinSamples &&
+	     _calibrate_converged(sCalSumX, sCalSquaresX) &&
+	     _calibrate_converged(sCalSumY, sCalSquaresY)))
+		_calibrate_finish();
 }
 
-uint8_t n35p112_get_btn(void)
+// No sample for two periods counts as a miss, too many and the stick isn't
+//  there
+void _calibrate_wait(void)
 {
-	return sBtn;
+	uint16_t nowUs = teensy_get_us();
+
+	if ((uint16_t)(nowUs - sSampleUs) <= 2 * (uint32_t)sJoyPeriodUs)
+		return;
+	sSampleUs = nowUs;
+	if (++sCalMisses >= kCalibrateMisses)
+		_calibrate_finish();
 }
 
-void _offset_calibrate(void)
+// Rounded sum / n
+static int8_t _calibrate_mean(int16_t sum)
 {
-	uint8_t i;
-	int8_t x_cal = 0;
-	int8_t y_cal = 0;
+	int16_t half = sCalKept >> 1;
 
-	// Disable the MCU interrupts
-	cli();
+	return (sum < 0 ? sum - half : sum + half) / sCalKept;
+}
+
+// Move a histogram taken around the reference to be around the rest
+//  position, shift counts off the reference
+static void _noise_recentre(uint8_t *bins, int8_t shift)
+{
+	uint8_t moved[N35P112_NOISE_BINS];
+	int8_t d;
 
-	// Set control register to configure the chip. Low Power Mode, 20ms wakeup
-	//  time, interrupt enabled, interrupt active after sampling, normal mode.
-	//  See N35P112 data sheet p.23
-	uint8_t controlValue = 0x00;
-	TWI_WritePacket(N35P112_TWI_ADDRESS, N35P112_TWI_TIMEOUT_MS, &REG_CONTROL1, 1, &controlValue, 1);
-	_delay_ms(1);
+	memset(moved, 0, sizeof(moved));
+	for (d=-N35P112_NOISE_SPAN; d<=N35P112_NOISE_SPAN; d++)
+	{
+		int8_t to = d - shift;
 
-	// Flush an unused Y_reg to reset the interrupt
-	uint8_t dummyVal;
-	TWI_ReadPacket(N35P112_TWI_ADDRESS, N35P112_TWI_TIMEOUT_MS, &REG_JOY_Y, 1, &dummyVal, 1);
+		if (to < -N35P112_NOISE_SPAN)
+			to = -N35P112_NOISE_SPAN;
+		else if (to > N35P112_NOISE_SPAN)
+			to = N35P112_NOISE_SPAN;
+		moved[to + N35P112_NOISE_SPAN] += bins[d + N35P112_NOISE_SPAN];
+	}
+	memcpy(bins, moved, sizeof(moved));
+}
 
-	for (i=0; i<16; i++)// Read 16 times the coordinates and then average
+/* The threshold window's half side for one axis, from its noise: the
+ *  smallest that holds every rest sample seen and kNoiseSigmas4 / 4
+ *  standard deviations plus half a count.  n squares - sum^2 is
+ *  n (n - 1) var, so k sigma <= h - 1/2 is
+ *  (4k)^2 (n squares - sum^2) <= 4 (2h - 1)^2 n (n - 1).
+ *
+ * returns
+ * - the half side, in counts; the standard deviation in 1/16 counts in
+ *   *sigma16
+ */
+static int8_t _noise_window(const uint8_t *bins, int16_t sum, uint16_t squares, uint8_t *sigma16)
+{
+	int32_t n = sCalKept;
+	int32_t spread = n * squares - (int32_t)sum * sum;	// n (n - 1) var
+	int32_t nn = n * (n - 1);
+	uint16_t sigma;
+	int8_t half, d;
+
+	// sqrt(256 var), rounded down
+	sigma = fixed_isqrt32(256 * spread / nn);
+	*sigma16 = sigma > 0xFF ? 0xFF : sigma;
+
+	half = 1;
+	while ((int32_t)kNoiseSigmas4 * kNoiseSigmas4 * spread > 4 * (int32_t)(2 * half - 1) * (2 * half - 1) * nn)
+		half++;
+	for (d=-N35P112_NOISE_SPAN; d<=N35P112_NOISE_SPAN; d++)
 	{
-		while (PIND & (1<<2));// Wait until next interrupt (new coordinates)
-		uint8_t xRegVal, yRegVal;
-		TWI_ReadPacket(N35P112_TWI_ADDRESS, N35P112_TWI_TIMEOUT_MS, &REG_JOY_X, 1, &xRegVal, 1);
-		TWI_ReadPacket(N35P112_TWI_ADDRESS, N35P112_TWI_TIMEOUT_MS, &REG_JOY_Y, 1, &yRegVal, 1);
-		x_cal += (int8_t) xRegVal;
-		y_cal += (int8_t) yRegVal;
+		if (bins[d + N35P112_NOISE_SPAN] && d > half)
+			half = d;
+		if (bins[d + N35P112_NOISE_SPAN] && -d > half)
+			half = -d;
+	}
+	return half;
+}
 
+// Take the offsets, if there were enough samples to go on, otherwise keep
+//  the old ones; then the deadzone goes around them, as wide as the noise
+//  needs
+void _calibrate_finish(void)
+{
+	int8_t meanX, meanY;
+
+	if (sCalState == CAL_GATHER && sCalKept >= kCalibrateMinSamples)
+	{
+		meanX = _calibrate_mean(sCalSumX);
+		meanY = _calibrate_mean(sCalSumY);
+		sPipe.offsetX = -(sCalX + meanX);
+		sPipe.offsetY = -(sCalY + meanY);
+		LOG("n35p112 offset %d %d, %u of %u samples\n",
+		    sPipe.offsetX, sPipe.offsetY, sCalKept, sCalSeen);
+
+		_noise_recentre(sNoise.x, meanX);
+		_noise_recentre(sNoise.y, meanY);
+		sNoise.halfX = _noise_window(sNoise.x, sCalSumX, sCalSquaresX, &sNoise.sigmaX16);
+		sNoise.halfY = _noise_window(sNoise.y, sCalSumY, sCalSquaresY, &sNoise.sigmaY16);
+		_set_deadzone(sNoise.halfX, sNoise.halfY);
+		LOG("n35p112 noise sigma/16 %u %u, window %d %d, deadzone %d\n",
+		    sNoise.sigmaX16, sNoise.sigmaY16, sNoise.halfX, sNoise.halfY, sNoise.radius);
+	}
+	else
+	{
+		LOG("n35p112 calibration failed\n");
+		sNoise.halfX = sNoise.halfY = ((int16_t)kDeadZoneRadius * 181) >> 8;
+		_set_deadzone(sNoise.halfX, sNoise.halfY);
 	}
-	// offset_X and offset_Y are global variables, used for each coordinate
-	// readout in the interrupt routine
-	sJoyOffsetX = -(x_cal>>4); // Average X: divide by 16
-	sJoyOffsetY = -(y_cal>>4); // Average Y: divide by 16
+	sCalState = CAL_OFF;
+	_release();
+}
 
-	// Reenable the MCU interrupts
-	sei();
+// The threshold window: conversions inside it don't raise the interrupt
+void _write_window(uint8_t xp, uint8_t xn, uint8_t yp, uint8_t yn)
+{
+	uint8_t twiError;
 
-	//print("calibrated to xOff = ");
-	//phex(sJoyOffsetX);
-	//print(", yOff = ");
-	//phex(sJoyOffsetY);
-	//print("\n");
+#ifdef SPLIT_PERIPHERAL
+	// the slave answers the other half between our own transfers, and this
+	//  one comes from n35p112_update(), not from twi_sched_run()
+	while (!split_pause())
+		;
+#endif
+	twiError = TWI_WritePacket(N35P112_TWI_ADDRESS, N35P112_TWI_TIMEOUT_MS, &REG_JOY_X_POSITIVE_THRESHHOLD, 1, &xp, 1);
+	if (twiError == TWI_ERROR_NoError)
+		twiError = TWI_WritePacket(N35P112_TWI_ADDRESS, N35P112_TWI_TIMEOUT_MS, &REG_JOY_X_NEGATIVE_THRESHHOLD, 1, &xn, 1);
+	if (twiError == TWI_ERROR_NoError)
+		twiError = TWI_WritePacket(N35P112_TWI_ADDRESS, N35P112_TWI_TIMEOUT_MS, &REG_JOY_Y_POSITIVE_THRESHHOLD, 1, &yp, 1);
+	if (twiError == TWI_ERROR_NoError)
+		twiError = TWI_WritePacket(N35P112_TWI_ADDRESS, N35P112_TWI_TIMEOUT_MS, &REG_JOY_Y_NEGATIVE_THRESHHOLD, 1, &yn, 1);
+	if (twiError != TWI_ERROR_NoError)
+		twi_sched_recover(sJoyDevice);
+#ifdef SPLIT_PERIPHERAL
+	split_resume();
+#endif
 }
 
-// Set the deadzone. The chip will not generate interrupts if these threshholds
-//  are not exceeded.
-void _set_deadzone (int8_t deadZoneRadius)
+// Set the threshold window, half sides per axis around the rest position,
+//  and the deadzone circle around it. The chip will not generate interrupts
+//  if the threshholds programmed here are not exceeded.  Runs in the main
+//  loop, like _joy_service(), so nothing else of ours is on the bus;
+//  _write_window() keeps a split peripheral's slave out of the way.
+void _set_deadzone (int8_t halfX, int8_t halfY)
 {
-	// Disable MCU interrupts
-	cli();
-	
-	sDeadZoneRadius = deadZoneRadius;
-	uint8_t xp = sJoyOffsetX + deadZoneRadius; // Xp register
-	uint8_t xn = sJoyOffsetX - deadZoneRadius; // Xn register
-	uint8_t yp = sJoyOffsetY + deadZoneRadius; // Yp register
-	uint8_t yn = sJoyOffsetY - deadZoneRadius; // Yn register
-	TWI_WritePacket(N35P112_TWI_ADDRESS, N35P112_TWI_TIMEOUT_MS, &REG_JOY_X_POSITIVE_THRESHHOLD, 1, &xp, 1);
-	TWI_WritePacket(N35P112_TWI_ADDRESS, N35P112_TWI_TIMEOUT_MS, &REG_JOY_X_NEGATIVE_THRESHHOLD, 1, &xn, 1);
-	TWI_WritePacket(N35P112_TWI_ADDRESS, N35P112_TWI_TIMEOUT_MS, &REG_JOY_Y_POSITIVE_THRESHHOLD, 1, &yp, 1);
-	TWI_WritePacket(N35P112_TWI_ADDRESS, N35P112_TWI_TIMEOUT_MS, &REG_JOY_Y_NEGATIVE_THRESHHOLD, 1, &yn, 1);
-
-	// Enable the MCU interrupts
-	sei();
+	// The chip only has a square window per axis.  The deadzone circle is
+	//  the one the wider of the two is inscribed in (radius half * sqrt(2),
+	//  rounded up), so every deflection past the circle raises an interrupt.
+	int16_t radius = ((int16_t)(halfX > halfY ? halfX : halfY) * 256 + 180) / 181;
+
+	if (radius < kDeadZoneMinRadius)
+		radius = kDeadZoneMinRadius;
+	else if (radius > kDeadZoneMaxRadius)
+		radius = kDeadZoneMaxRadius;
+	if (halfX > ((radius * 181) >> 8))
+		halfX = (radius * 181) >> 8;
+	if (halfY > ((radius * 181) >> 8))
+		halfY = (radius * 181) >> 8;
+	sNoise.radius = radius;
+	sNoise.halfX = halfX;
+	sNoise.halfY = halfY;
+	pipeline_build_gain(&sPipe, radius);
+
+	uint8_t xp = -sPipe.offsetX + halfX; // Xp register
+	uint8_t xn = -sPipe.offsetX - halfX; // Xn register
+	uint8_t yp = -sPipe.offsetY + halfY; // Yp register
+	uint8_t yn = -sPipe.offsetY - halfY; // Yn register
+	sWindowXp = xp;
+	sWindowXn = xn;
+	sWindowYp = yp;
+	sWindowYn = yn;
+#ifdef USB_GAMEPAD
+	// The gamepad reports the stick inside the deadzone too, so every
+	//  conversion interrupts; the window only matters for waking the host
+	_write_window(0x80, 0x7F, 0x80, 0x7F);
+#else
+	_write_window(xp, xn, yp, yn);
+#endif
 
 	//print("deadzone set to xNeg = ");
 	//phex(xn);
@@ -356,34 +796,135 @@ void _set_deadzone (int8_t deadZoneRadius)
 	//print("\n");
 }
 
-ISR(INT2_vect)
+// Queue a sample for n35p112_update()
+static void _push(uint16_t us, int8_t x, int8_t y, uint8_t polled)
+{
+	uint8_t head = sQueueHead;
+	uint8_t next = (head + 1) & N35P112_QUEUE_MASK;
+
+	if (next == sQueueTail)
+	{
+		sStats.overruns++;
+		return;
+	}
+	sQueue[head].us = us;
+	sQueue[head].x = x;
+	sQueue[head].y = y;
+	sQueue[head].polled = polled;
+	sQueueHead = next;
+}
+
+// Read a new sample.  Runs from twi_sched_run() in the main loop, after
+//  ISR(INT2_vect) asked for a turn on the bus, or n35p112_update() did to
+//  poll for an overdue one.
+uint8_t _joy_service(void)
 {
-	//int8_t X_temp, Y_temp;
+	uint8_t twiError;
+	uint8_t xRegVal;
+	uint8_t yRegVal;
+	uint8_t polled;
 
-	// Disable MCU interrupts
+	// INT2 is still listening if the interrupt didn't ask for this turn.
+	//  Keep it from asking for another in the middle of the read, the read
+	//  of Y takes care of whatever it would have been for.
 	cli();
+	polled = (EIMSK & (1 << INT2)) != 0;
+	EIMSK &=~ (1 << INT2);
+	sei();
 
 	/* OPTIONAL: If the module is in a slow power mode (e.g. Wakeup mode
 	   INT_function=1 with 320ms rate), configure to a higher rate with INTn for new
 	   coordinates ready (e.g. INT_function = 0 with 20ms rate) */
 
-	uint8_t xRegVal;
-	uint8_t yRegVal;
-	TWI_ReadPacket(N35P112_TWI_ADDRESS, N35P112_TWI_TIMEOUT_MS, &REG_JOY_X, 1, &xRegVal, 1);
-	TWI_ReadPacket(N35P112_TWI_ADDRESS, N35P112_TWI_TIMEOUT_MS, &REG_JOY_Y, 1, &yRegVal, 1);
-	sJoyX = (int8_t)xRegVal;
-	sJoyY = (int8_t)yRegVal;
-	sJoyChangeElapsedMs = 0;
-	// Add the X and Y offset for correct recentering
-	//X_temp = x_reg + offset_X;
-	//Y_temp = y_reg + offset_Y;
+	twiError = TWI_ReadPacket(N35P112_TWI_ADDRESS, N35P112_TWI_TIMEOUT_MS, &REG_JOY_X, 1, &xRegVal, 1);
+	if (twiError == TWI_ERROR_NoError)
+		twiError = TWI_ReadPacket(N35P112_TWI_ADDRESS, N35P112_TWI_TIMEOUT_MS, &REG_JOY_Y, 1, &yRegVal, 1);
+	if (twiError != TWI_ERROR_NoError)
+	{
+		// Half a sample, or a buffer the bus never filled.  Drop it and
+		//  have n35p112_update() listen again.
+		sStats.readErrors++;
+		sJoyRetry = 1;
+		return twiError;
+	}
+	capture_sample(polled ? teensy_get_us() : sJoyIntUs, xRegVal, yRegVal, polled);
+
+	// A poll that finds the same values as the last read came before the
+	//  conversion did, n35p112_update() will ask again.  Otherwise fill the
+	//  slot before publishing it by moving the head.  If the consumer has
+	//  fallen that far behind, the newest sample is dropped.
+	if (!polled || xRegVal != sRawX || yRegVal != sRawY)
+	{
+		sRawX = xRegVal;
+		sRawY = yRegVal;
+
+		_push(polled ? teensy_get_us() : sJoyIntUs, xRegVal, yRegVal, polled);
+	}
+
 	/* OPTIONAL: If X_temp and Y_temp are near the center since a few interrupts,
 	   meaning the knob has been released, the module can be put back in a slow power
 	   mode (e.g. Wakeup mode INT_function=1 with 320ms rate) */
 
-	// Clear the interrupt flag
+	// Reading Y released the interrupt line, listen for the next one
 	EIFR |= (1 << INTF2);
+	EIMSK |= (1 << INT2);
 
-	// Enable the MCU interrupts
-	sei();
+	return twiError;
+}
+
+// INT2 is level triggered and the line stays low until REG_JOY_Y is read, so
+//  mask it here and unmask it once _joy_service() has done the read.  The
+//  read itself happens in the main loop; all that's kept from here is when
+//  the conversion finished.
+ISR(INT2_vect)
+{
+	STACK_ISR_ENTER();
+	EIMSK &=~ (1 << INT2);
+	sJoyIntUs = teensy_get_us();
+	sStats.interrupts++;
+	twi_sched_request(sJoyDevice);
+	STACK_ISR_EXIT();
+}
+
+/* A sample that didn't come from the chip, for the benchmark (bench.c):
+ *  it's queued like a read one and taken by the next n35p112_update().  Keep
+ *  INT2 masked meanwhile, and call n35p112_release() when done.
+ */
+void n35p112_feed(int8_t x, int8_t y)
+{
+	_push(teensy_get_us(), x, y, 0);
+}
+
+// Back to center, as if the stick had been let go
+void n35p112_release(void)
+{
+	_release();
+}
+
+// The pointer pipeline's offset, gain table and stage state, for the
+//  benchmark to time the stages on a copy of
+const pipeline_state_t *n35p112_get_pipeline(void)
+{
+	return &sPipe;
+}
+
+const n35p112_stats_t *n35p112_get_stats(void)
+{
+	return &sStats;
+}
+
+// The rest noise the last calibration measured, and the window it set
+const n35p112_noise_t *n35p112_get_noise(void)
+{
+	return &sNoise;
+}
+
+// Samples taken by n35p112_update(), samples dropped because the queue was
+//  full, reads that failed, polls for an overdue sample, and releases that
+//  no poll could confirm
+void n35p112_print_stats(void)
+{
+	LOG("joy samples %04X overrun %04X err %04X poll %04X late %04X\n",
+	    sStats.samples, sStats.overruns, sStats.readErrors, sStats.polls,
+	    sStats.lateReleases);
 }
@@ -3,16 +3,90 @@
 #ifndef N35P112_H
 #define N35P112_H
 
+#include "../mouse/pipeline.h"
+
 #include <stdint.h>
 
 // --------------------------------------------------------------------
 
+// The stick's bus address, 0x40 or 0x41 by the strap on its ADDR pin.  In
+//  split mode both halves' sticks are on the one bus, see split.h: the
+//  master's stays at 0x41 and the peripheral's is strapped to 0x40, so each
+//  half only ever talks to its own.
+#ifndef N35P112_TWI_ADDRESS
+#ifdef SPLIT_PERIPHERAL
+#define N35P112_TWI_ADDRESS (0x40 << 1)
+#else
+#define N35P112_TWI_ADDRESS (0x41 << 1)
+#endif
+#endif
+
+// One conversion, as read from the chip
+typedef struct {
+	uint16_t us;	// when INT2 fired, teensy_get_us() time
+	int8_t x;
+	int8_t y;
+	uint8_t polled;	// read without an interrupt, us is when
+} n35p112_sample_t;
+
+// Sensor accounting
+typedef struct {
+	uint16_t samples;	// taken by n35p112_update()
+	uint16_t interrupts;	// INT2, one per conversion outside the window
+	uint16_t overruns;	// dropped, the queue was full
+	uint16_t readErrors;
+	uint16_t polls;		// reads for an overdue sample
+	uint16_t lateReleases;	// releases no poll could confirm
+} n35p112_stats_t;
+
+// The rest noise n35p112_calibrate() measured, and the deadzone it set from
+//  it.  The histograms count samples by their deviation from the rest
+//  position, -N35P112_NOISE_SPAN .. N35P112_NOISE_SPAN counts, the ends
+//  taking everything past them.
+#define N35P112_NOISE_SPAN 8
+#define N35P112_NOISE_BINS (2 * N35P112_NOISE_SPAN + 1)
+
+typedef struct {
+	uint8_t x[N35P112_NOISE_BINS];
+	uint8_t y[N35P112_NOISE_BINS];
+	uint8_t samples;
+	uint8_t sigmaX16;	// standard deviation, 1/16 counts, outliers left out
+	uint8_t sigmaY16;
+	int8_t halfX;		// the threshold window's half side, counts
+	int8_t halfY;
+	int8_t radius;		// the pointer's deadzone, see pipeline_build_gain()
+} n35p112_noise_t;
+
+// What n35p112_update() saw
+#define N35P112_NO_CHANGE  0
+#define N35P112_SAMPLE     1	// a new sample, see n35p112_get_sample_us()
+#define N35P112_RELEASED   2	// the stick is back in the deadzone
+
+// n35p112_get_position_x()/_y() at full deflection
+#define N35P112_POSITION_MAX 32766
+
+// --------------------------------------------------------------------
+
 uint8_t n35p112_init(void);
+uint8_t n35p112_probe(void);
 void n35p112_calibrate(void);
-void n35p112_update(uint8_t elapsedMs);
+uint8_t n35p112_calibrating(void);
+void n35p112_suspend(void);
+void n35p112_resume(void);
+uint8_t n35p112_activity(void);
+uint8_t n35p112_update(void);
+uint16_t n35p112_get_sample_us(void);
 int8_t n35p112_get_x(void);
 int8_t n35p112_get_y(void);
 uint8_t n35p112_get_btn(void);
+int16_t n35p112_get_position_x(void);
+int16_t n35p112_get_position_y(void);
+void n35p112_feed(int8_t x, int8_t y);
+void n35p112_release(void);
+const pipeline_state_t *n35p112_get_pipeline(void);
+const n35p112_stats_t *n35p112_get_stats(void);
+const n35p112_noise_t *n35p112_get_noise(void);
+void n35p112_print_stats(void);
 
 #endif //N35P112_H
 
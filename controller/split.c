@@ -0,0 +1,396 @@
+// split.c
+//
+// See split.h
+
+#include "split.h"
+#include "n35p112.h"
+#include "teensy-2-0.h"
+#include "stack.h"
+#include "../twi/twi_teensy-2-0.h"
+#include "../twi/twi_sched.h"
+
+#include "../log.h"
+
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <util/twi.h>
+
+// ----------------------------------------------------------------------------
+
+#define SPLIT_TWI_TIMEOUT_MS 10
+
+// The remote stick scrolls one wheel step per this many counts of its Y,
+//  summed over frames: full deflection is about 16 steps a second
+#define SPLIT_WHEEL_DIVIDE 8000
+
+// After this many failed polls in a row the other half counts as gone, and
+//  its stick and button as let go.  It's polled only every kSplitLostPollMs
+//  then, until it answers again.
+const uint8_t kSplitLostPolls = 20;
+const uint8_t kSplitLostPollMs = 250;
+
+const uint8_t REG_SPLIT_PACKET = SPLIT_REG_PACKET;
+
+// ----------------------------------------------------------------------------
+
+#ifdef SPLIT_MASTER
+
+// static data
+static uint8_t sDevice = 0;
+static uint8_t sPollMs = 0;
+static uint8_t sLostPolls = 0;
+static uint8_t sHaveSeq = 0;
+static uint8_t sSeq = 0;
+static split_stats_t sStats;
+
+// the latest poll, for split_update() to take
+static uint8_t sRxNew = 0;
+static uint8_t sRxTimed = 0;		// 0 for the first packet, of unknown age
+static int8_t sRxY = 0;
+static uint8_t sRxBtn = 0;
+static uint16_t sRxSampleUs = 0;	// teensy_get_us() time, on our clock
+
+// what the main loop works from
+static int8_t sY = 0;
+static uint8_t sBtn = 0;
+static int16_t sWheel = 0;
+
+// static function declarations
+uint8_t _poll_service(void);
+static void _latency(split_latency_t *latency, uint16_t sampleUs);
+
+/* Register the other half with the bus scheduler.  Whether it's there or
+ *  not is up to the polls, it may well start later than this half.
+ *
+ * returns
+ * - the scheduler's device index, or TWI_SCHED_NO_DEVICE if it had no room,
+ *   and then there are no polls
+ */
+uint8_t split_init(void)
+{
+	sStats.local.minUs = 0xFFFF;
+	sStats.remote.minUs = 0xFFFF;
+
+	// below the local stick, which goes first when both are waiting
+	sDevice = twi_sched_add_device(TWI_SCHED_PRIORITY_NORMAL, _poll_service);
+	return sDevice;
+}
+
+// Once per tick: a read of the packet every SPLIT_POLL_MS, or every
+//  kSplitLostPollMs while the other half is gone
+void split_poll(void)
+{
+	if (++sPollMs < (sLostPolls == kSplitLostPolls ? kSplitLostPollMs : SPLIT_POLL_MS))
+		return;
+	sPollMs = 0;
+	twi_sched_request(sDevice);
+}
+
+// Take what the last poll brought
+//
+// returns
+// - N35P112_SAMPLE if the remote stick has a new sample, N35P112_NO_CHANGE
+//   otherwise
+uint8_t split_update(void)
+{
+	sBtn = sRxBtn;
+	if (!sRxNew)
+		return N35P112_NO_CHANGE;
+
+	sRxNew = 0;
+	sY = sRxY;
+	if (!sY)
+		sWheel = 0;
+	if (sRxTimed)
+		_latency(&sStats.remote, sRxSampleUs);
+	return N35P112_SAMPLE;
+}
+
+// Wheel steps for one frame.  Pushing the stick away scrolls up.
+int8_t split_get_wheel(void)
+{
+	int8_t steps;
+
+	sWheel -= sY;
+	steps = sWheel / SPLIT_WHEEL_DIVIDE;
+	sWheel -= steps * SPLIT_WHEEL_DIVIDE;
+	return steps;
+}
+
+uint8_t split_get_btn(void)
+{
+	return sBtn;
+}
+
+// The local stick's sample was taken by the main loop now, for the
+//  comparison with the remote one
+void split_note_local(uint16_t sampleUs)
+{
+	_latency(&sStats.local, sampleUs);
+}
+
+const split_stats_t *split_get_stats(void)
+{
+	return &sStats;
+}
+
+static uint16_t _mean(const split_latency_t *latency)
+{
+	return latency->count ? latency->totalUs / latency->count : 0;
+}
+
+void split_print_stats(void)
+{
+	LOG("split polls %04X err %04X samples %04X missed %04X\n",
+	    sStats.polls, sStats.errors, sStats.samples, sStats.missed);
+	LOG("split local us %04X/%04X/%04X remote %04X/%04X/%04X\n",
+	    sStats.local.minUs, _mean(&sStats.local), sStats.local.maxUs,
+	    sStats.remote.minUs, _mean(&sStats.remote), sStats.remote.maxUs);
+}
+
+// ----------------------------------------------------------------------------
+
+static void _latency(split_latency_t *latency, uint16_t sampleUs)
+{
+	uint16_t us = teensy_get_us() - sampleUs;
+
+	// the sums would overflow eventually, start over
+	if (latency->count == 0xFFFF)
+	{
+		latency->count = 0;
+		latency->totalUs = 0;
+	}
+	latency->count++;
+	latency->totalUs += us;
+	if (us < latency->minUs)
+		latency->minUs = us;
+	if (us > latency->maxUs)
+		latency->maxUs = us;
+}
+
+// One read of the whole packet.  The age is counted up to where the
+//  peripheral saw its address, which is a few bytes into the transfer; the
+//  start of it is close enough.
+uint8_t _poll_service(void)
+{
+	uint8_t twiError;
+	uint8_t packet[SPLIT_PACKET_SIZE];
+	uint16_t startUs = teensy_get_us();
+
+	twiError = TWI_ReadPacket(SPLIT_TWI_ADDRESS, SPLIT_TWI_TIMEOUT_MS, &REG_SPLIT_PACKET, 1, packet, SPLIT_PACKET_SIZE);
+	sStats.polls++;
+	if (twiError != TWI_ERROR_NoError)
+	{
+		sStats.errors++;
+		if (sLostPolls < kSplitLostPolls && ++sLostPolls == kSplitLostPolls)
+		{
+			sHaveSeq = 0;
+			sRxY = 0;
+			sRxBtn = 0;
+			sRxNew = 1;
+			sRxTimed = 0;
+		}
+		// turned down at its address: busy with its own stick, or not
+		//  there, which is no reason to slow the bus down
+		if (twiError == TWI_ERROR_SlaveNotReady)
+			return TWI_SCHED_SLAVE_BUSY;
+		return twiError;
+	}
+
+	sRxBtn = packet[SPLIT_PACKET_BTN];
+	if (!sHaveSeq || packet[SPLIT_PACKET_SEQ] != sSeq)
+	{
+		// what the first packet holds may be from long before we started
+		//  polling, it counts for its values only
+		if (sHaveSeq)
+			sStats.missed += (uint8_t)(packet[SPLIT_PACKET_SEQ] - sSeq - 1);
+		sRxTimed = sHaveSeq;
+		sHaveSeq = 1;
+		sSeq = packet[SPLIT_PACKET_SEQ];
+		sRxY = packet[SPLIT_PACKET_Y];
+		sRxSampleUs = startUs - (packet[SPLIT_PACKET_AGE] | (packet[SPLIT_PACKET_AGE + 1] << 8));
+		sRxNew = 1;
+		sStats.samples++;
+	}
+	sLostPolls = 0;
+	return twiError;
+}
+
+#endif //SPLIT_MASTER
+
+// ----------------------------------------------------------------------------
+
+#ifdef SPLIT_PERIPHERAL
+
+// static data
+static uint8_t sSeq = 0;
+static int8_t sY = 0;
+static uint8_t sBtn = 0;
+static uint16_t sSampleUs = 0;
+static volatile uint8_t sSlaveBusy = 0;
+static uint8_t sSlaveOn = 0;		// split_peripheral_init() has run
+
+// after a pointer write the slave stays busy for the read that goes with it,
+//  the master's repeated START looks just like a STOP from here
+static volatile uint8_t sHold = 0;
+static volatile uint16_t sHoldUs = 0;
+
+// what the ISR sends, the packet as of the master's SLA+R
+static uint8_t sTx[SPLIT_PACKET_SIZE];
+static uint8_t sPointer = 0;
+static uint8_t sPointerNext = 0;
+static uint8_t sPointerSet = 0;
+
+// The longest a pointer write holds the slave for its read, should the read
+//  never come
+const uint16_t kSplitHoldUs = 1000;
+
+// TWCR for waiting to be addressed, with the interrupt on every step
+#define SPLIT_TWCR_SLAVE ((1 << TWEA) | (1 << TWEN) | (1 << TWIE))
+
+// Answer at SPLIT_TWI_ADDRESS.  Call it after the stick is set up, the
+//  slave only ever runs between the peripheral's own transfers.
+void split_peripheral_init(void)
+{
+	TWAR = SPLIT_TWI_ADDRESS;
+	TWCR = SPLIT_TWCR_SLAVE;
+	sSlaveOn = 1;
+}
+
+// After each n35p112_update(): a new sample, or the stick let go, is a new
+//  packet.  The button goes along with whichever poll comes next.
+void split_publish(uint8_t change)
+{
+	uint8_t sreg = SREG;
+
+	cli();
+	sBtn = n35p112_get_btn();
+	if (change != N35P112_NO_CHANGE)
+	{
+		sSeq++;
+		sY = n35p112_get_y();
+		sSampleUs = change == N35P112_SAMPLE ? n35p112_get_sample_us() : teensy_get_us();
+	}
+	SREG = sreg;
+}
+
+/* Stop answering, for the peripheral's own transfers.  A transfer of the
+ *  master's already going on is let finish first, the pointer write and the
+ *  packet read after it counting as one.
+ *
+ * returns
+ * - 1 if the slave is off, or not started yet, 0 if it's busy and this has
+ *   to be tried again
+ */
+uint8_t split_pause(void)
+{
+	uint8_t sreg = SREG;
+	uint8_t paused = 0;
+
+	if (!sSlaveOn)
+		return 1;
+	cli();
+	if (sHold && (uint16_t)(teensy_get_us() - sHoldUs) > kSplitHoldUs)
+	{
+		sHold = 0;
+		sSlaveBusy = 0;
+	}
+	if (!sSlaveBusy && !(TWCR & (1 << TWINT)))
+	{
+		TWCR = (1 << TWEN);
+		// addressed just before TWEA went: let the ISR have it after all
+		if (TWCR & (1 << TWINT))
+			TWCR = SPLIT_TWCR_SLAVE;
+		else
+			paused = 1;
+	}
+	SREG = sreg;
+	return paused;
+}
+
+// Answer again, once the peripheral's own transfers are done
+void split_resume(void)
+{
+	if (!sSlaveOn)
+		return;
+	// the last STOP has to be out before TWCR is written over
+	while (TWCR & (1 << TWSTO))
+		;
+	TWCR = SPLIT_TWCR_SLAVE;
+}
+
+static void _load(void)
+{
+	uint16_t ageUs = teensy_get_us() - sSampleUs;
+
+	sTx[SPLIT_PACKET_SEQ] = sSeq;
+	sTx[SPLIT_PACKET_Y] = sY;
+	sTx[SPLIT_PACKET_BTN] = sBtn;
+	sTx[SPLIT_PACKET_AGE] = ageUs & 0xFF;
+	sTx[SPLIT_PACKET_AGE + 1] = ageUs >> 8;
+}
+
+// The slave side, one step of the master's transfer per interrupt.  The
+//  first byte written is the register pointer, reads go on from there.
+ISR(TWI_vect)
+{
+	uint8_t twcr = SPLIT_TWCR_SLAVE;
+
+	STACK_ISR_ENTER();
+
+	switch (TWSR & TW_STATUS_MASK)
+	{
+		case TW_SR_SLA_ACK:
+		case TW_SR_ARB_LOST_SLA_ACK:
+			sSlaveBusy = 1;
+			sHold = 0;
+			sPointerNext = 1;
+			break;
+		case TW_SR_DATA_ACK:
+			if (sPointerNext)
+			{
+				sPointer = TWDR;
+				sPointerSet = 1;
+			}
+			sPointerNext = 0;
+			break;
+		case TW_SR_STOP:
+			// the end of a pointer write: busy until its read
+			if (sPointerSet)
+			{
+				sHold = 1;
+				sHoldUs = teensy_get_us();
+			}
+			else
+			{
+				sSlaveBusy = 0;
+			}
+			sPointerSet = 0;
+			break;
+		case TW_ST_SLA_ACK:
+		case TW_ST_ARB_LOST_SLA_ACK:
+			sSlaveBusy = 1;
+			sHold = 0;
+			_load();
+			// fall through
+		case TW_ST_DATA_ACK:
+			TWDR = sPointer < SPLIT_PACKET_SIZE ? sTx[sPointer] : 0xFF;
+			sPointer++;
+			break;
+		case TW_BUS_ERROR:
+			sSlaveBusy = 0;
+			sHold = 0;
+			sPointerSet = 0;
+			twcr |= (1 << TWSTO);
+			break;
+		default:
+			// the master's NAK after the last byte: the transfer is over
+			sSlaveBusy = 0;
+			break;
+	}
+
+	TWCR = twcr | (1 << TWINT);
+	STACK_ISR_EXIT();
+}
+
+#endif //SPLIT_PERIPHERAL
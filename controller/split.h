@@ -0,0 +1,100 @@
+// split.h
+//
+// Split mode: a second ATmega32U4 in the other half (make SPLIT=peripheral)
+//  runs the N35P112 driver for a stick of its own and answers as a TWI slave
+//  with its processed samples.  The half on USB (make SPLIT=master) reads it
+//  through the bus scheduler next to its own stick and the expander, and
+//  sends the remote stick as the scroll wheel and its button as the right
+//  button.
+//
+// The packet is polled as a bus scheduler job of its own, every
+//  SPLIT_POLL_MS, below the local stick's priority so it never holds that
+//  up.  It isn't read in the same turn as the local stick: that job only
+//  runs once a conversion, 10 to 32 ms apart, and the two sticks convert on
+//  their own clocks at no fixed phase, so the remote sample would wait up to
+//  a whole period for the local one and be dropped whenever two came in
+//  between.  Polling on its own keeps the remote within a poll period of
+//  the local stick, see split_print_stats() and host/split_sim.
+//
+// Both chips are masters of the same bus: the peripheral reads its own stick
+//  too, and stops answering while it does, see split_pause().  A poll that
+//  finds it busy NAKs and the next one gets the sample.
+//
+// Wiring: SDA, SCL and GND run between the halves, with one pair of pull-ups
+//  for the whole bus.  The two sticks would answer at the same address, so
+//  the peripheral's has its ADDR strap set for 0x40 and the master's stays
+//  at 0x41 (N35P112_TWI_ADDRESS).  Each stick's INT and reset only go to the
+//  chip in its own half.
+//
+// The packet carries the sample's age, so the master knows when the remote
+//  stick converted on its own clock and can put the latency of both sticks
+//  side by side, see split_print_stats().
+
+#ifndef SPLIT_H
+#define SPLIT_H
+
+#include <stdint.h>
+
+// --------------------------------------------------------------------
+
+#define SPLIT_TWI_ADDRESS (0x42 << 1)
+
+// The packet, from register 0 on; reads past it return 0xFF
+#define SPLIT_REG_PACKET 0
+#define SPLIT_PACKET_SIZE 5
+#define SPLIT_PACKET_SEQ 0	// counts the peripheral's samples
+#define SPLIT_PACKET_Y 1	// n35p112_get_y(), counts per UPSAMPLE_INPUT_MS
+#define SPLIT_PACKET_BTN 2
+#define SPLIT_PACKET_AGE 3	// us since the sample's interrupt, LSB first
+
+// The master reads the packet this often, in 1 ms ticks
+#ifndef SPLIT_POLL_MS
+#define SPLIT_POLL_MS 2
+#endif
+
+// Sample to main loop, for one stick
+typedef struct {
+	uint16_t count;
+	uint16_t minUs;
+	uint16_t maxUs;
+	uint32_t totalUs;
+} split_latency_t;
+
+typedef struct {
+	uint16_t polls;
+	uint16_t errors;	// polls that failed, the peripheral busy or gone
+	uint16_t samples;
+	uint16_t missed;	// samples the peripheral had between two polls
+	split_latency_t local;
+	split_latency_t remote;
+} split_stats_t;
+
+// --------------------------------------------------------------------
+
+#ifdef SPLIT_MASTER
+uint8_t split_init(void);
+void split_poll(void);
+uint8_t split_update(void);
+int8_t split_get_wheel(void);
+uint8_t split_get_btn(void);
+void split_note_local(uint16_t sampleUs);
+const split_stats_t *split_get_stats(void);
+void split_print_stats(void);
+#else
+static inline uint8_t split_init(void) { return 0; }
+static inline void split_poll(void) {}
+static inline uint8_t split_update(void) { return 0; }
+static inline int8_t split_get_wheel(void) { return 0; }
+static inline uint8_t split_get_btn(void) { return 0; }
+static inline void split_note_local(uint16_t sampleUs) {}
+static inline void split_print_stats(void) {}
+#endif
+
+#ifdef SPLIT_PERIPHERAL
+void split_peripheral_init(void);
+void split_publish(uint8_t change);
+uint8_t split_pause(void);
+void split_resume(void);
+#endif
+
+#endif //SPLIT_H
@@ -0,0 +1,89 @@
+// stack.c
+//
+// How much of the 2.5 KB of SRAM is really in use.  At reset, before
+//  anything else runs, everything from the end of .bss up to the top of RAM
+//  is painted with STACK_CANARY.  The stack grows down into that, and
+//  whatever it has ever overwritten stays overwritten, so counting the
+//  canaries still left above .bss gives the margin the stack has never
+//  come near.  Nothing uses malloc(), so that gap is all the heap there is.
+//
+// The ISRs also count how deeply they've nested, see stack.h.
+
+#include "stack.h"
+
+#include "../log.h"
+
+#include <avr/io.h>
+
+// ----------------------------------------------------------------------------
+
+// Less than this left and the stats say so
+const uint16_t kStackLowBytes = 128;
+
+// ----------------------------------------------------------------------------
+
+// from the linker script
+extern uint8_t __data_start;
+extern uint8_t _end;
+extern uint8_t __stack;
+
+volatile uint8_t stack_isr_depth = 0;
+volatile uint8_t stack_isr_peak = 0;
+
+// ----------------------------------------------------------------------------
+
+// Runs from .init1, straight out of reset: no stack yet and r1 isn't zero,
+//  so it's all registers.  .bss is cleared later, below _end.
+void _stack_paint(void) __attribute__ ((naked, used, section (".init1")));
+void _stack_paint(void)
+{
+	__asm volatile (
+		"	ldi r30, lo8(_end)\n"
+		"	ldi r31, hi8(_end)\n"
+		"	ldi r24, %0\n"
+		"	ldi r25, hi8(__stack)\n"
+		"	rjmp 2f\n"
+		"1:	st Z+, r24\n"
+		"2:	cpi r30, lo8(__stack)\n"
+		"	cpc r31, r25\n"
+		"	brlo 1b\n"
+		"	breq 1b\n"
+		:: "M" (STACK_CANARY)
+	);
+}
+
+/* returns
+ * - bytes above .bss the stack has never reached
+ *
+ * Scans up from .bss until the first overwritten byte, so it takes longer
+ *  the more there is; around 0.1 ms per 256 bytes left.
+ */
+uint16_t stack_get_free(void)
+{
+	const uint8_t *p = &_end;
+
+	while (p <= &__stack && *p == STACK_CANARY)
+		p++;
+	return p - &_end;
+}
+
+void stack_get_stats(stack_stats_t *stats)
+{
+	stats->staticBytes = &_end - &__data_start;
+	stats->freeMin = stack_get_free();
+	stats->stackMax = (&__stack - &_end) + 1 - stats->freeMin;
+}
+
+// RAM in use by static data and at the stack's deepest, what's never been
+//  touched, and how many ISRs have been running at once
+void stack_print_stats(void)
+{
+	stack_stats_t stats;
+
+	stack_get_stats(&stats);
+	LOG("ram static %04X stack %04X free %04X isr depth %02X",
+	    stats.staticBytes, stats.stackMax, stats.freeMin, stack_isr_peak);
+	if (stats.freeMin < kStackLowBytes)
+		LOG(" LOW");
+	LOG("\n");
+}
@@ -0,0 +1,39 @@
+// stack.h
+
+#ifndef STACK_H
+#define STACK_H
+
+#include <stdint.h>
+
+// --------------------------------------------------------------------
+
+// What the free RAM between .bss and the stack is painted with at reset
+#define STACK_CANARY 0xC5
+
+// Interrupt nesting, kept by every ISR: STACK_ISR_ENTER() first thing,
+//  STACK_ISR_EXIT() last thing, after any sei().  An ISR that enables
+//  interrupts lets others in on top of its own frame, and this is how
+//  deep that has gone.
+extern volatile uint8_t stack_isr_depth;
+extern volatile uint8_t stack_isr_peak;
+
+#define STACK_ISR_ENTER() do { \
+	if (++stack_isr_depth > stack_isr_peak) \
+		stack_isr_peak = stack_isr_depth; \
+} while (0)
+#define STACK_ISR_EXIT() (stack_isr_depth--)
+
+// Where RAM went, in bytes
+typedef struct {
+	uint16_t staticBytes;	// .data and .bss
+	uint16_t stackMax;	// deepest the stack has been since reset
+	uint16_t freeMin;	// never touched, between .bss and that
+} stack_stats_t;
+
+// --------------------------------------------------------------------
+
+uint16_t stack_get_free(void);
+void stack_get_stats(stack_stats_t *stats);
+void stack_print_stats(void);
+
+#endif //STACK_H
@@ -1,12 +1,16 @@
 //teensy-2-0.c
 
 #include "teensy-2-0.h"
+#include "stack.h"
 
 #include "../twi/twi_teensy-2-0.h"
+#include "../power.h"
 
 #include <util/delay.h>
 #include <avr/io.h>
 #include <avr/interrupt.h>
+#include <avr/sleep.h>
+#include <avr/wdt.h>
 
 // ----------------------------------------------------------------------------
 
@@ -22,11 +26,21 @@
 #define  CPU_125kHz       0x07
 #define  CPU_62kHz        0x08
 
-#define TWI_FREQ 400000UL
+// Standard mode to start with, every part on the bus takes it.
+//  twi/twi_tune.c moves it to what the bus on this unit can do.
+#define TWI_FREQ 100000UL
+
+// key matrix (see teensy-2-0.md): columns are driven low one at a time and
+//  left hi-Z otherwise, rows are read back with the internal pull-ups on
+#define MATRIX_COL_MASK_B  ((1<<0)|(1<<1)|(1<<2)|(1<<3)|(1<<5)|(1<<6))
+#define MATRIX_COL_MASK_C  (1<<6)
+#define MATRIX_COL_MASK_D  (1<<7)
+#define MATRIX_ROW_MASK_F  ((1<<0)|(1<<1)|(1<<4)|(1<<5)|(1<<6)|(1<<7))
 
 // ----------------------------------------------------------------------------
 
-volatile static uint8_t sElapsedMs = 0;
+volatile static uint16_t sElapsedMs = 0;
+volatile static uint8_t sWdtFired = 0;
 
 // ----------------------------------------------------------------------------
 
@@ -51,6 +65,21 @@ uint8_t teensy_init(void) {
 	DDRB &=~ (1 << 7); //Input
 	PORTB &=~ (1 << 7); //No Pullup
 
+	// JTAG off, so that PF4..PF7 can be used for the key matrix.  JTD has to
+	//  be written twice within 4 cycles.
+	MCUCR |= (1 << JTD);
+	MCUCR |= (1 << JTD);
+
+	// key matrix columns hi-Z, rows as input with pull-ups
+	DDRB  &=~ MATRIX_COL_MASK_B;
+	PORTB &=~ MATRIX_COL_MASK_B;
+	DDRC  &=~ MATRIX_COL_MASK_C;
+	PORTC &=~ MATRIX_COL_MASK_C;
+	DDRD  &=~ MATRIX_COL_MASK_D;
+	PORTD &=~ MATRIX_COL_MASK_D;
+	DDRF  &=~ MATRIX_ROW_MASK_F;
+	PORTF |= MATRIX_ROW_MASK_F;
+
 	// I2C (TWI)
 	uint8_t twiPrescaler = TWI_BIT_PRESCALE_1;
 	uint8_t twiBitRate = TWI_BITLENGTH_FROM_FREQ(1, TWI_FREQ);
@@ -78,16 +107,162 @@ uint8_t teensy_configure_interrupts(void)
 
 uint8_t teensy_get_elapsed_ms(void)
 {
-	return sElapsedMs;
+	return (uint8_t)sElapsedMs;
+}
+
+/* returns
+ * - microseconds since timer0 was started, modulo 2^16, with 4 us
+ *   resolution.  Differences between two calls are valid up to ~65 ms.
+ *
+ * Safe to call from interrupt context.
+ */
+uint16_t teensy_get_us(void)
+{
+	uint8_t intr_state, count;
+	uint16_t ms;
+
+	intr_state = SREG;
+	cli();
+	ms = sElapsedMs;
+	count = TCNT0;
+	// overflowed, but the ISR hasn't run yet to preload the counter
+	if ((TIFR0 & (1 << TOV0)) && count < 6)
+	{
+		ms++;
+		count += 6;
+	}
+	SREG = intr_state;
+
+	// 1000 * 2^16 is a multiple of 2^16, so this wraps consistently
+	return ms * 1000 + (uint8_t)(count - 6) * 4;
+}
+
+// Drive a single column low.  Every case is a constant bit so that these
+//  compile to sbi/cbi and don't race with anything else touching the ports.
+static inline void _matrix_col_select(uint8_t col)
+{
+	switch (col)
+	{
+		case 0: DDRB |= (1<<0); break;
+		case 1: DDRB |= (1<<1); break;
+		case 2: DDRB |= (1<<2); break;
+		case 3: DDRB |= (1<<3); break;
+		case 4: DDRB |= (1<<5); break;
+		case 5: DDRB |= (1<<6); break;
+		case 6: DDRC |= (1<<6); break;
+		case 7: DDRD |= (1<<7); break;
+	}
+}
+
+static inline void _matrix_col_release(uint8_t col)
+{
+	switch (col)
+	{
+		case 0: DDRB &=~ (1<<0); break;
+		case 1: DDRB &=~ (1<<1); break;
+		case 2: DDRB &=~ (1<<2); break;
+		case 3: DDRB &=~ (1<<3); break;
+		case 4: DDRB &=~ (1<<5); break;
+		case 5: DDRB &=~ (1<<6); break;
+		case 6: DDRC &=~ (1<<6); break;
+		case 7: DDRD &=~ (1<<7); break;
+	}
+}
+
+/* Read the raw (undebounced) state of the local key matrix.
+ *
+ * arguments
+ * - rows: one byte per column, bit n set if the key at row n is pressed
+ *
+ * A full pass is 8 columns with a 1 us settle delay each, ~12 us in total.
+ * Interrupts stay enabled, so the N35P112 interrupt is never held off.
+ */
+void teensy_update_matrix(uint8_t rows[TEENSY_MATRIX_COLS])
+{
+	uint8_t col, pinf;
+
+	for (col=0; col<TEENSY_MATRIX_COLS; col++)
+	{
+		_matrix_col_select(col);
+		_delay_us(1);
+		pinf = ~PINF;
+		_matrix_col_release(col);
+		rows[col] = (pinf & 0x03) | ((pinf >> 2) & 0x3C);
+	}
 }
 
 ISR(TIMER0_OVF_vect)
 {  
+	STACK_ISR_ENTER();
 	cli();
 
 	TCNT0=6;
 	++sElapsedMs;
+	power_tick(1);
 
+	// lets other interrupts in on top of this frame before the return,
+	//  which the nesting count gets to see
 	sei();
+	STACK_ISR_EXIT();
 }
 
+/* Power down until something happens: INT2 (the stick, level triggered, so
+ *  it works without a clock), the stick's button on PB7 (pin change), the
+ *  USB wakeup interrupt, or the watchdog after POWER_SLEEP_TICK_MS.  Timer0
+ *  stops as well, so elapsed time doesn't count the time asleep; the
+ *  watchdog counts it for power.h instead, a whole period each time it
+ *  fires and half of one for a sleep something else cut short.
+ *
+ * Call with interrupts disabled, after checking there's nothing left to do,
+ *  so a wakeup can't slip in between the check and the sleep.  Interrupts
+ *  are enabled when this returns.
+ */
+void teensy_sleep(void)
+{
+	uint8_t state = power_state;
+
+	PCIFR = (1 << PCIF0);
+	PCMSK0 |= (1 << PCINT7);
+	PCICR |= (1 << PCIE0);
+
+	// interrupt only, never a reset; the change has to be timed
+	sWdtFired = 0;
+	wdt_reset();
+	WDTCSR = (1 << WDCE) | (1 << WDE);
+	WDTCSR = (1 << WDIE) | (1 << WDP2);
+	power_state = POWER_SLEEP;
+
+	set_sleep_mode(SLEEP_MODE_PWR_DOWN);
+	sleep_enable();
+	sei();	// takes effect after the next instruction, the sleep
+	sleep_cpu();
+	sleep_disable();
+
+	cli();
+	MCUSR &=~ (1 << WDRF);
+	WDTCSR = (1 << WDCE) | (1 << WDE);
+	WDTCSR = 0;
+	if (!sWdtFired)
+		power_tick(POWER_SLEEP_TICK_MS / 2);
+	power_state = state;
+	sei();
+
+	PCICR &=~ (1 << PCIE0);
+	PCMSK0 &=~ (1 << PCINT7);
+}
+
+// The watchdog's period asleep, see teensy_sleep()
+ISR(WDT_vect)
+{
+	STACK_ISR_ENTER();
+	sWdtFired = 1;
+	power_tick(POWER_SLEEP_TICK_MS);
+	STACK_ISR_EXIT();
+}
+
+// Only here to wake teensy_sleep() when the button is pressed
+ISR(PCINT0_vect)
+{
+	STACK_ISR_ENTER();
+	STACK_ISR_EXIT();
+}
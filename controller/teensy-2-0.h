@@ -7,9 +7,19 @@
 
 // --------------------------------------------------------------------
 
+// local key matrix: rows on PF0,PF1,PF4..PF7, columns on PB0..PB3,PB5,PB6,
+//  PC6,PD7
+#define TEENSY_MATRIX_ROWS 6
+#define TEENSY_MATRIX_COLS 8
+
+// --------------------------------------------------------------------
+
 uint8_t teensy_init(void);
 uint8_t teensy_configure_interrupts(void);
 uint8_t teensy_get_elapsed_ms(void);
+uint16_t teensy_get_us(void);
+void teensy_update_matrix(uint8_t rows[TEENSY_MATRIX_COLS]);
+void teensy_sleep(void);
 
 #endif //TEENSY_2_0_H
 
@@ -23,10 +23,24 @@
 
 #include "controller/teensy-2-0.h"
 #include "controller/n35p112.h"
+#include "controller/stack.h"
+#include "controller/mcp23018.h"
+#include "controller/split.h"
+#include "twi/twi_sched.h"
+#include "twi/twi_tune.h"
+#include "keyboard/matrix.h"
+#include "keyboard/keymap.h"
+#include "mouse/upsample.h"
+#include "phase.h"
+#include "power.h"
 #include "usb_mouse_debug.h"
-#include "print.h"
+#include "capture.h"
+#include "health.h"
+#include "bench.h"
+#include "log.h"
 
 #include <avr/io.h>
+#include <avr/interrupt.h>
 #include <avr/pgmspace.h>
 #include <util/delay.h>
 
@@ -35,28 +49,196 @@
 #define LED_OFF		(PORTD |= (1<<6))
 #define CPU_PRESCALE(n)	(CLKPR = 0x80, CLKPR = (n))
 
+// The main loop runs once per 1 ms timer tick.  The key matrix is scanned
+//  and a mouse report goes out on every tick, the stick's ~20 ms samples are
+//  spread over the frames in between by mouse/upsample.c.
+
+// TWI scheduler accounting goes out over the debug channel this often
+const uint16_t kTwiStatsPeriodMs = 5000;
+
+// The bus clock is re-evaluated from the scheduler's error counts this often
+const uint16_t kTwiTunePeriodMs = 1000;
+
+// Transfers used to find the fastest clock the bus takes reliably
+static const twi_tune_probe_t kTwiProbes[] = { n35p112_probe, mcp23018_probe };
+
+#ifdef SPLIT_PERIPHERAL
+static const twi_tune_probe_t kPeripheralProbes[] = { n35p112_probe };
+#endif
+
+// USB 2.0 7.1.7.7: no remote wakeup in the first 5 ms of suspend.  The
+//  suspend interrupt comes after 3 ms of idle bus, this covers the rest.
+const uint8_t kSuspendSettleMs = 2;
+
+// How long a remote wakeup waits for the host to resume the bus before the
+//  chip goes back to sleep.  The host drives resume within a few ms of
+//  seeing it, so past this it isn't coming.
+const uint16_t kWakeTimeoutMs = 250;
+
+// Wake latency (stick or button seen to bus resumed) statistics, and remote
+//  wakeups the host never answered
+static uint16_t sWakeups = 0;
+static uint16_t sWakeLastMs = 0;
+static uint16_t sWakeMaxMs = 0;
+static uint16_t sWakeTimeouts = 0;
+
+/* Called while the host has the bus suspended.  The stick goes to its
+ *  wake-up mode and the chip to sleep; if the stick is pushed or the button
+ *  pressed, and the host allows it, a remote wakeup is signalled.  If the
+ *  host doesn't resume within kWakeTimeoutMs the chip goes back to sleep,
+ *  and the next push signals again.  Returns once the bus is running
+ *  again, whoever resumed it.
+ */
+static void _suspend(void)
+{
+	uint8_t woke = 0;
+	uint16_t nowUs, prevUs = 0;
+	uint32_t wakeUs = 0;
+
+	POWER_DELAY_MS(kSuspendSettleMs);
+	n35p112_suspend();
+
+	while (usb_suspended())
+	{
+		// a wake-up interrupt from the stick only queues a bus job
+		twi_sched_run();
+		n35p112_update();
+
+		if (!woke && n35p112_activity() && usb_remote_wakeup() == 0)
+		{
+			woke = 1;
+			wakeUs = 0;
+			prevUs = teensy_get_us();
+		}
+		if (woke)
+		{
+			// the host takes tens of ms to resume, too long for a single
+			//  teensy_get_us() difference
+			nowUs = teensy_get_us();
+			wakeUs += (uint16_t)(nowUs - prevUs);
+			prevUs = nowUs;
+			if (wakeUs < kWakeTimeoutMs * 1000UL)
+				continue;
+
+			// not answered: stop the clocks again and sleep as before
+			usb_remote_wakeup_cancel();
+			woke = 0;
+			sWakeTimeouts++;
+		}
+
+		cli();
+		if (usb_suspended() && !twi_sched_pending())
+			teensy_sleep();
+		sei();
+	}
+
+	n35p112_resume();
+	power_update();
+
+	if (woke)
+	{
+		sWakeups++;
+		sWakeLastMs = wakeUs / 1000;
+		if (sWakeLastMs > sWakeMaxMs)
+			sWakeMaxMs = sWakeLastMs;
+		LOG("wakeup %04X: %04X ms, max %04X ms, unanswered %04X\n",
+		    sWakeups, sWakeLastMs, sWakeMaxMs, sWakeTimeouts);
+	}
+}
+
+// Forward debounced key changes to the keyboard report
+static void _keyboard_update(void)
+{
+	uint8_t row, col, changed, on;
+
+	for (col=0; col<MATRIX_COLS; col++)
+	{
+		changed = matrix_get_changed(col);
+		if (!changed)
+			continue;
+		on = matrix_get_column(col);
+		for (row=0; row<MATRIX_ROWS; row++)
+		{
+			if (changed & (1<<row))
+				usb_keyboard_key(keymap_get_keycode(row, col), on & (1<<row));
+		}
+	}
+}
+
+#ifdef SPLIT_PERIPHERAL
+/* The other half of a split build (split.h): no USB, just the stick, read
+ *  like the main loop below does and handed to the master over the bus.
+ *  The bus is shared, so the slave is paused for this half's own reads.
+ */
+static void _peripheral_main(void)
+{
+	uint8_t thisFrameMs, prevFrameMs;
+
+	n35p112_init();
+	twi_tune_calibrate(kPeripheralProbes, sizeof(kPeripheralProbes) / sizeof(kPeripheralProbes[0]));
+	teensy_configure_interrupts();
+	n35p112_calibrate();
+	split_peripheral_init();
+
+	prevFrameMs = teensy_get_elapsed_ms();
+	while (1)
+	{
+		if (twi_sched_pending() && split_pause())
+		{
+			twi_sched_run();
+			split_resume();
+		}
+
+		thisFrameMs = teensy_get_elapsed_ms();
+		if (thisFrameMs == prevFrameMs)
+			continue;
+		prevFrameMs = thisFrameMs;
+
+		split_publish(n35p112_update());
+	}
+}
+#endif
+
 int main(void)
 {
-	int8_t x, y;
+#ifndef USB_GAMEPAD_ONLY
+	int8_t dx, dy, wheel;
 	uint8_t mouseBtn, prevMouseBtn;
+	uint8_t frames;
+#endif
 	uint8_t thisFrameMs, prevFrameMs, elapsedMs;
+	uint16_t statsElapsedMs;
+	uint16_t tuneElapsedMs;
 
 	teensy_init();
 
+#ifdef SPLIT_PERIPHERAL
+	_peripheral_main();
+#endif
+
 	// Initialize the USB, and then wait for the host to set configuration.
 	// If the Teensy is powered without a PC connected to the USB port,
 	// this will wait forever.
 	usb_init();
+	power_set(POWER_SPIN);
 	while (!usb_configured()) /* wait */ ;
 
 	// Wait an extra second for the PC's operating system to load drivers
 	// and do whatever it does to actually be ready for input
 	_delay_ms(3000);
+	power_set(POWER_ACTIVE);
 
 	//print("USB Initialized.\n");
 	//_delay_ms(1000);
 
 	n35p112_init();
+	mcp23018_init();
+	split_init();
+
+	// the parts are set up at the safe startup clock, now find how fast the
+	//  bus on this unit can go
+	twi_tune_calibrate(kTwiProbes, sizeof(kTwiProbes) / sizeof(kTwiProbes[0]));
+	twi_tune_print_stats();
 
 	// Vales Measured from working script
 	//TWCR = 69(0x45)
@@ -76,39 +258,144 @@ int main(void)
 	//_delay_ms(100);
 	teensy_configure_interrupts();
 
+	// The stick's button held down through the start runs the benchmark
+	n35p112_update();
+	if (n35p112_get_btn())
+		bench_run();
+
 	//print("n35p112_calibrate().\n");
 	//_delay_ms(100);
 	n35p112_calibrate();
 
-	print("Initialized.\n");
-	prevFrameMs = teensy_get_elapsed_ms();
+	LOG("Initialized.\n");
+	prevFrameMs = phase_frame();
+#ifndef USB_GAMEPAD_ONLY
 	prevMouseBtn = 0;
+#endif
+	statsElapsedMs = 0;
+	tuneElapsedMs = 0;
 	while (1) {
-		thisFrameMs = teensy_get_elapsed_ms();
+		// until there's a tick to handle, the loop only polls
+		power_set(POWER_IDLE);
+		if (usb_suspended())
+		{
+			power_set(POWER_ACTIVE);
+			_suspend();
+			upsample_reset();
+			prevFrameMs = phase_frame();
+			continue;
+		}
+
+		// all bus traffic after init goes through the scheduler, serve it
+		//  while waiting for the next tick
+		twi_sched_run();
+		capture_fill();
+
+		// the benchmark stops everything else for a while, start the
+		//  frames over after it
+		if (usb_debug_command() == HEALTH_COMMAND_BENCH)
+		{
+			power_set(POWER_ACTIVE);
+			bench_run();
+			upsample_reset();
+			prevFrameMs = phase_frame();
+			continue;
+		}
+
+		// frames start a little ahead of the host's, see phase.h
+		thisFrameMs = phase_frame();
+		if (thisFrameMs == prevFrameMs)
+			continue;
+		power_set(POWER_ACTIVE);
 		elapsedMs = thisFrameMs - prevFrameMs;
-		if (thisFrameMs < prevFrameMs)
-			elapsedMs = 1; //eh, not accurate, but can't hurt
-		n35p112_update(elapsedMs);
-		x = n35p112_get_x();
-		y = n35p112_get_y();
-		mouseBtn = n35p112_get_btn();
-		usb_mouse_move(x, y, 0);
-		//usb_mouse_move(0, 0, 0);
+		prevFrameMs = thisFrameMs;
+		health.ms += elapsedMs;
+		health.loopOverruns += elapsedMs - 1;
+
+		// Keyboard: one full matrix pass and at most one report per tick.
+		//  usb_keyboard_send() doesn't wait, a report that doesn't fit in
+		//  the endpoint stays pending and goes out on a later tick.  The
+		//  expander's half is read in the background by the scheduler and
+		//  is at most one tick old.
+		mcp23018_start_scan();
+		if (matrix_scan())
+			_keyboard_update();
+		usb_keyboard_send();
+
+		statsElapsedMs += elapsedMs;
+		if (statsElapsedMs >= kTwiStatsPeriodMs)
+		{
+			twi_sched_print_stats();
+			twi_tune_print_stats();
+			n35p112_print_stats();
+			stack_print_stats();
+			capture_print_stats();
+			split_print_stats();
+			phase_print_stats();
+			power_print_stats();
+			statsElapsedMs = 0;
+		}
+
+		tuneElapsedMs += elapsedMs;
+		if (tuneElapsedMs >= kTwiTunePeriodMs)
+		{
+			twi_tune_update();
+			tuneElapsedMs = 0;
+		}
+
+#ifdef USB_GAMEPAD_ONLY
+		if (n35p112_update() == N35P112_SAMPLE)
+			phase_sample(n35p112_get_sample_us());
+#else
+		// Mouse: samples feed the upsampler, which has a movement for every
+		//  frame.  Frames missed by a late tick are caught up one by one.
+		switch (n35p112_update())
+		{
+			case N35P112_SAMPLE:
+				split_note_local(n35p112_get_sample_us());
+				phase_sample(n35p112_get_sample_us());
+				upsample_push(n35p112_get_x(), n35p112_get_y(), n35p112_get_sample_us());
+				break;
+			case N35P112_RELEASED:
+				upsample_release();
+				break;
+		}
+		// the other half's stick, in a split build, scrolls
+		split_poll();
+		split_update();
+		for (frames=elapsedMs; frames; frames--)
+		{
+			upsample_frame(&dx, &dy);
+			wheel = split_get_wheel();
+			if (dx || dy || wheel)
+			{
+				usb_mouse_move(dx, dy, wheel);
+				phase_report();
+			}
+		}
+		mouseBtn = n35p112_get_btn() | (split_get_btn() << 1);
 		if (mouseBtn != prevMouseBtn)
 		{
-			usb_mouse_buttons(mouseBtn, 0, 0);
+			usb_mouse_buttons(mouseBtn & 1, 0, (mouseBtn >> 1) & 1);
 			//print("mouse click: ");
 			//phex(mouseBtn);
 			//print("\n");
 		}
-		prevFrameMs = thisFrameMs;
 		prevMouseBtn = mouseBtn;
-		_delay_ms(5);
+#endif
+
+#ifdef USB_GAMEPAD
+		// Gamepad: where the stick is, every tick, for the host to use as
+		//  it is
+		usb_gamepad_send(n35p112_get_position_x(), n35p112_get_position_y(),
+		                 n35p112_get_btn());
+		phase_report();
+#endif
 
 		//print("mouse move: x=");
-		//phex(x);
+		//phex(dx);
 		//print(", y=");
-		//phex(y);
+		//phex(dy);
 		//print("\n");
 		//_delay_ms(500);
 	}
@@ -0,0 +1,58 @@
+// fixed.c
+//
+// See fixed.h
+
+#include "fixed.h"
+
+// ----------------------------------------------------------------------------
+
+/* floor(sqrt(v)), a bit of the root at a time from the top, with no
+ *  multiplies: each step tries the next bit and keeps it if the square
+ *  still fits.  At most 16 steps, fewer for a small v.
+ */
+uint16_t fixed_isqrt32(uint32_t v)
+{
+	uint32_t root = 0;
+	uint32_t bit = 1UL << 30;
+
+	while (bit > v)
+		bit >>= 2;
+	while (bit)
+	{
+		if (v >= root + bit)
+		{
+			v -= root + bit;
+			root = (root >> 1) + bit;
+		}
+		else
+		{
+			root >>= 1;
+		}
+		bit >>= 2;
+	}
+	return root;
+}
+
+// The same in 16 bits, at most 8 steps
+uint8_t fixed_isqrt16(uint16_t v)
+{
+	uint16_t root = 0;
+	uint16_t bit = 1U << 14;
+
+	while (bit > v)
+		bit >>= 2;
+	while (bit)
+	{
+		if (v >= root + bit)
+		{
+			v -= root + bit;
+			root = (root >> 1) + bit;
+		}
+		else
+		{
+			root >>= 1;
+		}
+		bit >>= 2;
+	}
+	return root;
+}
@@ -0,0 +1,212 @@
+// fixed.h
+//
+// Fixed point arithmetic for the ATmega32U4, which has a two cycle 8x8
+//  hardware multiply but no divide: saturating adds and multiplies, the
+//  widening multiplies written so the compiler maps them onto MUL, MULS
+//  and MULSU, division by constants as a multiply by the reciprocal, an
+//  integer square root, a hypot approximation and linear interpolation.
+//
+// Formats are named by their fractional bits: a Q8 value is an int16_t in
+//  1/256ths, what the pointer pipeline and the upsampler carry counts in
+//  after the curve, so FIXED_ONE is 1.0 and 0x7FFF a little under 128.
+//  Saturation is symmetric, to +-0x7FFF and +-127, so that a saturated
+//  value can always be negated.
+//
+// Everything is inline but the square roots, so a caller with constant
+//  arguments gets them folded.  host/fixed_check runs each one against
+//  double precision math, and bench.c times them on the chip.
+
+#ifndef FIXED_H
+#define FIXED_H
+
+#include <stdint.h>
+
+// --------------------------------------------------------------------
+
+#define FIXED_Q          8
+#define FIXED_ONE        (1 << FIXED_Q)
+#define FIXED_HALF       (1 << (FIXED_Q - 1))
+
+// Whole counts, -128 to 127, to Q8 and back, the latter rounded half away
+//  from zero, like pipeline_round() on the magnitude.  Every step is cast to
+//  16 bits, so the host's wider int gives what the chip's does.
+#define FIXED_FROM_INT(i) ((int16_t)((int16_t)(i) * FIXED_ONE))
+#define FIXED_TO_INT(q)   ((int16_t)(q) < 0 ? \
+	-(int16_t)((uint16_t)((uint16_t)(0 - (uint16_t)(q)) + FIXED_HALF) >> FIXED_Q) : \
+	(int16_t)((uint16_t)((uint16_t)(q) + FIXED_HALF) >> FIXED_Q))
+
+// ceil(log2(d)), for d from 2 to 0x8000
+#define FIXED_LOG2_UP(d) \
+	((d) <= 0x2 ? 1 : (d) <= 0x4 ? 2 : (d) <= 0x8 ? 3 : (d) <= 0x10 ? 4 : \
+	 (d) <= 0x20 ? 5 : (d) <= 0x40 ? 6 : (d) <= 0x80 ? 7 : (d) <= 0x100 ? 8 : \
+	 (d) <= 0x200 ? 9 : (d) <= 0x400 ? 10 : (d) <= 0x800 ? 11 : (d) <= 0x1000 ? 12 : \
+	 (d) <= 0x2000 ? 13 : (d) <= 0x4000 ? 14 : 15)
+
+// The multiplier for dividing by d, see fixed_div_u16()
+#define FIXED_RECIP(d) \
+	((uint16_t)((0x10000UL * ((1UL << FIXED_LOG2_UP(d)) - (d))) / (d) + 1))
+
+// x / d for a constant d from 2 to 0x8000, rounded down like x / d, for any
+//  16 bit x
+#define FIXED_DIV_U16(x, d) fixed_div_u16((x), FIXED_RECIP(d), FIXED_LOG2_UP(d))
+
+// --------------------------------------------------------------------
+
+uint8_t fixed_isqrt16(uint16_t v);
+uint16_t fixed_isqrt32(uint32_t v);
+
+// --------------------------------------------------------------------
+
+// Saturation to the report's range and to int16_t
+static inline int8_t fixed_sat8(int16_t v)
+{
+	return v > 127 ? 127 : (v < -127 ? -127 : v);
+}
+
+static inline int16_t fixed_sat16(int32_t v)
+{
+	return v > 0x7FFF ? 0x7FFF : (v < -0x7FFF ? -0x7FFF : v);
+}
+
+// |v|, saturated to 8 bits, -0x8000 included
+static inline uint8_t fixed_abs8(int16_t v)
+{
+	if (v > 255 || v < -255)
+		return 255;
+	return v < 0 ? -v : v;
+}
+
+static inline int8_t fixed_add8(int8_t a, int8_t b)
+{
+	return fixed_sat8((int16_t)a + b);
+}
+
+static inline int16_t fixed_add16(int16_t a, int16_t b)
+{
+	return fixed_sat16((int32_t)a + b);
+}
+
+// 8x8 -> 16: MUL, and MULSU for a signed times an unsigned
+static inline uint16_t fixed_mul8(uint8_t a, uint8_t b)
+{
+	return (uint16_t)a * b;
+}
+
+static inline int16_t fixed_mul8su(int8_t a, uint8_t b)
+{
+	return (int16_t)a * (int16_t)b;
+}
+
+// 16x16 -> 32: four MULs in libgcc's __mulhisi3 and __umulhisi3, none of
+//  the 32x32 multiply a plain int32_t product would call
+static inline int32_t fixed_mul16(int16_t a, int16_t b)
+{
+	return (int32_t)a * b;
+}
+
+static inline uint32_t fixed_umul16(uint16_t a, uint16_t b)
+{
+	return (uint32_t)a * b;
+}
+
+/* The top half of a 16x16 product, (a * b) >> 16, rounded down: a times
+ *  b / 65536, for b a fraction in Q16.  On the chip three of the four
+ *  MULs' low bytes only matter for their carry, and nothing is shifted.
+ */
+static inline uint16_t fixed_umul16_hi(uint16_t a, uint16_t b)
+{
+#ifdef __AVR__
+	uint16_t r;
+	uint8_t t, zero;
+
+	__asm__ (
+		"	clr  %[zero]\n"
+		"	mul  %B[a], %B[b]\n"
+		"	movw %A[r], r0\n"
+		"	mul  %A[a], %A[b]\n"
+		"	mov  %[t], r1\n"
+		"	mul  %B[a], %A[b]\n"
+		"	add  %[t], r0\n"
+		"	adc  %A[r], r1\n"
+		"	adc  %B[r], %[zero]\n"
+		"	mul  %A[a], %B[b]\n"
+		"	add  %[t], r0\n"
+		"	adc  %A[r], r1\n"
+		"	adc  %B[r], %[zero]\n"
+		"	clr  __zero_reg__\n"
+		: [r] "=&r" (r), [t] "=&r" (t), [zero] "=&r" (zero)
+		: [a] "r" (a), [b] "r" (b)
+	);
+	return r;
+#else
+	return ((uint32_t)a * b) >> 16;
+#endif
+}
+
+// Q8 x Q8 -> Q8, rounded to nearest, saturated
+static inline int16_t fixed_mul_q8(int16_t a, int16_t b)
+{
+	return fixed_sat16((fixed_mul16(a, b) + FIXED_HALF) >> FIXED_Q);
+}
+
+// Q8 x an 8 bit gain in Q8, what the pointer pipeline's curve scales by:
+//  |c| saturated to 8 bits times the gain, with the sign of c, up to 0x7FFF
+static inline int16_t fixed_scale8(int16_t c, uint8_t gain)
+{
+	uint16_t v = fixed_mul8(fixed_abs8(c), gain);
+
+	if (v > 0x7FFF)
+		v = 0x7FFF;
+	return c < 0 ? -(int16_t)v : (int16_t)v;
+}
+
+/* x / d for a constant d, as a multiply (Granlund and Montgomery's round
+ *  up method, which needs no more than 16 bits anywhere): m and l from
+ *  FIXED_RECIP() and FIXED_LOG2_UP(), or use FIXED_DIV_U16().  At -Os the
+ *  compiler calls __udivmodhi4 for a constant divisor, about 200 cycles.
+ */
+static inline uint16_t fixed_div_u16(uint16_t x, uint16_t m, uint8_t l)
+{
+	uint16_t t = fixed_umul16_hi(x, m);
+
+	return (t + ((x - t) >> 1)) >> (l - 1);
+}
+
+// Integer approximation of sqrt(a^2 + b^2), within 1.3% at any angle
+//  ("alpha max plus beta min" with two line segments), and 2 counts for
+//  rounding the terms down
+static inline uint8_t fixed_hypot8(uint8_t a, uint8_t b)
+{
+	uint8_t hi = a > b ? a : b;
+	uint8_t lo = a > b ? b : a;
+	uint16_t m0 = hi + (fixed_mul8(5, lo) >> 5);
+	uint16_t m1 = (fixed_mul8(27, hi) >> 5) + (fixed_mul8(71, lo) >> 7);
+	uint16_t m = m0 > m1 ? m0 : m1;
+
+	return m > 255 ? 255 : m;
+}
+
+// The same for 16 bits, the fractions in Q16
+static inline uint16_t fixed_hypot16(uint16_t a, uint16_t b)
+{
+	uint16_t hi = a > b ? a : b;
+	uint16_t lo = a > b ? b : a;
+	uint32_t m0 = (uint32_t)hi + fixed_umul16_hi(lo, 5 * 2048);
+	uint32_t m1 = (uint32_t)fixed_umul16_hi(hi, 27 * 2048) + fixed_umul16_hi(lo, 71 * 512);
+	uint32_t m = m0 > m1 ? m0 : m1;
+
+	return m > 0xFFFF ? 0xFFFF : m;
+}
+
+/* a + (b - a) t, t in 1/256ths from 0 (a) to 255 (a little short of b),
+ *  rounded to nearest.  Any a and b: the difference is taken unsigned, so
+ *  it can't overflow, and the result is always between them.
+ */
+static inline int16_t fixed_lerp(int16_t a, int16_t b, uint8_t t)
+{
+	if (b >= a)
+		return a + (uint16_t)((fixed_umul16((uint16_t)b - (uint16_t)a, t) + FIXED_HALF) >> 8);
+	return a - (uint16_t)((fixed_umul16((uint16_t)a - (uint16_t)b, t) + FIXED_HALF) >> 8);
+}
+
+#endif //FIXED_H
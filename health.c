@@ -0,0 +1,47 @@
+// health.c
+//
+// See health.h
+
+#include "health.h"
+#include "controller/n35p112.h"
+#include "twi/twi_sched.h"
+
+// ----------------------------------------------------------------------------
+
+// The layout the host reads
+typedef char health_size_check[sizeof(health_t) == HEALTH_REPORT_SIZE ? 1 : -1];
+
+health_t health = {
+	.version = HEALTH_VERSION,
+	.size = sizeof(health_t),
+};
+
+// ----------------------------------------------------------------------------
+
+// Bring the counters that live elsewhere into the block.  Runs from the
+//  GET_REPORT request, so it only reads.
+const health_t *health_fill(void)
+{
+	const n35p112_stats_t *joy = n35p112_get_stats();
+	const twi_sched_stats_t *twi;
+	uint8_t i;
+
+	health.joyInterrupts = joy->interrupts;
+	health.joySamples = joy->samples;
+	health.joyReadErrors = joy->readErrors;
+	health.joyLateReleases = joy->lateReleases;
+
+	health.twiJobs = 0;
+	health.twiNaks = 0;
+	health.twiTimeouts = 0;
+	health.twiRecoveries = 0;
+	for (i=0; i<twi_sched_get_num_devices(); i++)
+	{
+		twi = twi_sched_get_stats(i);
+		health.twiJobs += twi->jobs;
+		health.twiNaks += twi->naks;
+		health.twiTimeouts += twi->timeouts;
+		health.twiRecoveries += twi->recoveries;
+	}
+	return &health;
+}
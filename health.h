@@ -0,0 +1,61 @@
+// health.h
+//
+// Always-on counters, for watching units under real load.  The host reads
+//  the block at any time as the debug interface's HID feature report
+//  (GET_REPORT, report type 3), see host/healthmon.c.  Writing it sends a
+//  command instead.
+//
+// Counters that only exist for this are bumped straight in the block where
+//  they happen; the ones modules keep anyway (bus scheduler, stick) are
+//  only gathered when the host asks.  Nothing stops the main loop for a
+//  read, so a count caught in the middle of a carry can be 256 out for
+//  that one read.
+
+#ifndef HEALTH_H
+#define HEALTH_H
+
+#include <stdint.h>
+
+// --------------------------------------------------------------------
+
+#define HEALTH_VERSION 3
+
+// The feature report, little endian like the AVR.  The 32-bit counts come
+//  first so that the layout is the same on the host.
+typedef struct {
+	uint32_t ms;		// main loop ticks since reset
+	uint32_t usbWaitUs;	// time spent waiting for the mouse endpoint
+	uint8_t version;	// HEALTH_VERSION
+	uint8_t size;		// of this block
+	uint16_t loopOverruns;	// ticks the main loop came round too late for
+	uint16_t joyInterrupts;	// INT2
+	uint16_t joySamples;	// samples taken by n35p112_update()
+	uint16_t joyReadErrors;
+	uint16_t twiJobs;	// scheduler jobs, all devices
+	uint16_t twiNaks;	// errors where a slave said no
+	uint16_t twiTimeouts;	// errors where the bus didn't move
+	uint16_t twiRecoveries;	// bus-clear sequences
+	uint16_t usbReports;	// mouse and keyboard reports sent
+	uint16_t usbDropped;	// mouse reports given up on
+	uint16_t usbDeferred;	// keyboard reports held over to a later tick
+	uint16_t usbWaitMaxUs;	// longest wait for the mouse endpoint
+	uint16_t debugDropped;	// debug output bytes thrown away
+	uint16_t sampleAgeUs;	// the latest stick sample at the SOF after it, see phase.h
+	uint16_t sampleAgeMaxUs;
+	uint16_t joyLateReleases;	// stick taken as let go after two periods without a sample
+	uint16_t reserved;	// keeps the size a multiple of 4, for the host's layout
+} health_t;
+
+#define HEALTH_REPORT_SIZE 44
+
+// Commands: the host writes the feature report (SET_REPORT, report type 3)
+//  with one of these in the first byte, the rest is ignored
+#define HEALTH_COMMAND_BENCH 1	// run the benchmark, see bench.h
+
+// --------------------------------------------------------------------
+
+extern health_t health;
+
+const health_t *health_fill(void);
+
+#endif //HEALTH_H
@@ -0,0 +1,199 @@
+// bus_sim.c
+//
+// Runs the real bus scheduler, N35P112 driver and MCP23018 matrix driver
+//  against simulated parts: the stick converts every 20 ms at a random phase
+//  with random deflections, and keys on the expander go up and down at
+//  random.  At the end it prints the scheduler's per-device accounting and
+//  checks that every expander pass read back the keys that were held.
+//
+// With a fault rate, NAK bursts and stuck buses are injected at random as
+//  well.  Then it also checks that no scheduler job ran longer than
+//  kMaxJobUs, that the stick kept being read, and that no failed read made
+//  it to the pointer: deflections are kept small, so a stalled read's 0x7F
+//  filler would show up as a large report.
+//
+// The bus clock is tuned at startup like on the device.  With a bus limit
+//  (in kHz), transfers above it NAK one time in four, and the clock chosen
+//  at startup must not be above the limit.
+//
+// usage: bus_sim [seconds] [seed] [faults per second] [bus limit]
+
+#include "host.h"
+#include "sim_n35p112.h"
+#include "sim_mcp23018.h"
+#include "../controller/teensy-2-0.h"
+#include "../controller/n35p112.h"
+#include "../controller/mcp23018.h"
+#include "../twi/twi_sched.h"
+#include "../twi/twi_teensy-2-0.h"
+#include "../twi/twi_tune.h"
+#include "../health.h"
+#include "../power.h"
+
+#include <avr/io.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+// ----------------------------------------------------------------------------
+
+#define SENSOR_PERIOD_US 20000
+
+// a job is one stalled transfer and a recovery at worst, on top of its own
+//  few bytes at the slowest clock the tuning may step down to
+const uint32_t kMaxJobUs = TWI_BYTE_TIMEOUT_US + 250 + 2500;
+// largest report from a deflection of kFaultDeflection on both axes
+const int8_t kFaultDeflection = 60;
+const int8_t kFaultReportLimit = 10;
+// no expander checks this soon after a fault, its pass was dropped
+const uint32_t kFaultSettleUs = 5000;
+
+// ----------------------------------------------------------------------------
+
+void INT2_vect(void);
+
+static sim_n35p112_t sStick;
+static sim_mcp23018_t sExpander;
+static uint32_t sNextConversionUs;
+static uint32_t sFaultRate = 0;
+static const twi_tune_probe_t kProbes[] = { n35p112_probe, mcp23018_probe };
+
+// ----------------------------------------------------------------------------
+
+// Interrupt sources, checked whenever simulated time moves
+static void _events(void)
+{
+	if (host_now_us() >= sNextConversionUs)
+	{
+		// the part runs off its own oscillator, so let the phase against
+		//  the 1 ms tick wander
+		sNextConversionUs += SENSOR_PERIOD_US + rand() % 201 - 100;
+		if (sFaultRate)
+			sim_n35p112_convert(&sStick, rand() % (2 * kFaultDeflection + 1) - kFaultDeflection,
+			                    rand() % (2 * kFaultDeflection + 1) - kFaultDeflection);
+		else
+			sim_n35p112_convert(&sStick, rand() % 255 - 127, rand() % 255 - 127);
+	}
+	// INT2 is level triggered
+	if (sStick.interrupt && (EIMSK & (1 << INT2)) && (SREG & 0x80))
+		INT2_vect();
+}
+
+int main(int argc, char **argv)
+{
+	uint32_t seconds = argc > 1 ? atoi(argv[1]) : 10;
+	uint32_t endUs, nextTickUs, stableSinceUs = 0, faultUs = 0;
+	uint32_t runUs, maxRunUs = 0, maxJobUs = 0, startUs;
+	uint32_t passes = 0, mismatches = 0, garbage = 0, ticks = 0;
+	uint32_t limitKhz, startKhz;
+	uint8_t col, served;
+	int8_t x, y;
+	const host_twi_stats_t *twiStats = host_twi_get_stats();
+
+	srand(argc > 2 ? atoi(argv[2]) : 1);
+	sFaultRate = argc > 3 ? atoi(argv[3]) : 0;
+	limitKhz = argc > 4 ? atoi(argv[4]) : 0;
+	host_twi_set_max_freq(limitKhz * 1000, 25);
+	sim_n35p112_init(&sStick, N35P112_TWI_ADDRESS);
+	sim_mcp23018_init(&sExpander, 0x20 << 1);
+
+	teensy_init();
+	n35p112_init();
+	mcp23018_init();
+	twi_tune_calibrate(kProbes, sizeof(kProbes) / sizeof(kProbes[0]));
+	startKhz = twi_tune_get_khz();
+	teensy_configure_interrupts();
+	n35p112_calibrate();
+
+	sNextConversionUs = host_now_us() + rand() % SENSOR_PERIOD_US;
+	host_set_event_hook(_events);
+
+	endUs = host_now_us() + seconds * 1000000;
+	nextTickUs = host_now_us();
+	power_update();		// the power figures are for the loop only
+	while (host_now_us() < endUs)
+	{
+		if (host_now_us() >= nextTickUs)
+		{
+			nextTickUs += 1000;
+			power_set(POWER_ACTIVE);
+
+			if (sFaultRate && !host_twi_faulty() && rand() % 1000 < sFaultRate)
+			{
+				if (rand() & 1)
+					host_twi_fault(HOST_TWI_FAULT_NAK, 1 + rand() % 4);
+				else
+					host_twi_fault(HOST_TWI_FAULT_STUCK, rand() % 3);
+			}
+			if (host_twi_faulty())
+				faultUs = host_now_us();
+
+			if (ticks % 1000 == 999)
+				twi_tune_update();
+
+			// every tick, like the main loop in example.c
+			ticks++;
+			n35p112_update();
+			x = n35p112_get_x();
+			y = n35p112_get_y();
+			if (sFaultRate && (x > kFaultReportLimit || x < -kFaultReportLimit ||
+			                   y > kFaultReportLimit || y < -kFaultReportLimit))
+				garbage++;
+
+			// a pass started at least one tick after the last key change
+			//  has to match what's held down
+			if (host_now_us() - stableSinceUs > 3000 &&
+			    (!sFaultRate || host_now_us() - faultUs > kFaultSettleUs))
+			{
+				passes++;
+				for (col=0; col<MCP23018_MATRIX_COLS; col++)
+				{
+					if (mcp23018_get_column(col) != sExpander.pressed[col])
+						mismatches++;
+				}
+			}
+			if (rand() % 50 == 0)
+			{
+				sim_mcp23018_set_key(&sExpander, rand() % 6, rand() % MCP23018_MATRIX_COLS, rand() & 1);
+				stableSinceUs = host_now_us();
+			}
+			mcp23018_start_scan();
+			power_set(POWER_IDLE);
+		}
+
+		startUs = host_now_us();
+		served = twi_sched_run();
+		runUs = host_now_us() - startUs;
+		if (runUs > maxRunUs)
+			maxRunUs = runUs;
+		if (!served)
+			host_advance_us(4);
+	}
+
+	twi_sched_print_stats();
+	twi_tune_print_stats();
+	power_print_stats();
+	printf("stick samples %u, expander reads %u, checked passes %u, mismatched columns %u\n",
+	       sStick.samples, sExpander.gpioReads, passes, mismatches);
+	printf("transfers %u, faulted %u, recoveries %u (%u freed the bus), longest pass %u us, bad reports %u\n",
+	       twiStats->transfers, twiStats->faulted, twiStats->recoveries, twiStats->recovered,
+	       maxRunUs, garbage);
+	health_fill();
+	printf("health: joy %u interrupts %u samples %u errors, twi %u jobs %u naks %u timeouts %u recoveries\n",
+	       health.joyInterrupts, health.joySamples, health.joyReadErrors,
+	       health.twiJobs, health.twiNaks, health.twiTimeouts, health.twiRecoveries);
+	for (col=0; col<twi_sched_get_num_devices(); col++)
+	{
+		if (twi_sched_get_stats(col)->maxBusUs > maxJobUs)
+			maxJobUs = twi_sched_get_stats(col)->maxBusUs;
+	}
+	if (sFaultRate && (maxJobUs > kMaxJobUs || garbage || sStick.samples < seconds * 40))
+		return 1;
+	if (limitKhz)
+	{
+		printf("bus limit %u kHz, tuned to %u kHz at startup, %u kHz now\n",
+		       limitKhz, startKhz, twi_tune_get_khz());
+		if (startKhz > limitKhz)
+			return 1;
+	}
+	return mismatches ? 1 : 0;
+}
@@ -0,0 +1,271 @@
+// fixed_check.c
+//
+// The fixed point library (../fixed.h) against double precision math:
+//  every input where there are few enough of them, the edges and random
+//  ones where there aren't.  Prints each function's worst error against
+//  the exact result and fails if any is worse than fixed.h says it is.
+//
+// This is the C the host compiles; on the chip fixed_umul16_hi() is
+//  assembler, which bench.c runs through the same divisions.  The host's int
+//  is 32 bits to the chip's 16: what fixed.h computes in int is cast back to
+//  16 bits at each step, so it overflows here where it would there.
+//
+// usage: fixed_check [random cases] [seed]
+
+#include "../fixed.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+// ----------------------------------------------------------------------------
+
+// The divisors FIXED_DIV_U16() is checked for on every x, besides all of
+//  2 to kDivAllTo: what the firmware divides by, and the ends
+static const uint16_t kDivisors[] = { 1000, 1024, 3600, 10000, 0x7FFF, 0x8000 };
+const uint16_t kDivAllTo = 1024;
+
+// hypot: the approximation's own error, then what rounding its two terms
+//  down can cost, in counts
+const double kHypotRelative = 0.013;
+const double kHypotCounts = 2.0;
+
+// ----------------------------------------------------------------------------
+
+typedef struct {
+	const char *name;
+	unsigned long cases;
+	double worst;		// |error|, in the result's units
+	double limit;
+} check_t;
+
+// static data
+static unsigned long sRandom = 1000000;
+static int sFailed = 0;
+
+// ----------------------------------------------------------------------------
+
+static void _error(check_t *c, double got, double want)
+{
+	double e = fabs(got - want);
+
+	c->cases++;
+	if (e > c->worst)
+		c->worst = e;
+}
+
+static void _report(const check_t *c)
+{
+	int ok = c->worst <= c->limit;
+
+	printf("%-16s %10lu cases, worst %8.4f, limit %8.4f %s\n",
+	       c->name, c->cases, c->worst, c->limit, ok ? "" : "FAIL");
+	if (!ok)
+		sFailed = 1;
+}
+
+static double _clamp(double v, double limit)
+{
+	return v > limit ? limit : (v < -limit ? -limit : v);
+}
+
+static uint16_t _rand16(void)
+{
+	return (rand() & 0xFF) | (rand() & 0xFF) << 8;
+}
+
+// Round to nearest, halves up
+static double _round_up(double v)
+{
+	return floor(v + 0.5);
+}
+
+static void _saturation(void)
+{
+	check_t sat8 = { "fixed_sat8" }, add8 = { "fixed_add8" };
+	check_t sat16 = { "fixed_sat16" }, add16 = { "fixed_add16" };
+	check_t abs8 = { "fixed_abs8" };
+	long a, b;
+	unsigned long i;
+	int32_t v;
+
+	for (a=-0x8000; a<=0x7FFF; a++)
+	{
+		_error(&sat8, fixed_sat8(a), _clamp(a, 127));
+		_error(&abs8, fixed_abs8(a), fabs(a) > 255 ? 255 : fabs(a));
+	}
+	for (a=-128; a<=127; a++)
+		for (b=-128; b<=127; b++)
+			_error(&add8, fixed_add8(a, b), _clamp(a + b, 127));
+	for (i=0; i<sRandom; i++)
+	{
+		v = (int32_t)((uint32_t)_rand16() << 16 | _rand16());
+		_error(&sat16, fixed_sat16(v), _clamp(v, 0x7FFF));
+		a = (int16_t)_rand16();
+		b = (int16_t)_rand16();
+		_error(&add16, fixed_add16(a, b), _clamp(a + b, 0x7FFF));
+	}
+	_error(&add16, fixed_add16(0x7FFF, 0x7FFF), 0x7FFF);
+	_error(&add16, fixed_add16(-0x8000, -0x8000), -0x7FFF);
+	_report(&sat8);
+	_report(&abs8);
+	_report(&add8);
+	_report(&sat16);
+	_report(&add16);
+}
+
+static void _multiplies(void)
+{
+	check_t mul8 = { "fixed_mul8" }, mul8su = { "fixed_mul8su" };
+	check_t mul16 = { "fixed_mul16" }, umul16 = { "fixed_umul16" };
+	check_t hi = { "fixed_umul16_hi" }, q8 = { "fixed_mul_q8" };
+	check_t scale8 = { "fixed_scale8" };
+	long a, b;
+	unsigned long i;
+	uint16_t ua, ub;
+	int16_t sa, sb;
+
+	for (a=0; a<=255; a++)
+	{
+		for (b=0; b<=255; b++)
+		{
+			_error(&mul8, fixed_mul8(a, b), (double)a * b);
+			_error(&mul8su, fixed_mul8su(a - 128, b), (double)(a - 128) * b);
+		}
+	}
+	for (a=-0x8000; a<=0x7FFF; a++)
+		for (b=0; b<=255; b+=5)
+			_error(&scale8, fixed_scale8(a, b), (a < 0 ? -1 : 1) * fmin(fmin(fabs(a), 255) * b, 0x7FFF));
+	for (i=0; i<sRandom + 4; i++)
+	{
+		// the corners first
+		ua = i < 4 ? (i & 1 ? 0xFFFF : 0) : _rand16();
+		ub = i < 4 ? (i & 2 ? 0xFFFF : 0) : _rand16();
+		sa = ua;
+		sb = ub;
+		_error(&mul16, fixed_mul16(sa, sb), (double)sa * sb);
+		_error(&umul16, fixed_umul16(ua, ub), (double)ua * ub);
+		_error(&hi, fixed_umul16_hi(ua, ub), floor((double)ua * ub / 65536));
+		_error(&q8, fixed_mul_q8(sa, sb), _clamp(_round_up((double)sa * sb / 256), 0x7FFF));
+	}
+	_report(&mul8);
+	_report(&mul8su);
+	_report(&scale8);
+	_report(&mul16);
+	_report(&umul16);
+	_report(&hi);
+	_report(&q8);
+}
+
+static void _divides(void)
+{
+	check_t div = { "FIXED_DIV_U16" };
+	check_t round = { "FIXED_TO_INT" }, whole = { "FIXED_FROM_INT" };
+	unsigned long d, x, i;
+	long n;
+
+	for (d=2; d<=kDivAllTo; d++)
+		for (x=0; x<=0xFFFF; x++)
+			_error(&div, FIXED_DIV_U16(x, d), floor((double)x / d));
+	for (i=0; i<sizeof(kDivisors) / sizeof(kDivisors[0]); i++)
+		for (x=0; x<=0xFFFF; x++)
+			_error(&div, FIXED_DIV_U16(x, kDivisors[i]), floor((double)x / kDivisors[i]));
+	for (i=0; i<sRandom; i++)
+	{
+		d = 2 + _rand16() % 0x7FFF;
+		x = _rand16();
+		_error(&div, FIXED_DIV_U16(x, d), floor((double)x / d));
+	}
+	for (x=0; x<=0xFFFF; x++)
+	{
+		int16_t q = x;
+
+		_error(&round, FIXED_TO_INT(q), (q < 0 ? -1 : 1) * floor(fabs(q) / 256 + 0.5));
+	}
+	for (n=-128; n<=127; n++)
+	{
+		_error(&whole, FIXED_FROM_INT(n), n * 256.0);
+		_error(&round, FIXED_TO_INT(FIXED_FROM_INT(n)), n);
+	}
+	_report(&div);
+	_report(&whole);
+	_report(&round);
+}
+
+static void _roots(void)
+{
+	check_t sqrt16 = { "fixed_isqrt16" }, sqrt32 = { "fixed_isqrt32" };
+	check_t hypot8 = { "fixed_hypot8", 0, 0, kHypotCounts };
+	check_t hypot16 = { "fixed_hypot16", 0, 0, kHypotCounts };
+	unsigned long a, b, i;
+	uint32_t v;
+	double h;
+
+	for (v=0; v<=0xFFFF; v++)
+		_error(&sqrt16, fixed_isqrt16(v), floor(sqrt(v)));
+	// either side of every square, then anywhere
+	for (a=1; a<=0xFFFF; a++)
+	{
+		v = a * a;
+		_error(&sqrt32, fixed_isqrt32(v), a);
+		_error(&sqrt32, fixed_isqrt32(v - 1), a - 1);
+	}
+	_error(&sqrt32, fixed_isqrt32(0xFFFFFFFF), 0xFFFF);
+	for (i=0; i<sRandom; i++)
+	{
+		v = (uint32_t)_rand16() << 16 | _rand16();
+		_error(&sqrt32, fixed_isqrt32(v), floor(sqrt(v)));
+	}
+
+	// hypot: what's off past kHypotRelative of the exact one
+	for (a=0; a<=255; a++)
+	{
+		for (b=0; b<=255; b++)
+		{
+			h = fmin(hypot(a, b), 255);
+			_error(&hypot8, fmax(fabs(fixed_hypot8(a, b) - h) - kHypotRelative * h, 0), 0);
+		}
+	}
+	for (i=0; i<sRandom; i++)
+	{
+		a = i < 0x100 ? i : _rand16();
+		b = i < 0x100 ? i * 3 % 0x100 : _rand16();
+		h = fmin(hypot(a, b), 0xFFFF);
+		_error(&hypot16, fmax(fabs(fixed_hypot16(a, b) - h) - kHypotRelative * h, 0), 0);
+	}
+	_report(&sqrt16);
+	_report(&sqrt32);
+	_report(&hypot8);
+	_report(&hypot16);
+}
+
+// a + (b - a) t / 256 to nearest, a tie going either way
+static void _lerp(void)
+{
+	check_t lerp = { "fixed_lerp", 0, 0, 0.5 };
+	unsigned long i, t;
+	int16_t a, b;
+
+	for (i=0; i<sRandom / 64 + 4; i++)
+	{
+		a = i < 4 ? (i & 1 ? 0x7FFF : -0x8000) : (int16_t)_rand16();
+		b = i < 4 ? (i & 2 ? 0x7FFF : -0x8000) : (int16_t)_rand16();
+		for (t=0; t<=255; t++)
+			_error(&lerp, fixed_lerp(a, b, t), a + ((double)b - a) * t / 256);
+	}
+	_report(&lerp);
+}
+
+int main(int argc, char **argv)
+{
+	if (argc > 1)
+		sRandom = strtoul(argv[1], NULL, 0);
+	srand(argc > 2 ? atoi(argv[2]) : 1);
+
+	_saturation();
+	_multiplies();
+	_divides();
+	_roots();
+	_lerp();
+	return sFailed;
+}
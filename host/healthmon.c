@@ -0,0 +1,205 @@
+// healthmon.c
+//
+// Polls the firmware's health counters (see health.h), the debug
+//  interface's HID feature report, through Linux hidraw, and prints what
+//  changed each interval: rates for the sensor, the bus and the USB
+//  reports, and every error.
+//
+// usage: healthmon [-i seconds] [-n count] [-t] [-b] [/dev/hidrawN]
+//   -i seconds  between reads, default 1
+//   -n count    stop after this many lines, default never
+//   -t          print the totals once and stop
+//   -b          run the firmware's benchmark (bench.h) and stop; the
+//               results come out on the debug channel
+//   without a device, the first hidraw node with the debug interface of
+//   a 16C0:047F is used
+//
+// The counts are 16 bits and wrap, so an interval has to be short enough
+//  for none of them to go round twice: at 1000 reports/s that's a minute.
+
+#include "../health.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <linux/hidraw.h>
+#include <sys/ioctl.h>
+
+// ----------------------------------------------------------------------------
+
+#define HEALTHMON_VENDOR_ID  0x16C0
+#define HEALTHMON_PRODUCT_ID 0x047F
+#define HEALTHMON_MAX_NODES  64
+
+// ----------------------------------------------------------------------------
+
+// The debug interface's report descriptor starts with its vendor usage page
+static const uint8_t kDebugUsagePage[] = { 0x06, 0x31, 0xFF };
+
+// ----------------------------------------------------------------------------
+
+static int _is_debug_interface(int fd)
+{
+	struct hidraw_devinfo info;
+	struct hidraw_report_descriptor desc;
+	int size;
+
+	if (ioctl(fd, HIDIOCGRAWINFO, &info) < 0 ||
+	    (uint16_t)info.vendor != HEALTHMON_VENDOR_ID ||
+	    (uint16_t)info.product != HEALTHMON_PRODUCT_ID)
+		return 0;
+	if (ioctl(fd, HIDIOCGRDESCSIZE, &size) < 0)
+		return 0;
+	desc.size = size;
+	if (ioctl(fd, HIDIOCGRDESC, &desc) < 0)
+		return 0;
+	return desc.size >= sizeof(kDebugUsagePage) &&
+	       !memcmp(desc.value, kDebugUsagePage, sizeof(kDebugUsagePage));
+}
+
+static int _open(const char *path)
+{
+	char name[32];
+	int fd, i;
+
+	if (path)
+	{
+		fd = open(path, O_RDWR);
+		if (fd < 0)
+			perror(path);
+		return fd;
+	}
+	for (i=0; i<HEALTHMON_MAX_NODES; i++)
+	{
+		snprintf(name, sizeof(name), "/dev/hidraw%d", i);
+		fd = open(name, O_RDWR);
+		if (fd < 0)
+			continue;
+		if (_is_debug_interface(fd))
+			return fd;
+		close(fd);
+	}
+	fprintf(stderr, "no debug interface of a %04x:%04x found\n",
+	        HEALTHMON_VENDOR_ID, HEALTHMON_PRODUCT_ID);
+	return -1;
+}
+
+// GET_REPORT for the feature report.  There are no report ids, so the
+//  kernel puts the data after the 0 we pass as one.
+static int _read(int fd, health_t *h)
+{
+	uint8_t buf[1 + HEALTH_REPORT_SIZE];
+	int n;
+
+	memset(buf, 0, sizeof(buf));
+	n = ioctl(fd, HIDIOCGFEATURE(sizeof(buf)), buf);
+	if (n < 0)
+	{
+		perror("HIDIOCGFEATURE");
+		return -1;
+	}
+	if (n < (int)sizeof(buf) || buf[1 + 8] != HEALTH_VERSION || buf[1 + 9] != HEALTH_REPORT_SIZE)
+	{
+		fprintf(stderr, "unexpected report: %d bytes, version %u, size %u\n",
+		        n - 1, buf[1 + 8], buf[1 + 9]);
+		return -1;
+	}
+	memcpy(h, buf + 1, sizeof(*h));
+	return 0;
+}
+
+// SET_REPORT for the feature report, with the command in the first byte
+static int _command(int fd, uint8_t command)
+{
+	uint8_t buf[1 + HEALTH_REPORT_SIZE];
+
+	memset(buf, 0, sizeof(buf));
+	buf[1] = command;
+	if (ioctl(fd, HIDIOCSFEATURE(sizeof(buf)), buf) < 0)
+	{
+		perror("HIDIOCSFEATURE");
+		return -1;
+	}
+	return 0;
+}
+
+static void _totals(const health_t *h)
+{
+	printf("up %u ms, loop overruns %u\n", h->ms, h->loopOverruns);
+	printf("joy interrupts %u, samples %u, read errors %u, late releases %u\n",
+	       h->joyInterrupts, h->joySamples, h->joyReadErrors, h->joyLateReleases);
+	printf("twi jobs %u, naks %u, timeouts %u, recoveries %u\n",
+	       h->twiJobs, h->twiNaks, h->twiTimeouts, h->twiRecoveries);
+	printf("usb reports %u, dropped %u, deferred %u, waited %u us (max %u)\n",
+	       h->usbReports, h->usbDropped, h->usbDeferred, h->usbWaitUs, h->usbWaitMaxUs);
+	printf("debug bytes dropped %u, sample age %u us (max %u)\n",
+	       h->debugDropped, h->sampleAgeUs, h->sampleAgeMaxUs);
+}
+
+#define D16(f) ((uint16_t)(b->f - a->f))
+
+// One line for an interval: rates per second of device time, then counts
+static void _interval(const health_t *a, const health_t *b)
+{
+	uint32_t ms = b->ms - a->ms;
+	double s = ms ? ms / 1000.0 : 1;
+
+	printf("%8.1f s %6.0f samples/s %5.0f int/s %6.0f jobs/s %6.0f reports/s"
+	       " | wait %5.0f us/s max %5u age %4u | err joy %u late %u nak %u to %u rec %u drop %u defer %u overrun %u dbg %u\n",
+	       b->ms / 1000.0, D16(joySamples) / s, D16(joyInterrupts) / s,
+	       D16(twiJobs) / s, D16(usbReports) / s,
+	       (b->usbWaitUs - a->usbWaitUs) / s, b->usbWaitMaxUs, b->sampleAgeUs,
+	       D16(joyReadErrors), D16(joyLateReleases), D16(twiNaks), D16(twiTimeouts), D16(twiRecoveries),
+	       D16(usbDropped), D16(usbDeferred), D16(loopOverruns), D16(debugDropped));
+	fflush(stdout);
+}
+
+// ----------------------------------------------------------------------------
+
+int main(int argc, char **argv)
+{
+	health_t prev, cur;
+	double seconds = 1;
+	long count = -1;
+	int c, fd, totals = 0, bench = 0;
+
+	while ((c = getopt(argc, argv, "i:n:tb")) != -1)
+	{
+		switch (c)
+		{
+			case 'i': seconds = atof(optarg); break;
+			case 'n': count = atol(optarg); break;
+			case 't': totals = 1; break;
+			case 'b': bench = 1; break;
+			default:
+				fprintf(stderr, "usage: healthmon [-i seconds] [-n count] [-t] [-b] [/dev/hidrawN]\n");
+				return 2;
+		}
+	}
+	fd = _open(optind < argc ? argv[optind] : NULL);
+	if (fd >= 0 && bench)
+		return _command(fd, HEALTH_COMMAND_BENCH) ? 1 : 0;
+	if (fd < 0 || _read(fd, &prev))
+		return 1;
+	if (totals)
+	{
+		_totals(&prev);
+		return 0;
+	}
+
+	while (count < 0 || count--)
+	{
+		usleep(seconds * 1000000);
+		if (_read(fd, &cur))
+			return 1;
+		if (cur.ms < prev.ms)
+			printf("reset\n");
+		else
+			_interval(&prev, &cur);
+		prev = cur;
+	}
+	return 0;
+}
@@ -0,0 +1,57 @@
+// host.h
+//
+// Host-side stand-ins for the Teensy: a simulated clock, a packet level TWI
+//  bus with simulated devices on it, and the debug channel on stdout.
+
+#ifndef HOST_H
+#define HOST_H
+
+#include <stdint.h>
+
+// --------------------------------------------------------------------
+
+// A register file device on the simulated bus.  Writes set the register
+//  pointer with their first byte, and reads and writes both advance it, like
+//  the N35P112 and MCP23018 (in sequential mode) do.
+typedef struct host_twi_device {
+	uint8_t address;	// 8-bit address, as the firmware passes it
+	uint8_t pointer;
+	uint8_t regs[256];
+	uint8_t (*read_reg)(struct host_twi_device *dev, uint8_t reg);
+	void (*write_reg)(struct host_twi_device *dev, uint8_t reg, uint8_t value);
+	uint8_t busy;		// NAKs its address while set, like a slave that's off
+	void *context;
+} host_twi_device_t;
+
+// Faults the simulated bus can be told to produce, see host_twi_fault()
+#define HOST_TWI_FAULT_NONE   0
+#define HOST_TWI_FAULT_NAK    1	// the addressed slave NAKs its next transfers
+#define HOST_TWI_FAULT_STUCK  2	// a slave holds SDA low, every transfer stalls
+
+// Bus accounting for checking the firmware's error handling
+typedef struct {
+	uint32_t transfers;
+	uint32_t faulted;	// transfers that failed because of an injected fault
+	uint32_t recoveries;	// TWI_RecoverBus() calls
+	uint32_t recovered;	// ... that freed a stuck bus
+} host_twi_stats_t;
+
+// --------------------------------------------------------------------
+
+void host_advance_us(double us);
+uint32_t host_now_us(void);
+void host_set_event_hook(void (*hook)(void));
+
+void host_twi_attach(host_twi_device_t *dev);
+uint32_t host_twi_freq(void);
+void host_twi_fault(uint8_t fault, uint8_t count);
+void host_twi_set_max_freq(uint32_t freq, uint8_t nakPercent);
+uint8_t host_twi_faulty(void);
+const host_twi_stats_t *host_twi_get_stats(void);
+
+void host_usb_set_sof(double startUs, int16_t ppm);
+void host_usb_capture_start(uint8_t flags);
+void host_usb_capture_sof(void);
+uint8_t host_usb_capture_take(void (*sink)(const uint8_t *data, uint8_t len));
+
+#endif //HOST_H
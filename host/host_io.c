@@ -0,0 +1,13 @@
+// host_io.c
+//
+// Storage for the registers declared in include/avr/io.h
+
+#define HOST_USB_REGS
+#include <avr/io.h>
+
+#define HOST_REG(name) volatile uint8_t name;
+#include <avr/host_regs.h>
+#undef HOST_REG
+
+volatile uint16_t TCNT1;
+volatile uint16_t OCR1A;
@@ -0,0 +1,9 @@
+// host_stack.c
+//
+// controller/stack.c for the host: there's no AVR RAM to paint, only the
+//  ISR nesting count that the firmware's interrupt handlers keep
+
+#include "../controller/stack.h"
+
+volatile uint8_t stack_isr_depth = 0;
+volatile uint8_t stack_isr_peak = 0;
@@ -0,0 +1,77 @@
+// host_teensy.c
+//
+// controller/teensy-2-0.c for the host: time comes from the simulated clock,
+//  which only moves when host code or a simulated delay advances it.
+
+#include "host.h"
+#include "../controller/teensy-2-0.h"
+#include "../twi/twi_teensy-2-0.h"
+#include "../power.h"
+
+#include <avr/io.h>
+#include <string.h>
+
+// ----------------------------------------------------------------------------
+
+static double sNowUs = 0;
+static double sTickUs = 0;	// towards the next timer0 tick, for power.h
+static void (*sEventHook)(void) = 0;
+static uint8_t sInHook = 0;
+static uint8_t sMatrix[TEENSY_MATRIX_COLS];
+
+// ----------------------------------------------------------------------------
+
+// Time passing is when simulated hardware gets to act, e.g. raise an
+//  interrupt in the middle of a bus transaction.  The hook isn't re-entered
+//  if the "interrupt" itself takes time.
+void host_advance_us(double us)
+{
+	sNowUs += us;
+	for (sTickUs += us; sTickUs >= 1000; sTickUs -= 1000)
+		power_tick(1);
+	if (sEventHook && !sInHook)
+	{
+		sInHook = 1;
+		sEventHook();
+		sInHook = 0;
+	}
+}
+
+void host_set_event_hook(void (*hook)(void))
+{
+	sEventHook = hook;
+}
+
+uint32_t host_now_us(void)
+{
+	return (uint32_t)sNowUs;
+}
+
+// Only the bus clock, at the same startup rate as the device
+uint8_t teensy_init(void)
+{
+	TWI_Init(TWI_BIT_PRESCALE_1, TWI_BITLENGTH_FROM_FREQ(1, 100000));
+	return 0;
+}
+
+uint8_t teensy_configure_interrupts(void)
+{
+	EIMSK |= (1 << INT2);
+	SREG |= 0x80;
+	return 0;
+}
+
+uint8_t teensy_get_elapsed_ms(void)
+{
+	return (uint8_t)(host_now_us() / 1000);
+}
+
+uint16_t teensy_get_us(void)
+{
+	return (uint16_t)host_now_us();
+}
+
+void teensy_update_matrix(uint8_t rows[TEENSY_MATRIX_COLS])
+{
+	memcpy(rows, sMatrix, sizeof(sMatrix));
+}
@@ -0,0 +1,220 @@
+// host_twi.c
+//
+// twi/twi_teensy-2-0.c for the host.  Packets go to the simulated device
+//  with the matching address, and the simulated clock is advanced by the
+//  time the transfer would take at the bus rate set in TWBR/TWSR.
+//
+// Faults can be injected: a burst of NAKs, or a slave holding SDA low so
+//  that every transfer stalls until TWI_RecoverBus() clocks it free.  Stalled
+//  transfers cost the driver's byte timeout and scribble over the caller's
+//  buffer, so code that uses a failed read shows up.  A bus can also be
+//  given a top speed, above which transfers NAK at random, like a long
+//  cable with weak pull-ups.
+
+#include "host.h"
+#include "../twi/twi_teensy-2-0.h"
+#include "../power.h"
+
+#include <stdlib.h>
+
+// ----------------------------------------------------------------------------
+
+#define HOST_TWI_MAX_DEVICES 8
+
+// ----------------------------------------------------------------------------
+
+static host_twi_device_t *sDevices[HOST_TWI_MAX_DEVICES];
+static uint8_t sNumDevices = 0;
+static uint8_t sFault = HOST_TWI_FAULT_NONE;
+static uint8_t sFaultCount = 0;
+static host_twi_stats_t sStats;
+static uint32_t sMaxFreq = 0;
+static uint8_t sNakPercent = 0;
+
+// ----------------------------------------------------------------------------
+
+void host_twi_attach(host_twi_device_t *dev)
+{
+	sDevices[sNumDevices++] = dev;
+}
+
+// SCL = F_CPU / (16 + 2 * TWBR * 4^prescale)
+uint32_t host_twi_freq(void)
+{
+	uint32_t div = 16 + 2UL * TWBR * (1UL << (2 * (TWSR & 0x03)));
+	return F_CPU / div;
+}
+
+// 9 clocks per byte, plus about one for each START/STOP.  Time is advanced
+//  a byte at a time so that simulated interrupts land inside transfers.
+static void _bus_time(uint8_t bytes)
+{
+	double clockUs = 1e6 / host_twi_freq();
+	uint8_t state = power_spin();
+
+	host_advance_us(2 * clockUs);
+	while (bytes--)
+		host_advance_us(9 * clockUs);
+	power_set(state);
+}
+
+/* Inject a fault.
+ *  HOST_TWI_FAULT_NAK: the next count transfers are NAKed after the first
+ *   byte.
+ *  HOST_TWI_FAULT_STUCK: the bus hangs until a TWI_RecoverBus() call, and
+ *   the first count of those calls fail to free it.
+ */
+void host_twi_fault(uint8_t fault, uint8_t count)
+{
+	sFault = fault;
+	sFaultCount = count;
+}
+
+// Above freq, nakPercent of the transfers fail.  0 for no limit.
+void host_twi_set_max_freq(uint32_t freq, uint8_t nakPercent)
+{
+	sMaxFreq = freq;
+	sNakPercent = nakPercent;
+}
+
+uint8_t host_twi_faulty(void)
+{
+	return sFault != HOST_TWI_FAULT_NONE;
+}
+
+const host_twi_stats_t *host_twi_get_stats(void)
+{
+	return &sStats;
+}
+
+// Apply an injected fault to a transfer.  Returns TWI_ERROR_NoError if the
+//  transfer should go ahead.
+static uint8_t _fault(uint8_t *buffer, uint8_t length)
+{
+	sStats.transfers++;
+	switch (sFault)
+	{
+		case HOST_TWI_FAULT_NAK:
+			_bus_time(2);
+			if (--sFaultCount == 0)
+				sFault = HOST_TWI_FAULT_NONE;
+			sStats.faulted++;
+			return TWI_ERROR_SlaveNAK;
+		case HOST_TWI_FAULT_STUCK:
+			_bus_time(1);
+			host_advance_us(TWI_BYTE_TIMEOUT_US);
+			while (buffer && length--)
+				*buffer++ = 0x7F;
+			sStats.faulted++;
+			return TWI_ERROR_BusTimeout;
+	}
+	if (sMaxFreq && host_twi_freq() > sMaxFreq && rand() % 100 < sNakPercent)
+	{
+		_bus_time(2);
+		sStats.faulted++;
+		return TWI_ERROR_SlaveNAK;
+	}
+	return TWI_ERROR_NoError;
+}
+
+// Nine SCL pulses and a STOP at 5us per phase, like the firmware
+uint8_t TWI_RecoverBus(void)
+{
+	host_advance_us(9 * 10 + 20 + 5);
+	sStats.recoveries++;
+	if (sFault == HOST_TWI_FAULT_STUCK)
+	{
+		if (sFaultCount)
+		{
+			sFaultCount--;
+			return TWI_ERROR_BusFault;
+		}
+		sFault = HOST_TWI_FAULT_NONE;
+		sStats.recovered++;
+	}
+	return TWI_ERROR_NoError;
+}
+
+static host_twi_device_t *_find(uint8_t address)
+{
+	uint8_t i;
+
+	for (i=0; i<sNumDevices; i++)
+	{
+		if (sDevices[i]->address == (address & TWI_DEVICE_ADDRESS_MASK))
+			return sDevices[i];
+	}
+	return 0;
+}
+
+static void _write(host_twi_device_t *dev, const uint8_t *data, uint8_t length, uint8_t setPointer)
+{
+	if (setPointer && length)
+	{
+		dev->pointer = *data++;
+		length--;
+	}
+	while (length--)
+	{
+		if (dev->write_reg)
+			dev->write_reg(dev, dev->pointer, *data);
+		else
+			dev->regs[dev->pointer] = *data;
+		data++;
+		dev->pointer++;
+	}
+}
+
+uint8_t TWI_ReadPacket(const uint8_t SlaveAddress,
+                       const uint8_t TimeoutMS,
+                       const uint8_t* InternalAddress,
+                       uint8_t InternalAddressLen,
+                       uint8_t* Buffer,
+                       uint8_t Length)
+{
+	host_twi_device_t *dev = _find(SlaveAddress);
+	uint8_t error;
+
+	(void)TimeoutMS;
+	if ((error = _fault(Buffer, Length)) != TWI_ERROR_NoError)
+		return error;
+	if (!dev || dev->busy)
+	{
+		_bus_time(1);
+		return TWI_ERROR_SlaveNotReady;
+	}
+
+	_bus_time(1 + InternalAddressLen + 1 + Length);
+	_write(dev, InternalAddress, InternalAddressLen, 1);
+	while (Length--)
+	{
+		*Buffer++ = dev->read_reg ? dev->read_reg(dev, dev->pointer) : dev->regs[dev->pointer];
+		dev->pointer++;
+	}
+	return TWI_ERROR_NoError;
+}
+
+uint8_t TWI_WritePacket(const uint8_t SlaveAddress,
+                        const uint8_t TimeoutMS,
+                        const uint8_t* InternalAddress,
+                        uint8_t InternalAddressLen,
+                        const uint8_t* Buffer,
+                        uint8_t Length)
+{
+	host_twi_device_t *dev = _find(SlaveAddress);
+	uint8_t error;
+
+	(void)TimeoutMS;
+	if ((error = _fault(0, 0)) != TWI_ERROR_NoError)
+		return error;
+	if (!dev || dev->busy)
+	{
+		_bus_time(1);
+		return TWI_ERROR_SlaveNotReady;
+	}
+
+	_bus_time(1 + InternalAddressLen + Length);
+	_write(dev, InternalAddress, InternalAddressLen, 1);
+	_write(dev, Buffer, Length, 0);
+	return TWI_ERROR_NoError;
+}
@@ -0,0 +1,137 @@
+// host_usb.c
+//
+// The debug channel for the host: print() and LOG() output goes to stdout,
+//  and the host's frames for usb_get_sof()
+
+#include "host.h"
+#include "../usb_mouse_debug.h"
+
+#include <stdio.h>
+
+int8_t usb_debug_putchar(uint8_t c)
+{
+	if (c != '\r')
+		putchar(c);
+	return 0;
+}
+
+// LOG() frames are binary: as they are, for host/logcat
+int8_t usb_debug_write(const uint8_t *buffer, uint8_t size)
+{
+	fwrite(buffer, 1, size, stdout);
+	return 0;
+}
+
+void usb_debug_flush_output(void)
+{
+	fflush(stdout);
+}
+
+// ----------------------------------------------------------------------------
+
+// A SOF every millisecond of the host's clock, which runs off from ours
+static double sSofStartUs = 0;
+static double sSofPeriodUs = 1000;
+
+// Where the host's frames start, and how far its clock is off, e.g. 50 ppm
+void host_usb_set_sof(double startUs, int16_t ppm)
+{
+	sSofStartUs = startUs;
+	sSofPeriodUs = 1000 * (1 + ppm / 1e6);
+}
+
+uint8_t usb_get_sof(uint16_t *us)
+{
+	double now = host_now_us();
+	uint32_t n = now > sSofStartUs ? (now - sSofStartUs) / sSofPeriodUs : 0;
+
+	*us = (uint16_t)(uint32_t)(sSofStartUs + n * sSofPeriodUs);
+	return n;
+}
+
+#ifdef USB_CAPTURE
+#include "../capture.h"
+
+#include <string.h>
+
+// ----------------------------------------------------------------------------
+
+// The capture endpoint: two banks of CAPTURE_PACKET_SIZE.  Completed
+//  packets wait in order for the simulated host to take them, and the bank
+//  after them, if there is one free, takes writes.
+static uint8_t sBanks[2][CAPTURE_PACKET_SIZE];
+static uint8_t sBankLen[2];
+static uint8_t sHead = 0;	// oldest completed packet
+static uint8_t sCompleted = 0;
+static uint8_t sFlags = 0;
+static uint8_t sFlushTimer = 0;
+
+// ----------------------------------------------------------------------------
+
+uint8_t usb_capture_flags(void)
+{
+	return sFlags;
+}
+
+uint8_t usb_capture_ready(void)
+{
+	return sFlags && sCompleted < 2;
+}
+
+int8_t usb_capture_write(const uint8_t *data, uint8_t len)
+{
+	uint8_t bank = (sHead + sCompleted) & 1;
+
+	if (!usb_capture_ready())
+		return -1;
+	memcpy(&sBanks[bank][sBankLen[bank]], data, len);
+	sBankLen[bank] += len;
+	if (sBankLen[bank] == CAPTURE_PACKET_SIZE)
+	{
+		sCompleted++;
+		sFlushTimer = 0;
+	}
+	else
+	{
+		sFlushTimer = 2;
+	}
+	return 0;
+}
+
+// The vendor request: empty banks, new flags
+void host_usb_capture_start(uint8_t flags)
+{
+	memset(sBankLen, 0, sizeof(sBankLen));
+	sHead = 0;
+	sCompleted = 0;
+	sFlushTimer = 0;
+	sFlags = flags;
+}
+
+// Start of frame: a partial packet goes out once its flush timer runs
+//  down, like the SOF handler does it
+void host_usb_capture_sof(void)
+{
+	uint8_t bank = (sHead + sCompleted) & 1;
+
+	if (sFlushTimer && !--sFlushTimer && sCompleted < 2 && sBankLen[bank])
+		sCompleted++;
+}
+
+/* The host reads a packet, if there's one waiting, and passes it to sink.
+ *
+ * returns
+ * - nonzero if there was one
+ */
+uint8_t host_usb_capture_take(void (*sink)(const uint8_t *data, uint8_t len))
+{
+	if (!sCompleted)
+		return 0;
+	sink(sBanks[sHead], sBankLen[sHead]);
+	sBankLen[sHead] = 0;
+	sHead ^= 1;
+	sCompleted--;
+	return 1;
+}
+
+#endif //USB_CAPTURE
@@ -0,0 +1,26 @@
+// host_regs.h (host)
+//
+// X-macro list of the 8-bit registers the firmware touches
+
+HOST_REG(SREG)
+HOST_REG(MCUCR)
+HOST_REG(MCUSR)
+HOST_REG(WDTCSR)
+HOST_REG(CLKPR)
+HOST_REG(SMCR)
+HOST_REG(PRR0)
+HOST_REG(PRR1)
+HOST_REG(PINB) HOST_REG(DDRB) HOST_REG(PORTB)
+HOST_REG(PINC) HOST_REG(DDRC) HOST_REG(PORTC)
+HOST_REG(PIND) HOST_REG(DDRD) HOST_REG(PORTD)
+HOST_REG(PINE) HOST_REG(DDRE) HOST_REG(PORTE)
+HOST_REG(PINF) HOST_REG(DDRF) HOST_REG(PORTF)
+HOST_REG(TWCR) HOST_REG(TWSR) HOST_REG(TWBR) HOST_REG(TWDR) HOST_REG(TWAR)
+HOST_REG(EICRA) HOST_REG(EIMSK) HOST_REG(EIFR)
+HOST_REG(PCICR) HOST_REG(PCMSK0) HOST_REG(PCIFR)
+HOST_REG(TCCR0A) HOST_REG(TCCR0B) HOST_REG(TCNT0) HOST_REG(TIMSK0) HOST_REG(TIFR0)
+HOST_REG(TCCR1A) HOST_REG(TCCR1B) HOST_REG(TIMSK1) HOST_REG(TIFR1)
+HOST_REG(UHWCON) HOST_REG(USBCON) HOST_REG(USBINT) HOST_REG(PLLCSR)
+HOST_REG(UDCON) HOST_REG(UDINT) HOST_REG(UDIEN) HOST_REG(UDADDR) HOST_REG(UDFNUML)
+HOST_REG(UENUM) HOST_REG(UERST) HOST_REG(UECONX) HOST_REG(UECFG0X) HOST_REG(UECFG1X)
+HOST_REG(UEINTX) HOST_REG(UEIENX) HOST_REG(UEDATX) HOST_REG(UEBCLX)
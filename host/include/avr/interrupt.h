@@ -0,0 +1,12 @@
+// interrupt.h (host)
+
+#ifndef HOST_AVR_INTERRUPT_H
+#define HOST_AVR_INTERRUPT_H
+
+#include <avr/io.h>
+
+// SREG's I bit is tracked so that code saving and restoring it behaves
+#define sei() (SREG |= 0x80)
+#define cli() (SREG &= ~0x80)
+
+#endif //HOST_AVR_INTERRUPT_H
@@ -0,0 +1,139 @@
+// io.h (host)
+//
+// Stand-in for avr-libc's <avr/io.h> so that firmware sources build on the
+//  host.  Registers are plain variables (see host_io.c), bit positions are
+//  the ATmega32U4's.
+
+#ifndef HOST_AVR_IO_H
+#define HOST_AVR_IO_H
+
+#include <stdint.h>
+
+#define _BV(bit) (1 << (bit))
+
+#define HOST_REG(name) extern volatile uint8_t name;
+#include "host_regs.h"
+#undef HOST_REG
+
+extern volatile uint16_t TCNT1;
+extern volatile uint16_t OCR1A;
+
+// host/usb_sim.c puts the endpoint registers behind its simulated USB
+//  controller: every access goes through it, takes a little simulated time
+//  and reaches the selected endpoint's copy
+#define HOST_UEINTX 0
+#define HOST_UEDATX 1
+#define HOST_UECONX 2
+#define HOST_UEIENX 3
+#define HOST_UECFG1X 4
+#if defined(HOST_USB_SIM) && !defined(HOST_USB_REGS)
+volatile uint8_t *host_usb_reg(uint8_t reg);
+#define UEINTX (*host_usb_reg(HOST_UEINTX))
+#define UEDATX (*host_usb_reg(HOST_UEDATX))
+#define UECONX (*host_usb_reg(HOST_UECONX))
+#define UEIENX (*host_usb_reg(HOST_UEIENX))
+#define UECFG1X (*host_usb_reg(HOST_UECFG1X))
+#endif
+
+// MCUCR, MCUSR, WDTCSR
+#define JTD	7
+#define WDRF	3
+#define WDIF	7
+#define WDIE	6
+#define WDP3	5
+#define WDCE	4
+#define WDE	3
+#define WDP2	2
+#define WDP1	1
+#define WDP0	0
+// TWCR, TWSR
+#define TWINT	7
+#define TWEA	6
+#define TWSTA	5
+#define TWSTO	4
+#define TWWC	3
+#define TWEN	2
+#define TWIE	0
+#define TWPS1	1
+#define TWPS0	0
+// EICRA, EIMSK, EIFR
+#define ISC21	5
+#define ISC20	4
+#define INT6	6
+#define INT2	2
+#define INTF6	6
+#define INTF2	2
+// PCICR, PCMSK0, PCIFR
+#define PCIE0	0
+#define PCINT7	7
+#define PCIF0	0
+// timers
+#define CS02	2
+#define CS01	1
+#define CS00	0
+#define TOIE0	0
+#define TOV0	0
+#define WGM12	3
+#define CS12	2
+#define CS11	1
+#define CS10	0
+#define OCIE1A	1
+#define TOIE1	0
+#define OCF1A	1
+#define TOV1	0
+// SMCR, power reduction
+#define SM2	3
+#define SM1	2
+#define SM0	1
+#define SE	0
+#define PRTWI	7
+#define PRTIM0	5
+#define PRTIM1	3
+#define PRSPI	2
+#define PRADC	0
+#define PRUSB	7
+#define PRTIM4	4
+#define PRTIM3	3
+#define PRUSART1 0
+// USB
+#define PLOCK	0
+#define PLLE	1
+#define USBE	7
+#define FRZCLK	5
+#define OTGPADE	4
+#define VBUSTI	0
+#define UPRSMI	6
+#define EORSMI	5
+#define WAKEUPI	4
+#define EORSTI	3
+#define SOFI	2
+#define SUSPI	0
+#define UPRSME	6
+#define EORSME	5
+#define WAKEUPE	4
+#define EORSTE	3
+#define SOFE	2
+#define SUSPE	0
+#define RMWKUP	1
+#define DETACH	0
+#define ADDEN	7
+#define STALLRQ	5
+#define STALLRQC 4
+#define RSTDT	3
+#define EPEN	0
+#define FIFOCON	7
+#define NAKINI	6
+#define RWAL	5
+#define RXSTPI	3
+#define RXOUTI	2
+#define TXINI	0
+#define RXSTPE	3
+#define RXOUTE	2
+#define TXINE	0
+
+#define RAMEND	0x0AFF
+
+// interrupt vectors become plain functions that the host code can call
+#define ISR(vector) void vector(void); void vector(void)
+
+#endif //HOST_AVR_IO_H
@@ -0,0 +1,19 @@
+// sleep.h (host)
+
+#ifndef HOST_AVR_SLEEP_H
+#define HOST_AVR_SLEEP_H
+
+#include <avr/io.h>
+
+#define SLEEP_MODE_IDLE		(0)
+#define SLEEP_MODE_PWR_DOWN	(1 << SM1)
+#define SLEEP_MODE_PWR_SAVE	((1 << SM1) | (1 << SM0))
+#define SLEEP_MODE_STANDBY	((1 << SM2) | (1 << SM1))
+
+#define set_sleep_mode(mode) (SMCR = (SMCR & ~((1 << SM2) | (1 << SM1) | (1 << SM0))) | (mode))
+#define sleep_enable() (SMCR |= (1 << SE))
+#define sleep_disable() (SMCR &= ~(1 << SE))
+// nothing to wait for on the host, simulated interrupts happen as time moves
+#define sleep_cpu() do { } while (0)
+
+#endif //HOST_AVR_SLEEP_H
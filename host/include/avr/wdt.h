@@ -0,0 +1,11 @@
+// wdt.h (host)
+
+#ifndef HOST_AVR_WDT_H
+#define HOST_AVR_WDT_H
+
+#include <avr/io.h>
+
+// there's no watchdog counter to clear
+#define wdt_reset() do { } while (0)
+
+#endif //HOST_AVR_WDT_H
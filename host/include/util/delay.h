@@ -0,0 +1,13 @@
+// delay.h (host)
+//
+// Delays advance the simulated clock instead of spinning
+
+#ifndef HOST_UTIL_DELAY_H
+#define HOST_UTIL_DELAY_H
+
+void host_advance_us(double us);
+
+static inline void _delay_us(double us) { host_advance_us(us); }
+static inline void _delay_ms(double ms) { host_advance_us(ms * 1000); }
+
+#endif //HOST_UTIL_DELAY_H
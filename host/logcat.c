@@ -0,0 +1,433 @@
+// logcat.c
+//
+// The host side of LOG() (see log.h): builds the dictionary of format
+//  strings from the firmware's sources, and renders the debug output with
+//  it.  Text from print() passes through as it is.
+//
+// usage: logcat -x file.c ... > example.logdict
+//        logcat [-s] example.logdict [in]
+//   -x  print the id and format of every LOG() in the files, one per line;
+//       fails if two different formats get the same id
+//   -s  when the input ends, compare its size with the text it stands for
+//   in  the debug output, e.g. the debug interface's /dev/hidrawN;
+//       default stdin
+//
+// The firmware's make builds the dictionary along with the hex (make
+//  logdict).
+
+#include "../log.h"
+
+#include <ctype.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// ----------------------------------------------------------------------------
+
+#define LOGCAT_MAX_FORMATS 1024
+#define LOGCAT_MAX_FORMAT  256
+
+typedef struct {
+	uint16_t id;
+	char fmt[LOGCAT_MAX_FORMAT];	// with its escapes resolved
+	char where[64];
+} logcat_format_t;
+
+// ----------------------------------------------------------------------------
+
+static logcat_format_t sFormats[LOGCAT_MAX_FORMATS];
+static int sNumFormats;
+
+// -s: what the messages took, and what the same output costs as text
+static unsigned long sInBytes, sTextBytes, sPlainBytes, sMessages, sMessageBytes, sUnknown;
+
+// ----------------------------------------------------------------------------
+
+// The same id LOG_ID() folds at compile time
+static uint16_t _hash(const char *fmt)
+{
+	uint16_t h = 5381;
+	size_t len = strlen(fmt), i;
+
+	for (i=0; i<LOG_HASH_LEN; i++)
+		h = (uint16_t)(h * 33u) ^ (i < len ? (uint8_t)fmt[i] : 0);
+	return h;
+}
+
+static logcat_format_t *_find(uint16_t id)
+{
+	int i;
+
+	for (i=0; i<sNumFormats; i++)
+	{
+		if (sFormats[i].id == id)
+			return &sFormats[i];
+	}
+	return NULL;
+}
+
+// A C string literal's body, from just after its opening quote; returns
+//  where it ends, just after the closing quote
+static const char *_literal(const char *p, char *out, size_t *len)
+{
+	int v, n;
+
+	while (*p && *p != '"')
+	{
+		if (*p != '\\')
+		{
+			if (*len < LOGCAT_MAX_FORMAT - 1)
+				out[(*len)++] = *p;
+			p++;
+			continue;
+		}
+		p++;
+		switch (*p)
+		{
+			case 'n': v = '\n'; p++; break;
+			case 't': v = '\t'; p++; break;
+			case 'r': v = '\r'; p++; break;
+			case 'x':
+				sscanf(p + 1, "%2x%n", &v, &n);
+				p += 1 + n;
+				break;
+			case '\0': v = 0; break;
+			default:
+				if (*p >= '0' && *p <= '7')
+				{
+					for (v=0, n=0; n<3 && *p >= '0' && *p <= '7'; n++)
+						v = v * 8 + *p++ - '0';
+				}
+				else
+					v = *p++;
+				break;
+		}
+		if (*len < LOGCAT_MAX_FORMAT - 1)
+			out[(*len)++] = v;
+	}
+	out[*len] = 0;
+	return *p ? p + 1 : p;
+}
+
+// Every LOG("...") in the file outside comments and strings
+static int _extract(const char *path)
+{
+	FILE *f = fopen(path, "r");
+	char *src, *p, fmt[LOGCAT_MAX_FORMAT];
+	long size;
+	int line = 1, status = 0;
+	size_t len;
+	logcat_format_t *known;
+
+	if (!f)
+	{
+		perror(path);
+		return 1;
+	}
+	fseek(f, 0, SEEK_END);
+	size = ftell(f);
+	rewind(f);
+	src = calloc(1, size + 1);
+	if (fread(src, 1, size, f) != (size_t)size)
+		size = 0;
+	fclose(f);
+
+	for (p=src; *p; )
+	{
+		if (*p == '\n')
+			line++, p++;
+		else if (p[0] == '/' && p[1] == '/')
+			p += strcspn(p, "\n");
+		else if (p[0] == '/' && p[1] == '*')
+		{
+			for (p+=2; *p && !(p[0] == '*' && p[1] == '/'); p++)
+				line += *p == '\n';
+			p += *p ? 2 : 0;
+		}
+		else if (*p == '"' || *p == '\'')
+		{
+			char quote = *p++;
+
+			for (; *p && *p != quote && *p != '\n'; p++)
+				p += p[0] == '\\' && p[1];
+			p += *p == quote;
+		}
+		else if (isalpha((unsigned char)*p) || *p == '_')
+		{
+			char *word = p;
+
+			while (isalnum((unsigned char)*p) || *p == '_')
+				p++;
+			if (p - word != 3 || strncmp(word, "LOG", 3))
+				continue;
+			while (isspace((unsigned char)*p))
+				line += *p++ == '\n';
+			if (*p != '(')
+				continue;
+			p++;
+			// the literal, and any that follow it straight on
+			len = 0;
+			for (;;)
+			{
+				while (isspace((unsigned char)*p))
+					line += *p++ == '\n';
+				if (*p != '"')
+					break;
+				p = (char *)_literal(p + 1, fmt, &len);
+			}
+			if (!len)
+				continue;
+
+			known = _find(_hash(fmt));
+			if (known && strcmp(known->fmt, fmt))
+			{
+				fprintf(stderr, "%s:%d: id %04X already taken by %s\n",
+				        path, line, known->id, known->where);
+				status = 1;
+			}
+			else if (!known && sNumFormats < LOGCAT_MAX_FORMATS)
+			{
+				known = &sFormats[sNumFormats++];
+				known->id = _hash(fmt);
+				strcpy(known->fmt, fmt);
+				snprintf(known->where, sizeof(known->where), "%s:%d", path, line);
+			}
+		}
+		else
+			p++;
+	}
+	free(src);
+	return status;
+}
+
+// One line per format: the id, then the format as a C string literal
+static void _write_dictionary(void)
+{
+	const char *c;
+	int i;
+
+	for (i=0; i<sNumFormats; i++)
+	{
+		printf("%04X \"", sFormats[i].id);
+		for (c=sFormats[i].fmt; *c; c++)
+		{
+			if (*c == '\n')
+				printf("\\n");
+			else if (*c == '"' || *c == '\\')
+				printf("\\%c", *c);
+			else if ((unsigned char)*c < ' ' || (unsigned char)*c > '~')
+				printf("\\x%02x", (unsigned char)*c);
+			else
+				putchar(*c);
+		}
+		printf("\"\n");
+	}
+}
+
+static int _read_dictionary(const char *path)
+{
+	FILE *f = fopen(path, "r");
+	char line[2 * LOGCAT_MAX_FORMAT], *q;
+	unsigned id;
+	size_t len;
+	logcat_format_t *entry;
+
+	if (!f)
+	{
+		perror(path);
+		return 1;
+	}
+	while (fgets(line, sizeof(line), f) && sNumFormats < LOGCAT_MAX_FORMATS)
+	{
+		if (sscanf(line, "%4x", &id) != 1 || !(q = strchr(line, '"')))
+			continue;
+		entry = &sFormats[sNumFormats++];
+		entry->id = id;
+		len = 0;
+		_literal(q + 1, entry->fmt, &len);
+	}
+	fclose(f);
+	return 0;
+}
+
+// ----------------------------------------------------------------------------
+
+// What the format wants for arguments, in bytes
+static int _argument_bytes(const char *fmt)
+{
+	int bytes = 0;
+
+	for (; *fmt; fmt++)
+	{
+		if (*fmt != '%')
+			continue;
+		fmt++;
+		while (*fmt >= '0' && *fmt <= '9')
+			fmt++;
+		if (*fmt == 'l')
+			bytes += 4, fmt++;
+		else if (*fmt && *fmt != '%')
+			bytes += 2;
+		if (!*fmt)
+			break;
+	}
+	return bytes;
+}
+
+// The text the firmware would have sent for one message, as log_text()
+//  makes it
+static void _render(const char *fmt, const uint8_t *args)
+{
+	char spec[16];
+	uint32_t value;
+	int width, wide;
+
+	for (; *fmt; fmt++)
+	{
+		if (*fmt != '%')
+		{
+			putchar(*fmt);
+			sTextBytes += *fmt == '\n' ? 2 : 1;
+			continue;
+		}
+		fmt++;
+		width = 0;
+		while (*fmt >= '0' && *fmt <= '9')
+			width = width * 10 + *fmt++ - '0';
+		wide = *fmt == 'l';
+		fmt += wide;
+		if (*fmt == '%' || !*fmt)
+		{
+			putchar('%');
+			sTextBytes++;
+			if (!*fmt)
+				break;
+			continue;
+		}
+
+		value = args[0] | (args[1] << 8);
+		if (wide)
+			value |= (uint32_t)args[2] << 16 | (uint32_t)args[3] << 24;
+		args += wide ? 4 : 2;
+		if (*fmt == 'd' && !wide)
+			value = (int16_t)value;
+
+		snprintf(spec, sizeof(spec), "%%0%d%s", width, *fmt == 'd' ? "d" : *fmt == 'u' ? "u" : *fmt == 'x' ? "x" : "X");
+		sTextBytes += printf(spec, *fmt == 'd' ? (int)(int32_t)value : (unsigned)value);
+	}
+}
+
+static void _message(uint16_t id, const uint8_t *args, uint8_t n)
+{
+	logcat_format_t *entry = _find(id);
+
+	sMessages++;
+	sMessageBytes += 3 + n;
+	if (!entry)
+	{
+		printf("<log %04X: %u bytes>\n", id, n);
+		sUnknown++;
+	}
+	else if (_argument_bytes(entry->fmt) != n)
+	{
+		printf("<log %04X: %u bytes for \"%s\">\n", id, n, entry->fmt);
+		sUnknown++;
+	}
+	else
+		_render(entry->fmt, args);
+}
+
+// Text and messages, a byte at a time, so messages can span reads
+static void _stream(int fd)
+{
+	uint8_t buf[256], frame[3 + 0x7F];
+	int got, i, have = 0, want = 0;
+
+	while ((got = read(fd, buf, sizeof(buf))) > 0)
+	{
+		sInBytes += got;
+		for (i=0; i<got; i++)
+		{
+			if (want)
+			{
+				frame[have++] = buf[i];
+				if (have == want)
+				{
+					_message(frame[1] | (frame[2] << 8), frame + 3, want - 3);
+					want = 0;
+				}
+			}
+			else if (buf[i] & LOG_FRAME)
+			{
+				frame[0] = buf[i];
+				have = 1;
+				want = 3 + (buf[i] & ~LOG_FRAME);
+			}
+			else if (buf[i] && buf[i] != '\r')
+			{
+				putchar(buf[i]);
+				sPlainBytes += buf[i] == '\n' ? 2 : 1;
+			}
+		}
+		fflush(stdout);
+	}
+}
+
+static void _stats(void)
+{
+	fprintf(stderr, "%lu messages in %lu bytes, %lu unknown; as text %lu bytes, %.1f times as many\n",
+	        sMessages, sMessageBytes, sUnknown, sTextBytes,
+	        sMessageBytes ? (double)sTextBytes / sMessageBytes : 0.0);
+	if (sPlainBytes)
+		fprintf(stderr, "  and %lu bytes of plain text\n", sPlainBytes);
+}
+
+// ----------------------------------------------------------------------------
+
+static void _usage(void)
+{
+	fprintf(stderr, "usage: logcat -x file.c ... > dictionary\n"
+	                "       logcat [-s] dictionary [in]\n");
+	exit(2);
+}
+
+int main(int argc, char **argv)
+{
+	int c, status = 0, stats = 0, extract = 0, fd = 0;
+
+	while ((c = getopt(argc, argv, "xs")) != -1)
+	{
+		switch (c)
+		{
+			case 'x': extract = 1; break;
+			case 's': stats = 1; break;
+			default: _usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+
+	if (extract)
+	{
+		for (; argc; argc--, argv++)
+			status |= _extract(*argv);
+		_write_dictionary();
+		return status;
+	}
+
+	if (argc < 1 || argc > 2)
+		_usage();
+	if (_read_dictionary(argv[0]))
+		return 2;
+	if (argc == 2 && (fd = open(argv[1], O_RDONLY)) < 0)
+	{
+		perror(argv[1]);
+		return 2;
+	}
+	_stream(fd);
+	if (stats)
+		_stats();
+	return 0;
+}
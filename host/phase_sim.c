@@ -0,0 +1,141 @@
+// phase_sim.c
+//
+// The main loop's frames against the host's (phase.h): the simulated
+//  N35P112 as in bus_sim converts every 20 ms on its own clock, the host
+//  sends a SOF every millisecond on its clock, a little off from ours, and
+//  the main loop reads the stick and sends a report each frame, after
+//  kLoopWorkUs of the rest of its work.  A report that isn't in the
+//  endpoint by the SOF waits for the next one.
+//
+// At the end it prints the phase histograms and the sample age, and with
+//  the lock on fails if a sample was older than the lock allows.
+//
+// usage: phase_sim [-u] [-d ppm] [seconds] [seed]
+//
+// -u runs with the lock off, frames by timer0 like before, for comparison
+
+#include "host.h"
+#include "sim_n35p112.h"
+#include "../controller/teensy-2-0.h"
+#include "../controller/n35p112.h"
+#include "../twi/twi_sched.h"
+#include "../twi/twi_tune.h"
+#include "../phase.h"
+
+#include <avr/io.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+// ----------------------------------------------------------------------------
+
+#define SENSOR_PERIOD_US 20000
+
+// The matrix pass and the keyboard report, before the stick's turn
+const uint32_t kLoopWorkUs = 150;
+
+// Interrupt to SOF, at worst with the lock on: a sample read just too late
+//  for a frame waits a whole one, plus the lead, plus the read itself
+const uint32_t kMaxLockedAgeUs = 1000 + PHASE_LEAD_US + 400;
+
+// ----------------------------------------------------------------------------
+
+void INT2_vect(void);
+
+static sim_n35p112_t sStick;
+static uint32_t sNextConversionUs;
+static const twi_tune_probe_t kProbes[] = { n35p112_probe };
+
+// ----------------------------------------------------------------------------
+
+// Interrupt sources, checked whenever simulated time moves
+static void _events(void)
+{
+	if (host_now_us() >= sNextConversionUs)
+	{
+		sNextConversionUs += SENSOR_PERIOD_US + rand() % 201 - 100;
+		sim_n35p112_convert(&sStick, rand() % 255 - 127, rand() % 255 - 127);
+	}
+	// INT2 is level triggered
+	if (sStick.interrupt && (EIMSK & (1 << INT2)) && (SREG & 0x80))
+		INT2_vect();
+}
+
+static void _histogram(const char *name, const uint16_t *bins, uint16_t binUs)
+{
+	uint8_t i;
+
+	printf("%-10s", name);
+	for (i=0; i<PHASE_BINS; i++)
+		printf(" %4u:%-5u", i * binUs, bins[i]);
+	printf("\n");
+}
+
+int main(int argc, char **argv)
+{
+	uint32_t seconds, endUs, workUs;
+	uint8_t thisFrame, prevFrame;
+	int ppm = 50;
+	int c, lock = 1;
+	const phase_stats_t *stats;
+
+	while ((c = getopt(argc, argv, "ud:")) != -1)
+	{
+		switch (c)
+		{
+			case 'u': lock = 0; break;
+			case 'd': ppm = atoi(optarg); break;
+			default:
+				fprintf(stderr, "usage: phase_sim [-u] [-d ppm] [seconds] [seed]\n");
+				return 2;
+		}
+	}
+	seconds = optind < argc ? atoi(argv[optind]) : 10;
+	srand(optind + 1 < argc ? atoi(argv[optind + 1]) : 1);
+
+	sim_n35p112_init(&sStick, N35P112_TWI_ADDRESS);
+	teensy_init();
+	n35p112_init();
+	twi_tune_calibrate(kProbes, sizeof(kProbes) / sizeof(kProbes[0]));
+	teensy_configure_interrupts();
+	n35p112_calibrate();
+
+	phase_set_lock(lock);
+	host_usb_set_sof(host_now_us() + rand() % 1000, ppm);
+	sNextConversionUs = host_now_us() + rand() % SENSOR_PERIOD_US;
+	host_set_event_hook(_events);
+
+	endUs = host_now_us() + seconds * 1000000;
+	prevFrame = phase_frame();
+	while (host_now_us() < endUs)
+	{
+		if (!twi_sched_run())
+			host_advance_us(4);
+
+		thisFrame = phase_frame();
+		if (thisFrame == prevFrame)
+			continue;
+		prevFrame = thisFrame;
+
+		// like the main loop in example.c, with the gamepad's report every
+		//  frame; the stick's interrupt can come in the middle of the work
+		for (workUs=0; workUs<kLoopWorkUs; workUs+=4)
+			host_advance_us(4);
+		if (n35p112_update() == N35P112_SAMPLE)
+			phase_sample(n35p112_get_sample_us());
+		phase_report();
+	}
+
+	stats = phase_get_stats();
+	printf("lock %s, host clock %+d ppm\n", lock ? "on" : "off", ppm);
+	_histogram("conversion", stats->conversion, PHASE_BIN_US);
+	_histogram("frame", stats->frame, PHASE_BIN_US);
+	_histogram("age", stats->age, PHASE_AGE_BIN_US);
+	printf("sample age us min/mean/max %u/%u/%u over %u samples\n",
+	       stats->ageMinUs, stats->ageCount ? (uint32_t)(stats->ageTotalUs / stats->ageCount) : 0,
+	       stats->ageMaxUs, stats->ageCount);
+
+	if (!stats->ageCount || (lock && stats->ageMaxUs > kMaxLockedAgeUs))
+		return 1;
+	return 0;
+}
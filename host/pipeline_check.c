@@ -0,0 +1,162 @@
+// pipeline_check.c
+//
+// The pointer pipeline's deadzone and curve (../mouse/pipeline.h) for
+//  rotational symmetry: fixed radii fed through pipeline_run() at angles
+//  all the way round, for every deadzone n35p112.c can set.
+//
+// - symmetry: the output's magnitude may only differ from what the gain
+//   table gives the exact input magnitude by what fixed_hypot8()'s error
+//   bound lets the table lookup pick instead, plus rounding each axis to
+//   whole counts.  Prints the worst excess over that and fails if there
+//   is any.  The bound goes through the table, not a number of counts,
+//   because the curve has steps: at a step's edge a 2 count error in the
+//   estimate is a jump in the output, and the same at any angle.
+// - deadzone: every input on or inside the deadzone circle, at any angle,
+//   has to come out as exactly 0 on both axes.
+//
+// It builds the stages pipeline_config.h has by default, with no offset.
+//
+// usage: pipeline_check [steps per turn]
+
+#include "../mouse/pipeline.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+// ----------------------------------------------------------------------------
+
+// What _set_deadzone() in n35p112.c clamps the radius to
+const uint8_t kMinRadius = 3;
+const uint8_t kMaxRadius = 30;
+
+// fixed_hypot8()'s error bound, see fixed.h and host/fixed_check
+const double kHypotRelative = 0.013;
+const double kHypotCounts = 2.0;
+
+// Each axis rounded to whole counts
+const double kRoundCounts = 0.7072;
+
+// ----------------------------------------------------------------------------
+
+// static data
+static unsigned long sSteps = 1440;
+static int sFailed = 0;
+
+// ----------------------------------------------------------------------------
+
+static double _magnitude(const pipeline_t *p)
+{
+	return hypot(p->x, p->y);
+}
+
+static void _run(pipeline_t *p, pipeline_state_t *state, int x, int y)
+{
+	p->x = x;
+	p->y = y;
+	pipeline_run(p, state);
+}
+
+// The output magnitude for an input of magnitude h, over every estimate of
+//  it the hypot bound allows
+static void _envelope(const pipeline_state_t *state, double h, double *lo, double *hi)
+{
+	long m, from, to;
+	double out;
+
+	from = (long)ceil(h - kHypotRelative * h - kHypotCounts);
+	to = (long)floor(h + kHypotRelative * h + kHypotCounts);
+	if (from < 0)
+		from = 0;
+	if (to > 255)
+		to = 255;
+	*lo = 1e9;
+	*hi = 0;
+	for (m=from; m<=to; m++)
+	{
+		out = h * state->gain[m >> 1] / 256;
+		if (out < *lo)
+			*lo = out;
+		if (out > *hi)
+			*hi = out;
+	}
+}
+
+static void _symmetry(void)
+{
+	pipeline_state_t state;
+	pipeline_t p;
+	unsigned long i, cases = 0;
+	double angle, h, out, lo, hi, excess, worst = 0;
+	int radius, r, x, y;
+
+	for (radius=kMinRadius; radius<=kMaxRadius; radius++)
+	{
+		pipeline_init(&state);
+		pipeline_build_gain(&state, radius);
+		for (r=radius + 1; r<=127; r++)
+		{
+			for (i=0; i<sSteps; i++)
+			{
+				angle = 2 * M_PI * i / sSteps;
+				x = lround(r * cos(angle));
+				y = lround(r * sin(angle));
+				_run(&p, &state, x, y);
+				out = _magnitude(&p);
+				h = hypot(x, y);
+				_envelope(&state, h, &lo, &hi);
+				excess = fmax(lo - kRoundCounts - out, out - hi - kRoundCounts);
+				if (excess > worst)
+					worst = excess;
+				cases++;
+			}
+		}
+	}
+	printf("symmetry %10lu cases, worst excess %8.4f, limit %8.4f %s\n",
+	       cases, worst, 0.0, worst > 0 ? "FAIL" : "");
+	if (worst > 0)
+		sFailed = 1;
+}
+
+static void _deadzone(void)
+{
+	pipeline_state_t state;
+	pipeline_t p;
+	unsigned long cases = 0, moved = 0;
+	int radius, x, y;
+
+	for (radius=kMinRadius; radius<=kMaxRadius; radius++)
+	{
+		pipeline_init(&state);
+		pipeline_build_gain(&state, radius);
+		for (x=-radius; x<=radius; x++)
+		{
+			for (y=-radius; y<=radius; y++)
+			{
+				if (x * x + y * y > radius * radius)
+					continue;
+				_run(&p, &state, x, y);
+				if (p.x || p.y)
+				{
+					if (!moved)
+						printf("deadzone %d: %d %d gives %d %d\n", radius, x, y, p.x, p.y);
+					moved++;
+				}
+				cases++;
+			}
+		}
+	}
+	printf("deadzone %10lu cases, %lu moved %s\n", cases, moved, moved ? "FAIL" : "");
+	if (moved)
+		sFailed = 1;
+}
+
+int main(int argc, char **argv)
+{
+	if (argc > 1)
+		sSteps = strtoul(argv[1], NULL, 0);
+
+	_symmetry();
+	_deadzone();
+	return sFailed;
+}
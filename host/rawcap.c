@@ -0,0 +1,350 @@
+// rawcap.c
+//
+// Reads the vendor bulk endpoint of a firmware built with USB_CAPTURE (see
+//  capture.h), writes the records it gets to a file as they came, and
+//  reports the throughput it saw and how many records were dropped on the
+//  way (gaps in the sequence numbers).
+//
+// Built two ways:
+//   rawcap      runs the firmware's stick, expander and bus code against
+//               the simulated parts, with a simulated host that reads up to
+//               -p packets per 1 ms frame, spread over the frame.  Time is
+//               simulated time.
+//   rawcap_usb  talks to the device with libusb (make rawcap_usb, needs
+//               libusb-1.0).  Time is wall clock time.
+//
+// usage: rawcap [-t seconds] [-f flags] [-p packets] out.bin
+//        rawcap -d in.bin
+//   -t seconds  how long to capture, default 10
+//   -f flags    CAPTURE_FLAG_* bits, default 3 (samples and bus jobs);
+//               8 alone fills the endpoint to measure its throughput
+//   -p packets  simulated host only: packets it reads per frame, default 8
+//   -d          print the records in a capture file instead
+//
+// The file is just the records, 8 bytes each, little endian.  A run of 256
+//  or more drops in a row looks like fewer; the firmware's own count is in
+//  its debug output ("capture records ... drop ...").
+
+#include "../capture.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifdef CAPTURE_LIBUSB
+#include <libusb.h>
+#include <time.h>
+#else
+#include "host.h"
+#include "sim_n35p112.h"
+#include "sim_mcp23018.h"
+#include "../controller/teensy-2-0.h"
+#include "../controller/n35p112.h"
+#include "../controller/mcp23018.h"
+#include "../twi/twi_sched.h"
+#include "../twi/twi_tune.h"
+
+#include <avr/io.h>
+#endif
+
+// ----------------------------------------------------------------------------
+
+#define RAWCAP_VENDOR_ID   0x16C0
+#define RAWCAP_PRODUCT_ID  0x047F
+#define RAWCAP_RECORD_SIZE 8
+#define RAWCAP_TRANSFERS   8
+#define RAWCAP_TRANSFER_SIZE (16 * CAPTURE_PACKET_SIZE)
+
+// ----------------------------------------------------------------------------
+
+static const char *kTypeNames[] = { "?", "sample", "twi", "fill" };
+
+static FILE *sOut;
+static uint64_t sBytes;
+static uint64_t sRecords;
+static uint64_t sTypes[4];
+static uint64_t sDrops;
+static int sLastSeq = -1;
+
+// ----------------------------------------------------------------------------
+
+// Everything that comes off the endpoint goes through here
+static void _sink(const uint8_t *data, uint32_t len)
+{
+	uint32_t i;
+
+	fwrite(data, 1, len, sOut);
+	sBytes += len;
+	for (i=0; i+RAWCAP_RECORD_SIZE<=len; i+=RAWCAP_RECORD_SIZE)
+	{
+		sRecords++;
+		sTypes[data[i] < 4 ? data[i] : 0]++;
+		if (sLastSeq >= 0)
+			sDrops += (uint8_t)(data[i + 1] - sLastSeq - 1);
+		sLastSeq = data[i + 1];
+	}
+}
+
+static void _report(double seconds)
+{
+	uint32_t i;
+
+	printf("%.2f s: %llu bytes, %llu records, %.0f bytes/s, %.0f records/s, %llu dropped\n",
+	       seconds, (unsigned long long)sBytes, (unsigned long long)sRecords,
+	       sBytes / seconds, sRecords / seconds, (unsigned long long)sDrops);
+	for (i=1; i<4; i++)
+	{
+		if (sTypes[i])
+			printf("  %s %llu\n", kTypeNames[i], (unsigned long long)sTypes[i]);
+	}
+	if (sTypes[0])
+		printf("  unknown %llu\n", (unsigned long long)sTypes[0]);
+}
+
+static int _dump(const char *path)
+{
+	FILE *f = fopen(path, "rb");
+	uint8_t r[RAWCAP_RECORD_SIZE];
+	uint16_t us;
+
+	if (!f)
+	{
+		perror(path);
+		return 2;
+	}
+	while (fread(r, 1, sizeof(r), f) == sizeof(r))
+	{
+		us = r[2] | (r[3] << 8);
+		printf("%3u %5u ", r[1], us);
+		switch (r[0])
+		{
+			case CAPTURE_RECORD_SAMPLE:
+				printf("sample x %d y %d%s\n", (int8_t)r[4], (int8_t)r[5], r[6] ? " polled" : "");
+				break;
+			case CAPTURE_RECORD_TWI:
+				printf("twi dev %u err %u bus %u us\n", r[4], r[5], r[6] | (r[7] << 8));
+				break;
+			case CAPTURE_RECORD_FILL:
+				printf("fill %u\n", r[4] | (r[5] << 8) | (r[6] << 16) | ((uint32_t)r[7] << 24));
+				break;
+			default:
+				printf("type %u\n", r[0]);
+				break;
+		}
+	}
+	fclose(f);
+	return 0;
+}
+
+#ifdef CAPTURE_LIBUSB
+
+static int sActive = 0;
+
+static void LIBUSB_CALL _transfer_done(struct libusb_transfer *transfer)
+{
+	if (transfer->status == LIBUSB_TRANSFER_COMPLETED ||
+	    transfer->status == LIBUSB_TRANSFER_TIMED_OUT)
+	{
+		_sink(transfer->buffer, transfer->actual_length);
+		if (libusb_submit_transfer(transfer) == 0)
+			return;
+	}
+	sActive--;
+}
+
+// Several transfers are kept queued, so the host always has one waiting
+//  when the device has a packet
+static int _capture(uint8_t flags, uint32_t seconds, uint8_t maxPackets, double *elapsed)
+{
+	libusb_context *ctx;
+	libusb_device_handle *dev;
+	struct libusb_transfer *transfers[RAWCAP_TRANSFERS];
+	static uint8_t buffers[RAWCAP_TRANSFERS][RAWCAP_TRANSFER_SIZE];
+	struct timespec t0, t1;
+	struct timeval tv = { 0, 100000 };
+	int i, err;
+
+	(void)maxPackets;
+	if ((err = libusb_init(&ctx)))
+	{
+		fprintf(stderr, "libusb_init: %s\n", libusb_error_name(err));
+		return 2;
+	}
+	dev = libusb_open_device_with_vid_pid(ctx, RAWCAP_VENDOR_ID, RAWCAP_PRODUCT_ID);
+	if (!dev)
+	{
+		fprintf(stderr, "no device %04x:%04x\n", RAWCAP_VENDOR_ID, RAWCAP_PRODUCT_ID);
+		libusb_exit(ctx);
+		return 2;
+	}
+	if ((err = libusb_claim_interface(dev, CAPTURE_INTERFACE)))
+	{
+		fprintf(stderr, "claim interface %d: %s (built without USB_CAPTURE?)\n",
+		        CAPTURE_INTERFACE, libusb_error_name(err));
+		libusb_close(dev);
+		libusb_exit(ctx);
+		return 2;
+	}
+
+	for (i=0; i<RAWCAP_TRANSFERS; i++)
+	{
+		transfers[i] = libusb_alloc_transfer(0);
+		libusb_fill_bulk_transfer(transfers[i], dev, CAPTURE_ENDPOINT | LIBUSB_ENDPOINT_IN,
+		                          buffers[i], sizeof(buffers[i]), _transfer_done, NULL, 100);
+		if (libusb_submit_transfer(transfers[i]) == 0)
+			sActive++;
+	}
+	err = libusb_control_transfer(dev, LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_INTERFACE,
+	                              CAPTURE_REQUEST_START, flags, CAPTURE_INTERFACE, NULL, 0, 1000);
+	if (err < 0)
+		fprintf(stderr, "start: %s\n", libusb_error_name(err));
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	do
+	{
+		libusb_handle_events_timeout(ctx, &tv);
+		clock_gettime(CLOCK_MONOTONIC, &t1);
+		*elapsed = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) * 1e-9;
+	} while (sActive && *elapsed < seconds);
+
+	libusb_control_transfer(dev, LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_INTERFACE,
+	                        CAPTURE_REQUEST_START, 0, CAPTURE_INTERFACE, NULL, 0, 1000);
+	for (i=0; i<RAWCAP_TRANSFERS; i++)
+		libusb_cancel_transfer(transfers[i]);
+	while (sActive)
+		libusb_handle_events_timeout(ctx, &tv);
+	for (i=0; i<RAWCAP_TRANSFERS; i++)
+		libusb_free_transfer(transfers[i]);
+
+	libusb_release_interface(dev, CAPTURE_INTERFACE);
+	libusb_close(dev);
+	libusb_exit(ctx);
+	return 0;
+}
+
+#else
+
+#define SENSOR_PERIOD_US 20000
+
+void INT2_vect(void);
+
+static sim_n35p112_t sStick;
+static sim_mcp23018_t sExpander;
+static uint32_t sNextConversionUs;
+static int sStickX, sStickY;
+static const twi_tune_probe_t kProbes[] = { n35p112_probe, mcp23018_probe };
+
+// The stick wanders about and converts every 20 ms or so, keys go up and
+//  down at random
+static void _events(void)
+{
+	if (host_now_us() >= sNextConversionUs)
+	{
+		sNextConversionUs += SENSOR_PERIOD_US + rand() % 201 - 100;
+		sStickX += rand() % 21 - 10;
+		sStickY += rand() % 21 - 10;
+		sStickX = sStickX > 127 ? 127 : sStickX < -127 ? -127 : sStickX;
+		sStickY = sStickY > 127 ? 127 : sStickY < -127 ? -127 : sStickY;
+		sim_n35p112_convert(&sStick, sStickX, sStickY);
+	}
+	if (sStick.interrupt && (EIMSK & (1 << INT2)) && (SREG & 0x80))
+		INT2_vect();
+}
+
+static void _packet(const uint8_t *data, uint8_t len)
+{
+	_sink(data, len);
+}
+
+// The main loop of example.c, less the USB reports, once per simulated ms.
+//  The host's reads are spread evenly over each frame.
+static int _capture(uint8_t flags, uint32_t seconds, uint8_t maxPackets, double *elapsed)
+{
+	uint32_t startUs, tickUs, nextReadUs;
+	uint32_t readUs = maxPackets ? 1000 / maxPackets : 1000000;
+
+	sim_n35p112_init(&sStick, N35P112_TWI_ADDRESS);
+	sim_mcp23018_init(&sExpander, 0x20 << 1);
+	PINB |= (1 << 7);
+	teensy_init();
+	n35p112_init();
+	mcp23018_init();
+	twi_tune_calibrate(kProbes, sizeof(kProbes) / sizeof(kProbes[0]));
+	teensy_configure_interrupts();
+	n35p112_calibrate();
+	sNextConversionUs = host_now_us() + rand() % SENSOR_PERIOD_US;
+	host_set_event_hook(_events);
+
+	host_usb_capture_start(flags);
+	startUs = host_now_us();
+	nextReadUs = startUs;
+	for (tickUs = startUs + 1000; tickUs - startUs <= seconds * 1000000; tickUs += 1000)
+	{
+		host_usb_capture_sof();
+		if (rand() % 50 == 0)
+			sim_mcp23018_set_key(&sExpander, rand() % 6, rand() % MCP23018_MATRIX_COLS, rand() & 1);
+		mcp23018_start_scan();
+		n35p112_update();
+		do
+		{
+			if (!twi_sched_run())
+				host_advance_us(4);
+			capture_fill();
+			// a read the host missed while the firmware was busy is gone,
+			//  like a NAKed IN token
+			for (; nextReadUs <= host_now_us(); nextReadUs += readUs)
+			{
+				if (nextReadUs + readUs > host_now_us())
+					host_usb_capture_take(_packet);
+			}
+		} while (host_now_us() < tickUs);
+	}
+	host_usb_capture_start(0);
+
+	*elapsed = (host_now_us() - startUs) * 1e-6;
+	capture_print_stats();
+	return 0;
+}
+
+#endif //CAPTURE_LIBUSB
+
+int main(int argc, char **argv)
+{
+	uint32_t seconds = 10;
+	uint8_t flags = CAPTURE_FLAG_SAMPLES | CAPTURE_FLAG_TWI, maxPackets = 8;
+	double elapsed = 0;
+	int opt, status;
+
+	while ((opt = getopt(argc, argv, "t:f:p:d")) != -1)
+	{
+		if (opt == 't')
+			seconds = atoi(optarg);
+		else if (opt == 'f')
+			flags = strtoul(optarg, NULL, 0);
+		else if (opt == 'p')
+			maxPackets = atoi(optarg);
+		else if (opt == 'd')
+			return optind < argc ? _dump(argv[optind]) : 2;
+		else
+			return 2;
+	}
+	if (optind >= argc || !flags)
+	{
+		fprintf(stderr, "usage: rawcap [-t seconds] [-f flags] [-p packets] out.bin\n"
+		                "       rawcap -d in.bin\n");
+		return 2;
+	}
+	sOut = fopen(argv[optind], "wb");
+	if (!sOut)
+	{
+		perror(argv[optind]);
+		return 2;
+	}
+
+	status = _capture(flags, seconds, maxPackets, &elapsed);
+	fclose(sOut);
+	if (!status && elapsed > 0)
+		_report(elapsed);
+	return status;
+}
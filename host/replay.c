@@ -0,0 +1,474 @@
+// replay.c
+//
+// Feeds a recorded trace of raw sensor conversions through the firmware's
+//  pointer code (the INT2 -> bus scheduler -> _joy_service() read, then
+//  n35p112_update() and the upsampler once per 1 ms frame, like the main
+//  loop) and compares the reports that come out with a golden file.
+//
+// usage: replay [-u] [-s] [-m mode] [-n repeat] [-c rest] trace [golden]
+//   -u         write the golden file instead of comparing against it
+//   -s         skip the golden file, only print the figures
+//   -m mode    upsampling mode: h(old), i(nterpolate) or e(xtrapolate)
+//   -n repeat  replay the trace this many times for the throughput figure
+//   -c rest    calibrate on this trace's conversions, a recording of the
+//              stick at rest, instead of a stick that reads 0 0 every time;
+//              the noise it measured and the deadzone it set are printed
+//
+// The golden file defaults to the trace's name with .golden in place of
+//  .trace.  Exit status is 1 if any report differs.
+//
+// The trace is then replayed once more in hold mode, which moves the pointer
+//  the way the firmware did before upsampling, and two figures compare the
+//  chosen mode with it:
+//   jerk  RMS change in speed from one 8 ms window to the next, in counts
+//         per window.  The eye sees about that often; lower is smoother.
+//   lag   delay of the pointer's path behind hold mode's, in ms, from a
+//         least squares fit of path(t) = hold(t - lag).
+//
+// Every release in the trace, a conversion back inside the chip's threshold
+//  window after one outside it, is timed too: how long after that conversion
+//  the pointer kept moving, and how far.
+
+#include "host.h"
+#include "sim_n35p112.h"
+#include "../controller/teensy-2-0.h"
+#include "../controller/n35p112.h"
+#include "../twi/twi_sched.h"
+#include "../mouse/upsample.h"
+
+#include <avr/io.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+// ----------------------------------------------------------------------------
+
+#define REPLAY_MAX_SAMPLES 4096
+#define REPLAY_MAX_REPORTS 16384
+#define REPLAY_MAX_FRAMES 65536
+#define REPLAY_SHOW_DIFFS 10
+
+// window for the jerk figure
+const uint32_t kJerkWindowMs = 8;
+// keep reporting for a while after the last sample, to see the stop
+const uint32_t kTailMs = 200;
+
+// ----------------------------------------------------------------------------
+
+typedef struct {
+	uint32_t t;
+	int8_t x, y;
+	uint8_t btn;
+	uint8_t raised;		// the conversion raised INT2
+} replay_sample_t;
+
+typedef struct {
+	uint32_t t;
+	int8_t x, y;
+	uint8_t btn;
+} replay_report_t;
+
+void INT2_vect(void);
+
+static sim_n35p112_t sStick;
+static replay_sample_t sSamples[REPLAY_MAX_SAMPLES];
+static uint32_t sNumSamples;
+static uint32_t sNextSample;
+static uint32_t sStartUs;
+static replay_report_t sReports[REPLAY_MAX_REPORTS];
+static uint32_t sNumReports;
+static int8_t sFrameX[REPLAY_MAX_FRAMES];
+static int8_t sFrameY[REPLAY_MAX_FRAMES];
+static uint32_t sNumFrames;
+static int8_t sRestX[REPLAY_MAX_SAMPLES];
+static int8_t sRestY[REPLAY_MAX_SAMPLES];
+static uint32_t sNumRest = 0;
+
+// ----------------------------------------------------------------------------
+
+static uint32_t _load(const char *path)
+{
+	FILE *f = fopen(path, "r");
+	char line[128];
+	int t, x, y, btn;
+
+	if (!f)
+	{
+		perror(path);
+		exit(2);
+	}
+	sNumSamples = 0;
+	while (fgets(line, sizeof(line), f) && sNumSamples < REPLAY_MAX_SAMPLES)
+	{
+		if (sscanf(line, "%d %d %d %d", &t, &x, &y, &btn) != 4)
+			continue;
+		sSamples[sNumSamples].t = t;
+		sSamples[sNumSamples].x = x;
+		sSamples[sNumSamples].y = y;
+		sSamples[sNumSamples].btn = btn;
+		sNumSamples++;
+	}
+	fclose(f);
+	return sNumSamples;
+}
+
+// Conversions land when the trace says, the button follows the trace, and
+//  INT2 fires like the level-triggered line it is
+static void _events(void)
+{
+	replay_sample_t *s;
+
+	while (sNextSample < sNumSamples &&
+	       host_now_us() - sStartUs >= sSamples[sNextSample].t * 1000)
+	{
+		s = &sSamples[sNextSample++];
+		s->raised = sim_n35p112_convert(&sStick, s->x, s->y);
+		if (s->btn)
+			PINB &=~ (1 << 7);
+		else
+			PINB |= (1 << 7);
+	}
+	if (sStick.interrupt && (EIMSK & (1 << INT2)) && (SREG & 0x80))
+		INT2_vect();
+}
+
+// Calibration as main() starts it, with the stick at rest converting every
+//  20 ms, served a tick at a time until it's done.  The rest trace, if
+//  there is one, goes round as often as it takes.
+static void _calibrate(void)
+{
+	uint32_t nextUs = host_now_us();
+	uint32_t i = 0;
+
+	n35p112_calibrate();
+	while (n35p112_calibrating())
+	{
+		if (host_now_us() >= nextUs)
+		{
+			nextUs += 20000;
+			if (sNumRest)
+				sim_n35p112_convert(&sStick, sRestX[i % sNumRest], sRestY[i % sNumRest]);
+			else
+				sim_n35p112_convert(&sStick, 0, 0);
+			i++;
+		}
+		if (sStick.interrupt && (EIMSK & (1 << INT2)) && (SREG & 0x80))
+			INT2_vect();
+		twi_sched_run();
+		n35p112_update();
+		host_advance_us(1000);
+	}
+}
+
+// What the calibration made of the rest trace
+static void _noise(const char *path)
+{
+	const n35p112_noise_t *noise = n35p112_get_noise();
+	int d;
+
+	printf("%s: rest noise over %u samples, sigma x %.2f y %.2f, window %d %d, deadzone %d\n",
+	       path, noise->samples, noise->sigmaX16 / 16.0, noise->sigmaY16 / 16.0,
+	       noise->halfX, noise->halfY, noise->radius);
+	printf("  deviation");
+	for (d=-N35P112_NOISE_SPAN; d<=N35P112_NOISE_SPAN; d++)
+		printf(" %3d", d);
+	printf("\n  x        ");
+	for (d=0; d<N35P112_NOISE_BINS; d++)
+		printf(" %3u", noise->x[d]);
+	printf("\n  y        ");
+	for (d=0; d<N35P112_NOISE_BINS; d++)
+		printf(" %3u", noise->y[d]);
+	printf("\n");
+}
+
+// The mouse half of the main loop in example.c, on the simulated clock.
+//  Every frame's movement is kept, and the reports that would have been
+//  sent (movement, or a button change) are listed.
+static void _run(void)
+{
+	uint32_t endMs, nowMs;
+	int8_t dx, dy;
+	uint8_t btn, prevBtn = n35p112_get_btn();
+
+	sNextSample = 0;
+	sNumReports = 0;
+	sNumFrames = 0;
+	upsample_reset();
+	sStartUs = host_now_us();
+	endMs = (sNumSamples ? sSamples[sNumSamples - 1].t : 0) + kTailMs;
+
+	for (nowMs = 1; nowMs <= endMs; nowMs++)
+	{
+		// serve the bus until the next tick
+		while (host_now_us() - sStartUs < nowMs * 1000)
+		{
+			if (!twi_sched_run())
+				host_advance_us(sStartUs + nowMs * 1000 - host_now_us());
+		}
+
+		switch (n35p112_update())
+		{
+			case N35P112_SAMPLE:
+				upsample_push(n35p112_get_x(), n35p112_get_y(), n35p112_get_sample_us());
+				break;
+			case N35P112_RELEASED:
+				upsample_release();
+				break;
+		}
+		upsample_frame(&dx, &dy);
+		btn = n35p112_get_btn();
+
+		if (sNumFrames < REPLAY_MAX_FRAMES)
+		{
+			sFrameX[sNumFrames] = dx;
+			sFrameY[sNumFrames] = dy;
+			sNumFrames++;
+		}
+		if ((dx || dy || btn != prevBtn) && sNumReports < REPLAY_MAX_REPORTS)
+		{
+			replay_report_t *r = &sReports[sNumReports++];
+			r->t = nowMs;
+			r->x = dx;
+			r->y = dy;
+			r->btn = btn;
+		}
+		prevBtn = btn;
+	}
+}
+
+// RMS change of speed between consecutive kJerkWindowMs windows
+static double _jerk(const int8_t *fx, const int8_t *fy, uint32_t n)
+{
+	uint32_t i, windows = 0;
+	int32_t wx = 0, wy = 0, px = 0, py = 0;
+	double sum = 0;
+
+	for (i=0; i<n; i++)
+	{
+		wx += fx[i];
+		wy += fy[i];
+		if ((i + 1) % kJerkWindowMs)
+			continue;
+		if (i + 1 > kJerkWindowMs)
+		{
+			sum += (double)(wx - px) * (wx - px) + (double)(wy - py) * (wy - py);
+			windows++;
+		}
+		px = wx;
+		py = wy;
+		wx = wy = 0;
+	}
+	return windows ? sqrt(sum / windows) : 0;
+}
+
+// Least squares delay of path p behind reference path r (both summed from
+//  per-frame movements): p(t) ~ r(t) - lag * r'(t)
+static double _lag(const int8_t *px, const int8_t *py, const int8_t *rx, const int8_t *ry, uint32_t n)
+{
+	uint32_t i;
+	int32_t pathX = 0, pathY = 0, refX = 0, refY = 0;
+	double num = 0, den = 0;
+
+	for (i=0; i<n; i++)
+	{
+		pathX += px[i];
+		pathY += py[i];
+		refX += rx[i];
+		refY += ry[i];
+		num += (double)(refX - pathX) * rx[i] + (double)(refY - pathY) * ry[i];
+		den += (double)rx[i] * rx[i] + (double)ry[i] * ry[i];
+	}
+	return den ? num / den : 0;
+}
+
+// Release to zero latency, averaged over the releases in the trace
+static void _releases(void)
+{
+	uint32_t i, j, t, endMs, lastMs, moved, count = 0, sumMs = 0, maxMs = 0, sumMoved = 0;
+
+	for (i=1; i<sNumSamples; i++)
+	{
+		if (sSamples[i].raised || !sSamples[i - 1].raised)
+			continue;
+		// until the stick moves again
+		for (j=i+1; j<sNumSamples && !sSamples[j].raised; j++)
+			;
+		endMs = j < sNumSamples ? sSamples[j].t : sNumFrames;
+		lastMs = sSamples[i].t;
+		moved = 0;
+		for (t=sSamples[i].t; t<endMs && t<=sNumFrames; t++)
+		{
+			// frame t went out at t ms
+			if (sFrameX[t - 1] || sFrameY[t - 1])
+			{
+				lastMs = t;
+				moved += abs(sFrameX[t - 1]) + abs(sFrameY[t - 1]);
+			}
+		}
+		count++;
+		sumMs += lastMs - sSamples[i].t;
+		if (lastMs - sSamples[i].t > maxMs)
+			maxMs = lastMs - sSamples[i].t;
+		sumMoved += moved;
+	}
+	if (count)
+		printf("  release: %u, to zero in %.1f ms (max %u), %.1f counts after\n",
+		       count, (double)sumMs / count, maxMs, (double)sumMoved / count);
+}
+
+static void _format(char *buf, size_t size, const replay_report_t *r)
+{
+	snprintf(buf, size, "%u %d %d %u\n", r->t, r->x, r->y, r->btn);
+}
+
+static uint32_t _compare(const char *path, uint8_t update)
+{
+	FILE *f = fopen(path, update ? "w" : "r");
+	char expected[128], got[128];
+	uint32_t i, diffs = 0;
+
+	if (!f)
+	{
+		perror(path);
+		exit(2);
+	}
+	if (update)
+	{
+		fprintf(f, "# t_ms x y btn: one line per mouse report\n");
+		for (i=0; i<sNumReports; i++)
+		{
+			_format(got, sizeof(got), &sReports[i]);
+			fputs(got, f);
+		}
+		fclose(f);
+		return 0;
+	}
+
+	i = 0;
+	while (fgets(expected, sizeof(expected), f))
+	{
+		if (expected[0] == '#')
+			continue;
+		if (i < sNumReports)
+			_format(got, sizeof(got), &sReports[i]);
+		else
+			strcpy(got, "(none)\n");
+		if (strcmp(expected, got))
+		{
+			if (diffs < REPLAY_SHOW_DIFFS)
+				printf("  report %u: expected %s  got %s", i, strtok(expected, "\n"), got);
+			diffs++;
+		}
+		i++;
+	}
+	if (i < sNumReports)
+	{
+		printf("  %u extra reports\n", sNumReports - i);
+		diffs += sNumReports - i;
+	}
+	fclose(f);
+	return diffs;
+}
+
+int main(int argc, char **argv)
+{
+	uint8_t update = 0, skip = 0, mode = UPSAMPLE_DEFAULT_MODE;
+	uint32_t repeat = 1, i, n, diffs = 0;
+	static int8_t outX[REPLAY_MAX_FRAMES], outY[REPLAY_MAX_FRAMES];
+	static const char *modeNames[] = { "hold", "interpolate", "extrapolate" };
+	const char *tracePath, *goldenPath, *restPath = 0;
+	char defaultGolden[256];
+	struct timespec t0, t1;
+	double seconds;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "usm:n:c:")) != -1)
+	{
+		if (opt == 'u')
+			update = 1;
+		else if (opt == 's')
+			skip = 1;
+		else if (opt == 'm' && optarg[0] == 'h')
+			mode = UPSAMPLE_HOLD;
+		else if (opt == 'm' && optarg[0] == 'i')
+			mode = UPSAMPLE_INTERPOLATE;
+		else if (opt == 'm' && optarg[0] == 'e')
+			mode = UPSAMPLE_EXTRAPOLATE;
+		else if (opt == 'n')
+			repeat = atoi(optarg);
+		else if (opt == 'c')
+			restPath = optarg;
+		else
+			return 2;
+	}
+	if (optind >= argc)
+	{
+		fprintf(stderr, "usage: replay [-u] [-s] [-m mode] [-n repeat] [-c rest] trace [golden]\n");
+		return 2;
+	}
+	tracePath = argv[optind];
+	if (optind + 1 < argc)
+	{
+		goldenPath = argv[optind + 1];
+	}
+	else
+	{
+		snprintf(defaultGolden, sizeof(defaultGolden), "%s", tracePath);
+		char *dot = strrchr(defaultGolden, '.');
+		if (dot)
+			*dot = 0;
+		strncat(defaultGolden, ".golden", sizeof(defaultGolden) - strlen(defaultGolden) - 1);
+		goldenPath = defaultGolden;
+	}
+
+	if (restPath)
+	{
+		sNumRest = _load(restPath);
+		for (i=0; i<sNumRest; i++)
+		{
+			sRestX[i] = sSamples[i].x;
+			sRestY[i] = sSamples[i].y;
+		}
+	}
+	_load(tracePath);
+
+	// bring the part up at rest, the way main() does
+	sim_n35p112_init(&sStick, N35P112_TWI_ADDRESS);
+	PINB |= (1 << 7);
+	n35p112_init();
+	teensy_configure_interrupts();
+	_calibrate();
+	if (restPath)
+		_noise(restPath);
+	host_set_event_hook(_events);
+
+	upsample_set_mode(mode);
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (i=0; i<repeat; i++)
+		_run();
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	seconds = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) * 1e-9;
+
+	if (!skip)
+		diffs = _compare(goldenPath, update);
+	printf("%s: %u samples, %u reports, %u differ, %.0f samples/s, %.0f reports/s\n",
+	       tracePath, sNumSamples, sNumReports, diffs,
+	       sNumSamples * repeat / seconds, sNumReports * repeat / seconds);
+	_releases();
+
+	// the same trace in hold mode, as the reference for the figures
+	n = sNumFrames;
+	memcpy(outX, sFrameX, n);
+	memcpy(outY, sFrameY, n);
+	upsample_set_mode(UPSAMPLE_HOLD);
+	_run();
+	if (sNumFrames < n)
+		n = sNumFrames;
+	printf("  %s: jerk %.2f (hold %.2f), lag %.1f ms\n", modeNames[mode],
+	       _jerk(outX, outY, n), _jerk(sFrameX, sFrameY, n),
+	       _lag(outX, outY, sFrameX, sFrameY, n));
+	return diffs ? 1 : 0;
+}
@@ -0,0 +1,83 @@
+// sim_mcp23018.c
+
+#include "sim_mcp23018.h"
+
+#include <string.h>
+
+// ----------------------------------------------------------------------------
+
+// IOCON.BANK = 0 register map
+#define IODIRA	0x00
+#define IODIRB	0x01
+#define GPPUA	0x0C
+#define GPPUB	0x0D
+#define GPIOA	0x12
+#define GPIOB	0x13
+#define OLATA	0x14
+#define OLATB	0x15
+
+// ----------------------------------------------------------------------------
+
+// Open drain outputs: a GPA pin pulls its column low only if it is an output
+//  with a 0 in the latch.  A GPB input reads low if any key on its row
+//  connects it to such a column, high (pull-up) otherwise.
+static uint8_t _read_reg(host_twi_device_t *dev, uint8_t reg)
+{
+	sim_mcp23018_t *sim = dev->context;
+	uint8_t col, rows = 0;
+	uint8_t driven = ~dev->regs[IODIRA] & ~dev->regs[OLATA];
+
+	switch (reg)
+	{
+		case GPIOA:
+			return dev->regs[OLATA] | dev->regs[IODIRA];
+		case GPIOB:
+			sim->gpioReads++;
+			for (col=0; col<8; col++)
+			{
+				if (driven & (1 << col))
+					rows |= sim->pressed[col];
+			}
+			return ~rows & dev->regs[GPPUB];
+		default:
+			return dev->regs[reg];
+	}
+}
+
+static void _write_reg(host_twi_device_t *dev, uint8_t reg, uint8_t value)
+{
+	switch (reg)
+	{
+		case GPIOA:
+		case OLATA:
+			dev->regs[OLATA] = value;
+			break;
+		case GPIOB:
+		case OLATB:
+			dev->regs[OLATB] = value;
+			break;
+		default:
+			dev->regs[reg] = value;
+			break;
+	}
+}
+
+void sim_mcp23018_init(sim_mcp23018_t *sim, uint8_t address)
+{
+	memset(sim, 0, sizeof(*sim));
+	sim->dev.address = address;
+	sim->dev.regs[IODIRA] = 0xFF;	// power-on: all inputs
+	sim->dev.regs[IODIRB] = 0xFF;
+	sim->dev.read_reg = _read_reg;
+	sim->dev.write_reg = _write_reg;
+	sim->dev.context = sim;
+	host_twi_attach(&sim->dev);
+}
+
+void sim_mcp23018_set_key(sim_mcp23018_t *sim, uint8_t row, uint8_t col, uint8_t pressed)
+{
+	if (pressed)
+		sim->pressed[col] |= (1 << row);
+	else
+		sim->pressed[col] &= ~(1 << row);
+}
@@ -0,0 +1,24 @@
+// sim_mcp23018.h
+//
+// Simulated MCP23018 with a key matrix wired to it: columns on GPA, rows on
+//  GPB, one diode per key so any combination of keys reads back correctly.
+
+#ifndef SIM_MCP23018_H
+#define SIM_MCP23018_H
+
+#include "host.h"
+
+// --------------------------------------------------------------------
+
+typedef struct {
+	host_twi_device_t dev;
+	uint8_t pressed[8];	// per GPA column, GPB row bits of keys held down
+	uint32_t gpioReads;
+} sim_mcp23018_t;
+
+// --------------------------------------------------------------------
+
+void sim_mcp23018_init(sim_mcp23018_t *sim, uint8_t address);
+void sim_mcp23018_set_key(sim_mcp23018_t *sim, uint8_t row, uint8_t col, uint8_t pressed);
+
+#endif //SIM_MCP23018_H
@@ -0,0 +1,68 @@
+// sim_n35p112.c
+
+#include "sim_n35p112.h"
+
+#include <string.h>
+
+// ----------------------------------------------------------------------------
+
+#define CONTROL1	0x0F
+#define JOY_X		0x10
+#define JOY_Y		0x11
+#define JOY_XP		0x12
+#define JOY_XN		0x13
+#define JOY_YP		0x14
+#define JOY_YN		0x15
+
+// ----------------------------------------------------------------------------
+
+static uint8_t _read_reg(host_twi_device_t *dev, uint8_t reg)
+{
+	sim_n35p112_t *sim = dev->context;
+
+	if (reg == JOY_Y)
+		sim->interrupt = 0;
+	return dev->regs[reg];
+}
+
+static void _write_reg(host_twi_device_t *dev, uint8_t reg, uint8_t value)
+{
+	// the soft reset bit clears itself
+	if (reg == CONTROL1)
+		value &= 0xFE;
+	dev->regs[reg] = value;
+}
+
+void sim_n35p112_init(sim_n35p112_t *sim, uint8_t address)
+{
+	memset(sim, 0, sizeof(*sim));
+	sim->dev.address = address;
+	sim->dev.regs[CONTROL1] = 0xF0;	// reset value
+	sim->dev.read_reg = _read_reg;
+	sim->dev.write_reg = _write_reg;
+	sim->dev.context = sim;
+	host_twi_attach(&sim->dev);
+}
+
+/* Complete a conversion.  Like the part does with the firmware's settings,
+ *  the interrupt is only raised when the result is outside the threshold
+ *  window programmed by _set_deadzone().
+ *
+ * returns
+ * - nonzero if the conversion raised the interrupt
+ */
+uint8_t sim_n35p112_convert(sim_n35p112_t *sim, int8_t x, int8_t y)
+{
+	uint8_t *regs = sim->dev.regs;
+
+	regs[JOY_X] = (uint8_t)x;
+	regs[JOY_Y] = (uint8_t)y;
+	sim->samples++;
+
+	if (x <= (int8_t)regs[JOY_XP] && x >= (int8_t)regs[JOY_XN] &&
+	    y <= (int8_t)regs[JOY_YP] && y >= (int8_t)regs[JOY_YN])
+		return 0;
+
+	sim->interrupt = 1;
+	return 1;
+}
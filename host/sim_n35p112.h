@@ -0,0 +1,25 @@
+// sim_n35p112.h
+//
+// Simulated N35P112: a register file whose X/Y registers hold whatever the
+//  host last fed it, with the interrupt line modelled as a flag that a read
+//  of REG_JOY_Y clears.
+
+#ifndef SIM_N35P112_H
+#define SIM_N35P112_H
+
+#include "host.h"
+
+// --------------------------------------------------------------------
+
+typedef struct {
+	host_twi_device_t dev;
+	uint8_t interrupt;	// 1 while the INT line is asserted (low)
+	uint32_t samples;
+} sim_n35p112_t;
+
+// --------------------------------------------------------------------
+
+void sim_n35p112_init(sim_n35p112_t *sim, uint8_t address);
+uint8_t sim_n35p112_convert(sim_n35p112_t *sim, int8_t x, int8_t y);
+
+#endif //SIM_N35P112_H
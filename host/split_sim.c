@@ -0,0 +1,230 @@
+// split_sim.c
+//
+// The master side of split mode (controller/split.h) against a simulated
+//  other half: the local stick is the simulated N35P112 as in bus_sim, and
+//  the peripheral is a register file with the packet in it, run by a model
+//  of the peripheral's firmware.  Its stick converts every 20 ms at its own
+//  random phase, its main loop reads the sample (and NAKs the master while
+//  it does), and publishes it on its own 1 ms tick, which runs off its own
+//  crystal at a random phase against ours.
+//
+// At the end it prints the latency of both sticks, sample interrupt to the
+//  master's main loop, and fails if a remote sample was missed or a remote
+//  sample took longer than the worst case the poll period allows.
+//
+// With a late start the other half is unplugged for that many seconds
+//  first, turning its address down, and is then expected to be picked up
+//  again within a slow poll.  twi_tune_update() runs once a second
+//  throughout, and the bus clock has to stay where twi_tune_calibrate() put
+//  it: a missing half is no reason to slow the bus down.
+//
+// usage: split_sim [seconds] [seed] [late start, seconds]
+//
+// The poll period is SPLIT_POLL_MS, e.g. make -B split_sim SPLIT_POLL_MS=1
+
+#include "host.h"
+#include "sim_n35p112.h"
+#include "../controller/teensy-2-0.h"
+#include "../controller/n35p112.h"
+#include "../controller/split.h"
+#include "../twi/twi_sched.h"
+#include "../twi/twi_tune.h"
+
+#include <avr/io.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+// ----------------------------------------------------------------------------
+
+#define SENSOR_PERIOD_US 20000
+
+// the peripheral's read of its stick: its interrupt latency and two
+//  register reads at 400 kHz
+const uint32_t kPeripheralReadUs = 150;
+
+// Interrupt to the master's loop, at worst: the peripheral's read, a tick
+//  there, a poll period, a tick here, and the poll itself
+const uint32_t kMaxRemoteUs = 150 + 1000 + SPLIT_POLL_MS * 1000 + 1000 + 500;
+
+// Samples the other half may have before the master finds it back after a
+//  late start: a slow poll's worth, see kSplitLostPollMs in split.c
+const uint32_t kLateSamples = 250000 / SENSOR_PERIOD_US + 1;
+
+// ----------------------------------------------------------------------------
+
+void INT2_vect(void);
+
+static sim_n35p112_t sStick;
+static uint32_t sNextConversionUs;
+
+// the other half
+static host_twi_device_t sPeripheral;
+static uint32_t sRemoteConversionUs;	// next conversion
+static uint32_t sRemoteReadUs;		// its read done, 0 if none going on
+static uint32_t sRemoteTickUs;		// next tick of its main loop
+static uint8_t sRemotePending = 0;	// read, waiting for the tick
+static int8_t sRemoteY;
+static uint32_t sRemoteSampleUs;
+static uint32_t sRemoteSamples = 0;
+static uint32_t sRemoteStartUs = 0;	// plugged in from then on
+
+// the packet as published
+static uint8_t sSeq = 0;
+static int8_t sY = 0;
+static uint32_t sSampleUs = 0;
+static const twi_tune_probe_t kProbes[] = { n35p112_probe };
+
+// ----------------------------------------------------------------------------
+
+// The peripheral's slave, as of the master's SLA+R: that's the packet's
+//  bytes before the end of the transfer this is called at
+static uint8_t _peripheral_read(host_twi_device_t *dev, uint8_t reg)
+{
+	uint16_t ageUs;
+
+	if (reg == SPLIT_REG_PACKET)
+	{
+		ageUs = host_now_us() - SPLIT_PACKET_SIZE * 9e6 / host_twi_freq() - sSampleUs;
+		dev->regs[SPLIT_PACKET_SEQ] = sSeq;
+		dev->regs[SPLIT_PACKET_Y] = (uint8_t)sY;
+		dev->regs[SPLIT_PACKET_BTN] = 0;
+		dev->regs[SPLIT_PACKET_AGE] = ageUs & 0xFF;
+		dev->regs[SPLIT_PACKET_AGE + 1] = ageUs >> 8;
+	}
+	return reg < SPLIT_PACKET_SIZE ? dev->regs[reg] : 0xFF;
+}
+
+// The peripheral's firmware: convert, read with the slave off, publish on
+//  the next tick
+static void _peripheral(void)
+{
+	uint32_t now = host_now_us();
+
+	if (now < sRemoteStartUs)
+		return;
+	if (now >= sRemoteConversionUs)
+	{
+		sRemoteSampleUs = sRemoteConversionUs;
+		sRemoteConversionUs += SENSOR_PERIOD_US + rand() % 201 - 100;
+		sRemoteY = rand() % 255 - 127;
+		sRemoteReadUs = now + kPeripheralReadUs;
+		sPeripheral.busy = 1;
+		sRemoteSamples++;
+	}
+	if (sRemoteReadUs && now >= sRemoteReadUs)
+	{
+		sRemoteReadUs = 0;
+		sPeripheral.busy = 0;
+		sRemotePending = 1;
+	}
+	if (now >= sRemoteTickUs)
+	{
+		sRemoteTickUs += 1000;
+		if (sRemotePending)
+		{
+			sRemotePending = 0;
+			sSeq++;
+			sY = sRemoteY;
+			sSampleUs = sRemoteSampleUs;
+		}
+	}
+}
+
+// Interrupt sources, checked whenever simulated time moves
+static void _events(void)
+{
+	if (host_now_us() >= sNextConversionUs)
+	{
+		sNextConversionUs += SENSOR_PERIOD_US + rand() % 201 - 100;
+		sim_n35p112_convert(&sStick, rand() % 255 - 127, rand() % 255 - 127);
+	}
+	_peripheral();
+	// INT2 is level triggered
+	if (sStick.interrupt && (EIMSK & (1 << INT2)) && (SREG & 0x80))
+		INT2_vect();
+}
+
+static uint32_t _mean(const split_latency_t *latency)
+{
+	return latency->count ? latency->totalUs / latency->count : 0;
+}
+
+int main(int argc, char **argv)
+{
+	uint32_t seconds = argc > 1 ? atoi(argv[1]) : 10;
+	uint32_t lateSeconds = argc > 3 ? atoi(argv[3]) : 0;
+	uint32_t endUs, nextTickUs;
+	uint16_t ticks = 0;
+	uint16_t khz;
+	int32_t wheel = 0;
+	int failed = 0;
+	const split_stats_t *stats;
+
+	srand(argc > 2 ? atoi(argv[2]) : 1);
+	sim_n35p112_init(&sStick, N35P112_TWI_ADDRESS);
+	sPeripheral.address = SPLIT_TWI_ADDRESS;
+	sPeripheral.read_reg = _peripheral_read;
+	host_twi_attach(&sPeripheral);
+
+	teensy_init();
+	n35p112_init();
+	split_init();
+	twi_tune_calibrate(kProbes, sizeof(kProbes) / sizeof(kProbes[0]));
+	teensy_configure_interrupts();
+	n35p112_calibrate();
+	khz = twi_tune_get_khz();
+
+	sRemoteStartUs = host_now_us() + lateSeconds * 1000000;
+	sPeripheral.busy = lateSeconds != 0;
+	sNextConversionUs = host_now_us() + rand() % SENSOR_PERIOD_US;
+	sRemoteConversionUs = sRemoteStartUs + rand() % SENSOR_PERIOD_US;
+	sRemoteTickUs = sRemoteStartUs + rand() % 1000;
+	host_set_event_hook(_events);
+
+	endUs = host_now_us() + seconds * 1000000;
+	nextTickUs = host_now_us();
+	while (host_now_us() < endUs)
+	{
+		if (host_now_us() >= nextTickUs)
+		{
+			nextTickUs += 1000;
+
+			// every tick, like the main loop in example.c
+			if (n35p112_update() == N35P112_SAMPLE)
+				split_note_local(n35p112_get_sample_us());
+			split_poll();
+			split_update();
+			wheel += split_get_wheel();
+
+			// and once a second, like the main loop
+			if (++ticks == 1000)
+			{
+				ticks = 0;
+				twi_tune_update();
+				if (twi_tune_get_khz() != khz)
+					failed = 1;
+			}
+		}
+
+		if (!twi_sched_run())
+			host_advance_us(4);
+	}
+
+	twi_sched_print_stats();
+	stats = split_get_stats();
+	printf("peripheral samples %u, master polls %u, errors %u, samples %u, missed %u, wheel %d\n",
+	       sRemoteSamples, stats->polls, stats->errors, stats->samples, stats->missed, wheel);
+	printf("latency us min/mean/max: local %u/%u/%u remote %u/%u/%u, remote adds %u us\n",
+	       stats->local.minUs, _mean(&stats->local), stats->local.maxUs,
+	       stats->remote.minUs, _mean(&stats->remote), stats->remote.maxUs,
+	       _mean(&stats->remote) - _mean(&stats->local));
+
+	twi_tune_print_stats();
+
+	// the last sample may still be on its way, and after a late start the
+	//  ones before the master found the other half back are gone
+	if (stats->missed || stats->samples + 1 + (lateSeconds ? kLateSamples : 0) < sRemoteSamples ||
+	    stats->remote.maxUs > kMaxRemoteUs)
+		failed = 1;
+	return failed;
+}
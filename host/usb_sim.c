@@ -0,0 +1,933 @@
+// usb_sim.c
+//
+// Enumerates the firmware's USB stack (usb_mouse_debug.c) against a
+//  simulated controller and host, and measures how long its interrupts
+//  keep everything else waiting: INT2, the stick's interrupt, can't be
+//  taken until the USB interrupt in progress returns, so the longest one
+//  is the worst latency the sensor sees.
+//
+// After enumeration the host switches the HID protocols and sets the
+//  keyboard's idle rate the way a BIOS or a test would, checking what
+//  GET_PROTOCOL and GET_IDLE say back.  Then the main loop sends a mouse
+//  report every 1 ms tick and a debug line every 10 for a while, and the
+//  host reads the interrupt endpoints: every mouse report has to arrive,
+//  the debug text has to come out as written, and the keyboard's idle
+//  reports have to be boot reports at the rate that was set.  How long
+//  each report sat in the endpoint before the host took it is printed
+//  per endpoint.
+//
+// Last, with the bitmap's first and last keys held down, the host switches
+//  the keyboard to report protocol and back: each report has to be the
+//  one for the protocol the host set, boot reports 8 bytes with the two
+//  keycodes, report protocol the NKRO bitmap with the two bits.
+//
+// usage: usb_sim [-g us] [-r ms] [-v]
+//   -g us  between the host's transactions, and between its retries of a
+//          NAKed one, default 125 (one high speed microframe)
+//   -r ms  of reports after enumeration, default 500
+//   -v     print every transfer and its reply
+//
+// The controller models endpoint 0 at the level the firmware sees it: the
+//  UEINTX flags, one bank each way and the FIFO.  The IN endpoints have
+//  the banks their UECFG1X asks for, and the host takes one each
+//  bInterval frames, as the configuration descriptor says.  Time only
+//  passes on register accesses, kAccessUs each, and on interrupt entry, so
+//  the figures are lower bounds; what they show is where the firmware
+//  waits for the host.
+
+#define HOST_USB_REGS
+
+#include "host.h"
+#include "../usb_mouse_debug.h"
+#include "../health.h"
+
+#include <avr/io.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// ----------------------------------------------------------------------------
+
+#define USB_SIM_EP0_SIZE     32
+#define USB_SIM_FIFO_SIZE    64
+#define USB_SIM_MAX_REPLY    256
+#define USB_SIM_ADDRESS      5
+#define USB_SIM_MAX_DEBUG    4096
+
+// the endpoints as usb_mouse_debug.c has them
+#define USB_SIM_KEYBOARD_EP  1
+#define USB_SIM_MOUSE_EP     3
+#define USB_SIM_DEBUG_EP     4
+#define USB_SIM_GAMEPAD_EP   5
+
+// the boot keyboard report, what the keyboard sends after SET_PROTOCOL 0,
+//  and the report protocol's: modifiers, reserved, then the NKRO bitmap
+#define USB_SIM_BOOT_KEYBOARD_SIZE 8
+#define USB_SIM_NKRO_KEYBOARD_SIZE (2 + KEYBOARD_NKRO_KEYS / 8)
+
+// the keys held down for the protocol switch, the bitmap's first and last
+#define USB_SIM_FIRST_KEY    KEYBOARD_FIRST_KEY
+#define USB_SIM_LAST_KEY     (KEYBOARD_FIRST_KEY + KEYBOARD_NKRO_KEYS - 1)
+
+// A control transfer, and how it went
+typedef struct {
+	const char *name;
+	uint8_t reset;		// a bus reset before it
+	uint8_t setup[8];
+	uint8_t out[USB_SIM_FIFO_SIZE];
+	uint8_t expectStall;
+	uint8_t expect[8];	// the reply it has to get, if expectLen
+	uint8_t expectLen;
+	// what came back
+	uint8_t done;
+	uint8_t stalled;
+	uint16_t replyLen;
+	uint8_t reply[USB_SIM_MAX_REPLY];
+} usb_sim_transfer_t;
+
+// An IN endpoint: the banks the firmware has handed over, oldest first,
+//  until the host polls for them, and what the host got
+typedef struct {
+	uint8_t cfg1;		// UECFG1X as the firmware set it
+	uint8_t interval;	// bInterval, 0 for an endpoint the host doesn't poll
+	uint8_t queued;
+	uint8_t len[2];
+	uint32_t queuedUs[2];
+	int8_t boot[2];		// keyboard: the host's protocol when queued, -1 mid switch
+	uint8_t data[2][USB_SIM_FIFO_SIZE];
+	uint8_t overruns;	// banks sent with none free
+	uint32_t packets;
+	uint32_t bytes;
+	uint32_t minUs;		// queued to taken
+	uint32_t maxUs;
+	uint64_t totalUs;
+	uint32_t lastUs;	// taken, for the time between packets
+	uint32_t minGapUs;
+	uint32_t maxGapUs;
+} usb_sim_endpoint_t;
+
+// Where the host is in a transfer
+#define STAGE_IDLE        0
+#define STAGE_RESET       1
+#define STAGE_SETUP       2
+#define STAGE_DATA_IN     3
+#define STAGE_DATA_OUT    4
+#define STAGE_STATUS_IN   5
+#define STAGE_STATUS_OUT  6
+
+// ----------------------------------------------------------------------------
+
+// a register access, a couple of AVR cycles; an interrupt's entry and exit
+static const double kAccessUs = 0.25;
+static const double kIsrUs = 2.0;
+// USB 2.0 7.1.7.5: reset for 10 ms, then 10 ms to recover; 9.2.6.3: 2 ms
+//  after SET_ADDRESS
+static const uint32_t kResetUs = 10000;
+static const uint32_t kRecoveryUs = 10000;
+static const uint32_t kAddressUs = 2000;
+// between transfers, and between start of frames
+static const uint32_t kTransferGapUs = 1000;
+static const uint32_t kFrameUs = 1000;
+// after the reports, for the last ones to go out
+static const uint32_t kDrainUs = 20000;
+// the keyboard's idle rate set after enumeration, in 4 ms units
+static const uint8_t kKeyboardIdle = 5;
+// the debug channel gets a line this often, in ticks
+static const uint8_t kDebugLineTicks = 10;
+
+static const char *kEndpointNames[] = { "control", "keyboard", "capture", "mouse", "debug", "gamepad", "", "" };
+
+// ----------------------------------------------------------------------------
+
+// the controller: UEINTX flags as the hardware keeps them, and the copy the
+//  firmware reads and writes (the latch), which is taken in at the next
+//  access because a write of 1 leaves an interrupt flag alone
+static uint8_t sIntx[8];
+static uint8_t sCon[8];
+static uint8_t sIen[8];
+static uint8_t sFifo[8][USB_SIM_FIFO_SIZE];
+static uint8_t sFifoIdx[8];
+static uint8_t sLatch;
+static int8_t sLatchEp = -1;
+static uint8_t sInBank[USB_SIM_FIFO_SIZE];
+static uint8_t sInBankLen;
+static usb_sim_endpoint_t sEp[8];
+static uint32_t sFrame;
+static uint8_t sConfigured;
+
+// the host
+static usb_sim_transfer_t sTransfers[64];
+static uint8_t sNumTransfers;
+static uint8_t sCurrent;
+static uint8_t sStage = STAGE_IDLE;
+static uint16_t sOutDone;
+static uint32_t sNextUs;
+static uint32_t sNextFrameUs;
+static uint32_t sGapUs = 125;
+static uint32_t sReportMs = 500;
+static uint8_t sVerbose;
+
+// the debug channel, as written and as the host read it
+static char sDebugSent[USB_SIM_MAX_DEBUG];
+static uint16_t sDebugSentLen;
+static char sDebugRead[USB_SIM_MAX_DEBUG];
+static uint16_t sDebugReadLen;
+static uint32_t sKeyboardWrongSize;
+
+// the keyboard's protocol as the host set it: 1 boot, 0 report, -1 while
+//  a SET_PROTOCOL is going on; and the last report the host read
+static int8_t sKeyboardBoot = 0;
+static uint8_t sKeyboardLast[USB_SIM_FIFO_SIZE];
+static uint8_t sKeyboardLastLen;
+static uint32_t sKeyboardLastUs;	// when it was queued
+
+// the interrupts
+static uint32_t sIsrs;
+static double sLongestIsrUs;
+static const char *sLongestIsrName = "none";
+static uint32_t sIsrsOverFrame;
+static double sIsrTotalUs;
+
+// ----------------------------------------------------------------------------
+
+static uint8_t _ep_banks(const usb_sim_endpoint_t *e)
+{
+	// EPBK: 0 one bank, 1 two
+	return (e->cfg1 & 0x0C) == 0x04 ? 2 : 1;
+}
+
+static uint8_t _ep_size(const usb_sim_endpoint_t *e)
+{
+	return 8 << ((e->cfg1 >> 4) & 3);
+}
+
+// An IN endpoint's UEINTX: room to write while a bank is free and the
+//  one being written isn't full
+static uint8_t _ep_flags(uint8_t ep)
+{
+	const usb_sim_endpoint_t *e = &sEp[ep];
+
+	if (e->queued >= _ep_banks(e))
+		return 0;
+	return (1 << FIFOCON) | (1 << TXINI) |
+	       (sFifoIdx[ep] < _ep_size(e) ? (1 << RWAL) : 0);
+}
+
+static void _queue(uint8_t ep)
+{
+	usb_sim_endpoint_t *e = &sEp[ep];
+
+	if (e->queued >= _ep_banks(e))
+	{
+		e->overruns++;
+	}
+	else
+	{
+		memcpy(e->data[e->queued], sFifo[ep], sFifoIdx[ep]);
+		e->len[e->queued] = sFifoIdx[ep];
+		e->queuedUs[e->queued] = host_now_us();
+		e->boot[e->queued] = sKeyboardBoot;
+		e->queued++;
+	}
+	sFifoIdx[ep] = 0;
+}
+
+// Take in what the firmware wrote to UEINTX
+static void _commit(void)
+{
+	uint8_t ep = sLatchEp, cleared;
+
+	if (sLatchEp < 0)
+		return;
+	sLatchEp = -1;
+	if (sLatch == sIntx[ep])
+		return;
+	if (ep)
+	{
+		// clearing FIFOCON hands the bank to the controller
+		if (!(sLatch & (1 << FIFOCON)))
+			_queue(ep);
+		return;
+	}
+
+	cleared = sIntx[0] & ~sLatch;
+	if (cleared & (1 << RXSTPI))
+	{
+		// a TXINI cleared along with the SETUP sends nothing: the
+		//  bank was free and stays free
+		sIntx[0] &= ~(1 << RXSTPI);
+		sFifoIdx[0] = 0;
+		cleared &= ~(1 << TXINI);
+	}
+	if (cleared & (1 << RXOUTI))
+	{
+		sIntx[0] &= ~(1 << RXOUTI);
+		sFifoIdx[0] = 0;
+	}
+	if (cleared & (1 << TXINI))
+	{
+		// the bank goes to the host with what was written
+		sIntx[0] &= ~(1 << TXINI);
+		memcpy(sInBank, sFifo[0], sFifoIdx[0]);
+		sInBankLen = sFifoIdx[0];
+		sFifoIdx[0] = 0;
+	}
+}
+
+volatile uint8_t *host_usb_reg(uint8_t reg)
+{
+	uint8_t ep = UENUM & 7, i;
+
+	_commit();
+	host_advance_us(kAccessUs);
+	switch (reg)
+	{
+		case HOST_UEINTX:
+			if (ep)
+				sIntx[ep] = _ep_flags(ep);
+			sLatch = sIntx[ep];
+			sLatchEp = ep;
+			return &sLatch;
+		case HOST_UEDATX:
+			i = sFifoIdx[ep];
+			if (i < USB_SIM_FIFO_SIZE)
+				sFifoIdx[ep]++;
+			return &sFifo[ep][i < USB_SIM_FIFO_SIZE ? i : USB_SIM_FIFO_SIZE - 1];
+		case HOST_UECONX:
+			return &sCon[ep];
+		case HOST_UECFG1X:
+			return &sEp[ep].cfg1;
+		default:
+			return &sIen[ep];
+	}
+}
+
+// ----------------------------------------------------------------------------
+
+// A transaction on a full speed bus: sync, PID, CRC and EOP around the data
+static uint32_t _bus_us(uint8_t bytes)
+{
+	return (bytes + 8) * 8 / 12 + 1;
+}
+
+static usb_sim_transfer_t *_transfer(void)
+{
+	return &sTransfers[sCurrent];
+}
+
+// The endpoints' polling intervals, from the configuration descriptor
+static void _parse_configuration(const uint8_t *desc, uint16_t len)
+{
+	uint16_t i;
+
+	for (i=0; i + 1 < len && desc[i]; i += desc[i])
+	{
+		// bLength, ENDPOINT, bEndpointAddress, bmAttributes, wMaxPacketSize, bInterval
+		if (desc[i + 1] == 5 && i + 7 <= len && (desc[i + 2] & 0x80))
+			sEp[desc[i + 2] & 7].interval = desc[i + 6] ? desc[i + 6] : 1;
+	}
+}
+
+// The host's read of an IN endpoint, one packet
+static void _take(uint8_t ep)
+{
+	usb_sim_endpoint_t *e = &sEp[ep];
+	uint32_t us = host_now_us() - e->queuedUs[0], gap;
+	uint8_t i, len = e->len[0];
+
+	if (e->packets)
+	{
+		gap = host_now_us() - e->lastUs;
+		if (e->packets == 1 || gap < e->minGapUs)
+			e->minGapUs = gap;
+		if (gap > e->maxGapUs)
+			e->maxGapUs = gap;
+	}
+	if (!e->packets || us < e->minUs)
+		e->minUs = us;
+	if (us > e->maxUs)
+		e->maxUs = us;
+	e->totalUs += us;
+	e->packets++;
+	e->bytes += len;
+	e->lastUs = host_now_us();
+
+	// a flushed debug packet is padded with zeros
+	if (ep == USB_SIM_DEBUG_EP)
+	{
+		for (i=0; i<len && e->data[0][i]; i++)
+		{
+			if (sDebugReadLen < USB_SIM_MAX_DEBUG)
+				sDebugRead[sDebugReadLen++] = e->data[0][i];
+		}
+	}
+	// the report for the protocol the host had set when it was queued
+	if (ep == USB_SIM_KEYBOARD_EP)
+	{
+		if (e->boot[0] >= 0 &&
+		    len != (e->boot[0] ? USB_SIM_BOOT_KEYBOARD_SIZE : USB_SIM_NKRO_KEYBOARD_SIZE))
+			sKeyboardWrongSize++;
+		memcpy(sKeyboardLast, e->data[0], len);
+		sKeyboardLastLen = len;
+		sKeyboardLastUs = e->queuedUs[0];
+	}
+
+	e->queued--;
+	e->len[0] = e->len[1];
+	e->queuedUs[0] = e->queuedUs[1];
+	e->boot[0] = e->boot[1];
+	memcpy(e->data[0], e->data[1], USB_SIM_FIFO_SIZE);
+}
+
+// Once a frame, every endpoint that's due gets an IN token
+static void _poll_endpoints(void)
+{
+	uint8_t ep;
+
+	if (!sConfigured)
+		return;
+	for (ep=1; ep<8; ep++)
+	{
+		if (sEp[ep].interval && sFrame % sEp[ep].interval == 0 && sEp[ep].queued)
+			_take(ep);
+	}
+}
+
+static void _finish(uint8_t stalled)
+{
+	usb_sim_transfer_t *t = _transfer();
+
+	t->done = 1;
+	t->stalled = stalled;
+	if (t->setup[1] == 6 && t->setup[3] == 2)
+		_parse_configuration(t->reply, t->replyLen);
+	if (t->setup[1] == 9 && t->setup[0] == 0x00 && !stalled)
+		sConfigured = 1;
+	// a SET_PROTOCOL that stalled leaves the keyboard's unknown
+	if (t->setup[1] == 11 && t->setup[4] == 2 && !stalled)
+		sKeyboardBoot = !t->setup[2];
+	sStage = STAGE_IDLE;
+	sNextUs = host_now_us() + (t->setup[1] == 5 ? kAddressUs : kTransferGapUs);
+	sCurrent++;
+}
+
+// The host's side, run whenever simulated time passes: the next token of
+//  the transfer in progress, once it's due
+static void _host(void)
+{
+	usb_sim_transfer_t *t;
+	uint16_t wLength;
+	uint8_t n;
+
+	_commit();
+	if (host_now_us() >= sNextFrameUs)
+	{
+		UDINT |= (1 << SOFI);
+		UDFNUML++;
+		sFrame++;
+		sNextFrameUs += kFrameUs;
+		_poll_endpoints();
+	}
+	if (sCurrent >= sNumTransfers || host_now_us() < sNextUs)
+		return;
+	t = _transfer();
+	wLength = t->setup[6] | (t->setup[7] << 8);
+
+	switch (sStage)
+	{
+		case STAGE_IDLE:
+			if (t->reset)
+			{
+				UDINT |= (1 << EORSTI);
+				UDADDR = 0;
+				sIntx[0] = (1 << TXINI);	// the bank is free
+				sFifoIdx[0] = 0;
+				sStage = STAGE_RESET;
+				sNextUs = host_now_us() + kResetUs + kRecoveryUs;
+				return;
+			}
+			// fall through
+		case STAGE_RESET:
+			if (t->setup[1] == 11 && t->setup[4] == 2)
+				sKeyboardBoot = -1;
+			memcpy(sFifo[0], t->setup, 8);
+			sFifoIdx[0] = 0;
+			sIntx[0] |= (1 << RXSTPI);
+			sCon[0] &= ~(1 << STALLRQ);
+			sOutDone = 0;
+			t->replyLen = 0;
+			if (!wLength)
+				sStage = STAGE_STATUS_IN;
+			else if (t->setup[0] & 0x80)
+				sStage = STAGE_DATA_IN;
+			else
+				sStage = STAGE_DATA_OUT;
+			sNextUs = host_now_us() + _bus_us(8) + sGapUs;
+			return;
+	}
+
+	if (sCon[0] & (1 << STALLRQ))
+	{
+		_finish(1);
+		return;
+	}
+	switch (sStage)
+	{
+		case STAGE_DATA_IN:
+			if (sIntx[0] & (1 << TXINI))
+				break;	// NAK
+			n = sInBankLen;
+			if (t->replyLen + n <= USB_SIM_MAX_REPLY)
+				memcpy(t->reply + t->replyLen, sInBank, n);
+			t->replyLen += n;
+			sIntx[0] |= (1 << TXINI);
+			if (n < USB_SIM_EP0_SIZE || t->replyLen >= wLength)
+				sStage = STAGE_STATUS_OUT;
+			sNextUs = host_now_us() + _bus_us(n) + sGapUs;
+			return;
+		case STAGE_DATA_OUT:
+			if (sIntx[0] & (1 << RXOUTI))
+				break;
+			n = wLength - sOutDone < USB_SIM_EP0_SIZE ? wLength - sOutDone : USB_SIM_EP0_SIZE;
+			memcpy(sFifo[0], t->out + sOutDone, n);
+			sFifoIdx[0] = 0;
+			sIntx[0] |= (1 << RXOUTI);
+			sOutDone += n;
+			if (sOutDone >= wLength)
+				sStage = STAGE_STATUS_IN;
+			sNextUs = host_now_us() + _bus_us(n) + sGapUs;
+			return;
+		case STAGE_STATUS_OUT:
+			if (sIntx[0] & (1 << RXOUTI))
+				break;
+			sFifoIdx[0] = 0;
+			sIntx[0] |= (1 << RXOUTI);
+			_finish(0);
+			return;
+		case STAGE_STATUS_IN:
+			if (sIntx[0] & (1 << TXINI))
+				break;
+			sIntx[0] |= (1 << TXINI);
+			_finish(sInBankLen != 0);
+			return;
+	}
+	sNextUs = host_now_us() + sGapUs;
+}
+
+// ----------------------------------------------------------------------------
+
+void USB_GEN_vect(void);
+void USB_COM_vect(void);
+
+static void _isr(void (*isr)(void), const char *name)
+{
+	double startUs = host_now_us(), us;
+
+	host_advance_us(kIsrUs);
+	isr();
+	_commit();
+
+	us = host_now_us() - startUs;
+	sIsrs++;
+	sIsrTotalUs += us;
+	if (us > sLongestIsrUs)
+	{
+		sLongestIsrUs = us;
+		sLongestIsrName = name;
+	}
+	if (us > kFrameUs)
+		sIsrsOverFrame++;
+}
+
+// What the controller would interrupt for: endpoint 0's enabled flags
+static uint8_t _ep0_pending(void)
+{
+	uint8_t flags = sIntx[0] & sIen[0];
+
+	return (flags & (1 << RXSTPI) && sIen[0] & (1 << RXSTPE)) ||
+	       (flags & (1 << TXINI) && sIen[0] & (1 << TXINE)) ||
+	       (flags & (1 << RXOUTI) && sIen[0] & (1 << RXOUTE));
+}
+
+// ----------------------------------------------------------------------------
+
+static usb_sim_transfer_t *_add(const char *name, uint8_t bmRequestType, uint8_t bRequest,
+                                uint16_t wValue, uint16_t wIndex, uint16_t wLength)
+{
+	usb_sim_transfer_t *t;
+
+	if (sNumTransfers == sizeof(sTransfers) / sizeof(sTransfers[0]))
+	{
+		fprintf(stderr, "no room for %s\n", name);
+		exit(2);
+	}
+	t = &sTransfers[sNumTransfers++];
+	memset(t, 0, sizeof(*t));
+	t->name = name;
+	t->setup[0] = bmRequestType;
+	t->setup[1] = bRequest;
+	t->setup[2] = wValue;
+	t->setup[3] = wValue >> 8;
+	t->setup[4] = wIndex;
+	t->setup[5] = wIndex >> 8;
+	t->setup[6] = wLength;
+	t->setup[7] = wLength >> 8;
+	return t;
+}
+
+// What Linux does with a new full speed device, then a look at each
+//  interface the way the HID driver and the tools here do
+static void _enumeration(void)
+{
+	usb_sim_transfer_t *t;
+
+	_add("GET_DESCRIPTOR device (64)", 0x80, 6, 0x0100, 0, 64)->reset = 1;
+	_add("SET_ADDRESS", 0x00, 5, USB_SIM_ADDRESS, 0, 0)->reset = 1;
+	_add("GET_DESCRIPTOR device", 0x80, 6, 0x0100, 0, 18);
+	_add("GET_DESCRIPTOR configuration (9)", 0x80, 6, 0x0200, 0, 9);
+	_add("GET_DESCRIPTOR configuration", 0x80, 6, 0x0200, 0, 255);
+	_add("GET_DESCRIPTOR string 0", 0x80, 6, 0x0300, 0, 255);
+	_add("GET_DESCRIPTOR string 2", 0x80, 6, 0x0302, 0x0409, 255);
+	_add("GET_DESCRIPTOR string 1", 0x80, 6, 0x0301, 0x0409, 255);
+	_add("SET_CONFIGURATION", 0x00, 9, 1, 0, 0);
+	_add("SET_IDLE mouse", 0x21, 10, 0, 0, 0)->expectStall = 1;
+	_add("GET_DESCRIPTOR report mouse", 0x81, 6, 0x2200, 0, 255);
+	_add("SET_IDLE debug", 0x21, 10, 0, 1, 0)->expectStall = 1;
+	_add("GET_DESCRIPTOR report debug", 0x81, 6, 0x2200, 1, 255);
+	_add("SET_IDLE keyboard", 0x21, 10, 0, 2, 0);
+	_add("GET_DESCRIPTOR report keyboard", 0x81, 6, 0x2200, 2, 255);
+	t = _add("SET_REPORT keyboard LEDs", 0x21, 9, 0x0200, 2, 1);
+	t->out[0] = 0x02;
+	_add("GET_STATUS device", 0x80, 0, 0, 0, 2);
+	_add("GET_REPORT debug feature", 0xA1, 1, 0x0300, 1, HEALTH_REPORT_SIZE);
+	t = _add("SET_REPORT debug feature", 0x21, 9, 0x0300, 1, HEALTH_REPORT_SIZE);
+	t->out[0] = HEALTH_COMMAND_BENCH;
+#ifdef USB_GAMEPAD
+	// after the mouse, keyboard and debug interfaces
+	_add("SET_IDLE gamepad", 0x21, 10, 0, 3, 0)->expectStall = 1;
+	_add("GET_DESCRIPTOR report gamepad", 0x81, 6, 0x2200, 3, 255);
+	_add("GET_REPORT gamepad", 0xA1, 1, 0x0100, 3, 5);
+#endif
+}
+
+static void _expect(usb_sim_transfer_t *t, uint8_t value)
+{
+	t->expect[t->expectLen++] = value;
+}
+
+// Boot protocol and an idle rate, the way a BIOS sets up a keyboard, and
+//  the mouse to boot protocol and back
+static void _protocols(void)
+{
+	_expect(_add("GET_IDLE keyboard", 0xA1, 2, 0, 2, 1), 0);
+	_add("SET_IDLE keyboard", 0x21, 10, kKeyboardIdle << 8, 2, 0);
+	_expect(_add("GET_IDLE keyboard", 0xA1, 2, 0, 2, 1), kKeyboardIdle);
+	_expect(_add("GET_PROTOCOL keyboard", 0xA1, 3, 0, 2, 1), 1);
+	_add("SET_PROTOCOL keyboard boot", 0x21, 11, 0, 2, 0);
+	_expect(_add("GET_PROTOCOL keyboard", 0xA1, 3, 0, 2, 1), 0);
+	_expect(_add("GET_PROTOCOL mouse", 0xA1, 3, 0, 0, 1), 1);
+	_add("SET_PROTOCOL mouse boot", 0x21, 11, 0, 0, 0);
+	_expect(_add("GET_PROTOCOL mouse", 0xA1, 3, 0, 0, 1), 0);
+	_add("SET_PROTOCOL mouse report", 0x21, 11, 1, 0, 0);
+	_expect(_add("GET_PROTOCOL mouse", 0xA1, 3, 0, 0, 1), 1);
+}
+
+// ----------------------------------------------------------------------------
+
+static uint16_t _sum(const uint8_t *data, uint16_t len)
+{
+	uint16_t sum = 0;
+
+	while (len--)
+		sum = (sum << 1 | sum >> 15) ^ *data++;
+	return sum;
+}
+
+// The interrupts the controller has pending, taken between the main
+//  loop's steps
+static void _interrupts(void)
+{
+	if (UDINT)
+		_isr(USB_GEN_vect, "device");
+	if (_ep0_pending())
+		_isr(USB_COM_vect, sCurrent < sNumTransfers ? _transfer()->name : "status");
+}
+
+// The main loop after enumeration: a mouse report every tick and a debug
+//  line every kDebugLineTicks, then nothing for the host to catch up
+//
+// returns
+// - the mouse reports the firmware took
+static uint32_t _reports(void)
+{
+	uint32_t tick = 0, sent = 0, endUs, nextTickUs;
+	char line[32];
+	uint8_t len;
+
+	nextTickUs = host_now_us();
+	endUs = host_now_us() + sReportMs * 1000;
+	while (host_now_us() < endUs + kDrainUs)
+	{
+		host_advance_us(1);
+		_interrupts();
+		if (host_now_us() < nextTickUs || host_now_us() >= endUs)
+			continue;
+		nextTickUs += 1000;
+		tick++;
+
+#ifndef USB_GAMEPAD_ONLY
+		if (usb_mouse_move(tick & 1 ? 1 : -1, 0, 0) == 0)
+			sent++;
+#endif
+#ifdef USB_GAMEPAD
+		usb_gamepad_send(tick, -tick, 0);
+#endif
+		if (tick % kDebugLineTicks == 0)
+		{
+			len = snprintf(line, sizeof(line), "tick %u\n", tick);
+			if (sDebugSentLen + len <= USB_SIM_MAX_DEBUG &&
+			    usb_debug_write((const uint8_t *)line, len) == 0)
+			{
+				memcpy(sDebugSent + sDebugSentLen, line, len);
+				sDebugSentLen += len;
+			}
+		}
+	}
+	return sent;
+}
+
+// Let the host get through the transfers it has queued
+//
+// returns
+// - 0, or 1 if one never finished
+static uint8_t _run_transfers(void)
+{
+	uint32_t endUs = host_now_us() + 10000000;
+
+	while (sCurrent < sNumTransfers)
+	{
+		host_advance_us(1);
+		_interrupts();
+		if (host_now_us() > endUs)
+		{
+			fprintf(stderr, "stuck in %s\n", _transfer()->name);
+			return 1;
+		}
+	}
+	return 0;
+}
+
+// Whether the transfers from the given one on went as they should
+//
+// returns
+// - 0, or 1 if one stalled or got the wrong reply
+static uint8_t _check_transfers(uint8_t from)
+{
+	usb_sim_transfer_t *t;
+	uint8_t i, failed = 0;
+
+	for (i=from; i<sNumTransfers; i++)
+	{
+		t = &sTransfers[i];
+		if (t->stalled != t->expectStall)
+			failed = 1;
+		if (t->expectLen && (t->replyLen != t->expectLen || memcmp(t->reply, t->expect, t->expectLen)))
+		{
+			printf("%s: %u bytes, %02X\n", t->name, t->replyLen, t->reply[0]);
+			failed = 1;
+		}
+		if (sVerbose)
+			printf("%-34s %s %3u bytes, sum %04X\n", t->name,
+			       t->stalled ? "stall" : "ok   ", t->replyLen, _sum(t->reply, t->replyLen));
+	}
+	return failed;
+}
+
+// Press or let go of both keys and send the report, then wait for the host
+//  to read it, and compare it with what the protocol the host set says
+//
+// returns
+// - 0, or 1 if the report was wrong or never came
+static uint8_t _key_report(const char *name, uint8_t pressed)
+{
+	uint8_t expect[USB_SIM_FIFO_SIZE];
+	uint8_t i, len;
+	uint32_t sentUs, endUs;
+
+	memset(expect, 0, sizeof(expect));
+	if (sKeyboardBoot)
+	{
+		len = USB_SIM_BOOT_KEYBOARD_SIZE;
+		if (pressed)
+		{
+			expect[2] = USB_SIM_FIRST_KEY;
+			expect[3] = USB_SIM_LAST_KEY;
+		}
+	}
+	else
+	{
+		len = USB_SIM_NKRO_KEYBOARD_SIZE;
+		if (pressed)
+		{
+			expect[2 + (USB_SIM_FIRST_KEY - KEYBOARD_FIRST_KEY) / 8] |= 1 << ((USB_SIM_FIRST_KEY - KEYBOARD_FIRST_KEY) & 7);
+			expect[2 + (USB_SIM_LAST_KEY - KEYBOARD_FIRST_KEY) / 8] |= 1 << ((USB_SIM_LAST_KEY - KEYBOARD_FIRST_KEY) & 7);
+		}
+	}
+
+	usb_keyboard_key(USB_SIM_FIRST_KEY, pressed);
+	usb_keyboard_key(USB_SIM_LAST_KEY, pressed);
+	sentUs = host_now_us();
+	endUs = sentUs + 100000;
+	while (usb_keyboard_send() != 0 || sKeyboardLastUs < sentUs)
+	{
+		host_advance_us(1);
+		_interrupts();
+		if (host_now_us() > endUs)
+		{
+			printf("keyboard %s: no report\n", name);
+			return 1;
+		}
+	}
+
+	if (sKeyboardLastLen != len || memcmp(sKeyboardLast, expect, len))
+	{
+		printf("keyboard %s: %u bytes, want %u:", name, sKeyboardLastLen, len);
+		for (i=0; i<sKeyboardLastLen; i++)
+			printf(" %02X", sKeyboardLast[i]);
+		printf("\n");
+		return 1;
+	}
+	return 0;
+}
+
+// The keyboard's protocol switched both ways with keys held down, and the
+//  reports that follow each switch
+//
+// returns
+// - 0, or 1 if anything went wrong
+static uint8_t _keys(void)
+{
+	uint8_t from, failed = 0;
+
+	failed |= _key_report("boot, pressed", 1);
+
+	from = sNumTransfers;
+	_add("SET_PROTOCOL keyboard report", 0x21, 11, 1, 2, 0);
+	_expect(_add("GET_PROTOCOL keyboard", 0xA1, 3, 0, 2, 1), 1);
+	failed |= _run_transfers() || _check_transfers(from);
+	failed |= _key_report("report, pressed", 1);
+	failed |= _key_report("report, released", 0);
+	failed |= _key_report("report, pressed again", 1);
+
+	from = sNumTransfers;
+	_add("SET_PROTOCOL keyboard boot", 0x21, 11, 0, 2, 0);
+	_expect(_add("GET_PROTOCOL keyboard", 0xA1, 3, 0, 2, 1), 0);
+	failed |= _run_transfers() || _check_transfers(from);
+	failed |= _key_report("boot, pressed again", 1);
+	failed |= _key_report("boot, released", 0);
+
+	if (sKeyboardWrongSize)
+	{
+		printf("keyboard: %u reports not for the protocol set\n", sKeyboardWrongSize);
+		failed = 1;
+	}
+	printf("keyboard protocol switch %s\n", failed ? "FAILED" : "done");
+	return failed;
+}
+
+static void _print_endpoint(uint8_t ep)
+{
+	const usb_sim_endpoint_t *e = &sEp[ep];
+
+	printf("%-8s ep%u: %5u packets %6u bytes, waited %u/%.0f/%u us, every %u-%u us\n",
+	       kEndpointNames[ep], ep, e->packets, e->bytes,
+	       e->minUs, e->packets ? (double)e->totalUs / e->packets : 0, e->maxUs,
+	       e->minGapUs, e->maxGapUs);
+}
+
+int main(int argc, char **argv)
+{
+	uint8_t i, failed = 0;
+	uint32_t mouseSent = 0;
+	int c;
+
+	while ((c = getopt(argc, argv, "g:r:v")) != -1)
+	{
+		switch (c)
+		{
+			case 'g': sGapUs = atoi(optarg); break;
+			case 'r': sReportMs = atoi(optarg); break;
+			case 'v': sVerbose = 1; break;
+			default:
+				fprintf(stderr, "usage: usb_sim [-g us] [-r ms] [-v]\n");
+				return 2;
+		}
+	}
+
+	_enumeration();
+	_protocols();
+	UDIEN = (1 << EORSTE) | (1 << SOFE) | (1 << SUSPE);
+	sNextFrameUs = kFrameUs;
+	host_set_event_hook(_host);
+
+	// the main loop has nothing to do but be interrupted
+	if (_run_transfers())
+		return 1;
+	failed = _check_transfers(0);
+	if (UDADDR != (USB_SIM_ADDRESS | (1 << ADDEN)))
+	{
+		printf("address %02X\n", UDADDR);
+		failed = 1;
+	}
+	if (!usb_configured() || usb_keyboard_leds() != 0x02 || usb_debug_command() != HEALTH_COMMAND_BENCH)
+	{
+		printf("configuration %u, keyboard LEDs %02X\n", usb_configured(), usb_keyboard_leds());
+		failed = 1;
+	}
+
+	printf("enumeration %s in %u ms, %u transfers, %u us between transactions\n",
+	       failed ? "FAILED" : "done", host_now_us() / 1000, sNumTransfers, sGapUs);
+	printf("usb interrupts %u, %.0f us in all; longest %.1f us (%s), %u over a frame\n",
+	       sIsrs, sIsrTotalUs, sLongestIsrUs, sLongestIsrName, sIsrsOverFrame);
+	printf("worst INT2 latency %.1f us\n", sLongestIsrUs + kIsrUs);
+	if (failed)
+		return failed;
+
+	mouseSent = _reports();
+	for (i=1; i<8; i++)
+	{
+		if (sEp[i].interval)
+			_print_endpoint(i);
+		if (sEp[i].overruns)
+		{
+			printf("%s: %u banks sent with none free\n", kEndpointNames[i], sEp[i].overruns);
+			failed = 1;
+		}
+	}
+#ifndef USB_GAMEPAD_ONLY
+	if (sEp[USB_SIM_MOUSE_EP].packets != mouseSent || health.usbDropped)
+	{
+		printf("mouse: %u reports sent, %u read, %u dropped\n",
+		       mouseSent, sEp[USB_SIM_MOUSE_EP].packets, health.usbDropped);
+		failed = 1;
+	}
+#endif
+	if (sDebugReadLen != sDebugSentLen || memcmp(sDebugRead, sDebugSent, sDebugSentLen))
+	{
+		printf("debug: %u bytes written, %u read\n", sDebugSentLen, sDebugReadLen);
+		failed = 1;
+	}
+	// the idle reports: boot reports, kKeyboardIdle * 4 ms apart
+	if (!sEp[USB_SIM_KEYBOARD_EP].packets || sKeyboardWrongSize ||
+	    sEp[USB_SIM_KEYBOARD_EP].minGapUs < kKeyboardIdle * 4000 - kFrameUs ||
+	    sEp[USB_SIM_KEYBOARD_EP].maxGapUs > kKeyboardIdle * 4000 + kFrameUs)
+	{
+		printf("keyboard: %u reports, %u not boot reports\n",
+		       sEp[USB_SIM_KEYBOARD_EP].packets, sKeyboardWrongSize);
+		failed = 1;
+	}
+	failed |= _keys();
+	printf("reports %s in %u ms\n", failed ? "FAILED" : "done", sReportMs);
+	return failed;
+}
@@ -0,0 +1,45 @@
+// keymap.c
+
+#include "keymap.h"
+#include "matrix.h"
+
+#include <avr/pgmspace.h>
+
+// ----------------------------------------------------------------------------
+
+// Default layout.  Columns 0..7 (the Teensy's matrix) hold a 4x12
+//  ortholinear block laid in reading order, columns 8..13 (the expander's)
+//  hold the number row, function keys and navigation.  Matrix positions
+//  don't have to match physical positions (see ../controller/teensy-2-0.md),
+//  this is the one place that maps them.
+static const uint8_t PROGMEM kKeymap[MATRIX_ROWS][MATRIX_COLS] = {
+	{ KEY_TAB,        KEY_LETTER('Q'), KEY_LETTER('W'), KEY_LETTER('E'),
+	  KEY_LETTER('R'), KEY_LETTER('T'), KEY_LETTER('Y'), KEY_LETTER('U'),
+	  KEY_DIGIT(1),   KEY_DIGIT(2),    KEY_DIGIT(3),    KEY_DIGIT(4),
+	  KEY_DIGIT(5),   KEY_DIGIT(6) },
+	{ KEY_LETTER('I'), KEY_LETTER('O'), KEY_LETTER('P'), KEY_BACKSPACE,
+	  KEY_ESC,        KEY_LETTER('A'), KEY_LETTER('S'), KEY_LETTER('D'),
+	  KEY_DIGIT(7),   KEY_DIGIT(8),    KEY_DIGIT(9),    KEY_DIGIT(0),
+	  KEY_LEFT_BRACE, KEY_RIGHT_BRACE },
+	{ KEY_LETTER('F'), KEY_LETTER('G'), KEY_LETTER('H'), KEY_LETTER('J'),
+	  KEY_LETTER('K'), KEY_LETTER('L'), KEY_SEMICOLON,  KEY_QUOTE,
+	  KEY_FN(1),      KEY_FN(2),       KEY_FN(3),       KEY_FN(4),
+	  KEY_FN(5),      KEY_FN(6) },
+	{ KEY_LEFT_SHIFT, KEY_LETTER('Z'), KEY_LETTER('X'), KEY_LETTER('C'),
+	  KEY_LETTER('V'), KEY_LETTER('B'), KEY_LETTER('N'), KEY_LETTER('M'),
+	  KEY_FN(7),      KEY_FN(8),       KEY_FN(9),       KEY_FN(10),
+	  KEY_FN(11),     KEY_FN(12) },
+	{ KEY_COMMA,      KEY_PERIOD,      KEY_SLASH,       KEY_ENTER,
+	  KEY_LEFT_CTRL,  KEY_LEFT_GUI,    KEY_LEFT_ALT,    KEY_TILDE,
+	  KEY_INSERT,     KEY_HOME,        KEY_PAGE_UP,     KEY_DELETE,
+	  KEY_END,        KEY_PAGE_DOWN },
+	{ KEY_MINUS,      KEY_SPACE,       KEY_SPACE,       KEY_EQUAL,
+	  KEY_LEFT,       KEY_DOWN,        KEY_UP,          KEY_RIGHT,
+	  KEY_BACKSLASH,  KEY_RIGHT_SHIFT, KEY_RIGHT_CTRL,  KEY_RIGHT_ALT,
+	  KEY_NONE,       KEY_NONE },
+};
+
+uint8_t keymap_get_keycode(uint8_t row, uint8_t col)
+{
+	return pgm_read_byte(&kKeymap[row][col]);
+}
@@ -0,0 +1,59 @@
+// keymap.h
+
+#ifndef KEYMAP_H
+#define KEYMAP_H
+
+#include <stdint.h>
+
+// --------------------------------------------------------------------
+
+// HID keyboard usages (HID Usage Tables 1.12, section 10), only the ones the
+//  default layout needs
+#define KEY_NONE	0x00
+#define KEY_A		0x04	// A..Z follow in order
+#define KEY_1		0x1E	// 1..9 follow in order
+#define KEY_0		0x27
+#define KEY_ENTER	0x28
+#define KEY_ESC		0x29
+#define KEY_BACKSPACE	0x2A
+#define KEY_TAB		0x2B
+#define KEY_SPACE	0x2C
+#define KEY_MINUS	0x2D
+#define KEY_EQUAL	0x2E
+#define KEY_LEFT_BRACE	0x2F
+#define KEY_RIGHT_BRACE	0x30
+#define KEY_BACKSLASH	0x31
+#define KEY_SEMICOLON	0x33
+#define KEY_QUOTE	0x34
+#define KEY_TILDE	0x35
+#define KEY_COMMA	0x36
+#define KEY_PERIOD	0x37
+#define KEY_SLASH	0x38
+#define KEY_F1		0x3A	// F1..F12 follow in order
+#define KEY_INSERT	0x49
+#define KEY_HOME	0x4A
+#define KEY_PAGE_UP	0x4B
+#define KEY_DELETE	0x4C
+#define KEY_END		0x4D
+#define KEY_PAGE_DOWN	0x4E
+#define KEY_RIGHT	0x4F
+#define KEY_LEFT	0x50
+#define KEY_DOWN	0x51
+#define KEY_UP		0x52
+#define KEY_LEFT_CTRL	0xE0	// modifiers run 0xE0..0xE7
+#define KEY_LEFT_SHIFT	0xE1
+#define KEY_LEFT_ALT	0xE2
+#define KEY_LEFT_GUI	0xE3
+#define KEY_RIGHT_CTRL	0xE4
+#define KEY_RIGHT_SHIFT	0xE5
+#define KEY_RIGHT_ALT	0xE6
+
+#define KEY_LETTER(c)	(KEY_A + ((c) - 'A'))
+#define KEY_DIGIT(n)	((n) ? KEY_1 + ((n) - 1) : KEY_0)
+#define KEY_FN(n)	(KEY_F1 + ((n) - 1))
+
+// --------------------------------------------------------------------
+
+uint8_t keymap_get_keycode(uint8_t row, uint8_t col);
+
+#endif //KEYMAP_H
@@ -0,0 +1,77 @@
+// matrix.c
+
+#include "matrix.h"
+
+// ----------------------------------------------------------------------------
+
+// Eager debouncing: a key's first edge is reported on the scan that sees it,
+//  then that key is locked for this many scans (one scan per ms) so that the
+//  contact bounce that follows is ignored.
+#define MATRIX_DEBOUNCE_SCANS 5
+
+// ----------------------------------------------------------------------------
+
+// static data
+static uint8_t sMatrix[MATRIX_COLS];	// debounced, row bits per column
+static uint8_t sChanged[MATRIX_COLS];	// row bits changed by the last scan
+static uint8_t sLocked[MATRIX_COLS];	// row bits still bouncing
+static uint8_t sLockScans[MATRIX_COLS][MATRIX_ROWS];
+
+/* Scan the matrix once and debounce it.
+ *
+ * returns
+ * - nonzero if any key changed state, see matrix_get_changed()
+ */
+uint8_t matrix_scan(void)
+{
+	uint8_t raw[MATRIX_COLS];
+	uint8_t col, row, bit, diff, changed;
+	uint8_t any = 0;
+
+	// local columns first, then the expander's from its last complete pass
+	teensy_update_matrix(raw);
+	for (col=0; col<MCP23018_MATRIX_COLS; col++)
+		raw[TEENSY_MATRIX_COLS + col] = mcp23018_get_column(col);
+
+	for (col=0; col<MATRIX_COLS; col++)
+	{
+		diff = raw[col] ^ sMatrix[col];
+		changed = 0;
+
+		// Nothing pressed, released or bouncing in this column: the
+		//  common case, keep it cheap
+		if (diff | sLocked[col])
+		{
+			for (row=0, bit=1; row<MATRIX_ROWS; row++, bit<<=1)
+			{
+				if (sLocked[col] & bit)
+				{
+					if (--sLockScans[col][row] == 0)
+						sLocked[col] &=~ bit;
+				}
+				else if (diff & bit)
+				{
+					changed |= bit;
+					sLocked[col] |= bit;
+					sLockScans[col][row] = MATRIX_DEBOUNCE_SCANS;
+				}
+			}
+			sMatrix[col] ^= changed;
+		}
+
+		sChanged[col] = changed;
+		any |= changed;
+	}
+
+	return any;
+}
+
+uint8_t matrix_get_column(uint8_t col)
+{
+	return sMatrix[col];
+}
+
+uint8_t matrix_get_changed(uint8_t col)
+{
+	return sChanged[col];
+}
@@ -0,0 +1,22 @@
+// matrix.h
+
+#ifndef MATRIX_H
+#define MATRIX_H
+
+#include "../controller/teensy-2-0.h"
+#include "../controller/mcp23018.h"
+
+#include <stdint.h>
+
+// --------------------------------------------------------------------
+
+#define MATRIX_ROWS TEENSY_MATRIX_ROWS
+#define MATRIX_COLS (TEENSY_MATRIX_COLS + MCP23018_MATRIX_COLS)
+
+// --------------------------------------------------------------------
+
+uint8_t matrix_scan(void);
+uint8_t matrix_get_column(uint8_t col);
+uint8_t matrix_get_changed(uint8_t col);
+
+#endif //MATRIX_H
@@ -0,0 +1,125 @@
+// log.c
+//
+// See log.h
+
+#include "log.h"
+#include "usb_mouse_debug.h"
+#include "print.h"
+
+#include <stdarg.h>
+
+// --------------------------------------------------------------------
+
+#define LOG_FRAME_MAX (3 + 4 * LOG_MAX_ARGS)
+
+// --------------------------------------------------------------------
+
+#ifndef LOG_TEXT
+
+// One message, all in one write: the header, the id, then the arguments
+void log_write(uint16_t id, uint16_t wide, uint8_t count, ...)
+{
+	uint8_t frame[LOG_FRAME_MAX];
+	uint8_t *p = frame + 3;
+	uint32_t value;
+	va_list ap;
+
+	va_start(ap, count);
+	for (; count; count--, wide >>= 1)
+	{
+		if (wide & 1)
+		{
+			value = va_arg(ap, uint32_t);
+			*p++ = value;
+			*p++ = value >> 8;
+			*p++ = value >> 16;
+			*p++ = value >> 24;
+		}
+		else
+		{
+			value = va_arg(ap, unsigned int);
+			*p++ = value;
+			*p++ = value >> 8;
+		}
+	}
+	va_end(ap);
+
+	frame[0] = LOG_FRAME | (p - frame - 3);
+	frame[1] = id;
+	frame[2] = id >> 8;
+	usb_debug_write(frame, p - frame);
+}
+
+#else
+
+static void _digits(uint32_t value, uint8_t base, uint8_t width, char a)
+{
+	char buf[10];
+	uint8_t n = 0, d;
+
+	do
+	{
+		d = value % base;
+		buf[n++] = d < 10 ? '0' + d : a + d - 10;
+		value /= base;
+	} while (value && n < sizeof(buf));
+	while (width-- > n)
+		pchar('0');
+	while (n)
+		pchar(buf[--n]);
+}
+
+// The text, as print() and phex() would have sent it
+void log_text(const char *fmt, uint16_t wide, ...)
+{
+	uint8_t width;
+	uint32_t value;
+	char c;
+	va_list ap;
+
+	va_start(ap, wide);
+	while ((c = pgm_read_byte(fmt++)))
+	{
+		if (c != '%')
+		{
+			if (c == '\n')
+				pchar('\r');
+			pchar(c);
+			continue;
+		}
+
+		width = 0;
+		while ((c = pgm_read_byte(fmt++)) >= '0' && c <= '9')
+			width = width * 10 + c - '0';
+		if (c == 'l')
+			c = pgm_read_byte(fmt++);
+		if (c == '%' || !c)
+		{
+			pchar('%');
+			if (!c)
+				break;
+			continue;
+		}
+
+		if (wide & 1)
+			value = va_arg(ap, uint32_t);
+		else if (c == 'd')
+			value = (int16_t)va_arg(ap, int);
+		else
+			value = (uint16_t)va_arg(ap, unsigned int);
+		wide >>= 1;
+
+		if (c == 'd' && (int32_t)value < 0)
+		{
+			pchar('-');
+			value = -value;
+		}
+		if (c == 'X' || c == 'x')
+			_digits(value, 16, width, c == 'X' ? 'A' : 'a');
+		else
+			_digits(value, 10, width, 'a');
+	}
+	va_end(ap);
+}
+
+#endif
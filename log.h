@@ -0,0 +1,89 @@
+// log.h
+//
+// Tokenized debug output.  LOG("joy samples %04X err %04X\n", a, b) sends
+//  a 16-bit hash of the format string and the arguments' binary values over
+//  the debug channel instead of the text: the format string stays on the
+//  host, in the dictionary host/logcat builds from the sources (make
+//  logdict), and never takes up flash.  host/logcat renders the log.
+//
+// On the wire, between the ASCII that print() still sends, a message is
+//  LOG_FRAME | n, the id low byte first, then n bytes of arguments, each
+//  little endian: 4 bytes for an argument wider than 16 bits (%lX, %lu in
+//  the format), 2 bytes for anything else.
+//
+// fmt must be a string literal.  Conversions: %X %x %u %d, with an
+//  optional 0 flag, width and l, and %%.  At most LOG_MAX_ARGS arguments.
+//
+// Built with LOG_TEXT, LOG() prints the text itself, like print() and
+//  phex() did, for hid_listen or anything else without the dictionary.
+
+#ifndef LOG_H
+#define LOG_H
+
+#include <stdint.h>
+#include <avr/pgmspace.h>
+
+// --------------------------------------------------------------------
+
+#define LOG_FRAME	0x80	// | bytes of arguments
+#define LOG_MAX_ARGS	10
+#define LOG_HASH_LEN	64	// characters of the format the id covers
+
+// The id: djb2 with xor, 16 bits, over the first LOG_HASH_LEN characters
+//  of fmt padded with zeros.  Every character is a constant, so the
+//  compiler folds it all into one; host/logcat computes the same.
+#define _LOG_C(s, i) ((i) < sizeof(s) ? (uint8_t)(s)[(i) < sizeof(s) ? (i) : 0] : 0)
+#define _LOG_H(h, s, i) ((uint16_t)((h) * 33u) ^ _LOG_C(s, i))
+#define _LOG_H4(h, s, i) _LOG_H(_LOG_H(_LOG_H(_LOG_H(h, s, i), s, i + 1), s, i + 2), s, i + 3)
+#define _LOG_H16(h, s, i) _LOG_H4(_LOG_H4(_LOG_H4(_LOG_H4(h, s, i), s, i + 4), s, i + 8), s, i + 12)
+#define LOG_ID(s) ((uint16_t)_LOG_H16(_LOG_H16(_LOG_H16(_LOG_H16(5381u, s, 0), s, 16), s, 32), s, 48))
+
+// How many arguments, and which of them are wider than 16 bits, one bit
+//  each from the first
+#define _LOG_NARGS(...) _LOG_NARGS_(_, ##__VA_ARGS__, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0)
+#define _LOG_NARGS_(_, a1, a2, a3, a4, a5, a6, a7, a8, a9, a10, n, ...) n
+
+#define _LOG_W(a, i) ((sizeof(a) > 2 ? 1u : 0u) << (i))
+#define _LOG_WIDE0() 0
+#define _LOG_WIDE1(a) _LOG_W(a, 0)
+#define _LOG_WIDE2(a, b) _LOG_WIDE1(a) | _LOG_W(b, 1)
+#define _LOG_WIDE3(a, b, c) _LOG_WIDE2(a, b) | _LOG_W(c, 2)
+#define _LOG_WIDE4(a, b, c, d) _LOG_WIDE3(a, b, c) | _LOG_W(d, 3)
+#define _LOG_WIDE5(a, b, c, d, e) _LOG_WIDE4(a, b, c, d) | _LOG_W(e, 4)
+#define _LOG_WIDE6(a, b, c, d, e, f) _LOG_WIDE5(a, b, c, d, e) | _LOG_W(f, 5)
+#define _LOG_WIDE7(a, b, c, d, e, f, g) _LOG_WIDE6(a, b, c, d, e, f) | _LOG_W(g, 6)
+#define _LOG_WIDE8(a, b, c, d, e, f, g, h) _LOG_WIDE7(a, b, c, d, e, f, g) | _LOG_W(h, 7)
+#define _LOG_WIDE9(a, b, c, d, e, f, g, h, i) _LOG_WIDE8(a, b, c, d, e, f, g, h) | _LOG_W(i, 8)
+#define _LOG_WIDE10(a, b, c, d, e, f, g, h, i, j) _LOG_WIDE9(a, b, c, d, e, f, g, h, i) | _LOG_W(j, 9)
+#define _LOG_CAT(a, b) _LOG_CAT_(a, b)
+#define _LOG_CAT_(a, b) a##b
+#define _LOG_WIDE(...) (_LOG_CAT(_LOG_WIDE, _LOG_NARGS(__VA_ARGS__))(__VA_ARGS__))
+
+// The compiler checks the arguments against the format, so an argument
+//  that's 32 bits on the AVR goes with %lX.  Never called.
+#ifdef __AVR__
+static inline void _log_check(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+static inline void _log_check(const char *fmt, ...) {}
+#define _LOG_CHECK(fmt, ...) do { if (0) _log_check(fmt, ##__VA_ARGS__); } while (0)
+#else
+#define _LOG_CHECK(fmt, ...) do { } while (0)
+#endif
+
+#ifdef LOG_TEXT
+#define LOG(fmt, ...) do { \
+	_LOG_CHECK(fmt, ##__VA_ARGS__); \
+	log_text(PSTR(fmt), _LOG_WIDE(__VA_ARGS__), ##__VA_ARGS__); \
+} while (0)
+#else
+#define LOG(fmt, ...) do { \
+	_LOG_CHECK(fmt, ##__VA_ARGS__); \
+	log_write(LOG_ID(fmt), _LOG_WIDE(__VA_ARGS__), _LOG_NARGS(__VA_ARGS__), ##__VA_ARGS__); \
+} while (0)
+#endif
+
+// --------------------------------------------------------------------
+
+void log_write(uint16_t id, uint16_t wide, uint8_t count, ...);
+void log_text(const char *fmt, uint16_t wide, ...);
+
+#endif //LOG_H
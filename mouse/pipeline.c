@@ -0,0 +1,81 @@
+// pipeline.c
+//
+// See pipeline.h
+
+#include "pipeline.h"
+
+#include <string.h>
+
+// ----------------------------------------------------------------------------
+
+// The curve: below kLowSensitivityThresh counts past the deadzone every
+//  kLowEndSensitivity counts make one, up to kMidSensitivityThresh every
+//  kMidSensitivity, then one for one
+const uint8_t kMidSensitivityThresh = 100;
+const int8_t kMidSensitivity = 8;
+const uint8_t kLowSensitivityThresh = 60;
+const int8_t kLowEndSensitivity = 12;
+
+// ----------------------------------------------------------------------------
+
+// No offset, no motion
+void pipeline_init(pipeline_state_t *state)
+{
+	memset(state, 0, sizeof(*state));
+	pipeline_reset(state);
+}
+
+// Forget the motion so far, when the stick is let go
+void pipeline_reset(pipeline_state_t *state)
+{
+#if PIPELINE_FILTER
+	state->filterX = 0;
+	state->filterY = 0;
+#endif
+#if PIPELINE_ACCEL
+	state->accel = 256;
+#endif
+#if PIPELINE_ACCUMULATE
+	state->restX = 0;
+	state->restY = 0;
+#endif
+}
+
+#if PIPELINE_DEADZONE || PIPELINE_CURVE
+// Deadzone and response curve as a function of deflection, for one step
+//  of the gain table
+static uint8_t _curve(uint8_t magnitude, uint8_t deadZoneRadius)
+{
+	uint8_t j = magnitude;
+
+#if PIPELINE_DEADZONE
+	if (magnitude <= deadZoneRadius)
+		return 0;
+	j = magnitude - deadZoneRadius;
+#endif
+#if PIPELINE_CURVE
+	if (j < kLowSensitivityThresh)
+		return j / kLowEndSensitivity;
+	if (j < kMidSensitivityThresh)
+		return j / kMidSensitivity;
+#endif
+	return j > 127 ? 127 : j;
+}
+#endif
+
+// The gain table pipeline_curve() looks up, for the deadzone and curve the
+//  build has
+void pipeline_build_gain(pipeline_state_t *state, uint8_t deadZoneRadius)
+{
+#if PIPELINE_DEADZONE || PIPELINE_CURVE
+	uint8_t i, m;
+	uint16_t gain;
+
+	for (i=0; i<PIPELINE_GAIN_STEPS; i++)
+	{
+		m = (i << 1) + 1;	// middle of the step
+		gain = (((uint16_t)_curve(m, deadZoneRadius) << 8) + (m >> 1)) / m;
+		state->gain[i] = gain > 255 ? 255 : gain;
+	}
+#endif
+}
@@ -0,0 +1,191 @@
+// pipeline.h
+//
+// What happens to each stick sample on its way to the pointer, as a row of
+//  stages over both axes at once:
+//
+//   offset -> filter -> deadzone/curve -> accel -> accumulate -> quantise
+//
+// Each stage is a static inline function on a pipeline_t, and
+//  pipeline_run() calls the ones pipeline_config.h builds in, in that
+//  order, so a stage that's left out costs nothing.  The values are whole
+//  counts up to the curve and 1/256ths of a count after it, until quantise
+//  rounds them back to the report's counts.
+//
+// Deadzone and curve are one stage: a gain for the deflection as a whole,
+//  looked up in a table that pipeline_build_gain() fills from both, so the
+//  vector keeps its direction.  The same code builds for the host, where
+//  host/replay runs it against recorded traces.
+
+#ifndef PIPELINE_H
+#define PIPELINE_H
+
+#include "pipeline_config.h"
+#include "../fixed.h"
+
+#include <stdint.h>
+
+// --------------------------------------------------------------------
+
+// The gain for a deflection of magnitude m is gain[m >> 1], in 1/256ths
+#define PIPELINE_GAIN_STEPS 128
+
+// The two axes on their way through
+typedef struct {
+	int16_t x;
+	int16_t y;
+} pipeline_t;
+
+// What the stages keep from one sample to the next
+typedef struct {
+	int8_t offsetX;		// counts, added to every sample
+	int8_t offsetY;
+#if PIPELINE_DEADZONE || PIPELINE_CURVE
+	uint8_t gain[PIPELINE_GAIN_STEPS];
+#endif
+#if PIPELINE_FILTER
+	int16_t filterX;	// counts, 4 fractional bits
+	int16_t filterY;
+#endif
+#if PIPELINE_ACCEL
+	uint16_t accel;		// 1/256ths
+#endif
+#if PIPELINE_ACCUMULATE
+	int16_t restX;		// 1/256ths of a count, not sent yet
+	int16_t restY;
+#endif
+} pipeline_state_t;
+
+// --------------------------------------------------------------------
+
+void pipeline_init(pipeline_state_t *state);
+void pipeline_reset(pipeline_state_t *state);
+void pipeline_build_gain(pipeline_state_t *state, uint8_t deadZoneRadius);
+
+// --------------------------------------------------------------------
+
+// Take the rest position off
+static inline void pipeline_offset(pipeline_t *p, const pipeline_state_t *state)
+{
+	p->x += state->offsetX;
+	p->y += state->offsetY;
+}
+
+#if PIPELINE_FILTER
+static inline void pipeline_filter(pipeline_t *p, pipeline_state_t *state)
+{
+	state->filterX += ((p->x << 4) - state->filterX) >> PIPELINE_FILTER_SHIFT;
+	state->filterY += ((p->y << 4) - state->filterY) >> PIPELINE_FILTER_SHIFT;
+	p->x = (state->filterX + 8) >> 4;
+	p->y = (state->filterY + 8) >> 4;
+}
+#endif
+
+#if PIPELINE_DEADZONE || PIPELINE_CURVE
+// Deadzone and curve: one magnitude estimate and one table lookup, then
+//  both axes scaled by the same gain
+static inline void pipeline_curve(pipeline_t *p, const pipeline_state_t *state)
+{
+	uint8_t gain = state->gain[fixed_hypot8(fixed_abs8(p->x), fixed_abs8(p->y)) >> 1];
+
+	p->x = fixed_scale8(p->x, gain);
+	p->y = fixed_scale8(p->y, gain);
+}
+#else
+// Neither: counts to 1/256ths as they are, within the report's range
+static inline void pipeline_curve(pipeline_t *p, const pipeline_state_t *state)
+{
+	int16_t x = p->x > 127 ? 127 : (p->x < -127 ? -127 : p->x);
+	int16_t y = p->y > 127 ? 127 : (p->y < -127 ? -127 : p->y);
+
+	p->x = x << 8;
+	p->y = y << 8;
+}
+#endif
+
+#if PIPELINE_ACCEL
+// Up by a step every sample the stick is out of the deadzone, back to 1x
+//  as soon as it isn't
+static inline void pipeline_accel(pipeline_t *p, pipeline_state_t *state)
+{
+	if (!p->x && !p->y)
+	{
+		state->accel = 256;
+		return;
+	}
+	p->x = fixed_sat16(fixed_mul16(p->x, state->accel) >> 8);
+	p->y = fixed_sat16(fixed_mul16(p->y, state->accel) >> 8);
+	if (state->accel < PIPELINE_ACCEL_MAX)
+		state->accel += PIPELINE_ACCEL_STEP;
+}
+#endif
+
+#if PIPELINE_ACCUMULATE
+// v plus a rest of at most half a count, kept clear of the int16 limits
+static inline int16_t pipeline_add_rest(int16_t v, int16_t rest)
+{
+	if (v > 0x7FFF - 128)
+		v = 0x7FFF - 128;
+	else if (v < -0x7FFF + 128)
+		v = -0x7FFF + 128;
+	return v + rest;
+}
+
+// What the last sample's rounding left over, see pipeline_quantise()
+static inline void pipeline_accumulate(pipeline_t *p, const pipeline_state_t *state)
+{
+	p->x = pipeline_add_rest(p->x, state->restX);
+	p->y = pipeline_add_rest(p->y, state->restY);
+}
+#endif
+
+// 1/256ths to whole counts, rounded half away from zero, -127 to 127
+static inline int16_t pipeline_round(int16_t v)
+{
+	uint16_t c = ((uint16_t)(v < 0 ? -v : v) + 128) >> 8;
+
+	if (c > 127)
+		c = 127;
+	return v < 0 ? -(int16_t)c : (int16_t)c;
+}
+
+static inline void pipeline_quantise(pipeline_t *p, pipeline_state_t *state)
+{
+	int16_t x = pipeline_round(p->x);
+	int16_t y = pipeline_round(p->y);
+
+#if PIPELINE_ACCUMULATE
+	// clamped to the report's range, the excess isn't kept
+	state->restX = p->x - (x << 8);
+	state->restY = p->y - (y << 8);
+	if (state->restX > 128 || state->restX < -128)
+		state->restX = 0;
+	if (state->restY > 128 || state->restY < -128)
+		state->restY = 0;
+#endif
+	p->x = x;
+	p->y = y;
+}
+
+// --------------------------------------------------------------------
+
+// A sample in, as read, and the movement for it out, in counts per
+//  UPSAMPLE_INPUT_MS
+static inline void pipeline_run(pipeline_t *p, pipeline_state_t *state)
+{
+#if PIPELINE_OFFSET
+	pipeline_offset(p, state);
+#endif
+#if PIPELINE_FILTER
+	pipeline_filter(p, state);
+#endif
+	pipeline_curve(p, state);
+#if PIPELINE_ACCEL
+	pipeline_accel(p, state);
+#endif
+#if PIPELINE_ACCUMULATE
+	pipeline_accumulate(p, state);
+#endif
+	pipeline_quantise(p, state);
+}
+
+#endif //PIPELINE_H
@@ -0,0 +1,58 @@
+// pipeline_config.h
+//
+// Which stages of the pointer pipeline (pipeline.h) are built in.  A stage
+//  set to 0 isn't compiled at all: no cycles, no flash, no state.  Any of
+//  them can be set from the command line instead, e.g.
+//  make CDEFS=-DPIPELINE_ACCEL=1, and make pipeline_size shows what each
+//  one costs in flash.
+//
+// The defaults are the pointer as it has always been: offset, deadzone and
+//  curve, rounded to whole counts per sample.
+
+#ifndef PIPELINE_CONFIG_H
+#define PIPELINE_CONFIG_H
+
+// --------------------------------------------------------------------
+
+// The calibrated rest position taken off each sample
+#ifndef PIPELINE_OFFSET
+#define PIPELINE_OFFSET      1
+#endif
+
+// Exponential smoothing of the position, a new sample counting for
+//  1/2^PIPELINE_FILTER_SHIFT.  Costs about that many periods of lag.
+#ifndef PIPELINE_FILTER
+#define PIPELINE_FILTER      0
+#endif
+#define PIPELINE_FILTER_SHIFT 1
+
+// Nothing inside the radial deadzone, the rest of the travel starting
+//  from 0 at its edge
+#ifndef PIPELINE_DEADZONE
+#define PIPELINE_DEADZONE    1
+#endif
+
+// Finer control near the centre: counts divided down more at small
+//  deflections than at large ones
+#ifndef PIPELINE_CURVE
+#define PIPELINE_CURVE       1
+#endif
+
+// Speed building up while the stick is held out of the deadzone, from 1x
+//  by PIPELINE_ACCEL_STEP/256 a sample up to PIPELINE_ACCEL_MAX/256
+#ifndef PIPELINE_ACCEL
+#define PIPELINE_ACCEL       0
+#endif
+#define PIPELINE_ACCEL_STEP  8
+#define PIPELINE_ACCEL_MAX   512
+
+// Carry what rounding to whole counts leaves over to the next sample,
+//  so slow movements aren't lost
+#ifndef PIPELINE_ACCUMULATE
+#define PIPELINE_ACCUMULATE  0
+#endif
+
+// Quantising to the report's whole counts, -127 to 127, is always last and
+//  always there
+
+#endif //PIPELINE_CONFIG_H
@@ -0,0 +1,162 @@
+// upsample.c
+//
+// Turns the stick's samples, which arrive about every 20 ms, into a
+//  movement for every 1 ms USB frame.  Speeds are kept per axis in counts
+//  per frame with 8 fractional bits, and a per-axis accumulator carries the
+//  fractions over from frame to frame, so no movement is lost to rounding.
+//
+// Interpolation ramps from the current speed to each new sample over one
+//  sample period, which costs about half a period of latency on average.
+//  Extrapolation jumps to each new sample and keeps changing at the rate of
+//  the last change for at most half a period (so it overshoots by at most
+//  half that change), and never past zero.
+
+#include "upsample.h"
+#include "../fixed.h"
+
+#include <string.h>
+
+// ----------------------------------------------------------------------------
+
+// Sample period estimate, in frames: starts at the N35P112's 20 ms, follows
+//  the measured period, and ignores gaps outside this range
+const uint8_t kMinPeriodMs = 10;
+const uint8_t kMaxPeriodMs = 40;
+
+// ----------------------------------------------------------------------------
+
+typedef struct {
+	int16_t speed;		// counts per frame, Q8
+	int16_t target;		// latest sample, counts per frame, Q8
+	int16_t step;		// change per frame while ramping
+	int16_t frac;		// movement not sent yet, Q8, 0..255
+} upsample_axis_t;
+
+// static data
+static uint8_t sMode = UPSAMPLE_DEFAULT_MODE;
+static upsample_axis_t sAxis[2];
+static uint8_t sRampFrames = 0;
+static uint8_t sPeriodMs = 20;	// what the N35P112 does
+static uint16_t sLastUs = 0;
+static uint8_t sHaveLast = 0;
+
+// ----------------------------------------------------------------------------
+
+// Forget all motion, e.g. after the bus was suspended
+void upsample_reset(void)
+{
+	memset(sAxis, 0, sizeof(sAxis));
+	sRampFrames = 0;
+	sPeriodMs = 20;
+	sHaveLast = 0;
+}
+
+void upsample_set_mode(uint8_t mode)
+{
+	sMode = mode;
+}
+
+uint8_t upsample_get_mode(void)
+{
+	return sMode;
+}
+
+// Set up a ramp towards a new target, according to the mode
+static void _retarget(upsample_axis_t *axis, int16_t target)
+{
+	switch (sMode)
+	{
+		case UPSAMPLE_INTERPOLATE:
+			axis->step = (target - axis->speed) / (int16_t)sPeriodMs;
+			break;
+		case UPSAMPLE_EXTRAPOLATE:
+			axis->step = (target - axis->target) / (int16_t)sPeriodMs;
+			axis->speed = target;
+			break;
+		default:
+			axis->step = 0;
+			axis->speed = target;
+			break;
+	}
+	axis->target = target;
+}
+
+static void _start_ramp(void)
+{
+	if (sMode == UPSAMPLE_INTERPOLATE)
+		sRampFrames = sPeriodMs;
+	else if (sMode == UPSAMPLE_EXTRAPOLATE)
+		sRampFrames = sPeriodMs >> 1;
+	else
+		sRampFrames = 0;
+}
+
+/* A new sample, in counts per UPSAMPLE_INPUT_MS, taken at the given
+ *  teensy_get_us() time
+ */
+void upsample_push(int8_t x, int8_t y, uint16_t us)
+{
+	uint16_t periodMs;
+
+	if (sHaveLast)
+	{
+		periodMs = FIXED_DIV_U16((uint16_t)(us - sLastUs), 1000);
+		if (periodMs >= kMinPeriodMs && periodMs <= kMaxPeriodMs)
+			sPeriodMs = (3 * sPeriodMs + periodMs + 2) >> 2;
+	}
+	sLastUs = us;
+	sHaveLast = 1;
+
+	_retarget(&sAxis[0], ((int16_t)x << 8) / UPSAMPLE_INPUT_MS);
+	_retarget(&sAxis[1], ((int16_t)y << 8) / UPSAMPLE_INPUT_MS);
+	_start_ramp();
+}
+
+// The stick was let go.  By the time this is known a conversion has found
+//  it back in the deadzone, so stop right away, in every mode.
+void upsample_release(void)
+{
+	memset(sAxis, 0, sizeof(sAxis));
+	sRampFrames = 0;
+	// the gap before a release isn't a sample period
+	sHaveLast = 0;
+}
+
+static int8_t _advance(upsample_axis_t *axis)
+{
+	int16_t counts;
+
+	if (sRampFrames)
+	{
+		axis->speed += axis->step;
+		// interpolation lands exactly on the target, extrapolation never
+		//  turns the pointer around
+		if (sMode == UPSAMPLE_INTERPOLATE)
+		{
+			if (sRampFrames == 1)
+				axis->speed = axis->target;
+		}
+		else if ((axis->target >= 0 && axis->speed < 0) || (axis->target <= 0 && axis->speed > 0))
+		{
+			axis->speed = 0;
+		}
+	}
+
+	axis->frac += axis->speed;
+	counts = axis->frac >> 8;	// rounds towards -inf, frac stays 0..255
+	axis->frac -= counts * 256;
+	if (counts > 127)
+		counts = 127;
+	else if (counts < -127)
+		counts = -127;
+	return counts;
+}
+
+// The movement for one 1 ms frame
+void upsample_frame(int8_t *dx, int8_t *dy)
+{
+	*dx = _advance(&sAxis[0]);
+	*dy = _advance(&sAxis[1]);
+	if (sRampFrames)
+		sRampFrames--;
+}
@@ -0,0 +1,32 @@
+// upsample.h
+
+#ifndef UPSAMPLE_H
+#define UPSAMPLE_H
+
+#include <stdint.h>
+
+// --------------------------------------------------------------------
+
+// How the ~50 Hz stream of stick samples becomes one report per 1 ms frame
+#define UPSAMPLE_HOLD         0	// each sample's speed until the next one
+#define UPSAMPLE_INTERPOLATE  1	// ramp to each new sample over a sample period
+#define UPSAMPLE_EXTRAPOLATE  2	// continue the last change, for half a period
+
+#ifndef UPSAMPLE_DEFAULT_MODE
+#define UPSAMPLE_DEFAULT_MODE UPSAMPLE_INTERPOLATE
+#endif
+
+// The stick's values are counts per this many ms, the report period the
+//  pointer speed was tuned for
+#define UPSAMPLE_INPUT_MS 5
+
+// --------------------------------------------------------------------
+
+void upsample_reset(void);
+void upsample_set_mode(uint8_t mode);
+uint8_t upsample_get_mode(void);
+void upsample_push(int8_t x, int8_t y, uint16_t us);
+void upsample_release(void);
+void upsample_frame(int8_t *dx, int8_t *dy);
+
+#endif //UPSAMPLE_H
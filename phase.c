@@ -0,0 +1,152 @@
+// phase.c
+//
+// See phase.h
+
+#include "phase.h"
+#include "controller/teensy-2-0.h"
+#include "usb_mouse_debug.h"
+#include "health.h"
+#include "log.h"
+
+// ----------------------------------------------------------------------------
+
+// A full speed frame
+const uint16_t kPhaseFrameUs = 1000;
+
+// ----------------------------------------------------------------------------
+
+// static data
+static uint8_t sLock = PHASE_LOCK;
+static uint8_t sFrame = 0;
+static uint8_t sSampleNew = 0;	// the latest sample hasn't gone out yet
+static uint16_t sSampleUs = 0;
+static uint16_t sAgeUs = 0;
+static phase_stats_t sStats = { .ageMinUs = 0xFFFF };
+
+// ----------------------------------------------------------------------------
+
+// Where us falls in its USB frame, us after that frame's SOF.  Any SOF
+//  from up to ~30 ms either side will do, the frames are all alike.
+static uint16_t _in_frame(uint16_t us, uint16_t sofUs)
+{
+	int16_t d = (int16_t)(us - sofUs) % (int16_t)kPhaseFrameUs;
+
+	return d < 0 ? d + kPhaseFrameUs : d;
+}
+
+static void _count(uint16_t *bins, uint16_t bin)
+{
+	if (bin >= PHASE_BINS)
+		bin = PHASE_BINS - 1;
+	if (bins[bin] < 0xFFFF)
+		bins[bin]++;
+}
+
+// Frames from the host's SOFs (1), or from timer0 (0).  Set it before the
+//  main loop starts counting, the two don't count alike.
+void phase_set_lock(uint8_t on)
+{
+	sLock = on;
+}
+
+/* The main loop's frame counter, in place of teensy_get_elapsed_ms().
+ *  Locked, a frame starts PHASE_LEAD_US before each SOF is due; with no
+ *  SOFs coming, it goes on counting by the clock from the last one, for
+ *  up to ~65 ms.
+ *
+ * returns
+ * - frames, modulo 256
+ */
+uint8_t phase_frame(void)
+{
+	uint16_t sofUs;
+	uint8_t frame;
+
+	if (sLock)
+	{
+		frame = usb_get_sof(&sofUs);
+		frame += (uint16_t)(teensy_get_us() - sofUs + PHASE_LEAD_US) / kPhaseFrameUs;
+	}
+	else
+	{
+		frame = teensy_get_elapsed_ms();
+	}
+
+	if (frame != sFrame)
+	{
+		sFrame = frame;
+		usb_get_sof(&sofUs);
+		_count(sStats.frame, _in_frame(teensy_get_us(), sofUs) / PHASE_BIN_US);
+	}
+	return frame;
+}
+
+// A new sample from the stick, n35p112_get_sample_us()
+void phase_sample(uint16_t sampleUs)
+{
+	uint16_t sofUs;
+
+	usb_get_sof(&sofUs);
+	_count(sStats.conversion, _in_frame(sampleUs, sofUs) / PHASE_BIN_US);
+	sSampleUs = sampleUs;
+	sSampleNew = 1;
+}
+
+// A report went out this frame.  The first one after a sample takes its
+//  age, up to the next SOF, which is when the host gets it.
+void phase_report(void)
+{
+	uint16_t sofUs, nowUs, nextSofUs;
+
+	if (!sSampleNew)
+		return;
+	sSampleNew = 0;
+
+	usb_get_sof(&sofUs);
+	nowUs = teensy_get_us();
+	nextSofUs = nowUs - _in_frame(nowUs, sofUs) + kPhaseFrameUs;
+	sAgeUs = nextSofUs - sSampleUs;
+	health.sampleAgeUs = sAgeUs;
+
+	_count(sStats.age, sAgeUs / PHASE_AGE_BIN_US);
+	if (sStats.ageCount == 0xFFFF)
+	{
+		sStats.ageCount = 0;
+		sStats.ageTotalUs = 0;
+	}
+	sStats.ageCount++;
+	sStats.ageTotalUs += sAgeUs;
+	if (sAgeUs < sStats.ageMinUs)
+		sStats.ageMinUs = sAgeUs;
+	if (sAgeUs > sStats.ageMaxUs)
+		sStats.ageMaxUs = health.sampleAgeMaxUs = sAgeUs;
+}
+
+// The latest sample's age at its first report, us
+uint16_t phase_get_age_us(void)
+{
+	return sAgeUs;
+}
+
+const phase_stats_t *phase_get_stats(void)
+{
+	return &sStats;
+}
+
+void phase_print_stats(void)
+{
+	const uint16_t *b;
+
+	b = sStats.conversion;
+	LOG("phase conv %04X %04X %04X %04X %04X %04X %04X %04X\n",
+	    b[0], b[1], b[2], b[3], b[4], b[5], b[6], b[7]);
+	b = sStats.frame;
+	LOG("phase frame %04X %04X %04X %04X %04X %04X %04X %04X\n",
+	    b[0], b[1], b[2], b[3], b[4], b[5], b[6], b[7]);
+	b = sStats.age;
+	LOG("phase age %04X %04X %04X %04X %04X %04X %04X %04X\n",
+	    b[0], b[1], b[2], b[3], b[4], b[5], b[6], b[7]);
+	LOG("phase age us %04X/%04X/%04X lock %u\n", sStats.ageMinUs,
+	    sStats.ageCount ? (uint16_t)(sStats.ageTotalUs / sStats.ageCount) : 0,
+	    sStats.ageMaxUs, sLock);
+}
@@ -0,0 +1,61 @@
+// phase.h
+//
+// Where things fall against the host's USB frames.  The stick converts on
+//  its own 20 ms timebase, the main loop ran off timer0, and the host takes
+//  a report at the start of each frame, three clocks that drift against
+//  each other.  The chip has no way to start a conversion on demand, so
+//  what can be lined up is the main loop: with the lock on, phase_frame()
+//  starts each frame PHASE_LEAD_US before the next SOF, so a sample read
+//  during a frame is in the report the host takes at the next one.
+//
+// Kept here, for phase_print_stats():
+//  - where in the USB frame the stick's samples came, which shows the
+//    conversions walking through it
+//  - where the main loop's frames started
+//  - for each sample, how old it was at the SOF that took its first
+//    report: interrupt, read, a wait for the main loop and a wait for the
+//    host.  The latest one is in the health report too.
+
+#ifndef PHASE_H
+#define PHASE_H
+
+#include <stdint.h>
+
+// --------------------------------------------------------------------
+
+// The main loop's work for a frame: the matrix, both reports and the
+//  stick, with room to spare
+#define PHASE_LEAD_US 250
+
+// Lock the main loop to the host's frames, see phase_set_lock()
+#ifndef PHASE_LOCK
+#define PHASE_LOCK 1
+#endif
+
+// Histograms: where in the frame, 125 us a bin; sample age, 250 us a bin,
+//  the last one for everything older
+#define PHASE_BINS 8
+#define PHASE_BIN_US 125
+#define PHASE_AGE_BIN_US 250
+
+typedef struct {
+	uint16_t conversion[PHASE_BINS];	// sample interrupts, after the SOF
+	uint16_t frame[PHASE_BINS];		// main loop frames, after the SOF
+	uint16_t age[PHASE_BINS];		// samples, by age at their first report
+	uint16_t ageCount;
+	uint16_t ageMinUs;
+	uint16_t ageMaxUs;
+	uint32_t ageTotalUs;
+} phase_stats_t;
+
+// --------------------------------------------------------------------
+
+void phase_set_lock(uint8_t on);
+uint8_t phase_frame(void);
+void phase_sample(uint16_t sampleUs);
+void phase_report(void);
+uint16_t phase_get_age_us(void);
+const phase_stats_t *phase_get_stats(void);
+void phase_print_stats(void);
+
+#endif //PHASE_H
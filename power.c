@@ -0,0 +1,112 @@
+// power.c
+//
+// See power.h
+
+#include "power.h"
+#include "log.h"
+
+#include <avr/interrupt.h>
+#include <string.h>
+
+// ----------------------------------------------------------------------------
+
+const uint16_t kPowerUa[POWER_STATES] = {
+	POWER_UA_ACTIVE, POWER_UA_IDLE, POWER_UA_SPIN, POWER_UA_SLEEP
+};
+const uint16_t kPowerSensorUa[POWER_SENSOR_MODES] = {
+	POWER_UA_SENSOR_ACTIVE, POWER_UA_SENSOR_SLEEP
+};
+
+// uA s in a uAh
+const uint16_t kPowerUaSPerUah = 3600;
+
+// ----------------------------------------------------------------------------
+
+volatile uint8_t power_state = POWER_ACTIVE;
+volatile uint8_t power_sensor = POWER_SENSOR_ACTIVE;
+volatile power_residency_t power_residency;
+
+// static data
+static power_residency_t sLast;		// as of the last power_update()
+static uint32_t sUaS = 0;		// charge short of a whole uAh
+static uint16_t sUaMs = 0;		// ... and of a whole uA s
+static power_energy_t sEnergy;
+
+// ----------------------------------------------------------------------------
+
+// Charge for ms at ua, whole uA s into *uaS and the rest into *uaMs.  In
+//  seconds the sums stay in 32 bits for days awake or years asleep.
+static void _charge(uint32_t ms, uint16_t ua, uint32_t *uaS, uint32_t *uaMs)
+{
+	*uaS += (ms / 1000) * ua;
+	*uaMs += (ms % 1000) * ua;
+}
+
+// part / whole, per mille, whole up to days of ms
+static uint16_t _permille(uint32_t part, uint32_t whole)
+{
+	if (whole < 0x400000)
+		return part * 1000 / whole;
+	return part / (whole / 1000);
+}
+
+/* Charge the time since the last call to the table, and work out the
+ *  average current over it.  The stats period calls it, and leaving
+ *  suspend.
+ */
+void power_update(void)
+{
+	power_residency_t now;
+	uint32_t ms, periodMs = 0, uaS = 0, uaMs = sUaMs;
+	uint8_t i, sreg = SREG;
+
+	cli();
+	memcpy(&now, (const void *)&power_residency, sizeof(now));
+	SREG = sreg;
+
+	for (i=0; i<POWER_STATES; i++)
+	{
+		ms = now.ms[i] - sLast.ms[i];
+		periodMs += ms;
+		_charge(ms, kPowerUa[i], &uaS, &uaMs);
+	}
+	for (i=0; i<POWER_SENSOR_MODES; i++)
+		_charge(now.sensorMs[i] - sLast.sensorMs[i], kPowerSensorUa[i], &uaS, &uaMs);
+	if (!periodMs)
+		return;
+
+	for (i=0; i<POWER_STATES; i++)
+		sEnergy.permille[i] = _permille(now.ms[i] - sLast.ms[i], periodMs);
+	sEnergy.sensorSleepPermille =
+		_permille(now.sensorMs[POWER_SENSOR_SLEEP] - sLast.sensorMs[POWER_SENSOR_SLEEP], periodMs);
+	if (periodMs < 0x10000)
+		sEnergy.averageUa = (uaS * 1000 + uaMs - sUaMs) / periodMs;
+	else
+		sEnergy.averageUa = uaS / (periodMs / 1000);
+	if (sEnergy.averageUa > sEnergy.maxUa)
+		sEnergy.maxUa = sEnergy.averageUa;
+
+	uaS += uaMs / 1000;
+	sUaMs = uaMs % 1000;
+	sUaS += uaS;
+	sEnergy.uAh += sUaS / kPowerUaSPerUah;
+	sUaS %= kPowerUaSPerUah;
+	sLast = now;
+}
+
+const power_energy_t *power_get_energy(void)
+{
+	return &sEnergy;
+}
+
+// Where the last period went, per mille of it, what it drew on average,
+//  and the charge since reset
+void power_print_stats(void)
+{
+	power_update();
+	LOG("power active %u idle %u spin %u sleep %u, stick asleep %u\n",
+	    sEnergy.permille[POWER_ACTIVE], sEnergy.permille[POWER_IDLE],
+	    sEnergy.permille[POWER_SPIN], sEnergy.permille[POWER_SLEEP],
+	    sEnergy.sensorSleepPermille);
+	LOG("power %u uA, max %u uA, %lu uAh\n", sEnergy.averageUa, sEnergy.maxUa, sEnergy.uAh);
+}
@@ -0,0 +1,115 @@
+// power.h
+//
+// Where the time goes, for a current budget.  The Timer0 tick counts each
+//  millisecond against what the CPU is doing then (power_state) and which
+//  mode the stick is in (power_sensor); a table of currents turns the counts
+//  into the average current and the charge drawn, see power_print_stats().
+//  Asleep Timer0 stops, so teensy_sleep() has the watchdog wake it every
+//  POWER_SLEEP_TICK_MS to count the time instead.
+//
+// The states are sampled, not timed: a wait shorter than a tick shows up in
+//  proportion to how often it's going on when the tick comes, which over a
+//  stats period is all the average needs.
+//
+// The currents are typical figures for the whole unit through VBUS, not
+//  measurements.  Measure a unit in each state and build with them, e.g.
+//  make CDEFS+=-DPOWER_UA_ACTIVE=11500, before going by the totals.
+
+#ifndef POWER_H
+#define POWER_H
+
+#include <stdint.h>
+
+// --------------------------------------------------------------------
+
+// CPU states
+#define POWER_ACTIVE 0	// the main loop's work, interrupts
+#define POWER_IDLE   1	// the main loop with nothing due, polling for its tick
+#define POWER_SPIN   2	// busy waiting: _delay_ms(), a TWI transfer, a USB bank
+#define POWER_SLEEP  3	// powered down, the host has the bus suspended
+#define POWER_STATES 4
+
+// The stick's modes, see n35p112_suspend()
+#define POWER_SENSOR_ACTIVE 0	// a conversion every 20 ms
+#define POWER_SENSOR_SLEEP  1	// wake-up mode, one every 320 ms
+#define POWER_SENSOR_MODES  2
+
+// Current in each, uA.  The CPU draws the same running or spinning at
+//  16 MHz with the PLL and USB on; in power down it's the regulator and the
+//  USB pull-up.
+#ifndef POWER_UA_ACTIVE
+#define POWER_UA_ACTIVE 14000
+#endif
+#ifndef POWER_UA_IDLE
+#define POWER_UA_IDLE 14000
+#endif
+#ifndef POWER_UA_SPIN
+#define POWER_UA_SPIN 14000
+#endif
+#ifndef POWER_UA_SLEEP
+#define POWER_UA_SLEEP 250
+#endif
+#ifndef POWER_UA_SENSOR_ACTIVE
+#define POWER_UA_SENSOR_ACTIVE 400
+#endif
+#ifndef POWER_UA_SENSOR_SLEEP
+#define POWER_UA_SENSOR_SLEEP 30
+#endif
+
+// The watchdog's period asleep, WDP2 = 250 ms
+#define POWER_SLEEP_TICK_MS 250
+
+// Milliseconds in each state and mode since reset
+typedef struct {
+	uint32_t ms[POWER_STATES];
+	uint32_t sensorMs[POWER_SENSOR_MODES];
+} power_residency_t;
+
+// What the counts come to, as of the last power_update()
+typedef struct {
+	uint32_t uAh;			// charge since reset
+	uint16_t averageUa;		// over the last period
+	uint16_t maxUa;			// the highest period average
+	uint16_t permille[POWER_STATES];	// of the last period
+	uint16_t sensorSleepPermille;
+} power_energy_t;
+
+// --------------------------------------------------------------------
+
+extern volatile uint8_t power_state;
+extern volatile uint8_t power_sensor;
+extern volatile power_residency_t power_residency;
+
+// From the tick, with interrupts off
+static inline void power_tick(uint16_t ms)
+{
+	power_residency.ms[power_state] += ms;
+	power_residency.sensorMs[power_sensor] += ms;
+}
+
+// Mark a busy wait.  Returns the state to put back with power_set() after.
+static inline uint8_t power_spin(void)
+{
+	uint8_t state = power_state;
+
+	power_state = POWER_SPIN;
+	return state;
+}
+
+static inline void power_set(uint8_t state)
+{
+	power_state = state;
+}
+
+// _delay_ms() counted as a busy wait
+#define POWER_DELAY_MS(ms) do { \
+	uint8_t _powerState = power_spin(); \
+	_delay_ms(ms); \
+	power_set(_powerState); \
+} while (0)
+
+void power_update(void);
+const power_energy_t *power_get_energy(void);
+void power_print_stats(void);
+
+#endif //POWER_H
@@ -0,0 +1,218 @@
+// twi_sched.c
+//
+// Shares the TWI bus between several device drivers.  Drivers don't touch
+//  the bus whenever they like, they ask for a turn with twi_sched_request()
+//  (also from interrupt context) and their service function is called from
+//  twi_sched_run() in the main loop.  The highest priority pending device
+//  goes first, but a device that has been passed over kStarveLimit times
+//  is served next regardless of priority.
+
+#include "twi_sched.h"
+#include "twi_teensy-2-0.h"
+#include "../controller/teensy-2-0.h"
+#include "../capture.h"
+
+#include "../log.h"
+
+#include <avr/io.h>
+#include <avr/interrupt.h>
+
+// ----------------------------------------------------------------------------
+
+const uint8_t kStarveLimit = 8;
+
+// ----------------------------------------------------------------------------
+
+typedef struct {
+	twi_sched_service_t service;
+	uint8_t priority;
+	uint8_t age;		// times passed over while pending
+	uint16_t requestUs;
+	twi_sched_stats_t stats;
+} twi_sched_device_t;
+
+// static data
+static twi_sched_device_t sDevices[TWI_SCHED_MAX_DEVICES];
+static uint8_t sNumDevices = 0;
+volatile static uint8_t sPending = 0;
+
+/* Register a device driver with the scheduler.
+ *
+ * returns
+ * - the device id to pass to twi_sched_request(), or TWI_SCHED_NO_DEVICE
+ *   if there are TWI_SCHED_MAX_DEVICES already
+ */
+uint8_t twi_sched_add_device(uint8_t priority, twi_sched_service_t service)
+{
+	twi_sched_device_t *dev;
+
+	if (sNumDevices >= TWI_SCHED_MAX_DEVICES)
+	{
+		LOG("twi_sched: no room for another device\n");
+		return TWI_SCHED_NO_DEVICE;
+	}
+	dev = &sDevices[sNumDevices];
+	dev->service = service;
+	dev->priority = priority;
+	return sNumDevices++;
+}
+
+// Ask for a turn on the bus.  Safe to call from interrupt context, and
+//  asking again before the device has been served is a no-op, as is asking
+//  for a device that was never added.
+void twi_sched_request(uint8_t device)
+{
+	uint8_t intr_state;
+
+	if (device >= sNumDevices)
+		return;
+	intr_state = SREG;
+	cli();
+	if (!(sPending & (1 << device)))
+	{
+		sPending |= (1 << device);
+		sDevices[device].requestUs = teensy_get_us();
+	}
+	SREG = intr_state;
+}
+
+static uint8_t _pick(uint8_t pending)
+{
+	uint8_t i, best = 0xFF;
+	twi_sched_device_t *dev;
+
+	for (i=0; i<sNumDevices; i++)
+	{
+		if (!(pending & (1 << i)))
+			continue;
+		dev = &sDevices[i];
+		if (dev->age >= kStarveLimit)
+		{
+			dev->stats.starved++;
+			return i;
+		}
+		if (best == 0xFF || dev->priority > sDevices[best].priority)
+			best = i;
+	}
+	return best;
+}
+
+/* Serve pending devices until none are left.  Priorities are re-evaluated
+ *  before every service call, so a critical request raised while another
+ *  device holds the bus waits for at most one transaction.
+ *
+ * returns
+ * - the number of devices served
+ */
+uint8_t twi_sched_run(void)
+{
+	uint8_t i, id, pending, error, intr_state;
+	uint8_t served = 0;
+	uint16_t startUs, busUs, waitUs;
+	twi_sched_device_t *dev;
+
+	while ((pending = sPending))
+	{
+		id = _pick(pending);
+		dev = &sDevices[id];
+
+		// age everything that has to wait another turn
+		for (i=0; i<sNumDevices; i++)
+		{
+			if (i != id && (pending & (1 << i)))
+				sDevices[i].age++;
+		}
+		dev->age = 0;
+
+		// clear the request first, so that a new one raised during the
+		//  service isn't lost
+		intr_state = SREG;
+		cli();
+		sPending &=~ (1 << id);
+		startUs = teensy_get_us();
+		waitUs = startUs - dev->requestUs;
+		SREG = intr_state;
+
+		error = dev->service();
+		if (error == TWI_ERROR_BusFault ||
+		    error == TWI_ERROR_BusCaptureTimeout ||
+		    error == TWI_ERROR_BusTimeout)
+		{
+			twi_sched_recover(id);
+		}
+
+		busUs = teensy_get_us() - startUs;
+		dev->stats.jobs++;
+		if (error != TWI_ERROR_NoError)
+			dev->stats.errors++;
+		if (error == TWI_SCHED_SLAVE_BUSY)
+			dev->stats.busy++;
+		else if (error == TWI_ERROR_SlaveNotReady || error == TWI_ERROR_SlaveNAK)
+			dev->stats.naks++;
+		else if (error != TWI_ERROR_NoError)
+			dev->stats.timeouts++;
+		dev->stats.busUs += busUs;
+		if (busUs > dev->stats.maxBusUs)
+			dev->stats.maxBusUs = busUs;
+		if (waitUs > dev->stats.maxWaitUs)
+			dev->stats.maxWaitUs = waitUs;
+		capture_twi(startUs, id, error, busUs);
+		served++;
+	}
+	return served;
+}
+
+/* Run the bus-clear sequence and charge it to a device.  twi_sched_run()
+ *  does this itself; it's public for drivers that use the bus directly
+ *  before the scheduler is running.
+ *
+ * returns
+ * - a TWI_ErrorCodes_t value, TWI_ERROR_BusFault if the bus is still held
+ */
+uint8_t twi_sched_recover(uint8_t device)
+{
+	uint8_t error;
+	uint16_t startUs = teensy_get_us();
+	twi_sched_stats_t *stats;
+
+	error = TWI_RecoverBus();
+	if (device < sNumDevices)
+	{
+		stats = &sDevices[device].stats;
+		stats->recoveries++;
+		stats->recoveryUs += teensy_get_us() - startUs;
+	}
+	return error;
+}
+
+// Non-zero while any device is waiting for the bus
+uint8_t twi_sched_pending(void)
+{
+	return sPending;
+}
+
+uint8_t twi_sched_get_num_devices(void)
+{
+	return sNumDevices;
+}
+
+const twi_sched_stats_t *twi_sched_get_stats(uint8_t device)
+{
+	return &sDevices[device].stats;
+}
+
+// One line per device: id, jobs, errors, starved, max wait us, max bus us,
+//  total bus us, bus recoveries, us spent recovering
+void twi_sched_print_stats(void)
+{
+	uint8_t i;
+	twi_sched_stats_t *stats;
+
+	for (i=0; i<sNumDevices; i++)
+	{
+		stats = &sDevices[i].stats;
+		LOG("twi dev %02X: jobs %04X err %04X starved %04X wait %04X max %04X us %08lX rec %04X %04X\n",
+		    i, stats->jobs, stats->errors, stats->starved, stats->maxWaitUs,
+		    stats->maxBusUs, stats->busUs, stats->recoveries, stats->recoveryUs);
+	}
+}
@@ -0,0 +1,60 @@
+// twi_sched.h
+
+#ifndef TWI_SCHED_H
+#define TWI_SCHED_H
+
+#include <stdint.h>
+
+// --------------------------------------------------------------------
+
+#define TWI_SCHED_MAX_DEVICES 4
+
+// twi_sched_add_device() with the table full
+#define TWI_SCHED_NO_DEVICE   0xFF
+
+// Device priorities, higher runs first
+#define TWI_SCHED_PRIORITY_LOW       0
+#define TWI_SCHED_PRIORITY_NORMAL    4
+#define TWI_SCHED_PRIORITY_CRITICAL  8
+
+// A device's service function does one bus transaction (or one short burst
+//  of them) and returns a TWI_ErrorCodes_t value.  A bus level error (fault,
+//  capture timeout or a stalled byte) makes the scheduler run the bus-clear
+//  sequence before anything else gets a turn.  The service should drop
+//  whatever it read on any error and ask again if it still needs the data.
+typedef uint8_t (*twi_sched_service_t)(void);
+
+// What a service returns instead of TWI_ERROR_SlaveNotReady for a slave
+//  that is allowed to turn its address down while busy, or to be missing,
+//  like the other half in split mode (controller/split.h).  It counts as
+//  busy, not as a NAK, so it doesn't look like a bus that runs too fast to
+//  twi_tune_update().
+#define TWI_SCHED_SLAVE_BUSY 0x40
+
+// Per-device bus accounting
+typedef struct {
+	uint16_t jobs;
+	uint16_t errors;
+	uint16_t naks;		// errors where a slave said no
+	uint16_t busy;		// errors where it was busy, TWI_SCHED_SLAVE_BUSY
+	uint16_t timeouts;	// errors where the bus didn't move
+	uint16_t starved;	// times promoted past a higher priority device
+	uint16_t maxWaitUs;	// request to start of service
+	uint16_t maxBusUs;	// longest single service
+	uint32_t busUs;		// total time spent on the bus
+	uint16_t recoveries;	// bus-clear sequences after this device's errors
+	uint16_t recoveryUs;	// total time spent in them
+} twi_sched_stats_t;
+
+// --------------------------------------------------------------------
+
+uint8_t twi_sched_add_device(uint8_t priority, twi_sched_service_t service);
+void twi_sched_request(uint8_t device);
+uint8_t twi_sched_run(void);
+uint8_t twi_sched_get_num_devices(void);
+uint8_t twi_sched_pending(void);
+const twi_sched_stats_t *twi_sched_get_stats(uint8_t device);
+void twi_sched_print_stats(void);
+uint8_t twi_sched_recover(uint8_t device);
+
+#endif //TWI_SCHED_H
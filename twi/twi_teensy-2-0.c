@@ -29,9 +29,37 @@
 */
 
 #include "twi_teensy-2-0.h"
+#include "../power.h"
 
 #include <util/delay.h>
 
+// SCL and SDA are PD0 and PD1 on the ATmega32U4
+#define TWI_SCL (1 << 0)
+#define TWI_SDA (1 << 1)
+
+// Waits for the current byte to finish, for at most TWI_BYTE_TIMEOUT_US
+static bool TWI_WaitForComplete(void)
+{
+	uint16_t TimeoutRemaining = TWI_BYTE_TIMEOUT_US;
+
+	while (!(TWCR & (1 << TWINT)))
+	{
+		if (!(TimeoutRemaining--))
+		  return false;
+
+		_delay_us(1);
+	}
+
+	return true;
+}
+
+// Tells a NAK from a byte that never finished, after TWI_SendByte() or
+//  TWI_ReceiveByte() has failed
+static inline uint8_t TWI_ByteError(void)
+{
+	return (TWCR & (1 << TWINT)) ? TWI_ERROR_SlaveNAK : TWI_ERROR_BusTimeout;
+}
+
 uint8_t TWI_StartTransmission(const uint8_t SlaveAddress,
                               const uint8_t TimeoutMS)
 {
@@ -65,7 +93,8 @@ uint8_t TWI_StartTransmission(const uint8_t SlaveAddress,
 			_delay_us(10);
 		}
 
-		if (!(TimeoutRemaining))
+		// TimeoutRemaining wraps when the loop runs out, so test the outcome
+		if (!(BusCaptured))
 		{
 			TWCR = (1 << TWEN);
 			return TWI_ERROR_BusCaptureTimeout;
@@ -83,8 +112,11 @@ uint8_t TWI_StartTransmission(const uint8_t SlaveAddress,
 			_delay_us(10);
 		}
 
-		if (!(TimeoutRemaining))
-		  return TWI_ERROR_SlaveResponseTimeout;
+		if (!(TWCR & (1 << TWINT)))
+		{
+			TWCR = (1 << TWEN);
+			return TWI_ERROR_SlaveResponseTimeout;
+		}
 
 		switch (TWSR & TW_STATUS_MASK)
 		{
@@ -102,7 +134,8 @@ bool TWI_SendByte(const uint8_t Byte)
 {
 	TWDR = Byte;
 	TWCR = ((1 << TWINT) | (1 << TWEN));
-	while (!(TWCR & (1 << TWINT)));
+	if (!(TWI_WaitForComplete()))
+	  return false;
 
 	return ((TWSR & TW_STATUS_MASK) == TW_MT_DATA_ACK);
 }
@@ -118,7 +151,8 @@ bool TWI_ReceiveByte(uint8_t* const Byte,
 	  TWCRMask = ((1 << TWINT) | (1 << TWEN) | (1 << TWEA));
 
 	TWCR = TWCRMask;
-	while (!(TWCR & (1 << TWINT)));
+	if (!(TWI_WaitForComplete()))
+	  return false;
 	*Byte = TWDR;
 
 	uint8_t Status = (TWSR & TW_STATUS_MASK);
@@ -134,6 +168,7 @@ uint8_t TWI_ReadPacket(const uint8_t SlaveAddress,
                        uint8_t Length)
 {
 	uint8_t ErrorCode;
+	uint8_t PowerState = power_spin();	// the CPU only waits on the bus
 
 	ErrorCode = TWI_StartTransmission((SlaveAddress & TWI_DEVICE_ADDRESS_MASK) | TWI_ADDRESS_WRITE, TimeoutMS);
 	//ErrorCode = TWI_StartTransmission(SlaveAddress, TimeoutMS);
@@ -143,12 +178,13 @@ uint8_t TWI_ReadPacket(const uint8_t SlaveAddress,
 		{
 			if (!(TWI_SendByte(*(InternalAddress++))))
 			{
-				ErrorCode = TWI_ERROR_SlaveNAK;
+				ErrorCode = TWI_ByteError();
 				break;
 			}
 		}
 
-		ErrorCode = TWI_StartTransmission((SlaveAddress & TWI_DEVICE_ADDRESS_MASK) | TWI_ADDRESS_READ, TimeoutMS);
+		if (ErrorCode == TWI_ERROR_NoError)
+		  ErrorCode = TWI_StartTransmission((SlaveAddress & TWI_DEVICE_ADDRESS_MASK) | TWI_ADDRESS_READ, TimeoutMS);
 		//ErrorCode = TWI_StartTransmission(SlaveAddress, TimeoutMS);
 		if (ErrorCode == TWI_ERROR_NoError)
 		{
@@ -156,15 +192,18 @@ uint8_t TWI_ReadPacket(const uint8_t SlaveAddress,
 			{
 				if (!(TWI_ReceiveByte(Buffer++, (Length == 0))))
 				{
-					ErrorCode = TWI_ERROR_SlaveNAK;
+					ErrorCode = TWI_ByteError();
 					break;
 				}
 			}
-
-			TWI_StopTransmission();
 		}
+
+		// a stuck bus can't take a STOP; leave it to TWI_RecoverBus()
+		if (ErrorCode != TWI_ERROR_BusTimeout)
+		  TWI_StopTransmission();
 	}
 
+	power_set(PowerState);
 	return ErrorCode;
 }
 
@@ -176,6 +215,7 @@ uint8_t TWI_WritePacket(const uint8_t SlaveAddress,
                         uint8_t Length)
 {
 	uint8_t ErrorCode;
+	uint8_t PowerState = power_spin();
 
 	ErrorCode = TWI_StartTransmission((SlaveAddress & TWI_DEVICE_ADDRESS_MASK) | TWI_ADDRESS_WRITE, TimeoutMS);
 	//ErrorCode = TWI_StartTransmission(SlaveAddress, TimeoutMS);
@@ -185,23 +225,65 @@ uint8_t TWI_WritePacket(const uint8_t SlaveAddress,
 		{
 			if (!(TWI_SendByte(*(InternalAddress++))))
 			{
-				ErrorCode = TWI_ERROR_SlaveNAK;
+				ErrorCode = TWI_ByteError();
 				break;
 			}
 		}
 
-		while (Length--)
+		while (ErrorCode == TWI_ERROR_NoError && Length--)
 		{
 			if (!(TWI_SendByte(*(Buffer++))))
 			{
-				ErrorCode = TWI_ERROR_SlaveNAK;
+				ErrorCode = TWI_ByteError();
 				break;
 			}
 		}
 
-		TWI_StopTransmission();
+		if (ErrorCode != TWI_ERROR_BusTimeout)
+		  TWI_StopTransmission();
 	}
 
+	power_set(PowerState);
 	return ErrorCode;
 }
 
+uint8_t TWI_RecoverBus(void)
+{
+	uint8_t PortState = PORTD & (TWI_SCL | TWI_SDA);
+	uint8_t Clocks;
+
+	// Hand the pins back to the port as open drain outputs: DDR set pulls
+	//  the line low, DDR clear lets the pull-ups take it high
+	TWCR   = 0;
+	PORTD &= ~(TWI_SCL | TWI_SDA);
+	DDRD  &= ~(TWI_SCL | TWI_SDA);
+	_delay_us(5);
+
+	// A slave part way through sending a byte lets go of SDA once it has
+	//  clocked out the rest of it and seen the (missing) ACK
+	for (Clocks = 0; (Clocks < 9) && !(PIND & TWI_SDA); Clocks++)
+	{
+		DDRD |= TWI_SCL;
+		_delay_us(5);
+		DDRD &= ~TWI_SCL;
+		_delay_us(5);
+	}
+
+	// STOP: SDA rises while SCL is high
+	DDRD |= TWI_SCL;
+	_delay_us(5);
+	DDRD |= TWI_SDA;
+	_delay_us(5);
+	DDRD &= ~TWI_SCL;
+	_delay_us(5);
+	DDRD &= ~TWI_SDA;
+	_delay_us(5);
+
+	uint8_t BusFree = ((PIND & (TWI_SCL | TWI_SDA)) == (TWI_SCL | TWI_SDA));
+
+	// TWBR and TWSR survive the TWI being switched off
+	PORTD |= PortState;
+	TWCR   = (1 << TWEN);
+
+	return BusFree ? TWI_ERROR_NoError : TWI_ERROR_BusFault;
+}
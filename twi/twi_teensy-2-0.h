@@ -171,6 +171,11 @@
 			 */
 			#define TWI_BITLENGTH_FROM_FREQ(Prescale, Frequency) ((((F_CPU / (Prescale)) / (Frequency)) - 16) / 2)
 
+			/** Longest time a single byte transfer may take before it is abandoned, in microseconds. A byte is nine
+			 *  SCL clocks, so this allows for slaves stretching the clock up to roughly 10kHz.
+			 */
+			#define TWI_BYTE_TIMEOUT_US      1000
+
 		/* Enums: */
 			/** Enum for the possible return codes of the TWI transfer start routine and other dependant TWI functions. */
 			enum TWI_ErrorCodes_t
@@ -181,6 +186,7 @@
 				TWI_ERROR_SlaveResponseTimeout = 3, /**< No ACK received at the nominated slave address within the timeout period. */
 				TWI_ERROR_SlaveNotReady        = 4, /**< Slave NAKed the TWI bus START condition. */
 				TWI_ERROR_SlaveNAK             = 5, /**< Slave NAKed whilst attempting to send data to the device. */
+				TWI_ERROR_BusTimeout           = 6, /**< The bus stopped moving part way through a byte; see \ref TWI_RecoverBus(). */
 			};
 
 		/* Inline Functions: */
@@ -234,7 +240,8 @@
 			 *
 			 *  \param[in] Byte  Byte to send to the currently addressed device
 			 *
-			 *  \return Boolean \c true if the recipient ACKed the byte, \c false otherwise
+			 *  \return Boolean \c true if the recipient ACKed the byte, \c false otherwise (including when the
+			 *          transfer did not finish within \ref TWI_BYTE_TIMEOUT_US)
 			 */
 			bool TWI_SendByte(const uint8_t Byte);
 
@@ -243,7 +250,8 @@
 			 *  \param[in] Byte      Location where the read byte is to be stored.
 			 *  \param[in] LastByte  Indicates if the byte should be ACKed if false, NAKed if true.
 			 *
-			 *  \return Boolean \c true if the byte reception successfully completed, \c false otherwise.
+			 *  \return Boolean \c true if the byte reception successfully completed, \c false otherwise (including
+			 *          when the transfer did not finish within \ref TWI_BYTE_TIMEOUT_US).
 			 */
 			bool TWI_ReceiveByte(uint8_t* const Byte,
 			                     const bool LastByte);
@@ -286,6 +294,15 @@
 			                        const uint8_t* Buffer,
 			                        uint8_t Length);
 
+			/** Frees a bus that a slave is holding, e.g. after it lost track of a transfer and keeps SDA low. The
+			 *  TWI hardware is switched off, SCL is clocked by hand until SDA is released (at most nine times),
+			 *  a STOP is generated and the hardware is switched back on with its bit rate unchanged. Takes at
+			 *  most about 100us.
+			 *
+			 *  \return \ref TWI_ERROR_NoError if both lines read high afterwards, \ref TWI_ERROR_BusFault otherwise.
+			 */
+			uint8_t TWI_RecoverBus(void);
+
 	/* Disable C linkage for C++ Compilers: */
 		#if defined(__cplusplus)
 			}
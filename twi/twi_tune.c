@@ -0,0 +1,198 @@
+// twi_tune.c
+//
+// Picks the bus clock.  How fast the bus can run depends on the pull-ups
+//  and the cable to the parts, which differ from unit to unit, so at
+//  startup twi_tune_calibrate() walks down a ladder of TWBR/prescaler
+//  settings, fastest first, and keeps the first one where a burst of probe
+//  transfers sees no NAKs, no timeouts and reads back every value right.
+//
+// After that twi_tune_update() watches the scheduler's error counts.  A
+//  window with too many errors steps the clock down a rung; a long run of
+//  clean windows tries the next rung up again, unless that rung failed
+//  recently.
+
+#include "twi_tune.h"
+#include "twi_sched.h"
+#include "twi_teensy-2-0.h"
+
+#include "../log.h"
+
+#include <avr/io.h>
+
+// ----------------------------------------------------------------------------
+
+// Fastest first, from the slowest part's rating: the N35P112 and the
+//  MCP23018 are both rated for 400kHz (fast mode), so nothing runs faster
+//  however clean the probes come back.
+const uint8_t kRungPrescale[TWI_TUNE_RUNGS] = {
+	TWI_BIT_PRESCALE_1,
+	TWI_BIT_PRESCALE_1,
+	TWI_BIT_PRESCALE_1,
+	TWI_BIT_PRESCALE_1,
+	TWI_BIT_PRESCALE_4,
+};
+const uint8_t kRungBitLength[TWI_TUNE_RUNGS] = {
+	TWI_BITLENGTH_FROM_FREQ(1, 400000),
+	TWI_BITLENGTH_FROM_FREQ(1, 200000),
+	TWI_BITLENGTH_FROM_FREQ(1, 100000),
+	TWI_BITLENGTH_FROM_FREQ(1, 50000),
+	TWI_BITLENGTH_FROM_FREQ(4, 20000),
+};
+const uint16_t kRungKhz[TWI_TUNE_RUNGS] = { 400, 200, 100, 50, 20 };
+
+// probe rounds per rung at startup; every probe runs once per round
+const uint8_t kProbeRounds = 32;
+// a runtime window fails with more than 1 error (NAK or timeout) in 64 jobs;
+//  the odd glitch is left to bus recovery
+const uint8_t kErrorRateShift = 6;
+// clean windows before trying a faster rung, and how long a rung that
+//  failed is left alone
+const uint8_t kStepUpWindows = 60;
+const uint16_t kBanWindows = 600;
+
+// ----------------------------------------------------------------------------
+
+// static data
+static uint8_t sRung = TWI_TUNE_RUNGS - 1;
+static twi_tune_rung_stats_t sRungStats[TWI_TUNE_RUNGS];
+static uint16_t sJobs = 0;
+static uint16_t sNaks = 0;
+static uint16_t sTimeouts = 0;
+static uint8_t sCleanWindows = 0;
+static uint8_t sBannedRung = 0xFF;
+static uint16_t sBanWindows = 0;
+static uint16_t sStepsDown = 0;
+static uint16_t sStepsUp = 0;
+
+// ----------------------------------------------------------------------------
+
+// Only call this while the bus is idle, i.e. not from inside a service
+static void _set_rung(uint8_t rung)
+{
+	sRung = rung;
+	TWI_Init(kRungPrescale[rung], kRungBitLength[rung]);
+}
+
+/* Try every rung, fastest first, with kProbeRounds rounds of the probes.
+ *  Uses the bus directly, so call it before the scheduler is running, and
+ *  after the devices have been set up (their probes may depend on it).
+ *
+ * returns
+ * - the rung chosen.  If none of them was clean, the slowest.
+ */
+uint8_t twi_tune_calibrate(const twi_tune_probe_t *probes, uint8_t numProbes)
+{
+	uint8_t rung, round, i, error;
+	twi_tune_rung_stats_t *stats;
+
+	for (rung=0; rung<TWI_TUNE_RUNGS; rung++)
+	{
+		_set_rung(rung);
+		stats = &sRungStats[rung];
+		for (round=0; round<kProbeRounds; round++)
+		{
+			for (i=0; i<numProbes; i++)
+			{
+				error = probes[i]();
+				if (error == TWI_ERROR_SlaveNotReady || error == TWI_ERROR_SlaveNAK)
+				{
+					stats->naks++;
+				}
+				else if (error == TWI_TUNE_MISMATCH)
+				{
+					stats->mismatches++;
+				}
+				else if (error != TWI_ERROR_NoError)
+				{
+					stats->timeouts++;
+					TWI_RecoverBus();
+				}
+			}
+		}
+		if (!stats->naks && !stats->timeouts && !stats->mismatches)
+			break;
+	}
+	if (rung == TWI_TUNE_RUNGS)
+		_set_rung(TWI_TUNE_RUNGS - 1);
+	return sRung;
+}
+
+// Sum of the scheduler's counters over all devices.  Jobs a busy slave
+//  turned down (TWI_SCHED_SLAVE_BUSY) say nothing about the clock, they are
+//  left out.
+static void _totals(uint16_t *jobs, uint16_t *naks, uint16_t *timeouts)
+{
+	uint8_t i;
+	const twi_sched_stats_t *stats;
+
+	*jobs = *naks = *timeouts = 0;
+	for (i=0; i<twi_sched_get_num_devices(); i++)
+	{
+		stats = twi_sched_get_stats(i);
+		*jobs += stats->jobs - stats->busy;
+		*naks += stats->naks;
+		*timeouts += stats->timeouts;
+	}
+}
+
+// Close a window of bus traffic and adjust the clock.  Call it from the main
+//  loop at a steady rate, about once a second; the bus has to be idle.
+void twi_tune_update(void)
+{
+	uint16_t jobs, naks, timeouts;
+
+	_totals(&jobs, &naks, &timeouts);
+	// the counters wrap, differences don't mind
+	jobs -= sJobs;
+	naks -= sNaks;
+	timeouts -= sTimeouts;
+	sJobs += jobs;
+	sNaks += naks;
+	sTimeouts += timeouts;
+
+	if (sBanWindows && --sBanWindows == 0)
+		sBannedRung = 0xFF;
+
+	if (naks + timeouts > (jobs >> kErrorRateShift))
+	{
+		sCleanWindows = 0;
+		if (sRung < TWI_TUNE_RUNGS - 1)
+		{
+			sBannedRung = sRung;
+			sBanWindows = kBanWindows;
+			_set_rung(sRung + 1);
+			sStepsDown++;
+		}
+	}
+	else if (jobs && ++sCleanWindows >= kStepUpWindows)
+	{
+		sCleanWindows = 0;
+		if (sRung > 0 && sRung - 1 != sBannedRung)
+		{
+			_set_rung(sRung - 1);
+			sStepsUp++;
+		}
+	}
+}
+
+uint16_t twi_tune_get_khz(void)
+{
+	return kRungKhz[sRung];
+}
+
+const twi_tune_rung_stats_t *twi_tune_get_rung_stats(uint8_t rung)
+{
+	return &sRungStats[rung];
+}
+
+// The clock in use, then the startup NAK/timeout/mismatch counts per rung
+//  and the runtime steps down and up
+void twi_tune_print_stats(void)
+{
+	uint8_t i;
+
+	LOG("twi clk %04X kHz, probes", kRungKhz[sRung]);
+	for (i=0; i<TWI_TUNE_RUNGS; i++)
+		LOG(" %02X/%02X/%02X", sRungStats[i].naks, sRungStats[i].timeouts, sRungStats[i].mismatches);
+	LOG(", down %04X up %04X\n", sStepsDown, sStepsUp);
+}
@@ -0,0 +1,36 @@
+// twi_tune.h
+
+#ifndef TWI_TUNE_H
+#define TWI_TUNE_H
+
+#include <stdint.h>
+
+// --------------------------------------------------------------------
+
+// Number of bus clock settings tried, fastest first
+#define TWI_TUNE_RUNGS 5
+
+// A probe does one harmless bus transfer to a device, reading back a
+//  register that holds a known value, and returns a TWI_ErrorCodes_t value,
+//  or TWI_TUNE_MISMATCH if the transfer went through but the value read
+//  wasn't the one written
+typedef uint8_t (*twi_tune_probe_t)(void);
+
+#define TWI_TUNE_MISMATCH 0x80
+
+// Startup results for one clock setting
+typedef struct {
+	uint8_t naks;
+	uint8_t timeouts;
+	uint8_t mismatches;	// bits that came back wrong without an error
+} twi_tune_rung_stats_t;
+
+// --------------------------------------------------------------------
+
+uint8_t twi_tune_calibrate(const twi_tune_probe_t *probes, uint8_t numProbes);
+void twi_tune_update(void);
+uint16_t twi_tune_get_khz(void);
+const twi_tune_rung_stats_t *twi_tune_get_rung_stats(uint8_t rung);
+void twi_tune_print_stats(void);
+
+#endif //TWI_TUNE_H
@@ -26,6 +26,13 @@
 
 #define USB_SERIAL_PRIVATE_INCLUDE
 #include "usb_mouse_debug.h"
+#include "controller/stack.h"
+#include "controller/teensy-2-0.h"
+#include "capture.h"
+#include "health.h"
+#include "power.h"
+
+#include <stddef.h>
 
 /**************************************************************************
  *
@@ -73,11 +80,49 @@
 #define DEBUG_TX_SIZE		32
 #define DEBUG_TX_BUFFER		EP_DOUBLE_BUFFER
 
+#define KEYBOARD_INTERFACE	2
+#define KEYBOARD_ENDPOINT	1
+#define KEYBOARD_SIZE		16
+#define KEYBOARD_BUFFER		EP_DOUBLE_BUFFER
+
+// optional vendor class interface with a bulk IN endpoint, for raw
+// data capture (see capture.h), make USB_CAPTURE=1 to include it
+#define CAPTURE_SIZE		CAPTURE_PACKET_SIZE
+#define CAPTURE_BUFFER		EP_DOUBLE_BUFFER
+
+// optional HID joystick with absolute 16 bit axes, make USB_GAMEPAD=1
+// for it after the other interfaces, or USB_GAMEPAD=only for it in
+// place of the mouse
+#ifdef USB_GAMEPAD_ONLY
+#define GAMEPAD_INTERFACE	0
+#elif defined(USB_CAPTURE)
+#define GAMEPAD_INTERFACE	4
+#else
+#define GAMEPAD_INTERFACE	3
+#endif
+#define GAMEPAD_ENDPOINT	5
+#define GAMEPAD_SIZE		8
+#define GAMEPAD_BUFFER		EP_DOUBLE_BUFFER
+#define GAMEPAD_REPORT_SIZE	5
+
 static const uint8_t PROGMEM endpoint_config_table[] = {
+	1, EP_TYPE_INTERRUPT_IN,  EP_SIZE(KEYBOARD_SIZE) | KEYBOARD_BUFFER,
+#ifdef USB_CAPTURE
+	1, EP_TYPE_BULK_IN,       EP_SIZE(CAPTURE_SIZE) | CAPTURE_BUFFER,
+#else
 	0,
-	0,
+#endif
+#ifndef USB_GAMEPAD_ONLY
 	1, EP_TYPE_INTERRUPT_IN,  EP_SIZE(MOUSE_SIZE) | MOUSE_BUFFER,
-	1, EP_TYPE_INTERRUPT_IN,  EP_SIZE(DEBUG_TX_SIZE) | DEBUG_TX_BUFFER
+#else
+	0,
+#endif
+	1, EP_TYPE_INTERRUPT_IN,  EP_SIZE(DEBUG_TX_SIZE) | DEBUG_TX_BUFFER,
+#ifdef USB_GAMEPAD
+	1, EP_TYPE_INTERRUPT_IN,  EP_SIZE(GAMEPAD_SIZE) | GAMEPAD_BUFFER
+#else
+	0
+#endif
 };
 
 
@@ -141,6 +186,78 @@ static const uint8_t PROGMEM mouse_hid_report_desc[] = {
 	0xC0				// End Collection
 };
 
+// Keyboard with an NKRO bitmap in report protocol: the modifier and reserved
+// bytes as in the boot report, then a bit per keycode from KEYBOARD_FIRST_KEY
+// (0x04, A; 0 to 3 are error codes, not keys).  In boot protocol the same
+// two bytes go out followed by up to 6 keycodes instead of the bitmap.
+static const uint8_t PROGMEM keyboard_hid_report_desc[] = {
+	0x05, 0x01,			// Usage Page (Generic Desktop)
+	0x09, 0x06,			// Usage (Keyboard)
+	0xA1, 0x01,			// Collection (Application)
+	0x75, 0x01,			//   Report Size (1)
+	0x95, 0x08,			//   Report Count (8)
+	0x05, 0x07,			//   Usage Page (Key Codes)
+	0x19, 0xE0,			//   Usage Minimum (224)
+	0x29, 0xE7,			//   Usage Maximum (231)
+	0x15, 0x00,			//   Logical Minimum (0)
+	0x25, 0x01,			//   Logical Maximum (1)
+	0x81, 0x02,			//   Input (Data, Variable, Absolute), ;Modifier byte
+	0x95, 0x01,			//   Report Count (1)
+	0x75, 0x08,			//   Report Size (8)
+	0x81, 0x03,			//   Input (Constant), ;Reserved byte
+	0x95, 0x05,			//   Report Count (5),
+	0x75, 0x01,			//   Report Size (1),
+	0x05, 0x08,			//   Usage Page (LEDs),
+	0x19, 0x01,			//   Usage Minimum (1),
+	0x29, 0x05,			//   Usage Maximum (5),
+	0x91, 0x02,			//   Output (Data, Variable, Absolute), ;LED report
+	0x95, 0x01,			//   Report Count (1),
+	0x75, 0x03,			//   Report Size (3),
+	0x91, 0x03,			//   Output (Constant), ;LED report padding
+	0x95, KEYBOARD_NKRO_KEYS,	//   Report Count (112),
+	0x75, 0x01,			//   Report Size (1),
+	0x15, 0x00,			//   Logical Minimum (0),
+	0x25, 0x01,			//   Logical Maximum (1),
+	0x05, 0x07,			//   Usage Page (Key Codes),
+	0x19, KEYBOARD_FIRST_KEY,	//   Usage Minimum (4),
+	0x29, KEYBOARD_FIRST_KEY + KEYBOARD_NKRO_KEYS - 1, //   Usage Maximum (115),
+	0x81, 0x02,			//   Input (Data, Variable, Absolute), ;Key bitmap
+	0xC0				// End Collection
+};
+
+#ifdef USB_GAMEPAD
+// Joystick with one button and absolute X and Y over the whole 16 bit
+// range, the calibrated stick position without deadzone or curve
+static const uint8_t PROGMEM gamepad_hid_report_desc[] = {
+	0x05, 0x01,			// Usage Page (Generic Desktop)
+	0x09, 0x04,			// Usage (Joystick)
+	0xA1, 0x01,			// Collection (Application)
+	0x05, 0x09,			//   Usage Page (Button)
+	0x19, 0x01,			//   Usage Minimum (Button #1)
+	0x29, 0x01,			//   Usage Maximum (Button #1)
+	0x15, 0x00,			//   Logical Minimum (0)
+	0x25, 0x01,			//   Logical Maximum (1)
+	0x95, 0x01,			//   Report Count (1)
+	0x75, 0x01,			//   Report Size (1)
+	0x81, 0x02,			//   Input (Data, Variable, Absolute)
+	0x95, 0x01,			//   Report Count (1)
+	0x75, 0x07,			//   Report Size (7)
+	0x81, 0x03,			//   Input (Constant)
+	0x05, 0x01,			//   Usage Page (Generic Desktop)
+	0x09, 0x01,			//   Usage (Pointer)
+	0xA1, 0x00,			//   Collection (Physical)
+	0x09, 0x30,			//     Usage (X)
+	0x09, 0x31,			//     Usage (Y)
+	0x16, 0x01, 0x80,		//     Logical Minimum (-32767)
+	0x26, 0xFF, 0x7F,		//     Logical Maximum (32767)
+	0x75, 0x10,			//     Report Size (16),
+	0x95, 0x02,			//     Report Count (2),
+	0x81, 0x02,			//     Input (Data, Variable, Absolute)
+	0xC0,				//   End Collection
+	0xC0				// End Collection
+};
+#endif
+
 static const uint8_t PROGMEM debug_hid_report_desc[] = {
 	0x06, 0x31, 0xFF,			// Usage Page 0xFF31 (vendor defined)
 	0x09, 0x74,				// Usage 0x74
@@ -151,23 +268,59 @@ static const uint8_t PROGMEM debug_hid_report_desc[] = {
 	0x95, DEBUG_TX_SIZE,			// report count
 	0x09, 0x75,				// usage
 	0x81, 0x02,				// Input (array)
+	0x95, HEALTH_REPORT_SIZE,		// report count
+	0x09, 0x76,				// usage
+	0xB1, 0x02,				// Feature, the health counters
 	0xC0					// end collection
 };
 
-#define CONFIG1_DESC_SIZE        (9+9+9+7+9+9+7)
+#ifdef USB_CAPTURE
+#define CAPTURE_DESC_SIZE        (9+7)
+#define CAPTURE_INTERFACES       1
+#else
+#define CAPTURE_DESC_SIZE        0
+#define CAPTURE_INTERFACES       0
+#endif
+#if defined(USB_GAMEPAD) && !defined(USB_GAMEPAD_ONLY)
+#define GAMEPAD_DESC_SIZE        (9+9+7)
+#define GAMEPAD_INTERFACES       1
+#else
+#define GAMEPAD_DESC_SIZE        0
+#define GAMEPAD_INTERFACES       0
+#endif
+#define NUM_INTERFACES           (3+CAPTURE_INTERFACES+GAMEPAD_INTERFACES)
+#define CONFIG1_DESC_SIZE        (9+9+9+7+9+9+7+9+9+7+CAPTURE_DESC_SIZE+GAMEPAD_DESC_SIZE)
 #define MOUSE_HID_DESC_OFFSET    (9+9)
 #define DEBUG_HID_DESC_OFFSET    (9+9+9+7+9)
+#define KEYBOARD_HID_DESC_OFFSET (9+9+9+7+9+9+7+9)
+#ifdef USB_GAMEPAD_ONLY
+#define GAMEPAD_HID_DESC_OFFSET  MOUSE_HID_DESC_OFFSET
+#else
+#define GAMEPAD_HID_DESC_OFFSET  (9+9+9+7+9+9+7+9+9+7+CAPTURE_DESC_SIZE+9)
+#endif
+
+// The gamepad's interface, HID and endpoint descriptors, the same
+// layout as the mouse's: in its place with USB_GAMEPAD_ONLY, after all
+// the others otherwise
+#define GAMEPAD_DESCRIPTORS						\
+	9, 4, GAMEPAD_INTERFACE, 0, 1, 0x03, 0x00, 0x00, 0,		\
+	9, 0x21, 0x11, 0x01, 0, 1, 0x22,				\
+	sizeof(gamepad_hid_report_desc), 0,				\
+	7, 5, GAMEPAD_ENDPOINT | 0x80, 0x03, GAMEPAD_REPORT_SIZE, 0, 1,
 static const uint8_t PROGMEM config1_descriptor[CONFIG1_DESC_SIZE] = {
 	// configuration descriptor, USB spec 9.6.3, page 264-266, Table 9-10
 	9, 					// bLength;
 	2,					// bDescriptorType;
 	LSB(CONFIG1_DESC_SIZE),			// wTotalLength
 	MSB(CONFIG1_DESC_SIZE),
-	2,					// bNumInterfaces
+	NUM_INTERFACES,				// bNumInterfaces
 	1,					// bConfigurationValue
 	0,					// iConfiguration
-	0xC0,					// bmAttributes
+	0xE0,					// bmAttributes (remote wakeup)
 	50,					// bMaxPower
+#ifdef USB_GAMEPAD_ONLY
+	GAMEPAD_DESCRIPTORS
+#else
 	// interface descriptor, USB spec 9.6.5, page 267-269, Table 9-12
 	9,					// bLength
 	4,					// bDescriptorType
@@ -194,6 +347,7 @@ static const uint8_t PROGMEM config1_descriptor[CONFIG1_DESC_SIZE] = {
 	0x03,					// bmAttributes (0x03=intr)
 	4, 0,					// wMaxPacketSize
 	1,					// bInterval
+#endif
 	// interface descriptor, USB spec 9.6.5, page 267-269, Table 9-12
 	9,					// bLength
 	4,					// bDescriptorType
@@ -219,7 +373,55 @@ static const uint8_t PROGMEM config1_descriptor[CONFIG1_DESC_SIZE] = {
 	DEBUG_TX_ENDPOINT | 0x80,		// bEndpointAddress
 	0x03,					// bmAttributes (0x03=intr)
 	DEBUG_TX_SIZE, 0,			// wMaxPacketSize
-	1					// bInterval
+	1,					// bInterval
+	// interface descriptor, USB spec 9.6.5, page 267-269, Table 9-12
+	9,					// bLength
+	4,					// bDescriptorType
+	KEYBOARD_INTERFACE,			// bInterfaceNumber
+	0,					// bAlternateSetting
+	1,					// bNumEndpoints
+	0x03,					// bInterfaceClass (0x03 = HID)
+	0x01,					// bInterfaceSubClass (0x01 = Boot)
+	0x01,					// bInterfaceProtocol (0x01 = Keyboard)
+	0,					// iInterface
+	// HID interface descriptor, HID 1.11 spec, section 6.2.1
+	9,					// bLength
+	0x21,					// bDescriptorType
+	0x11, 0x01,				// bcdHID
+	0,					// bCountryCode
+	1,					// bNumDescriptors
+	0x22,					// bDescriptorType
+	sizeof(keyboard_hid_report_desc),	// wDescriptorLength
+	0,
+	// endpoint descriptor, USB spec 9.6.6, page 269-271, Table 9-13
+	7,					// bLength
+	5,					// bDescriptorType
+	KEYBOARD_ENDPOINT | 0x80,		// bEndpointAddress
+	0x03,					// bmAttributes (0x03=intr)
+	KEYBOARD_SIZE, 0,			// wMaxPacketSize
+	1,					// bInterval
+#ifdef USB_CAPTURE
+	// interface descriptor, USB spec 9.6.5, page 267-269, Table 9-12
+	9,					// bLength
+	4,					// bDescriptorType
+	CAPTURE_INTERFACE,			// bInterfaceNumber
+	0,					// bAlternateSetting
+	1,					// bNumEndpoints
+	0xFF,					// bInterfaceClass (0xFF = vendor)
+	0x00,					// bInterfaceSubClass
+	0x00,					// bInterfaceProtocol
+	0,					// iInterface
+	// endpoint descriptor, USB spec 9.6.6, page 269-271, Table 9-13
+	7,					// bLength
+	5,					// bDescriptorType
+	CAPTURE_ENDPOINT | 0x80,		// bEndpointAddress
+	0x02,					// bmAttributes (0x02=bulk)
+	CAPTURE_SIZE, 0,			// wMaxPacketSize
+	0,					// bInterval
+#endif
+#if defined(USB_GAMEPAD) && !defined(USB_GAMEPAD_ONLY)
+	GAMEPAD_DESCRIPTORS
+#endif
 };
 
 // If you're desperate for a little extra code memory, these strings
@@ -228,7 +430,7 @@ static const uint8_t PROGMEM config1_descriptor[CONFIG1_DESC_SIZE] = {
 struct usb_string_descriptor_struct {
 	uint8_t bLength;
 	uint8_t bDescriptorType;
-	int16_t wString[];
+	wchar_t wString[];	// 16 bits, like avr-gcc's wchar_t
 };
 static const struct usb_string_descriptor_struct PROGMEM string0 = {
 	4,
@@ -256,10 +458,18 @@ static const struct descriptor_list_struct {
 } PROGMEM descriptor_list[] = {
 	{0x0100, 0x0000, device_descriptor, sizeof(device_descriptor)},
 	{0x0200, 0x0000, config1_descriptor, sizeof(config1_descriptor)},
+#ifndef USB_GAMEPAD_ONLY
 	{0x2200, MOUSE_INTERFACE, mouse_hid_report_desc, sizeof(mouse_hid_report_desc)},
 	{0x2100, MOUSE_INTERFACE, config1_descriptor+MOUSE_HID_DESC_OFFSET, 9},
+#endif
+#ifdef USB_GAMEPAD
+	{0x2200, GAMEPAD_INTERFACE, gamepad_hid_report_desc, sizeof(gamepad_hid_report_desc)},
+	{0x2100, GAMEPAD_INTERFACE, config1_descriptor+GAMEPAD_HID_DESC_OFFSET, 9},
+#endif
 	{0x2200, DEBUG_INTERFACE, debug_hid_report_desc, sizeof(debug_hid_report_desc)},
 	{0x2100, DEBUG_INTERFACE, config1_descriptor+DEBUG_HID_DESC_OFFSET, 9},
+	{0x2200, KEYBOARD_INTERFACE, keyboard_hid_report_desc, sizeof(keyboard_hid_report_desc)},
+	{0x2100, KEYBOARD_INTERFACE, config1_descriptor+KEYBOARD_HID_DESC_OFFSET, 9},
 	{0x0300, 0x0000, (const uint8_t *)&string0, 4},
 	{0x0301, 0x0409, (const uint8_t *)&string1, sizeof(STR_MANUFACTURER)},
 	{0x0302, 0x0409, (const uint8_t *)&string2, sizeof(STR_PRODUCT)}
@@ -276,10 +486,18 @@ static const struct descriptor_list_struct {
 // zero when we are not configured, non-zero when enumerated
 static volatile uint8_t usb_configuration=0;
 
+// non-zero while the host has the bus suspended
+static volatile uint8_t usb_suspend_state=0;
+
+// whether the host allows us to wake it up (SET_FEATURE
+// DEVICE_REMOTE_WAKEUP), cleared again on bus reset
+static volatile uint8_t usb_remote_wakeup_enabled=0;
+
 // the time remaining before we transmit any partially full
 // packet, or send a zero length packet.
 static volatile uint8_t debug_flush_timer=0;
 
+#ifndef USB_GAMEPAD_ONLY
 // which buttons are currently pressed
 static uint8_t mouse_buttons=0;
 
@@ -287,6 +505,77 @@ static uint8_t mouse_buttons=0;
 // either way, so this variable only stores the setting since we
 // are required to be able to report which setting is in use.
 static uint8_t mouse_protocol=1;
+#endif
+
+#ifdef USB_GAMEPAD
+// the last gamepad report, little endian like the wire: buttons, then
+// X and Y 16 bits each
+static uint8_t gamepad_report[GAMEPAD_REPORT_SIZE];
+#endif
+
+// keyboard state: modifier bits and a bitmap of all other pressed keys,
+// bit 0 for KEYBOARD_FIRST_KEY, plus whether it has changed since the last report went out
+static uint8_t keyboard_modifier_keys=0;
+static uint8_t keyboard_keys[KEYBOARD_NKRO_KEYS/8];
+static uint8_t keyboard_dirty=0;
+
+// keyboard protocol setting from the host.  1 (report) sends the NKRO
+// bitmap, 0 (boot) sends the 6KRO boot report.
+static uint8_t keyboard_protocol=1;
+
+// the idle configuration, how often we send the report to the
+// host (ms * 4) even when it hasn't changed
+static uint8_t keyboard_idle_config=125;
+
+// count until idle timeout
+static uint8_t keyboard_idle_count=0;
+
+// 1=num lock, 2=caps lock, 4=scroll lock, 8=compose, 16=kana
+static volatile uint8_t keyboard_leds=0;
+
+// when the last start of frame came (teensy_get_us() time, taken in the
+// interrupt) and its frame number, see usb_get_sof()
+static volatile uint16_t sof_us=0;
+static volatile uint8_t sof_frame=0;
+
+// HEALTH_COMMAND_* the host wrote to the debug feature report, until
+// the main loop takes it
+static volatile uint8_t debug_command=0;
+
+// Endpoint 0 control transfers.  Anything that has to wait for the
+// host between packets (a data stage of more than one packet, an OUT
+// data stage, SET_ADDRESS's status stage) is carried on from the next
+// endpoint interrupt instead of spinning in this one, so the sensor
+// interrupt and the timer tick are never held off for longer than it
+// takes to handle one packet.  A reply that fits in one packet goes
+// straight out: the bank is free right after the SETUP.
+#define EP0_IDLE		0	// waiting for a SETUP
+#define EP0_IN			1	// sending the data stage
+#define EP0_STATUS_OUT		2	// all sent, waiting for the host's ZLP
+#define EP0_ADDRESS		3	// waiting for SET_ADDRESS's status to go
+#define EP0_OUT			4	// receiving the data stage
+
+// where an IN data stage comes from
+#define EP0_FROM_FLASH		0
+#define EP0_FROM_RAM		1
+#define EP0_FROM_ZEROS		2
+
+// what an OUT data stage is for: only its first byte is kept
+#define EP0_FOR_KEYBOARD_LEDS	0
+#define EP0_FOR_DEBUG_COMMAND	1
+
+static uint8_t ep0_state=EP0_IDLE;
+static const uint8_t *ep0_addr;
+static uint8_t ep0_len;
+static uint8_t ep0_from;
+static uint8_t ep0_for;
+static uint8_t ep0_first;
+static uint8_t ep0_started;
+
+// CAPTURE_FLAG_* bits the host asked for, 0 when not capturing, and
+// the time before a partially full capture packet goes out
+static volatile uint8_t capture_request_flags=0;
+static volatile uint8_t capture_flush_timer=0;
 
 
 /**************************************************************************
@@ -306,7 +595,7 @@ void usb_init(void)
         USB_CONFIG();				// start USB clock
         UDCON = 0;				// enable attach resistor
 	usb_configuration = 0;
-        UDIEN = (1<<EORSTE)|(1<<SOFE);
+        UDIEN = (1<<EORSTE)|(1<<SOFE)|(1<<SUSPE);
 	sei();
 }
 
@@ -317,7 +606,62 @@ uint8_t usb_configured(void)
 	return usb_configuration;
 }
 
+// return non-zero while the host has suspended the bus.  The USB
+// clock and PLL are stopped then, so the chip may be put to sleep.
+uint8_t usb_suspended(void)
+{
+	return usb_suspend_state;
+}
+
+// The last start of frame: its frame number, low 8 bits, is returned
+// and when it came, teensy_get_us() time, stored in *us.  Both stay
+// where they were while the host sends no frames.
+uint8_t usb_get_sof(uint16_t *us)
+{
+	uint8_t intr_state, frame;
+
+	intr_state = SREG;
+	cli();
+	*us = sof_us;
+	frame = sof_frame;
+	SREG = intr_state;
+	return frame;
+}
+
+// Signal resume to a suspended host.  The host has to have enabled
+// remote wakeup, and the bus has to have been idle for at least 5 ms
+// (USB spec 7.1.7.7).  Returns 0 when resume signalling has started,
+// the host then resumes the bus and usb_suspended() goes back to 0.
+int8_t usb_remote_wakeup(void)
+{
+	if (!usb_suspend_state || !usb_remote_wakeup_enabled) return -1;
+	// the USB clock has to run to drive the bus
+	PLL_CONFIG();
+        while (!(PLLCSR & (1<<PLOCK))) ;
+        USB_CONFIG();
+	UDCON |= (1<<RMWKUP);
+	return 0;
+}
+
+// Give up on a remote wakeup the host didn't answer: stop the USB clock
+// and the PLL again, as the suspend interrupt did, so the chip can go
+// back to sleep at the suspend current.  Nothing to do if the host has
+// resumed the bus meanwhile.
+void usb_remote_wakeup_cancel(void)
+{
+	uint8_t intr_state;
 
+	intr_state = SREG;
+	cli();
+	if (usb_suspend_state) {
+		USB_FREEZE();
+		PLLCSR &= ~(1<<PLLE);
+	}
+	SREG = intr_state;
+}
+
+
+#ifndef USB_GAMEPAD_ONLY
 // Set the mouse buttons.  To create a "click", 2 calls are needed,
 // one to push the button down and the second to release it
 int8_t usb_mouse_buttons(uint8_t left, uint8_t middle, uint8_t right)
@@ -334,7 +678,8 @@ int8_t usb_mouse_buttons(uint8_t left, uint8_t middle, uint8_t right)
 // Move the mouse.  x, y and wheel are -127 to 127.  Use 0 for no movement.
 int8_t usb_mouse_move(int8_t x, int8_t y, int8_t wheel)
 {
-	uint8_t intr_state, timeout;
+	uint8_t intr_state, timeout, power;
+	uint16_t wait_start, wait_us;
 
 	if (!usb_configuration) return -1;
 	if (x == -128) x = -127;
@@ -344,33 +689,182 @@ int8_t usb_mouse_move(int8_t x, int8_t y, int8_t wheel)
 	cli();
 	UENUM = MOUSE_ENDPOINT;
 	timeout = UDFNUML + 50;
-	while (1) {
-		// are we ready to transmit?
-		if (UEINTX & (1<<RWAL)) break;
-		SREG = intr_state;
-		// has the USB gone offline?
-		if (!usb_configuration) return -1;
-		// have we waited too long?
-		if (UDFNUML == timeout) return -1;
-		// get ready to try checking again
-		intr_state = SREG;
-		cli();
-		UENUM = MOUSE_ENDPOINT;
+	// only a report that has to wait is timed
+	if (!(UEINTX & (1<<RWAL))) {
+		wait_start = teensy_get_us();
+		power = power_spin();
+		while (1) {
+			SREG = intr_state;
+			// has the USB gone offline?
+			if (!usb_configuration) {
+				power_set(power);
+				return -1;
+			}
+			// have we waited too long?
+			if (UDFNUML == timeout) {
+				health.usbDropped++;
+				power_set(power);
+				return -1;
+			}
+			// get ready to try checking again
+			intr_state = SREG;
+			cli();
+			UENUM = MOUSE_ENDPOINT;
+			// are we ready to transmit?
+			if (UEINTX & (1<<RWAL)) break;
+		}
+		power_set(power);
+		wait_us = teensy_get_us() - wait_start;
+		health.usbWaitUs += wait_us;
+		if (wait_us > health.usbWaitMaxUs) health.usbWaitMaxUs = wait_us;
 	}
 	UEDATX = mouse_buttons;
 	UEDATX = x;
 	UEDATX = y;
 	UEDATX = wheel;
 	UEINTX = 0x3A;
+	health.usbReports++;
+	SREG = intr_state;
+	return 0;
+}
+#endif
+
+#ifdef USB_GAMEPAD
+// Send the stick position, x and y -32767 to 32767, and the button.
+// This never waits: if both endpoint banks are still full, -1 is
+// returned and the report is left out, the next one has newer values
+// anyway.  Meant to be called every tick, changed or not.
+int8_t usb_gamepad_send(int16_t x, int16_t y, uint8_t button)
+{
+	uint8_t intr_state, i;
+
+	if (x == -32768) x = -32767;
+	if (y == -32768) y = -32767;
+	intr_state = SREG;
+	cli();
+	gamepad_report[0] = button ? 1 : 0;
+	gamepad_report[1] = LSB(x);
+	gamepad_report[2] = MSB(x);
+	gamepad_report[3] = LSB(y);
+	gamepad_report[4] = MSB(y);
+	if (!usb_configuration) {
+		SREG = intr_state;
+		return -1;
+	}
+	UENUM = GAMEPAD_ENDPOINT;
+	if (!(UEINTX & (1<<RWAL))) {
+		health.usbDeferred++;
+		SREG = intr_state;
+		return -1;
+	}
+	for (i=0; i<GAMEPAD_REPORT_SIZE; i++) {
+		UEDATX = gamepad_report[i];
+	}
+	UEINTX = 0x3A;
+	health.usbReports++;
 	SREG = intr_state;
 	return 0;
 }
+#endif
+
+// Press or release a key.  Nothing is sent until usb_keyboard_send().
+void usb_keyboard_key(uint8_t keycode, uint8_t pressed)
+{
+	uint8_t mask, *p;
+
+	if (keycode >= 0xE0 && keycode <= 0xE7) {
+		mask = 1 << (keycode - 0xE0);
+		p = &keyboard_modifier_keys;
+	} else if (keycode >= KEYBOARD_FIRST_KEY && keycode < KEYBOARD_FIRST_KEY + KEYBOARD_NKRO_KEYS) {
+		keycode -= KEYBOARD_FIRST_KEY;
+		mask = 1 << (keycode & 7);
+		p = &keyboard_keys[keycode >> 3];
+	} else {
+		return;
+	}
+	if (pressed) *p |= mask;
+	else *p &= ~mask;
+	keyboard_dirty = 1;
+}
+
+// write the boot protocol report: up to 6 keys, or ErrorRollOver (0x01)
+// in every slot if more are held down
+static void usb_keyboard_write_boot_keys(void)
+{
+	uint8_t i, bits, keycode, n=0;
+	uint8_t keys[6];
+
+	for (i=0; i<KEYBOARD_NKRO_KEYS/8; i++) {
+		bits = keyboard_keys[i];
+		for (keycode = (i << 3) + KEYBOARD_FIRST_KEY; bits; keycode++, bits >>= 1) {
+			if (!(bits & 1)) continue;
+			if (n == 6) {
+				for (n=0; n<6; n++) UEDATX = 0x01;
+				return;
+			}
+			keys[n++] = keycode;
+		}
+	}
+	for (i=0; i<6; i++) {
+		UEDATX = i < n ? keys[i] : 0;
+	}
+}
+
+static void usb_keyboard_write_report(void)
+{
+	uint8_t i;
+
+	UEDATX = keyboard_modifier_keys;
+	UEDATX = 0;
+	if (keyboard_protocol) {
+		for (i=0; i<KEYBOARD_NKRO_KEYS/8; i++) {
+			UEDATX = keyboard_keys[i];
+		}
+	} else {
+		usb_keyboard_write_boot_keys();
+	}
+}
+
+// Send the keyboard report if it changed since the last one.  This never
+// waits: if both endpoint banks are still full, -1 is returned and the
+// report stays pending for the next call.  0 returned when sent or when
+// there was nothing to send.
+int8_t usb_keyboard_send(void)
+{
+	uint8_t intr_state;
+
+	if (!usb_configuration) return -1;
+	if (!keyboard_dirty) return 0;
+	intr_state = SREG;
+	cli();
+	UENUM = KEYBOARD_ENDPOINT;
+	if (!(UEINTX & (1<<RWAL))) {
+		health.usbDeferred++;
+		SREG = intr_state;
+		return -1;
+	}
+	usb_keyboard_write_report();
+	UEINTX = 0x3A;
+	keyboard_idle_count = 0;
+	keyboard_dirty = 0;
+	health.usbReports++;
+	SREG = intr_state;
+	return 0;
+}
+
+// the keyboard LEDs last set by the host
+uint8_t usb_keyboard_leds(void)
+{
+	return keyboard_leds;
+}
+
+// set when a write gave up waiting, so the next one doesn't wait again
+static uint8_t debug_previous_timeout=0;
 
 // transmit a character.  0 returned on success, -1 on error
 int8_t usb_debug_putchar(uint8_t c)
 {
-	static uint8_t previous_timeout=0;
-	uint8_t timeout, intr_state;
+	uint8_t timeout, intr_state, power;
 
 	// if we're not online (enumerated and configured), error
 	if (!usb_configuration) return -1;
@@ -381,31 +875,39 @@ int8_t usb_debug_putchar(uint8_t c)
 	cli();
 	UENUM = DEBUG_TX_ENDPOINT;
 	// if we gave up due to timeout before, don't wait again
-	if (previous_timeout) {
+	if (debug_previous_timeout) {
 		if (!(UEINTX & (1<<RWAL))) {
+			health.debugDropped++;
 			SREG = intr_state;
 			return -1;
 		}
-		previous_timeout = 0;
+		debug_previous_timeout = 0;
 	}
 	// wait for the FIFO to be ready to accept data
 	timeout = UDFNUML + 4;
+	power = power_spin();
 	while (1) {
 		// are we ready to transmit?
 		if (UEINTX & (1<<RWAL)) break;
 		SREG = intr_state;
 		// have we waited too long?
 		if (UDFNUML == timeout) {
-			previous_timeout = 1;
+			debug_previous_timeout = 1;
+			health.debugDropped++;
+			power_set(power);
 			return -1;
 		}
 		// has the USB gone offline?
-		if (!usb_configuration) return -1;
+		if (!usb_configuration) {
+			power_set(power);
+			return -1;
+		}
 		// get ready to try checking again
 		intr_state = SREG;
 		cli();
 		UENUM = DEBUG_TX_ENDPOINT;
 	}
+	power_set(power);
 	// actually write the byte into the FIFO
 	UEDATX = c;
 	// if this completed a packet, transmit it now!
@@ -419,6 +921,63 @@ int8_t usb_debug_putchar(uint8_t c)
 	return 0;
 }
 
+// transmit a buffer, waiting for a free bank only when one fills up,
+// with the same timeout as usb_debug_putchar.  0 returned on success,
+// -1 on error, with whatever had been written up to then sent
+int8_t usb_debug_write(const uint8_t *buffer, uint8_t size)
+{
+	uint8_t timeout, intr_state, power;
+
+	if (!usb_configuration) return -1;
+	intr_state = SREG;
+	cli();
+	UENUM = DEBUG_TX_ENDPOINT;
+	if (debug_previous_timeout) {
+		if (!(UEINTX & (1<<RWAL))) {
+			health.debugDropped += size;
+			SREG = intr_state;
+			return -1;
+		}
+		debug_previous_timeout = 0;
+	}
+	timeout = UDFNUML + 4;
+	power = power_spin();
+	while (size) {
+		// wait for the FIFO to be ready to accept data
+		if (!(UEINTX & (1<<RWAL))) {
+			SREG = intr_state;
+			if (UDFNUML == timeout) {
+				debug_previous_timeout = 1;
+				health.debugDropped += size;
+				power_set(power);
+				return -1;
+			}
+			if (!usb_configuration) {
+				power_set(power);
+				return -1;
+			}
+			intr_state = SREG;
+			cli();
+			UENUM = DEBUG_TX_ENDPOINT;
+			continue;
+		}
+		// fill the bank, and transmit it as soon as it's full
+		do {
+			UEDATX = *buffer++;
+			size--;
+		} while (size && (UEINTX & (1<<RWAL)));
+		if (!(UEINTX & (1<<RWAL))) {
+			UEINTX = 0x3A;
+			debug_flush_timer = 0;
+			timeout = UDFNUML + 4;
+		} else {
+			debug_flush_timer = 2;
+		}
+	}
+	power_set(power);
+	SREG = intr_state;
+	return 0;
+}
 
 // immediately transmit any buffered output.
 void usb_debug_flush_output(void)
@@ -438,6 +997,74 @@ void usb_debug_flush_output(void)
 	SREG = intr_state;
 }
 
+// return the command the host last wrote to the debug interface's
+// feature report, 0 if none since the last call
+uint8_t usb_debug_command(void)
+{
+	uint8_t command, intr_state;
+
+	intr_state = SREG;
+	cli();
+	command = debug_command;
+	debug_command = 0;
+	SREG = intr_state;
+	return command;
+}
+
+
+
+#ifdef USB_CAPTURE
+// the capture flags set by the host, 0 while it isn't capturing
+uint8_t usb_capture_flags(void)
+{
+	return capture_request_flags;
+}
+
+// non-zero if a record can be written without being dropped
+uint8_t usb_capture_ready(void)
+{
+	uint8_t intr_state, ready;
+
+	if (!usb_configuration || !capture_request_flags) return 0;
+	intr_state = SREG;
+	cli();
+	UENUM = CAPTURE_ENDPOINT;
+	ready = UEINTX & (1<<RWAL);
+	SREG = intr_state;
+	return ready;
+}
+
+// queue a record on the capture endpoint.  This never waits: if
+// both banks are full, -1 is returned and the record is lost.  A
+// full packet goes out right away, a partial one at the next frame
+// or the one after.  Records must divide CAPTURE_SIZE, so that
+// none is split between packets.
+int8_t usb_capture_write(const uint8_t *data, uint8_t len)
+{
+	uint8_t intr_state;
+
+	if (!usb_configuration || !capture_request_flags) return -1;
+	intr_state = SREG;
+	cli();
+	UENUM = CAPTURE_ENDPOINT;
+	if (!(UEINTX & (1<<RWAL))) {
+		SREG = intr_state;
+		return -1;
+	}
+	while (len--) {
+		UEDATX = *data++;
+	}
+	if (!(UEINTX & (1<<RWAL))) {
+		UEINTX = 0x3A;
+		capture_flush_timer = 0;
+	} else {
+		capture_flush_timer = 2;
+	}
+	SREG = intr_state;
+	return 0;
+}
+#endif
+
 
 
 /**************************************************************************
@@ -454,18 +1081,53 @@ void usb_debug_flush_output(void)
 ISR(USB_GEN_vect)
 {
 	uint8_t intbits, t;
+	static uint8_t div4=0;
 
+	STACK_ISR_ENTER();
         intbits = UDINT;
         UDINT = 0;
+	if ((intbits & (1<<SUSPI)) && (UDIEN & (1<<SUSPE))) {
+		// 3 ms without a SOF: stop the clocks and wait for the bus
+		// (or usb_remote_wakeup) to start them again
+		UDIEN = (UDIEN & ~(1<<SUSPE)) | (1<<WAKEUPE);
+		USB_FREEZE();
+		PLLCSR &= ~(1<<PLLE);
+		usb_suspend_state = 1;
+	}
+	if ((intbits & (1<<WAKEUPI)) && (UDIEN & (1<<WAKEUPE))) {
+		PLL_CONFIG();
+		while (!(PLLCSR & (1<<PLOCK))) ;
+		USB_CONFIG();
+		// WAKEUPI can't be cleared while the clock is frozen
+		UDINT = ~(1<<WAKEUPI);
+		UDIEN = (UDIEN & ~(1<<WAKEUPE)) | (1<<SUSPE);
+		usb_suspend_state = 0;
+	}
         if (intbits & (1<<EORSTI)) {
 		UENUM = 0;
 		UECONX = 1;
 		UECFG0X = EP_TYPE_CONTROL;
 		UECFG1X = EP_SIZE(ENDPOINT0_SIZE) | EP_SINGLE_BUFFER;
 		UEIENX = (1<<RXSTPE);
+		ep0_state = EP0_IDLE;
 		usb_configuration = 0;
+		usb_remote_wakeup_enabled = 0;
+		capture_request_flags = 0;
         }
 	if ((intbits & (1<<SOFI)) && usb_configuration) {
+		sof_us = teensy_get_us();
+		sof_frame = UDFNUML;
+		if (keyboard_idle_config && (++div4 & 3) == 0) {
+			UENUM = KEYBOARD_ENDPOINT;
+			if (UEINTX & (1<<RWAL)) {
+				keyboard_idle_count++;
+				if (keyboard_idle_count == keyboard_idle_config) {
+					keyboard_idle_count = 0;
+					usb_keyboard_write_report();
+					UEINTX = 0x3A;
+				}
+			}
+		}
 		t = debug_flush_timer;
 		if (t) {
 			debug_flush_timer = -- t;
@@ -477,7 +1139,18 @@ ISR(USB_GEN_vect)
 				UEINTX = 0x3A;
 			}
 		}
+#ifdef USB_CAPTURE
+		t = capture_flush_timer;
+		if (t) {
+			capture_flush_timer = -- t;
+			if (!t) {
+				UENUM = CAPTURE_ENDPOINT;
+				UEINTX = 0x3A;	// a short packet
+			}
+		}
+#endif
 	}
+	STACK_ISR_EXIT();
 }
 
 
@@ -491,201 +1164,361 @@ static inline void usb_send_in(void)
 {
 	UEINTX = ~(1<<TXINI);
 }
-static inline void usb_wait_receive_out(void)
-{
-	while (!(UEINTX & (1<<RXOUTI))) ;
-}
 static inline void usb_ack_out(void)
 {
 	UEINTX = ~(1<<RXOUTI);
 }
 
 
+static inline void usb_ep0_idle(void)
+{
+	ep0_state = EP0_IDLE;
+	UEIENX = (1<<RXSTPE);
+}
+
+// Start an IN data stage of len bytes.  The first packet goes out
+// from the interrupt that the free bank raises.
+static inline void usb_ep0_in_start(uint8_t from, const uint8_t *addr, uint8_t len)
+{
+	ep0_from = from;
+	ep0_addr = addr;
+	ep0_len = len;
+	ep0_state = EP0_IN;
+	// RXOUTI during the data stage is the host's status, it took less
+	// than we had
+	UEIENX = (1<<RXSTPE) | (1<<TXINE) | (1<<RXOUTE);
+}
+
+// The next packet of an IN data stage.  A last packet that's full is
+// followed by a zero length one.
+static inline void usb_ep0_in_packet(void)
+{
+	uint8_t i, n;
 
-// USB Endpoint Interrupt - endpoint 0 is handled here.  The
-// other endpoints are manipulated by the user-callable
-// functions, and the start-of-frame interrupt.
-//
-ISR(USB_COM_vect)
+	n = ep0_len < ENDPOINT0_SIZE ? ep0_len : ENDPOINT0_SIZE;
+	for (i = n; i; i--) {
+		if (ep0_from == EP0_FROM_FLASH) UEDATX = pgm_read_byte(ep0_addr++);
+		else if (ep0_from == EP0_FROM_RAM) UEDATX = *ep0_addr++;
+		else UEDATX = 0;
+	}
+	ep0_len -= n;
+	usb_send_in();
+	if (!ep0_len && n < ENDPOINT0_SIZE) {
+		ep0_state = EP0_STATUS_OUT;
+		UEIENX = (1<<RXSTPE) | (1<<RXOUTE);
+	}
+}
+
+// Start an OUT data stage of len bytes
+static inline void usb_ep0_out_start(uint8_t what, uint8_t len)
 {
-        uint8_t intbits;
-	const uint8_t *list;
-        const uint8_t *cfg;
-	uint8_t i, n, len, en;
+	ep0_for = what;
+	ep0_len = len;
+	ep0_first = 0;
+	ep0_started = 0;
+	ep0_state = EP0_OUT;
+	UEIENX = (1<<RXSTPE) | (1<<RXOUTE);
+}
+
+// The data stage is in: use it, and send the status
+static inline void usb_ep0_out_done(void)
+{
+	if (ep0_for == EP0_FOR_KEYBOARD_LEDS) keyboard_leds = ep0_first;
+	else debug_command = ep0_first;
+	usb_send_in();
+	usb_ep0_idle();
+}
+
+// The next packet of an OUT data stage
+static inline void usb_ep0_out_packet(void)
+{
+	uint8_t n;
+
+	if (!ep0_started && ep0_len) ep0_first = UEDATX;
+	ep0_started = 1;
+	n = ep0_len < ENDPOINT0_SIZE ? ep0_len : ENDPOINT0_SIZE;
+	ep0_len -= n;
+	usb_ack_out();
+	if (!ep0_len) usb_ep0_out_done();
+}
+
+// A SETUP packet
+static inline void usb_ep0_setup(void)
+{
+	const struct descriptor_list_struct *list;
+	const uint8_t *cfg;
+	uint8_t i, len, en;
 	uint8_t bmRequestType;
 	uint8_t bRequest;
 	uint16_t wValue;
 	uint16_t wIndex;
 	uint16_t wLength;
-	uint16_t desc_val;
-	const uint8_t *desc_addr;
-	uint8_t	desc_length;
 
-        UENUM = 0;
-	intbits = UEINTX;
-        if (intbits & (1<<RXSTPI)) {
-                bmRequestType = UEDATX;
-                bRequest = UEDATX;
-                wValue = UEDATX;
-                wValue |= (UEDATX << 8);
-                wIndex = UEDATX;
-                wIndex |= (UEDATX << 8);
-                wLength = UEDATX;
-                wLength |= (UEDATX << 8);
-                UEINTX = ~((1<<RXSTPI) | (1<<RXOUTI) | (1<<TXINI));
-                if (bRequest == GET_DESCRIPTOR) {
-			list = (const uint8_t *)descriptor_list;
-			for (i=0; ; i++) {
-				if (i >= NUM_DESC_LIST) {
-					UECONX = (1<<STALLRQ)|(1<<EPEN);  //stall
-					return;
-				}
-				desc_val = pgm_read_word(list);
-				if (desc_val != wValue) {
-					list += sizeof(struct descriptor_list_struct);
-					continue;
-				}
-				list += 2;
-				desc_val = pgm_read_word(list);
-				if (desc_val != wIndex) {
-					list += sizeof(struct descriptor_list_struct)-2;
-					continue;
-				}
-				list += 2;
-				desc_addr = (const uint8_t *)pgm_read_word(list);
-				list += 2;
-				desc_length = pgm_read_byte(list);
-				break;
+	bmRequestType = UEDATX;
+	bRequest = UEDATX;
+	wValue = UEDATX;
+	wValue |= (UEDATX << 8);
+	wIndex = UEDATX;
+	wIndex |= (UEDATX << 8);
+	wLength = UEDATX;
+	wLength |= (UEDATX << 8);
+	UEINTX = ~((1<<RXSTPI) | (1<<RXOUTI) | (1<<TXINI));
+	// a new SETUP ends whatever the last transfer was doing
+	usb_ep0_idle();
+	len = (wLength < 256) ? wLength : 255;
+	if (bRequest == GET_DESCRIPTOR) {
+		list = descriptor_list;
+		for (i=0; ; i++, list++) {
+			if (i >= NUM_DESC_LIST) {
+				UECONX = (1<<STALLRQ)|(1<<EPEN);  //stall
+				return;
 			}
-			len = (wLength < 256) ? wLength : 255;
-			if (len > desc_length) len = desc_length;
-			do {
-				// wait for host ready for IN packet
-				do {
-					i = UEINTX;
-				} while (!(i & ((1<<TXINI)|(1<<RXOUTI))));
-				if (i & (1<<RXOUTI)) return;	// abort
-				// send IN packet
-				n = len < ENDPOINT0_SIZE ? len : ENDPOINT0_SIZE;
-				for (i = n; i; i--) {
-					UEDATX = pgm_read_byte(desc_addr++);
-				}
-				len -= n;
-				usb_send_in();
-			} while (len || n == ENDPOINT0_SIZE);
-			return;
-                }
-		if (bRequest == SET_ADDRESS) {
-			usb_send_in();
-			usb_wait_in_ready();
-			UDADDR = wValue | (1<<ADDEN);
-			return;
+			if (pgm_read_word(&list->wValue) == wValue
+			  && pgm_read_word(&list->wIndex) == wIndex) break;
 		}
-		if (bRequest == SET_CONFIGURATION && bmRequestType == 0) {
-			usb_configuration = wValue;
-			usb_send_in();
-			cfg = endpoint_config_table;
-			for (i=1; i<5; i++) {
-				UENUM = i;
-				en = pgm_read_byte(cfg++);
-				UECONX = en;
-				if (en) {
-					UECFG0X = pgm_read_byte(cfg++);
-					UECFG1X = pgm_read_byte(cfg++);
-				}
+		en = pgm_read_byte(&list->length);
+		usb_ep0_in_start(EP0_FROM_FLASH,
+			(const uint8_t *)pgm_read_ptr(&list->addr),
+			len < en ? len : en);
+		return;
+	}
+	if (bRequest == SET_ADDRESS) {
+		// the new address only counts once the status has gone
+		UDADDR = wValue & 0x7F;
+		usb_send_in();
+		ep0_state = EP0_ADDRESS;
+		UEIENX = (1<<RXSTPE) | (1<<TXINE);
+		return;
+	}
+	if (bRequest == SET_CONFIGURATION && bmRequestType == 0) {
+		usb_configuration = wValue;
+		usb_send_in();
+		cfg = endpoint_config_table;
+		for (i=1; i<=MAX_ENDPOINT; i++) {
+			UENUM = i;
+			en = pgm_read_byte(cfg++);
+			UECONX = en;
+			if (en) {
+				UECFG0X = pgm_read_byte(cfg++);
+				UECFG1X = pgm_read_byte(cfg++);
 			}
-        		UERST = 0x1E;
-        		UERST = 0;
-			return;
 		}
-		if (bRequest == GET_CONFIGURATION && bmRequestType == 0x80) {
-			usb_wait_in_ready();
-			UEDATX = usb_configuration;
+		UERST = 0x3E;
+		UERST = 0;
+		return;
+	}
+	if (bRequest == GET_CONFIGURATION && bmRequestType == 0x80) {
+		usb_wait_in_ready();
+		UEDATX = usb_configuration;
+		usb_send_in();
+		return;
+	}
+
+	if (bRequest == GET_STATUS) {
+		usb_wait_in_ready();
+		i = 0;
+		#ifdef SUPPORT_ENDPOINT_HALT
+		if (bmRequestType == 0x82) {
+			UENUM = wIndex;
+			if (UECONX & (1<<STALLRQ)) i = 1;
+			UENUM = 0;
+		}
+		#endif
+		if (bmRequestType == 0x80 && usb_remote_wakeup_enabled) i = 2;
+		UEDATX = i;
+		UEDATX = 0;
+		usb_send_in();
+		return;
+	}
+	if ((bRequest == CLEAR_FEATURE || bRequest == SET_FEATURE)
+	  && bmRequestType == 0x00 && wValue == DEVICE_REMOTE_WAKEUP) {
+		usb_remote_wakeup_enabled = (bRequest == SET_FEATURE);
+		usb_send_in();
+		return;
+	}
+	#ifdef SUPPORT_ENDPOINT_HALT
+	if ((bRequest == CLEAR_FEATURE || bRequest == SET_FEATURE)
+	  && bmRequestType == 0x02 && wValue == 0) {
+		i = wIndex & 0x7F;
+		if (i >= 1 && i <= MAX_ENDPOINT) {
 			usb_send_in();
+			UENUM = i;
+			if (bRequest == SET_FEATURE) {
+				UECONX = (1<<STALLRQ)|(1<<EPEN);
+			} else {
+				UECONX = (1<<STALLRQC)|(1<<RSTDT)|(1<<EPEN);
+				UERST = (1 << i);
+				UERST = 0;
+			}
 			return;
 		}
-
-		if (bRequest == GET_STATUS) {
-			usb_wait_in_ready();
-			i = 0;
-			#ifdef SUPPORT_ENDPOINT_HALT
-			if (bmRequestType == 0x82) {
-				UENUM = wIndex;
-				if (UECONX & (1<<STALLRQ)) i = 1;
-				UENUM = 0;
+	}
+	#endif
+#ifndef USB_GAMEPAD_ONLY
+	if (wIndex == MOUSE_INTERFACE) {
+		if (bmRequestType == 0xA1) {
+			if (bRequest == HID_GET_REPORT) {
+				usb_wait_in_ready();
+				UEDATX = mouse_buttons;
+				UEDATX = 0;
+				UEDATX = 0;
+				UEDATX = 0;
+				usb_send_in();
+				return;
+			}
+			if (bRequest == HID_GET_PROTOCOL) {
+				usb_wait_in_ready();
+				UEDATX = mouse_protocol;
+				usb_send_in();
+				return;
 			}
-			#endif
-			UEDATX = i;
-			UEDATX = 0;
-			usb_send_in();
-			return;
 		}
-		#ifdef SUPPORT_ENDPOINT_HALT
-		if ((bRequest == CLEAR_FEATURE || bRequest == SET_FEATURE)
-		  && bmRequestType == 0x02 && wValue == 0) {
-			i = wIndex & 0x7F;
-			if (i >= 1 && i <= MAX_ENDPOINT) {
+		if (bmRequestType == 0x21) {
+			if (bRequest == HID_SET_PROTOCOL) {
+				mouse_protocol = wValue;
 				usb_send_in();
-				UENUM = i;
-				if (bRequest == SET_FEATURE) {
-					UECONX = (1<<STALLRQ)|(1<<EPEN);
-				} else {
-					UECONX = (1<<STALLRQC)|(1<<RSTDT)|(1<<EPEN);
-					UERST = (1 << i);
-					UERST = 0;
-				}
 				return;
 			}
 		}
-		#endif
-		if (wIndex == MOUSE_INTERFACE) {
-			if (bmRequestType == 0xA1) {
-				if (bRequest == HID_GET_REPORT) {
-					usb_wait_in_ready();
-					UEDATX = mouse_buttons;
-					UEDATX = 0;
-					UEDATX = 0;
-					UEDATX = 0;
-					usb_send_in();
-					return;
-				}
-				if (bRequest == HID_GET_PROTOCOL) {
-					usb_wait_in_ready();
-					UEDATX = mouse_protocol;
-					usb_send_in();
-					return;
-				}
+	}
+#endif
+#ifdef USB_GAMEPAD
+	if (wIndex == GAMEPAD_INTERFACE && bmRequestType == 0xA1
+	  && bRequest == HID_GET_REPORT) {
+		usb_ep0_in_start(EP0_FROM_RAM, gamepad_report,
+			len < GAMEPAD_REPORT_SIZE ? len : GAMEPAD_REPORT_SIZE);
+		return;
+	}
+#endif
+	if (wIndex == KEYBOARD_INTERFACE) {
+		if (bmRequestType == 0xA1) {
+			if (bRequest == HID_GET_REPORT) {
+				usb_wait_in_ready();
+				usb_keyboard_write_report();
+				usb_send_in();
+				return;
 			}
-			if (bmRequestType == 0x21) {
-				if (bRequest == HID_SET_PROTOCOL) {
-					mouse_protocol = wValue;
-					usb_send_in();
-					return;
-				}
+			if (bRequest == HID_GET_IDLE) {
+				usb_wait_in_ready();
+				UEDATX = keyboard_idle_config;
+				usb_send_in();
+				return;
+			}
+			if (bRequest == HID_GET_PROTOCOL) {
+				usb_wait_in_ready();
+				UEDATX = keyboard_protocol;
+				usb_send_in();
+				return;
 			}
 		}
-		if (wIndex == DEBUG_INTERFACE) {
-			if (bRequest == HID_GET_REPORT && bmRequestType == 0xA1) {
-				len = wLength;
-				do {
-					// wait for host ready for IN packet
-					do {
-						i = UEINTX;
-					} while (!(i & ((1<<TXINI)|(1<<RXOUTI))));
-					if (i & (1<<RXOUTI)) return;	// abort
-					// send IN packet
-					n = len < ENDPOINT0_SIZE ? len : ENDPOINT0_SIZE;
-					for (i = n; i; i--) {
-						UEDATX = 0;
-					}
-					len -= n;
-					usb_send_in();
-				} while (len || n == ENDPOINT0_SIZE);
+		if (bmRequestType == 0x21) {
+			if (bRequest == HID_SET_REPORT) {
+				usb_ep0_out_start(EP0_FOR_KEYBOARD_LEDS, len);
+				if (!len) usb_ep0_out_done();
 				return;
 			}
+			if (bRequest == HID_SET_IDLE) {
+				keyboard_idle_config = (wValue >> 8);
+				keyboard_idle_count = 0;
+				usb_send_in();
+				return;
+			}
+			if (bRequest == HID_SET_PROTOCOL) {
+				keyboard_protocol = wValue;
+				keyboard_dirty = 1;
+				usb_send_in();
+				return;
+			}
+		}
+	}
+#ifdef USB_CAPTURE
+	if (wIndex == CAPTURE_INTERFACE && bmRequestType == 0x41
+	  && bRequest == CAPTURE_REQUEST_START) {
+		// start over with empty banks
+		UENUM = CAPTURE_ENDPOINT;
+		UERST = (1 << CAPTURE_ENDPOINT);
+		UERST = 0;
+		UENUM = 0;
+		capture_flush_timer = 0;
+		capture_request_flags = wValue;
+		usb_send_in();
+		return;
+	}
+#endif
+	if (wIndex == DEBUG_INTERFACE) {
+		if (bRequest == HID_GET_REPORT && bmRequestType == 0xA1) {
+			// the feature report is the health counters, the
+			// input report is never asked for this way
+			if ((wValue >> 8) == 3) {
+				usb_ep0_in_start(EP0_FROM_RAM,
+					(const uint8_t *)health_fill(),
+					len < sizeof(health_t) ? len : sizeof(health_t));
+			} else {
+				usb_ep0_in_start(EP0_FROM_ZEROS, 0, len);
+			}
+			return;
+		}
+		if (bRequest == HID_SET_REPORT && bmRequestType == 0x21
+		  && (wValue >> 8) == 3) {
+			// a command in the first byte, the rest of the
+			// report is read and ignored
+			usb_ep0_out_start(EP0_FOR_DEBUG_COMMAND, len);
+			if (!len) usb_ep0_out_done();
+			return;
 		}
 	}
 	UECONX = (1<<STALLRQ) | (1<<EPEN);	// stall
 }
 
+// Endpoint 0 requests, from the endpoint interrupt below: a new SETUP,
+// or the next step of the transfer in progress
+//
+static inline void usb_endpoint0(void)
+{
+	uint8_t intbits;
+
+	UENUM = 0;
+	intbits = UEINTX;
+	if (intbits & (1<<RXSTPI)) {
+		usb_ep0_setup();
+		return;
+	}
+	switch (ep0_state) {
+	  case EP0_IN:
+		if (intbits & (1<<RXOUTI)) {
+			usb_ack_out();
+			usb_ep0_idle();
+		} else if (intbits & (1<<TXINI)) {
+			usb_ep0_in_packet();
+		}
+		break;
+	  case EP0_STATUS_OUT:
+		if (intbits & (1<<RXOUTI)) {
+			usb_ack_out();
+			usb_ep0_idle();
+		}
+		break;
+	  case EP0_ADDRESS:
+		if (intbits & (1<<TXINI)) {
+			UDADDR |= (1<<ADDEN);
+			usb_ep0_idle();
+		}
+		break;
+	  case EP0_OUT:
+		if (intbits & (1<<RXOUTI)) usb_ep0_out_packet();
+		break;
+	}
+}
+
+// USB Endpoint Interrupt - endpoint 0 is handled here.  The
+// other endpoints are manipulated by the user-callable
+// functions, and the start-of-frame interrupt.
+//
+ISR(USB_COM_vect)
+{
+	STACK_ISR_ENTER();
+	usb_endpoint0();
+	STACK_ISR_EXIT();
+}
+
 
@@ -5,14 +5,38 @@
 
 void usb_init(void);			// initialize everything
 uint8_t usb_configured(void);		// is the USB port configured
+uint8_t usb_suspended(void);		// has the host suspended the bus
+int8_t usb_remote_wakeup(void);		// ask a suspended host to resume
+void usb_remote_wakeup_cancel(void);	// it didn't, back to suspend
+uint8_t usb_get_sof(uint16_t *us);	// the last frame number, and when
 
+// mouse, unless built with USB_GAMEPAD_ONLY
 int8_t usb_mouse_buttons(uint8_t left, uint8_t middle, uint8_t right);
 int8_t usb_mouse_move(int8_t x, int8_t y, int8_t wheel);
 
+// gamepad, with USB_GAMEPAD: absolute X and Y, -32767 to 32767
+int8_t usb_gamepad_send(int16_t x, int16_t y, uint8_t button); // never waits
+
+// keyboard: up to KEYBOARD_NKRO_KEYS keys at once in report protocol,
+// 6 in boot protocol, keycodes KEYBOARD_FIRST_KEY (A) to 0x73 (F24) and
+// the modifiers
+#define KEYBOARD_NKRO_KEYS	112
+#define KEYBOARD_FIRST_KEY	0x04
+void usb_keyboard_key(uint8_t keycode, uint8_t pressed);
+int8_t usb_keyboard_send(void);
+uint8_t usb_keyboard_leds(void);
+
 int8_t usb_debug_putchar(uint8_t c);	// transmit a character
+int8_t usb_debug_write(const uint8_t *buffer, uint8_t size); // transmit a buffer
 void usb_debug_flush_output(void);	// immediately transmit any buffered output
+uint8_t usb_debug_command(void);	// the last HEALTH_COMMAND_* written, once
 #define USB_DEBUG_HID
 
+// raw capture on the vendor bulk endpoint, with USB_CAPTURE (capture.h)
+uint8_t usb_capture_flags(void);	// what the host asked for, 0 = off
+uint8_t usb_capture_ready(void);	// room for another record
+int8_t usb_capture_write(const uint8_t *data, uint8_t len); // never waits
+
 
 
 
@@ -38,7 +62,7 @@ void usb_debug_flush_output(void);	// immediately transmit any buffered output
 			((s) == 16 ? 0x10 :	\
 			             0x00)))
 
-#define MAX_ENDPOINT		4
+#define MAX_ENDPOINT		5
 
 #define LSB(n) (n & 255)
 #define MSB(n) ((n >> 8) & 255)
@@ -75,6 +99,8 @@ void usb_debug_flush_output(void);	// immediately transmit any buffered output
 #define SET_CONFIGURATION		9
 #define GET_INTERFACE			10
 #define SET_INTERFACE			11
+// standard feature selectors
+#define DEVICE_REMOTE_WAKEUP		1
 // HID (human interface device)
 #define HID_GET_REPORT			1
 #define HID_GET_IDLE			2